@@ -0,0 +1,98 @@
+/* Compares the forest file backends, with the buffer pool both bigger and
+ * smaller than the forest. Build with `make bench_backend` */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <utreexo.h>
+
+#define BLOCKS 400
+#define LEAVES_PER_BLOCK 1000
+#define SPENT_PER_BLOCK 500
+#define PROOF_LEAVES 100
+#define PROOF_ROUNDS 200
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static utreexo_node_hash make_hash(uint64_t n) {
+  utreexo_node_hash hash = {{0}};
+  memcpy(hash.data, &n, sizeof(n));
+  hash.data[31] = 0x01;
+  return hash;
+}
+
+/* Leaves n such that n % LEAVES_PER_BLOCK >= SPENT_PER_BLOCK are never
+ * spent, so that's where we pick leaves to prove from */
+static uint64_t unspent(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  const uint64_t block = *state % BLOCKS;
+  const uint64_t n = (*state >> 32) % (LEAVES_PER_BLOCK - SPENT_PER_BLOCK);
+  return block * LEAVES_PER_BLOCK + SPENT_PER_BLOCK + n;
+}
+
+static void run(const char *name, const char *tag, int backend,
+                uint64_t pool_size) {
+  char map_name[64], forest_name[64];
+  snprintf(map_name, sizeof(map_name), "bench_backend_%s_map.bin", tag);
+  snprintf(forest_name, sizeof(forest_name), "bench_backend_%s.bin", tag);
+  unlink(map_name);
+  unlink(forest_name);
+
+  const struct utreexo_forest_options options = {
+      .backend = backend,
+      .pool_size = pool_size,
+  };
+  utreexo_forest forest;
+  if (utreexo_forest_init_ex(&forest, map_name, forest_name, &options) != 0) {
+    printf("%-24s unavailable\n", name);
+    return;
+  }
+
+  static utreexo_node_hash adds[LEAVES_PER_BLOCK];
+  static utreexo_node_hash dels[SPENT_PER_BLOCK];
+  // Every block spends half of the previous block's leaves
+  double start = now();
+  for (uint64_t block = 0; block < BLOCKS; ++block) {
+    for (uint64_t n = 0; n < LEAVES_PER_BLOCK; ++n)
+      adds[n] = make_hash(block * LEAVES_PER_BLOCK + n);
+    for (uint64_t n = 0; n < SPENT_PER_BLOCK && block > 0; ++n)
+      dels[n] = make_hash((block - 1) * LEAVES_PER_BLOCK + n);
+    utreexo_forest_modify(forest, adds, LEAVES_PER_BLOCK, dels,
+                          block > 0 ? SPENT_PER_BLOCK : 0);
+  }
+  const double modify = (now() - start) * 1e6 / BLOCKS;
+
+  static utreexo_node_hash proof[64 * PROOF_LEAVES];
+  static utreexo_node_hash leaves[PROOF_LEAVES];
+  static uint64_t targets[PROOF_LEAVES];
+  uint64_t state = 88172645463325252ULL;
+  start = now();
+  for (size_t round = 0; round < PROOF_ROUNDS; ++round) {
+    for (size_t n = 0; n < PROOF_LEAVES; ++n)
+      leaves[n] = make_hash(unspent(&state));
+    size_t proof_len = sizeof(proof) / sizeof(proof[0]);
+    utreexo_forest_prove(forest, proof, &proof_len, targets, leaves,
+                         PROOF_LEAVES);
+  }
+  const double prove = (now() - start) * 1e6 / PROOF_ROUNDS;
+
+  utreexo_forest_free(forest);
+  printf("%-24s %10.1f us/block %10.1f us/proof\n", name, modify, prove);
+}
+
+int main() {
+  // The forest ends up at about 90MB
+  run("mmap", "mmap", 0, 0);
+  run("pool (larger)", "pool_large", 1, 1024);
+  run("pool (smaller)", "pool_small", 1, 16);
+  return 0;
+}
@@ -0,0 +1,101 @@
+/* Checks that the C++ wrapper costs the same as calling the C API directly,
+ * and that it never allocates on its own. Build with `make bench_cpp` */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory_resource>
+#include <new>
+#include <vector>
+
+#include <utreexo.hpp>
+
+#define BLOCKS 200
+#define LEAVES_PER_BLOCK 1000
+#define PROOF_LEAVES 100
+
+// Every allocation made through operator new is counted, the C library uses
+// malloc, so it doesn't show up here
+static size_t allocations = 0;
+
+void *operator new(std::size_t size) {
+  ++allocations;
+  if (void *p = std::malloc(size))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+static utreexo::Hash make_hash(uint64_t n) {
+  utreexo::Hash hash{};
+  for (size_t i = 0; i < 8; ++i)
+    hash.data[i] = (n >> (8 * i)) & 0xff;
+  hash.data[31] = 0x01;
+  return hash;
+}
+
+template <class F> static void bench(const char *name, size_t ops, F f) {
+  const size_t before = allocations;
+  const auto start = std::chrono::steady_clock::now();
+  f();
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  const double ns =
+      std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+  std::printf("%-28s %10.1f ns/op %6.2f allocs/op\n", name, ns,
+              double(allocations - before) / ops);
+}
+
+int main() {
+  std::vector<utreexo::Hash> leaves(BLOCKS * LEAVES_PER_BLOCK);
+  for (size_t n = 0; n < leaves.size(); ++n)
+    leaves[n] = make_hash(n);
+
+  utreexo_forest c_forest;
+  if (utreexo_forest_init(&c_forest, "bench_c_map.bin", "bench_c.bin"))
+    return 1;
+  utreexo::Forest forest("bench_cpp_map.bin", "bench_cpp.bin");
+
+  bench("modify (C)", BLOCKS, [&] {
+    for (size_t block = 0; block < BLOCKS; ++block)
+      utreexo_forest_modify(c_forest, &leaves[block * LEAVES_PER_BLOCK],
+                            LEAVES_PER_BLOCK, NULL, 0);
+  });
+  bench("modify (C++)", BLOCKS, [&] {
+    for (size_t block = 0; block < BLOCKS; ++block)
+      forest.Modify({&leaves[block * LEAVES_PER_BLOCK], LEAVES_PER_BLOCK},
+                    {});
+  });
+
+  static utreexo::Hash proof[utreexo::Forest::MaxProofSize(PROOF_LEAVES)];
+  static uint64_t targets[PROOF_LEAVES];
+  const size_t rounds = leaves.size() / PROOF_LEAVES;
+
+  bench("prove (C)", rounds, [&] {
+    for (size_t round = 0; round < rounds; ++round) {
+      size_t proof_len = sizeof(proof) / sizeof(proof[0]);
+      utreexo_forest_prove(c_forest, proof, &proof_len, targets,
+                           &leaves[round * PROOF_LEAVES], PROOF_LEAVES);
+    }
+  });
+  bench("prove (C++, caller buffer)", rounds, [&] {
+    for (size_t round = 0; round < rounds; ++round)
+      forest.Prove(proof, targets,
+                   {&leaves[round * PROOF_LEAVES], PROOF_LEAVES});
+  });
+
+  // One arena per "block", reset instead of freed
+  static char arena[1 << 20];
+  std::pmr::monotonic_buffer_resource resource(
+      arena, sizeof(arena), std::pmr::null_memory_resource());
+  bench("prove (C++, pmr arena)", rounds, [&] {
+    for (size_t round = 0; round < rounds; ++round) {
+      forest.Prove({&leaves[round * PROOF_LEAVES], PROOF_LEAVES}, &resource);
+      resource.release();
+    }
+  });
+
+  utreexo_forest_free(c_forest);
+  return 0;
+}
@@ -0,0 +1,133 @@
+/* Compares the position math in position.h against the bit-by-bit loops it
+ * replaced. Build with `make bench_position` */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <util.h>
+
+#define N_POSITIONS (1 << 16)
+#define ROUNDS 200
+
+/* The old implementations, kept here for comparison only. They use 32-bit
+ * shifts, so we only feed them forests shorter than 31 rows */
+static inline int loop_detect_row(uint64_t pos, uint64_t forest_rows) {
+  uint64_t marker = 1 << forest_rows;
+  uint8_t h = 0;
+
+  while ((pos & marker) != 0) {
+    marker >>= 1;
+    h += 1;
+  }
+
+  return h & 0xff;
+}
+
+static inline int loop_tree_rows(uint64_t pos) {
+  if (pos == 0)
+    return 0;
+  unsigned int leading_zeros = 0;
+  pos = pos - 1;
+  uint64_t bit = (uint64_t)1 << 63;
+  while ((pos & bit) == 0) {
+    bit >>= 1;
+    ++leading_zeros;
+  }
+  return (64 - leading_zeros) & 0xff;
+}
+
+static inline node_offset loop_detect_offset(uint64_t pos,
+                                             uint64_t num_leaves) {
+  uint8_t tr = loop_tree_rows(num_leaves);
+  uint8_t nr = loop_detect_row(pos, tr);
+
+  uint8_t bigger_trees = tr;
+  uint64_t marker = pos;
+
+  while (((marker << nr) & ((2 << tr) - 1)) >= ((1 << tr) & num_leaves)) {
+    uint64_t tree_size = (1 << tr) & num_leaves;
+    marker -= tree_size;
+    bigger_trees -= 1;
+
+    tr -= 1;
+  }
+  return (node_offset){
+      .tree = (uint8_t)bigger_trees,
+      .depth = (uint8_t)(tr - nr),
+      .bits = !pos,
+  };
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, double elapsed) {
+  const double ops = (double)N_POSITIONS * ROUNDS;
+  printf("%-24s %8.2f ns/op\n", name, elapsed * 1e9 / ops);
+}
+
+int main() {
+  static uint64_t positions[N_POSITIONS];
+  static node_offset offsets[N_POSITIONS];
+  // ~a mainnet sized forest, all trees present
+  const uint64_t num_leaves = ((uint64_t)1 << 30) - 1;
+  const uint8_t tr = tree_rows(num_leaves);
+  uint64_t state = 88172645463325252ULL;
+  volatile uint64_t sink = 0;
+
+  for (size_t i = 0; i < N_POSITIONS; ++i) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    positions[i] = state % num_leaves;
+  }
+
+  double start = now();
+  for (size_t r = 0; r < ROUNDS; ++r)
+    for (size_t i = 0; i < N_POSITIONS; ++i)
+      sink += loop_detect_offset(positions[i], num_leaves).depth;
+  report("detect_offset (loop)", now() - start);
+
+  start = now();
+  for (size_t r = 0; r < ROUNDS; ++r)
+    for (size_t i = 0; i < N_POSITIONS; ++i)
+      sink += detect_offset(positions[i], num_leaves).depth;
+  report("detect_offset", now() - start);
+
+  start = now();
+  for (size_t r = 0; r < ROUNDS; ++r) {
+    detect_offset_many(offsets, positions, N_POSITIONS, num_leaves);
+    sink += offsets[r].depth;
+  }
+  report("detect_offset_many", now() - start);
+
+  start = now();
+  for (size_t r = 0; r < ROUNDS; ++r)
+    for (size_t i = 0; i < N_POSITIONS; ++i)
+      sink += loop_detect_row(positions[i] | ((uint64_t)1 << tr), tr);
+  report("detect_row (loop)", now() - start);
+
+  start = now();
+  for (size_t r = 0; r < ROUNDS; ++r)
+    for (size_t i = 0; i < N_POSITIONS; ++i)
+      sink += detect_row(positions[i] | ((uint64_t)1 << tr), tr);
+  report("detect_row", now() - start);
+
+  start = now();
+  for (size_t r = 0; r < ROUNDS; ++r)
+    for (size_t i = 0; i < N_POSITIONS; ++i)
+      sink += loop_tree_rows(positions[i]);
+  report("tree_rows (loop)", now() - start);
+
+  start = now();
+  for (size_t r = 0; r < ROUNDS; ++r)
+    for (size_t i = 0; i < N_POSITIONS; ++i)
+      sink += tree_rows(positions[i]);
+  report("tree_rows", now() - start);
+
+  return sink == 42;
+}
@@ -0,0 +1,76 @@
+/* Times rebuilding the leaf map from the forest, against the time it took to
+ * build the forest in the first place. Build with `make bench_rebuild` */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <utreexo.h>
+
+#define BLOCKS 1000
+#define LEAVES_PER_BLOCK 2000
+#define SPENT_PER_BLOCK 1000
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static utreexo_node_hash make_hash(uint64_t n) {
+  utreexo_node_hash hash = {{0}};
+  memcpy(hash.data, &n, sizeof(n));
+  hash.data[31] = 0x01;
+  return hash;
+}
+
+int main() {
+  unlink("bench_rebuild_map.bin");
+  unlink("bench_rebuild.bin");
+
+  const struct utreexo_forest_options options = {
+      .leaf_map_slots = 4 * BLOCKS * LEAVES_PER_BLOCK,
+  };
+  utreexo_forest forest;
+  if (utreexo_forest_init_ex(&forest, "bench_rebuild_map.bin",
+                             "bench_rebuild.bin", &options) != 0) {
+    printf("can't create the forest\n");
+    return 1;
+  }
+
+  static utreexo_node_hash adds[LEAVES_PER_BLOCK];
+  static utreexo_node_hash dels[SPENT_PER_BLOCK];
+  // Every block spends half of the previous block's leaves
+  double start = now();
+  for (uint64_t block = 0; block < BLOCKS; ++block) {
+    for (uint64_t n = 0; n < LEAVES_PER_BLOCK; ++n)
+      adds[n] = make_hash(block * LEAVES_PER_BLOCK + n);
+    for (uint64_t n = 0; n < SPENT_PER_BLOCK && block > 0; ++n)
+      dels[n] = make_hash((block - 1) * LEAVES_PER_BLOCK + n);
+    utreexo_forest_modify(forest, adds, LEAVES_PER_BLOCK, dels,
+                          block > 0 ? SPENT_PER_BLOCK : 0);
+  }
+  const double build = now() - start;
+
+  start = now();
+  uint64_t n_leaves = 0;
+  if (utreexo_forest_rebuild_leaf_map(forest, &n_leaves) != 0) {
+    printf("rebuild failed\n");
+    return 1;
+  }
+  const double rebuild = now() - start;
+
+  // Spend what's left of the last block, so those leaves have to be found
+  for (uint64_t n = 0; n < SPENT_PER_BLOCK; ++n)
+    dels[n] = make_hash((BLOCKS - 1) * LEAVES_PER_BLOCK + n);
+  const int ret =
+      utreexo_forest_modify(forest, NULL, 0, dels, SPENT_PER_BLOCK);
+
+  utreexo_forest_free(forest);
+  printf("%lu leaves, built in %.2fs, leaf map rebuilt in %.2fs%s\n",
+         (unsigned long)n_leaves, build, rebuild,
+         ret == 0 ? "" : " (but some leaves are missing)");
+  return ret == 0 ? 0 : 1;
+}
@@ -0,0 +1,215 @@
+/* Replays a trace recorded with record_trace against a new forest, checking
+ * the roots after every block, and reports how fast it went next to how fast
+ * it went when it was recorded. Build with `make bench_replay`, then run
+ *
+ *   bench_replay [--snapshot=<file>] [options] <trace>
+ *
+ * A trace recorded on a forest that already had leaves can only be replayed
+ * from a snapshot of that forest, taken with utreexo_forest_serialize when
+ * recording started. We load it before the first block, and refuse to replay
+ * if the forest isn't where the trace starts.
+ *
+ * Options are the forest options to replay with:
+ *   --backend=mmap|pool  --pool-size=<MB>     --deferred-hashing
+ *   --leaf-cache=<n>     --leaf-filter=<n>    --leaf-map-slots=<n>
+ *   --rss-budget=<MB>    --page-checksums     --latency-histograms
+ *
+ * With --latency-histograms, we also print how long each phase of applying
+ * a block took, see utreexo_forest_latency.
+ *
+ * Rehashing and verifying use every core we see, run this under taskset to
+ * try fewer. The page size is fixed at build time, see NODES_PER_PAGE. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <utreexo.h>
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p) {
+  return n == 0 ? 0 : sorted[(size_t)(p * (n - 1))];
+}
+
+static int parse_option(struct utreexo_forest_options *options,
+                        const char *arg) {
+  if (strcmp(arg, "--backend=mmap") == 0)
+    options->backend = 0;
+  else if (strcmp(arg, "--backend=pool") == 0)
+    options->backend = 1;
+  else if (strncmp(arg, "--pool-size=", 12) == 0)
+    options->pool_size = strtoull(arg + 12, NULL, 10);
+  else if (strcmp(arg, "--deferred-hashing") == 0)
+    options->deferred_hashing = 1;
+  else if (strncmp(arg, "--leaf-cache=", 13) == 0)
+    options->leaf_cache_size = strtoull(arg + 13, NULL, 10);
+  else if (strncmp(arg, "--leaf-filter=", 14) == 0)
+    options->leaf_filter_size = strtoull(arg + 14, NULL, 10);
+  else if (strncmp(arg, "--leaf-map-slots=", 17) == 0)
+    options->leaf_map_slots = strtoull(arg + 17, NULL, 10);
+  else if (strncmp(arg, "--rss-budget=", 13) == 0)
+    options->rss_budget = strtoull(arg + 13, NULL, 10);
+  else if (strcmp(arg, "--page-checksums") == 0)
+    options->page_checksums = 1;
+  else if (strcmp(arg, "--latency-histograms") == 0)
+    options->latency_histograms = 1;
+  else
+    return -1;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  struct utreexo_forest_options options = {0};
+  const char *trace_name = NULL, *snapshot_name = NULL;
+  int bad_args = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i][0] != '-' && trace_name == NULL)
+      trace_name = argv[i];
+    else if (strncmp(argv[i], "--snapshot=", 11) == 0)
+      snapshot_name = argv[i] + 11;
+    else if (parse_option(&options, argv[i]) != 0)
+      bad_args = 1;
+  }
+  if (trace_name == NULL || bad_args) {
+    fprintf(stderr, "usage: %s [--snapshot=<file>] [options] <trace>\n",
+            argv[0]);
+    return 2;
+  }
+
+  utreexo_trace trace;
+  if (utreexo_forest_trace_open(&trace, trace_name) != 0) {
+    fprintf(stderr, "%s isn't a trace\n", trace_name);
+    return 2;
+  }
+  unlink("bench_replay_map.bin");
+  unlink("bench_replay.bin");
+  utreexo_forest forest;
+  if (utreexo_forest_init_ex(&forest, "bench_replay_map.bin",
+                             "bench_replay.bin", &options) != 0) {
+    fprintf(stderr, "can't create the forest with these options\n");
+    return 2;
+  }
+  if (snapshot_name != NULL &&
+      utreexo_forest_deserialize(forest, snapshot_name) != 0) {
+    fprintf(stderr, "can't load the snapshot %s\n", snapshot_name);
+    return 2;
+  }
+
+  // Blocks only apply to the forest they were recorded on
+  utreexo_node_hash start_roots[64], forest_roots[64];
+  size_t n_start_roots = 0, n_forest_roots = 0;
+  uint64_t start_leaves = 0, forest_leaves = 0;
+  utreexo_forest_trace_start(trace, &start_leaves, start_roots,
+                             &n_start_roots);
+  utreexo_forest_snapshot(forest, forest_roots, &n_forest_roots,
+                          &forest_leaves);
+  if (start_leaves != forest_leaves || n_start_roots != n_forest_roots ||
+      memcmp(start_roots, forest_roots,
+             n_start_roots * sizeof(utreexo_node_hash)) != 0) {
+    fprintf(stderr,
+            "%s starts on a forest with %lu leaves and %zu roots, but we have "
+            "%lu leaves and %zu roots%s\n",
+            trace_name, (unsigned long)start_leaves, n_start_roots,
+            (unsigned long)forest_leaves, n_forest_roots,
+            snapshot_name == NULL
+                ? ", pass --snapshot= with the forest it was recorded on"
+                : ", the snapshot isn't of the forest it was recorded on");
+    return 2;
+  }
+
+  uint64_t *replayed = NULL, *recorded = NULL;
+  size_t n_blocks = 0, cap = 0;
+  uint64_t n_utxos = 0, n_stxos = 0;
+  int status = 0, ret;
+  utreexo_trace_block block;
+  const double start = now();
+  while ((ret = utreexo_forest_trace_next(trace, &block)) == 0) {
+    if (n_blocks == cap) {
+      cap = cap ? cap * 2 : 1024;
+      replayed = realloc(replayed, cap * sizeof(uint64_t));
+      recorded = realloc(recorded, cap * sizeof(uint64_t));
+      if (replayed == NULL || recorded == NULL) {
+        perror("realloc");
+        return 2;
+      }
+    }
+
+    // Hashing is part of what a block costs, even if it's deferred
+    const double block_start = now();
+    const int modify_ret =
+        utreexo_forest_modify(forest, block.utxos, block.utxo_count,
+                              block.stxos, block.stxo_count);
+    const utreexo_node_hash *roots[64];
+    size_t n_roots = 0;
+    utreexo_forest_roots(forest, roots, &n_roots);
+    replayed[n_blocks] = (now() - block_start) * 1e9;
+    recorded[n_blocks] = block.nanos;
+
+    int same = modify_ret == block.ret && n_roots == block.n_roots;
+    for (size_t i = 0; same && i < n_roots; ++i)
+      same = memcmp(roots[i]->data, block.roots[i].data, 32) == 0;
+    if (!same) {
+      fprintf(stderr, "block %zu: got %d and %zu roots, trace has %d and %zu\n",
+              n_blocks, modify_ret, n_roots, block.ret, block.n_roots);
+      status = 1;
+      break;
+    }
+    n_utxos += block.utxo_count;
+    n_stxos += block.stxo_count;
+    ++n_blocks;
+  }
+  const double elapsed = now() - start;
+  if (ret < 0) {
+    fprintf(stderr, "trace is damaged after block %zu\n", n_blocks);
+    status = 1;
+  }
+
+  qsort(replayed, n_blocks, sizeof(uint64_t), cmp_u64);
+  qsort(recorded, n_blocks, sizeof(uint64_t), cmp_u64);
+
+  printf("%zu blocks, %lu utxos, %lu stxos in %.2fs (%.0f blocks/s)\n",
+         n_blocks, (unsigned long)n_utxos, (unsigned long)n_stxos, elapsed,
+         n_blocks / elapsed);
+  printf("%-10s %10s %10s %10s %10s %10s\n", "us/block", "total s", "p50",
+         "p90", "p99", "max");
+  const uint64_t *runs[2] = {replayed, recorded};
+  const char *names[2] = {"replayed", "recorded"};
+  for (size_t r = 0; r < 2; ++r) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < n_blocks; ++i)
+      total += runs[r][i];
+    printf("%-10s %10.2f %10.1f %10.1f %10.1f %10.1f\n", names[r], total / 1e9,
+           percentile(runs[r], n_blocks, 0.5) / 1e3,
+           percentile(runs[r], n_blocks, 0.9) / 1e3,
+           percentile(runs[r], n_blocks, 0.99) / 1e3,
+           percentile(runs[r], n_blocks, 1.0) / 1e3);
+  }
+
+  const char *phases[] = {"modify", "resolve", "delete",
+                          "add",    "hash",    "page alloc"};
+  for (int phase = 0; options.latency_histograms && phase < 6; ++phase) {
+    utreexo_latency_stats stats;
+    utreexo_forest_latency(forest, phase, &stats, 0);
+    printf("%-10s %10.2f %10.1f %10.1f %10.1f %10.1f\n", phases[phase],
+           stats.count * (double)stats.mean / 1e9, stats.p50 / 1e3,
+           stats.p90 / 1e3, stats.p99 / 1e3, stats.max / 1e3);
+  }
+
+  free(replayed);
+  free(recorded);
+  utreexo_forest_trace_close(trace);
+  utreexo_forest_free(forest);
+  return status;
+}
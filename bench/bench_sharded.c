@@ -0,0 +1,161 @@
+/* Times lookups in the sharded leaf map with more and more reader threads,
+ * while a writer keeps adding leaves. If readers don't get in each other's
+ * way, lookups per second should grow with them. Build with
+ * `make bench_sharded`, and run it as `bench_sharded [max readers]`, by default
+ * we go up to one reader per CPU */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flat_file_impl.h"
+#include "sharded_leaf_map_impl.h"
+
+#define SHARDS 16
+#define LEAVES (1 << 20)
+#define LOOKUPS_PER_THREAD (1 << 21)
+/* Readers double every round, so there are at most seven rounds, and the
+ * writer never runs out of new leaves */
+#define MAX_THREADS 64
+
+struct reader_ctx {
+  const utreexo_sharded_leaf_map *map;
+  utreexo_forest_node **nodes;
+  size_t n_nodes;
+  uint64_t seed;
+  size_t n_found;
+};
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Looks up leaves we know are there, in a random order */
+static void *reader(void *arg) {
+  struct reader_ctx *ctx = arg;
+  uint64_t x = ctx->seed;
+  for (size_t i = 0; i < LOOKUPS_PER_THREAD; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    utreexo_forest_node *node = NULL;
+    utreexo_sharded_leaf_map_get(ctx->map, &node,
+                                 &ctx->nodes[x % ctx->n_nodes]->hash);
+    ctx->n_found += node != NULL;
+  }
+  return NULL;
+}
+
+struct writer_ctx {
+  utreexo_sharded_leaf_map *map;
+  utreexo_forest_node **nodes;
+  size_t n_nodes;
+  int stop;
+};
+
+/* Adds leaves until it's told to stop, or runs out of them */
+static void *writer(void *arg) {
+  struct writer_ctx *ctx = arg;
+  for (size_t i = 0; i < ctx->n_nodes; ++i) {
+    if (__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED))
+      break;
+    utreexo_sharded_leaf_map_set(ctx->map, ctx->nodes[i],
+                                 &ctx->nodes[i]->hash);
+  }
+  return NULL;
+}
+
+static void make_leaf(utreexo_forest_node *node, uint64_t n) {
+  memset(node, 0x00, sizeof(*node));
+  memcpy(node->hash.hash, &n, sizeof(n));
+  node->hash.hash[31] = 0x01;
+}
+
+int main(int argc, char **argv) {
+  unlink("bench_sharded_forest.bin");
+  char name[64];
+  for (int i = 0; i < SHARDS; ++i) {
+    snprintf(name, sizeof(name), "bench_sharded_map.%d", i);
+    unlink(name);
+  }
+
+  struct utreexo_forest_file *file = NULL;
+  void *heap = NULL;
+  utreexo_forest_file_init(&file, &heap, "bench_sharded_forest.bin");
+  utreexo_sharded_leaf_map map;
+  if (utreexo_sharded_leaf_map_new(&map, "bench_sharded_map", SHARDS,
+                                   4 * LEAVES / SHARDS, NULL) != 0) {
+    printf("can't create the leaf map\n");
+    return 1;
+  }
+
+  // Half the leaves are there from the start, the writer adds the rest
+  utreexo_forest_node **nodes = malloc(2 * LEAVES * sizeof(*nodes));
+  if (nodes == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  for (size_t i = 0; i < 2 * LEAVES; ++i) {
+    nodes[i] = utreexo_forest_file_node_alloc(file);
+    make_leaf(nodes[i], i);
+    if (i < LEAVES)
+      utreexo_sharded_leaf_map_set(&map, nodes[i], &nodes[i]->hash);
+  }
+
+  long max_readers =
+      argc > 1 ? atol(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_readers > MAX_THREADS)
+    max_readers = MAX_THREADS;
+
+  // Every round, the writer gets leaves nobody added before
+  double single = 0;
+  size_t round = 0;
+  for (long n_threads = 1; n_threads <= max_readers; n_threads *= 2, ++round) {
+    struct writer_ctx wctx = {.map = &map,
+                              .nodes = nodes + LEAVES + round * (LEAVES / 8),
+                              .n_nodes = LEAVES / 8,
+                              .stop = 0};
+    pthread_t wthread;
+    pthread_create(&wthread, NULL, writer, &wctx);
+
+    pthread_t threads[MAX_THREADS];
+    struct reader_ctx ctx[MAX_THREADS];
+    const double start = now();
+    for (long t = 0; t < n_threads; ++t) {
+      ctx[t] = (struct reader_ctx){.map = &map,
+                                   .nodes = nodes,
+                                   .n_nodes = LEAVES,
+                                   .seed = 0x9e3779b97f4a7c15ULL * (t + 1),
+                                   .n_found = 0};
+      pthread_create(&threads[t], NULL, reader, &ctx[t]);
+    }
+    size_t n_found = 0;
+    for (long t = 0; t < n_threads; ++t) {
+      pthread_join(threads[t], NULL);
+      n_found += ctx[t].n_found;
+    }
+    const double elapsed = now() - start;
+
+    __atomic_store_n(&wctx.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(wthread, NULL);
+
+    const double rate = n_threads * (double)LOOKUPS_PER_THREAD / elapsed;
+    if (n_threads == 1)
+      single = rate;
+    printf("%2ld readers: %6.2f M lookups/s, %.2fx one reader%s\n", n_threads,
+           rate / 1e6, rate / single,
+           n_found == (size_t)n_threads * LOOKUPS_PER_THREAD
+               ? ""
+               : " (but some leaves are missing)");
+  }
+
+  utreexo_sharded_leaf_map_close(&map);
+  utreexo_forest_file_close(file);
+  free(nodes);
+  return 0;
+}
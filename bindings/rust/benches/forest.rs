@@ -0,0 +1,55 @@
+//! Calls go straight to C with borrowed slices, so these should be as fast as
+//! the C library itself.
+
+use criterion::{black_box, criterion_group, criterion_main, BatchSize, Criterion};
+use libutreexo::{Configs, Forest, UtreexoHash};
+
+const LEAVES_PER_BLOCK: usize = 1000;
+const PROOF_LEAVES: usize = 100;
+
+fn hash(n: u64) -> UtreexoHash {
+    let mut hash = [0x01; 32];
+    hash[..8].copy_from_slice(&n.to_le_bytes());
+    UtreexoHash(hash)
+}
+
+fn bench_forest(c: &mut Criterion) {
+    let mut forest = Forest::new(Configs {
+        map_filename: "bench_map.bin",
+        forest_filename: "bench_forest.bin",
+    })
+    .unwrap();
+    let mut next = 0;
+
+    c.bench_function("modify 1000 leaves", |b| {
+        b.iter_batched(
+            || {
+                let block = (next..next + LEAVES_PER_BLOCK as u64)
+                    .map(hash)
+                    .collect::<Vec<_>>();
+                next += LEAVES_PER_BLOCK as u64;
+                block
+            },
+            |block| forest.writer().modify(&block, &[]).unwrap(),
+            BatchSize::SmallInput,
+        )
+    });
+
+    let leaves = (0..PROOF_LEAVES as u64)
+        .map(|n| hash(n * 7))
+        .collect::<Vec<_>>();
+    let mut proof = vec![UtreexoHash::default(); PROOF_LEAVES * 64];
+    let mut targets = vec![0; PROOF_LEAVES];
+    let snapshot = forest.snapshot();
+
+    c.bench_function("prove 100 leaves into a buffer", |b| {
+        b.iter(|| black_box(snapshot.prove(&mut proof, &mut targets, &leaves).unwrap()))
+    });
+    c.bench_function("prove 100 leaves into a vec", |b| {
+        b.iter(|| black_box(snapshot.prove_to_vec(&leaves).unwrap()))
+    });
+    c.bench_function("roots", |b| b.iter(|| black_box(snapshot.roots().len())));
+}
+
+criterion_group!(benches, bench_forest);
+criterion_main!(benches);
@@ -1,3 +1,9 @@
 fn main() {
     println!(r"cargo:rustc-link-search=/usr/local/lib");
+    // Lets us link against a library that isn't installed, e.g. the one
+    // inside a build tree: UTREEXO_LIB_DIR=../../.libs cargo test
+    println!("cargo:rerun-if-env-changed=UTREEXO_LIB_DIR");
+    if let Ok(dir) = std::env::var("UTREEXO_LIB_DIR") {
+        println!("cargo:rustc-link-search={}", dir);
+    }
 }
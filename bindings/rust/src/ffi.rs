@@ -1,30 +1,50 @@
-use core::ffi::{c_int, c_char};
+use core::ffi::{c_char, c_int};
 
 #[repr(C)]
-#[derive(Clone)]
+#[derive(Clone, Debug, PartialEq, Eq, Hash, Default)]
 pub struct UtreexoHash(pub [u8; 32]);
 
-impl Copy for UtreexoHash{}
+impl Copy for UtreexoHash {}
 
 #[repr(C)]
 #[allow(non_camel_case_types)]
-pub struct utreexo_forest;
+pub struct utreexo_forest {
+    _private: [u8; 0],
+}
 
-#[allow(improper_ctypes)]
 #[link(name = "utreexo", kind = "static")]
 #[link(name = "crypto")]
 extern "C" {
     pub fn utreexo_forest_init(
-        p: *mut *const utreexo_forest,
+        p: *mut *mut utreexo_forest,
         map_name: *const c_char,
         forest_name: *const c_char,
     ) -> c_int;
-    pub fn utreexo_forest_free(p: *const utreexo_forest) -> c_int;
+    pub fn utreexo_forest_free(p: *mut utreexo_forest) -> c_int;
     pub fn utreexo_forest_modify(
-        p: *const utreexo_forest,
+        p: *mut utreexo_forest,
         utxos: *const UtreexoHash,
         utxo_count: c_int,
         stxos: *const UtreexoHash,
         stxo_count: c_int,
     ) -> c_int;
+    pub fn utreexo_forest_position(
+        p: *mut utreexo_forest,
+        pos: *mut u64,
+        leaf: *const UtreexoHash,
+    ) -> c_int;
+    pub fn utreexo_forest_roots(
+        p: *mut utreexo_forest,
+        roots: *mut *const UtreexoHash,
+        n_roots: *mut usize,
+    ) -> c_int;
+    pub fn utreexo_forest_num_leaves(p: *mut utreexo_forest, num_leaves: *mut u64) -> c_int;
+    pub fn utreexo_forest_prove(
+        p: *mut utreexo_forest,
+        proof: *mut UtreexoHash,
+        proof_len: *mut usize,
+        targets: *mut u64,
+        leaves: *const UtreexoHash,
+        leaf_count: usize,
+    ) -> c_int;
 }
@@ -0,0 +1,337 @@
+use std::ffi::CString;
+use std::fmt;
+use std::marker::PhantomData;
+use std::ptr::NonNull;
+
+pub use ffi::UtreexoHash;
+pub mod ffi;
+
+/// Something went wrong inside the C library
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Error {
+    /// A file name has a NUL byte in it
+    InvalidName,
+    /// Batches can't have more than `c_int::MAX` leaves
+    BatchTooBig,
+    /// Some leaf isn't in the forest
+    NotFound,
+    /// The proof buffer is too small, we need this many hashes
+    ProofTooSmall(usize),
+    /// Any other error, with the code the C API returned
+    Code(i32),
+}
+
+impl fmt::Display for Error {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            Error::InvalidName => write!(f, "file names can't have NUL bytes"),
+            Error::BatchTooBig => write!(f, "batch is too big"),
+            Error::NotFound => write!(f, "leaf not found"),
+            Error::ProofTooSmall(n) => write!(f, "proof needs {} hashes", n),
+            Error::Code(code) => write!(f, "utreexo error {}", code),
+        }
+    }
+}
+
+impl std::error::Error for Error {}
+
+fn check(ret: core::ffi::c_int) -> Result<(), Error> {
+    match ret {
+        0 => Ok(()),
+        code => Err(Error::Code(code)),
+    }
+}
+
+pub struct Configs<'a> {
+    pub map_filename: &'a str,
+    pub forest_filename: &'a str,
+}
+
+/// A forest, and the leaf map that goes with it.
+///
+/// Changing a forest needs a [`Writer`], which borrows it mutably, while
+/// reading it goes through [`Snapshot`]s, which borrow it immutably. So the
+/// borrow checker makes sure nobody reads while we write, and snapshots can be
+/// shared between as many threads as we want.
+pub struct Forest {
+    forest: NonNull<ffi::utreexo_forest>,
+}
+
+///# Safety
+/// It's ok to send the forest to another thread because it's just a pointer
+/// to a C struct. The C struct is heap allocated and the pointer is valid
+/// for the lifetime of the struct.
+unsafe impl Send for Forest {}
+
+///# Safety
+/// Through a shared reference we only call functions that don't change the
+/// forest, and the C library allows calling those from many threads at once.
+unsafe impl Sync for Forest {}
+
+impl Drop for Forest {
+    fn drop(&mut self) {
+        unsafe {
+            ffi::utreexo_forest_free(self.forest.as_ptr());
+        }
+    }
+}
+
+impl Forest {
+    pub fn new(conf: Configs) -> Result<Forest, Error> {
+        let mut forest: *mut ffi::utreexo_forest = core::ptr::null_mut();
+        let name = CString::new(conf.map_filename).map_err(|_| Error::InvalidName)?;
+        let name2 = CString::new(conf.forest_filename).map_err(|_| Error::InvalidName)?;
+        check(unsafe { ffi::utreexo_forest_init(&mut forest, name.as_ptr(), name2.as_ptr()) })?;
+
+        let forest = NonNull::new(forest).ok_or(Error::Code(1))?;
+        Ok(Forest { forest })
+    }
+
+    /// The only way to change a forest
+    pub fn writer(&mut self) -> Writer<'_> {
+        Writer { forest: self }
+    }
+
+    /// A read-only view of this forest, that may be shared between threads
+    pub fn snapshot(&self) -> Snapshot<'_> {
+        Snapshot { forest: self }
+    }
+}
+
+/// Mutable access to a forest
+pub struct Writer<'a> {
+    forest: &'a mut Forest,
+}
+
+impl<'a> Writer<'a> {
+    /// Adds utxos and deletes stxos, both are passed straight to C, without
+    /// copying anything.
+    pub fn modify(&mut self, utxos: &[UtreexoHash], stxos: &[UtreexoHash]) -> Result<(), Error> {
+        let utxo_count = core::ffi::c_int::try_from(utxos.len()).map_err(|_| Error::BatchTooBig)?;
+        let stxo_count = core::ffi::c_int::try_from(stxos.len()).map_err(|_| Error::BatchTooBig)?;
+
+        check(unsafe {
+            ffi::utreexo_forest_modify(
+                self.forest.forest.as_ptr(),
+                utxos.as_ptr(),
+                utxo_count,
+                stxos.as_ptr(),
+                stxo_count,
+            )
+        })
+    }
+
+    /// Applies many blocks in order, each one is a pair of (utxos, stxos).
+    /// Stops at the first block that fails.
+    pub fn modify_many<'b, I>(&mut self, blocks: I) -> Result<(), Error>
+    where
+        I: IntoIterator<Item = (&'b [UtreexoHash], &'b [UtreexoHash])>,
+    {
+        for (utxos, stxos) in blocks {
+            self.modify(utxos, stxos)?;
+        }
+        Ok(())
+    }
+
+    /// Reads the forest we are writing to
+    pub fn snapshot(&self) -> Snapshot<'_> {
+        self.forest.snapshot()
+    }
+}
+
+/// A read-only view of a forest. It's `Copy`, `Send` and `Sync`, and the
+/// forest can't change while it's alive.
+#[derive(Clone, Copy)]
+pub struct Snapshot<'a> {
+    forest: &'a Forest,
+}
+
+/// The roots of a forest, pointing right into it instead of copying them.
+/// They go from the highest row to the lowest, and rows without a tree are
+/// skipped: there is a tree in row `r` if bit `r` of
+/// [`Snapshot::num_leaves`] is set.
+pub struct Roots<'a> {
+    roots: [*const UtreexoHash; 64],
+    len: usize,
+    _forest: PhantomData<&'a Forest>,
+}
+
+impl<'a> Roots<'a> {
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    /// Roots go from the tallest tree to the smallest
+    pub fn get(&self, i: usize) -> Option<&'a UtreexoHash> {
+        if i >= self.len {
+            return None;
+        }
+        // Safety: the C library gave us these pointers, and they live as long
+        // as the forest isn't modified, which the lifetime makes sure of
+        Some(unsafe { &*self.roots[i] })
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = &'a UtreexoHash> + '_ {
+        (0..self.len).filter_map(move |i| self.get(i))
+    }
+}
+
+/// A proof that owns its buffers, see [`Snapshot::prove`] to use your own
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub struct Proof {
+    pub targets: Vec<u64>,
+    pub hashes: Vec<UtreexoHash>,
+}
+
+impl<'a> Snapshot<'a> {
+    fn ptr(&self) -> *mut ffi::utreexo_forest {
+        self.forest.forest.as_ptr()
+    }
+
+    pub fn roots(&self) -> Roots<'a> {
+        let mut roots = Roots {
+            roots: [core::ptr::null(); 64],
+            len: 0,
+            _forest: PhantomData,
+        };
+        unsafe {
+            ffi::utreexo_forest_roots(self.ptr(), roots.roots.as_mut_ptr(), &mut roots.len);
+        }
+        roots
+    }
+
+    pub fn num_leaves(&self) -> u64 {
+        let mut num_leaves = 0;
+        unsafe {
+            ffi::utreexo_forest_num_leaves(self.ptr(), &mut num_leaves);
+        }
+        num_leaves
+    }
+
+    pub fn position(&self, leaf: &UtreexoHash) -> Result<u64, Error> {
+        let mut pos = 0;
+        match unsafe { ffi::utreexo_forest_position(self.ptr(), &mut pos, leaf) } {
+            0 => Ok(pos),
+            -1 => Err(Error::NotFound),
+            code => Err(Error::Code(code)),
+        }
+    }
+
+    /// Proves leaves into buffers we don't own. targets must be as long as
+    /// leaves, and proof can hold up to `leaves.len() * 64` hashes. Returns
+    /// how many hashes of proof were used.
+    pub fn prove(
+        &self,
+        proof: &mut [UtreexoHash],
+        targets: &mut [u64],
+        leaves: &[UtreexoHash],
+    ) -> Result<usize, Error> {
+        if targets.len() < leaves.len() {
+            return Err(Error::BatchTooBig);
+        }
+
+        let mut proof_len = proof.len();
+        let ret = unsafe {
+            ffi::utreexo_forest_prove(
+                self.ptr(),
+                proof.as_mut_ptr(),
+                &mut proof_len,
+                targets.as_mut_ptr(),
+                leaves.as_ptr(),
+                leaves.len(),
+            )
+        };
+        match ret {
+            0 => Ok(proof_len),
+            -1 => Err(Error::NotFound),
+            -2 => Err(Error::ProofTooSmall(proof_len)),
+            code => Err(Error::Code(code)),
+        }
+    }
+
+    /// Same as [`Snapshot::prove`], but allocates the proof
+    pub fn prove_to_vec(&self, leaves: &[UtreexoHash]) -> Result<Proof, Error> {
+        let mut proof = Proof {
+            targets: vec![0; leaves.len()],
+            // Enough for forests up to 2^32 leaves, we only retry past that
+            hashes: vec![UtreexoHash::default(); leaves.len() * 32],
+        };
+        let len = match self.prove(&mut proof.hashes, &mut proof.targets, leaves) {
+            Err(Error::ProofTooSmall(len)) => {
+                proof.hashes.resize(len, UtreexoHash::default());
+                self.prove(&mut proof.hashes, &mut proof.targets, leaves)?
+            }
+            other => other?,
+        };
+        proof.hashes.truncate(len);
+        Ok(proof)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::{Error, Forest, UtreexoHash};
+
+    fn leaves(range: std::ops::Range<u8>) -> Vec<UtreexoHash> {
+        range.map(|n| UtreexoHash([n; 32])).collect()
+    }
+
+    #[test]
+    fn test() {
+        let mut forest = Forest::new(crate::Configs {
+            map_filename: "test.bin",
+            forest_filename: "forest_test.bin",
+        })
+        .unwrap();
+        let leaves = leaves(0..8);
+
+        forest.writer().modify(&leaves, &[]).unwrap();
+        let snapshot = forest.snapshot();
+        assert_eq!(snapshot.num_leaves(), 8);
+        assert_eq!(snapshot.roots().len(), 1);
+        assert_eq!(snapshot.position(&leaves[5]), Ok(5));
+
+        // 8 leaves, one tree, so proving one leaf takes 3 hashes
+        let proof = snapshot.prove_to_vec(&leaves[2..3]).unwrap();
+        assert_eq!(proof.targets, vec![2]);
+        assert_eq!(proof.hashes.len(), 3);
+        assert_eq!(proof.hashes[0], leaves[3]);
+
+        forest.writer().modify(&[], &leaves[0..1]).unwrap();
+        assert_eq!(forest.snapshot().position(&leaves[0]), Err(Error::NotFound));
+    }
+
+    #[test]
+    fn test_concurrent_snapshots() {
+        let mut forest = Forest::new(crate::Configs {
+            map_filename: "test_threads.bin",
+            forest_filename: "forest_test_threads.bin",
+        })
+        .unwrap();
+        let leaves = leaves(0..100);
+        forest
+            .writer()
+            .modify_many(leaves.chunks(10).map(|block| (block, &[][..])))
+            .unwrap();
+
+        let snapshot = forest.snapshot();
+        let expected = snapshot.prove_to_vec(&leaves).unwrap();
+        std::thread::scope(|s| {
+            for _ in 0..4 {
+                s.spawn(|| {
+                    let mut hashes = vec![UtreexoHash::default(); leaves.len() * 64];
+                    let mut targets = vec![0; leaves.len()];
+                    for _ in 0..20 {
+                        let len = snapshot.prove(&mut hashes, &mut targets, &leaves).unwrap();
+                        assert_eq!(&hashes[..len], &expected.hashes[..]);
+                        assert_eq!(targets, expected.targets);
+                    }
+                });
+            }
+        });
+    }
+}
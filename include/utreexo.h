@@ -47,6 +47,15 @@
  *
  * 4 - All functions that may fail are marked with MUST_USE, so the compiler
  *     will warn you if you don't check the return value.
+ *
+ * 5 - Functions that don't change the forest (proving, positions, roots and
+ *     leaf counts) may be called from many threads at once, as long as no
+ *     other thread is modifying this forest.
+ *
+ * 6 - Roots always go from the highest row to the lowest, and rows without a
+ *     tree are skipped, so roots don't tell their row by where they are. There
+ *     is a tree in row r if bit r of the number of leaves is set: the first
+ *     root is in the row of its highest set bit, and so on.
  */
 
 #ifndef UTREEXO_H
@@ -56,6 +65,7 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -94,6 +104,129 @@ typedef struct utreexo_forest_ *utreexo_forest;
 extern int utreexo_forest_init(utreexo_forest *p, const char *map_name,
                                const char *forest_name);
 
+/**
+ * Options that can be passed to utreexo_forest_init_ex. A zeroed struct means
+ * the defaults for everything.
+ */
+struct utreexo_forest_options {
+  /* How many slots a new leaf map should have. This is rounded up to a power
+   * of two, and should be a few times the number of leaves you expect to
+   * hold, and at most 2^59. Ignored if the leaf map already exists. */
+  uint64_t leaf_map_slots;
+  /* If set, modifying the forest only rewires nodes, and hashes are computed
+   * the next time someone needs them: utreexo_forest_roots, proving and
+   * serializing. Every dirty node is then hashed once, on many threads. This
+   * saves a lot of work when many blocks are applied one after another, and
+   * the roots are only needed at the end. */
+  int deferred_hashing;
+  /* How many recently added leaves we keep in memory, zero means none.
+   * Leaves spent while still there never reach the leaf map, the rest are
+   * written to it once they are among the oldest we hold, or when the forest
+   * is freed. If the process dies before that, the leaf map doesn't know
+   * about them, and must be rebuilt with utreexo_forest_rebuild_leaf_map.
+   * Something like 65536 is a good size. */
+  uint64_t leaf_cache_size;
+  /* How many single-leaf proofs we remember, zero means 4096. A proof is
+   * kept until the tree holding its leaf changes, so leaves proven again
+   * before that are served from memory. */
+  uint64_t proof_cache_size;
+  /* If set, a filter over every leaf in the leaf map is kept next to it, in
+   * a file named like the map with ".filter" appended. It's sized for this
+   * many leaves, and answers almost all lookups for leaves that aren't there
+   * from memory. It's built from the leaf map if it doesn't exist yet, and
+   * rebuilt, twice as big, if it ever fills up. Zero means no filter. */
+  uint64_t leaf_filter_size;
+  /* If set, a background thread keeps track of the forest pages we write to,
+   * and starts writeback for them every 100ms, at up to this many MB/s. The
+   * kernel then rarely gets to flush a big backlog at once, which stalls
+   * modify while it happens. Zero leaves writeback to the kernel. */
+  uint64_t writeback_rate;
+  /* Where the forest lives while it's open. Zero maps the file, and leaves it
+   * to the kernel's page cache. One reads it into a buffer pool of our own,
+   * bypassing the page cache, and never holds more than pool_size of it in
+   * memory. The pool needs userfaultfd, utreexo_forest_init_ex returns -1 if
+   * we were built without it or the kernel won't let us use it. */
+  int backend;
+  /* How many MB of the forest the buffer pool may hold, zero means 1024.
+   * Ignored by other backends. */
+  uint64_t pool_size;
+  /* If set, the pages of the forest and leaf map files that are in the page
+   * cache when the forest is freed are recorded next to them, in files named
+   * like them with ".warm" appended. The next init with this set reads them
+   * back in the background, so a restarted node doesn't have to fault its
+   * working set in one page at a time. The buffer pool doesn't use the page
+   * cache, so only the leaf map is recorded with it. */
+  int warm_start;
+  /* If set, how many MB of the forest file we want in the page cache at
+   * most. A background thread checks every second, and if we are over it,
+   * hands the pages no one used in the last couple of seconds back to the
+   * kernel, oldest first. Pages near the roots always stay. Ignored by the
+   * buffer pool, which has its own pool_size. Zero means no budget. */
+  uint64_t rss_budget;
+  /* If set, every page of the forest file keeps a CRC32C of itself, brought
+   * up to date after each block, that utreexo_forest_verify checks. A file
+   * that didn't have them gets them all after the first block, which reads
+   * the whole file once. Opening a file without this set throws them away. */
+  int page_checksums;
+  /* If set, every block applied to the forest, through utreexo_forest_modify
+   * or utreexo_forest_submit, is appended to a file named like the forest
+   * file with ".trace" appended, with the roots it gave and how long it took.
+   * See utreexo_forest_trace_open to read it back. Getting the roots means
+   * hashing after every block, even with deferred_hashing. Blocks committed
+   * from an overlay aren't recorded. The trace starts with the forest's state
+   * when it was created, and an existing trace is only appended to if it
+   * ends where the forest is, otherwise utreexo_forest_init_ex returns -1. */
+  int record_trace;
+  /* If set, we keep a latency histogram for each phase of applying a block,
+   * and for lookups and proofs, see utreexo_forest_latency. This costs a
+   * couple of clock reads per phase, and about 60KB. */
+  int latency_histograms;
+};
+typedef struct utreexo_forest_options utreexo_forest_options;
+
+/**
+ * Same as utreexo_forest_init, but takes some options to tune the forest.
+ *
+ * This method returns 0 if everything goes Ok, -1 if one of the files can't
+ * be used, and -4 if we are out of memory. A leaf map written by a version
+ * that didn't have a header is refused, it must be removed, and rebuilt with
+ * utreexo_forest_rebuild_leaf_map once the forest is open.
+ *
+ * Out:            p: The newly created forest
+ * In:      map_name: File name of the leaf map
+ *       forest_name: File name of the forest backend
+ *           options: Options for this forest, may be NULL
+ */
+extern int utreexo_forest_init_ex(utreexo_forest *p, const char *map_name,
+                                  const char *forest_name,
+                                  const utreexo_forest_options *options);
+
+/**
+ * Opens a forest another process has open, read-only, e.g. to serve proofs
+ * without getting in the way of the process applying blocks. Both files are
+ * shared with that process, with no locks and no IPC: every block it applies
+ * shows up here as soon as it's done, or once its hashes are computed if it
+ * uses deferred hashing.
+ *
+ * Only utreexo_forest_snapshot, utreexo_forest_num_leaves,
+ * utreexo_forest_position and utreexo_forest_prove work on this forest, the
+ * rest return -1. Leaves that are still in the writer's leaf cache (see
+ * leaf_cache_size) aren't found until they make it to the leaf map. If the
+ * writer is restarted, this forest must be freed and attached again. If it
+ * dies halfway through a block, those functions return -1 rather than wait
+ * for it forever.
+ *
+ * This method returns 0 if everything goes Ok, -1 if the forest isn't open
+ * in another process, or is but with the buffer pool backend, or we can't map
+ * it where that process has it, and -4 if we are out of memory.
+ *
+ * Out:            p: The attached forest
+ * In:      map_name: File name of the leaf map
+ *       forest_name: File name of the forest backend
+ */
+extern int utreexo_forest_attach(utreexo_forest *p, const char *map_name,
+                                 const char *forest_name);
+
 /**
  * Frees-up a forest. This method should be called when you're done with
  * the forest, otherwise may cause resource leak.
@@ -112,26 +245,580 @@ extern int utreexo_forest_free(utreexo_forest p);
  * takes as arguments the leaf that should be added/removed, and the number of
  * leaves for each operation.
  *
- * This method returns 0 if everything goes Ok, 1 otherwise.
+ * This method returns 0 if everything goes Ok, a negative value otherwise,
+ * e.g. -3 if some stxo isn't in the forest. If it fails, the forest is left
+ * as it was.
  *
  * Out:           p: The newly created forest
  * In:         leaf: The leaf that should be added
  *       leaf_count: The number of leaves that should be added/removed
  */
 extern int utreexo_forest_modify(utreexo_forest forest,
-                                 utreexo_node_hash *utxos, int utxo_count,
-                                 utreexo_node_hash *stxos, int stxo_count);
+                                 const utreexo_node_hash *utxos,
+                                 int utxo_count,
+                                 const utreexo_node_hash *stxos,
+                                 int stxo_count);
 
 /**
- * Prove that some elements are in the forest. This function takes as input
- * an array of leaves, and an array that will be filled with the proofs.
+ * The changes a block makes to the forest, see utreexo_forest_submit.
+ */
+struct utreexo_block_delta {
+  const utreexo_node_hash *utxos;
+  size_t utxo_count;
+  const utreexo_node_hash *stxos;
+  size_t stxo_count;
+};
+typedef struct utreexo_block_delta utreexo_block_delta;
+
+/**
+ * Starts applying blocks in the background. While one block is being hashed,
+ * the next ones already have their spent leaves looked up and their pages
+ * faulted in, so I/O and hashing overlap. Blocks are still applied in the
+ * order they are submitted.
  *
- * Out:           p: The newly created forest
- * In:         leaf: The leaf that should be added
- *       leaf_count: The number of leaves that should be added/removed
+ * Calling this is optional, utreexo_forest_submit starts the pipeline with a
+ * default depth if needed.
+ *
+ * This method returns 0 if everything goes Ok, a negative value otherwise.
+ *
+ * In:  forest: The forest blocks will be applied to
+ *       depth: How many blocks may be in flight at once, 0 means the default
+ */
+extern int utreexo_forest_pipeline_start(utreexo_forest forest, size_t depth);
+
+/**
+ * Queues a block to be applied, this is the asynchronous version of
+ * utreexo_forest_modify. If there are already depth blocks in flight, this
+ * waits until the oldest one is applied. The arrays inside block are not
+ * copied, so they must stay valid until this block is applied.
+ *
+ * While blocks are in flight, the forest may only be used through
+ * utreexo_forest_submit and utreexo_forest_wait.
+ *
+ * This method returns 0 if everything goes Ok, a negative value otherwise.
+ *
+ * Out: ticket: Identifies this block, pass it to utreexo_forest_wait
+ * In:  forest: The forest this block will be applied to
+ *       block: The leaves this block adds and spends
+ */
+extern int utreexo_forest_submit(utreexo_forest forest, uint64_t *ticket,
+                                 const utreexo_block_delta *block);
+
+/**
+ * Waits until a block is applied, and gets the roots right after it, from the
+ * tallest tree to the smallest. Results are kept until depth more blocks are
+ * submitted, so wait for a ticket before submitting ticket + depth if you need
+ * every block's roots.
+ *
+ * This method returns what utreexo_forest_modify would have returned for this
+ * block, -5 if the pipeline was stopped since this block was submitted, -6 if
+ * this result is gone and -7 if this ticket was never submitted. Once a block
+ * fails, all blocks after it fail with the same error. Tickets keep counting
+ * up when the pipeline is started again.
+ *
+ * Out:   roots: The roots after this block, must have room for 64 entries.
+ *               May be NULL
+ *      n_roots: How many roots there are, may be NULL
+ * In:   forest: The forest this block was submitted to
+ *       ticket: What utreexo_forest_submit returned for this block
+ */
+extern int utreexo_forest_wait(utreexo_forest forest, utreexo_node_hash *roots,
+                               size_t *n_roots, uint64_t ticket);
+
+/**
+ * Applies every block already submitted and stops the background threads.
+ * utreexo_forest_modify and utreexo_forest_free do this as well.
+ *
+ * This method returns 0 if everything goes Ok, 1 otherwise.
+ *
+ * In:  forest: The forest we are stopping
+ */
+extern int utreexo_forest_pipeline_stop(utreexo_forest forest);
+
+/**
+ * Writes a snapshot of the whole forest to a file. Unlike the forest file, a
+ * snapshot doesn't depend on where the forest was mapped, so it can be copied
+ * to another host and loaded with utreexo_forest_deserialize. Snapshots are
+ * versioned and checksummed.
+ *
+ * This method returns 0 if everything goes Ok, a negative value otherwise.
+ *
+ * In:    forest: The forest we are writing
+ *      filename: Where the snapshot should be written to
+ *         flags: If 1, also store the hashes of internal nodes. This makes the
+ *                snapshot bigger, but loading it won't need to rehash anything.
+ *                Any other bit makes this method fail
+ */
+extern int utreexo_forest_serialize(utreexo_forest forest,
+                                    const char *filename, int flags);
+
+/**
+ * Loads a snapshot created by utreexo_forest_serialize into an empty forest,
+ * rebuilding both the forest and the leaf map.
+ *
+ * This method returns 0 if everything goes Ok, a negative value otherwise,
+ * e.g. if the snapshot uses flags we don't know, or its trees don't fit the
+ * number of leaves it claims. The whole snapshot, checksum included, is
+ * checked before anything is loaded, so a damaged one leaves the forest as it
+ * was.
+ *
+ * In:    forest: A newly created forest, without any leaves
+ *      filename: The snapshot we should load
+ */
+extern int utreexo_forest_deserialize(utreexo_forest forest,
+                                      const char *filename);
+
+/**
+ * Finds where a leaf is in the forest. Positions follow the usual utreexo
+ * numbering: leaves in the bottom row are numbered from 0, and each row above
+ * is numbered right after the one below it.
+ *
+ * This method returns 0 if everything goes Ok, -1 if this leaf isn't in the
+ * forest.
+ *
+ * Out:     pos: The leaf's position
+ * In:   forest: The forest we are looking into
+ *         leaf: The leaf we are looking for
+ */
+extern int utreexo_forest_position(utreexo_forest forest, uint64_t *pos,
+                                   const utreexo_node_hash *leaf);
+
+/**
+ * Gets the current roots, from the tallest tree to the smallest, skipping
+ * rows without a tree (see 6 above). Instead of copying hashes, this gives
+ * pointers right into the forest, they are only valid until the next
+ * utreexo_forest_modify.
+ *
+ * This method returns 0 if everything goes Ok, 1 otherwise.
+ *
+ * Out:   roots: Pointers to each root's hash, must have room for 64 entries
+ *      n_roots: How many roots we have
+ * In:   forest: The forest we are looking into
+ */
+extern int utreexo_forest_roots(utreexo_forest forest,
+                                const utreexo_node_hash **roots,
+                                size_t *n_roots);
+
+/**
+ * Copies the current roots, from the tallest tree to the smallest, skipping
+ * rows without a tree (see 6 above), and the number of leaves, all from the
+ * same state of the forest. Unlike
+ * utreexo_forest_roots, this also works on forests from utreexo_forest_attach.
+ *
+ * This method returns 0 if everything goes Ok, 1 otherwise.
+ *
+ * Out:      roots: Each root's hash, must have room for 64 entries
+ *         n_roots: How many roots we have
+ *      num_leaves: How many leaves were added, may be NULL
+ * In:      forest: The forest we are looking into
+ */
+extern int utreexo_forest_snapshot(utreexo_forest forest,
+                                   utreexo_node_hash *roots, size_t *n_roots,
+                                   uint64_t *num_leaves);
+
+/**
+ * Gets how many leaves were ever added to this forest, including the ones that
+ * were deleted since. Together with the roots, this is the accumulator state.
+ *
+ * This method returns 0 if everything goes Ok, 1 otherwise.
+ *
+ * Out: num_leaves: How many leaves were added
+ * In:      forest: The forest we are looking into
+ */
+extern int utreexo_forest_num_leaves(utreexo_forest forest,
+                                     uint64_t *num_leaves);
+
+/**
+ * Prove that some elements are in the forest. The proof is made of the
+ * positions of each leaf (the targets) and the hashes a verifier needs to
+ * recompute the roots from them, sorted by position.
+ *
+ * Every leaf adds at most one hash per forest row, so leaf_count * 64 hashes
+ * is always enough. If proof is too small, *proof_len is set to the size
+ * we need and nothing is written.
+ *
+ * This method returns 0 if everything goes Ok, -1 if some leaf isn't in the
+ * forest, and -2 if proof is too small.
+ *
+ * Out:      proof: The hashes needed to verify this proof
+ *       proof_len: In: how many hashes proof can hold. Out: how many hashes
+ *                  this proof has
+ *         targets: The position of each leaf, must hold leaf_count entries
+ * In:      forest: The forest we are proving from
+ *          leaves: The leaves we are proving
+ *      leaf_count: How many leaves we are proving
  */
-static int utreexo_forest_prove(utreexo_forest forest, utreexo_node_hash *leaf,
-                                int leaf_count, utreexo_node_hash *proof);
+extern int utreexo_forest_prove(utreexo_forest forest, utreexo_node_hash *proof,
+                                size_t *proof_len, uint64_t *targets,
+                                const utreexo_node_hash *leaves,
+                                size_t leaf_count);
+/**
+ * A speculative view of a forest. Blocks applied to an overlay never touch the
+ * forest under it: changed nodes, roots and leaves are kept in memory, and
+ * everything else is read from the forest. So we can apply a block we aren't
+ * sure about yet, look at the roots it gives us, and then either commit it or
+ * just free the overlay.
+ *
+ * The forest stays readable by other threads while overlays exist, and many
+ * overlays may sit on the same forest, e.g. one per competing block. Only one
+ * of them may be committed, committing any other one after that fails.
+ */
+typedef struct utreexo_overlay_ *utreexo_overlay;
+
+/**
+ * Creates an empty overlay on top of a forest. The forest must outlive the
+ * overlay.
+ *
+ * This method returns 0 if everything goes Ok, a negative value otherwise.
+ *
+ * Out: overlay: The new overlay
+ * In:   forest: The forest under this overlay
+ */
+extern int utreexo_forest_overlay_new(utreexo_overlay *overlay,
+                                      utreexo_forest forest);
+
+/**
+ * Applies a block to an overlay only, the same way utreexo_forest_modify
+ * would apply it to the forest. If some stxo isn't found, nothing is applied.
+ * This may be called many times, each block goes on top of the last one.
+ *
+ * This method returns 0 if everything goes Ok, -3 if some stxo isn't in the
+ * forest, or another negative value if something else failed.
+ *
+ * In:    overlay: The overlay we are changing
+ *          utxos: The leaves we are adding
+ *     utxo_count: How many leaves we are adding
+ *          stxos: The leaves we are deleting
+ *     stxo_count: How many leaves we are deleting
+ */
+extern int utreexo_forest_overlay_modify(utreexo_overlay overlay,
+                                         const utreexo_node_hash *utxos,
+                                         size_t utxo_count,
+                                         const utreexo_node_hash *stxos,
+                                         size_t stxo_count);
+
+/**
+ * Gets the roots of the forest as this overlay sees it, from the tallest tree
+ * to the smallest.
+ *
+ * This method returns 0 if everything goes Ok, 1 otherwise.
+ *
+ * Out:   roots: Where we write the roots, must have room for 64 entries
+ *      n_roots: How many roots there are
+ * In:  overlay: The overlay we are looking into
+ */
+extern int utreexo_forest_overlay_roots(utreexo_overlay overlay,
+                                        utreexo_node_hash *roots,
+                                        size_t *n_roots);
+
+/**
+ * Writes an overlay to its forest, as if every block applied to it had gone
+ * to utreexo_forest_modify, and frees the overlay. If the forest changed since
+ * the overlay was created, nothing is written.
+ *
+ * This method returns 0 if everything goes Ok, -8 if the forest changed, or
+ * another negative value if something else failed. The overlay is freed
+ * either way.
+ *
+ * In:  overlay: The overlay we are committing
+ */
+extern int utreexo_forest_overlay_commit(utreexo_overlay overlay);
+
+/**
+ * Frees an overlay without writing anything to the forest.
+ *
+ * This method returns 0 if everything goes Ok, 1 otherwise.
+ *
+ * In:  overlay: The overlay we are dropping
+ */
+extern int utreexo_forest_overlay_free(utreexo_overlay overlay);
+/**
+ * How the cache of recently added leaves is doing, see
+ * utreexo_forest_options.leaf_cache_size.
+ */
+struct utreexo_leaf_cache_stats {
+  /* Lookups answered from the cache */
+  uint64_t hits;
+  /* Lookups that went to the leaf map */
+  uint64_t misses;
+  /* Leaves spent before they ever reached the leaf map */
+  uint64_t elided;
+  /* Leaves written to the leaf map to make room for newer ones */
+  uint64_t evicted;
+};
+typedef struct utreexo_leaf_cache_stats utreexo_leaf_cache_stats;
+
+/**
+ * Gets the counters of the recently added leaf cache, they count from when
+ * the forest was created.
+ *
+ * This method returns 0 if everything goes Ok, 1 otherwise.
+ *
+ * Out:  stats: The counters
+ * In:  forest: The forest we are looking into
+ */
+extern int utreexo_forest_leaf_cache_stats(utreexo_forest forest,
+                                           utreexo_leaf_cache_stats *stats);
+
+/**
+ * What utreexo_forest_latency can tell about. Applying a block, through
+ * utreexo_forest_modify or utreexo_forest_submit, is split in phases:
+ *
+ *  RESOLVE:    Finding the leaves it spends in the leaf map
+ *  DELETE:     Taking them out of the forest
+ *  ADD:        Putting its new leaves in the forest and the leaf map
+ *  HASH:       Rehashing everything it changed, with deferred_hashing.
+ *              Otherwise, hashing is part of DELETE and ADD
+ *  PAGE_ALLOC: Getting a new page for nodes, part of DELETE or ADD
+ *
+ * MODIFY is a whole utreexo_forest_modify call, POSITION a whole
+ * utreexo_forest_position, and PROVE a whole utreexo_forest_prove.
+ */
+enum utreexo_latency_phase {
+  UTREEXO_LATENCY_MODIFY,
+  UTREEXO_LATENCY_RESOLVE,
+  UTREEXO_LATENCY_DELETE,
+  UTREEXO_LATENCY_ADD,
+  UTREEXO_LATENCY_HASH,
+  UTREEXO_LATENCY_PAGE_ALLOC,
+  UTREEXO_LATENCY_POSITION,
+  UTREEXO_LATENCY_PROVE,
+  UTREEXO_LATENCY_PHASES,
+};
+
+/**
+ * How long some phase took, in nanoseconds. Percentiles are the top of the
+ * bucket they fall in, which is at most 1/16th above the real value.
+ */
+struct utreexo_latency_stats {
+  /* How many times we timed it */
+  uint64_t count;
+  uint64_t mean;
+  uint64_t max;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+};
+typedef struct utreexo_latency_stats utreexo_latency_stats;
+
+/**
+ * Gets the latency histogram of a phase, see latency_histograms. They count
+ * from when the forest was created, or from the last reset, so reading them
+ * with reset set once per interval gives how that interval went. Everything
+ * is zero if we aren't keeping histograms.
+ *
+ * This method returns 0 if everything goes Ok, -1 if phase isn't one of
+ * utreexo_latency_phase.
+ *
+ * Out:  stats: What we counted
+ * In:  forest: The forest we are looking into
+ *       phase: Which phase we want, one of utreexo_latency_phase
+ *       reset: If set, we start counting again from zero
+ */
+extern int utreexo_forest_latency(utreexo_forest forest, int phase,
+                                  utreexo_latency_stats *stats, int reset);
+
+/**
+ * What utreexo_forest_verify found.
+ */
+struct utreexo_forest_verify_stats {
+  /* Pages we looked at */
+  uint64_t pages;
+  /* Nodes we reached from the roots */
+  uint64_t nodes;
+  /* Pages that aren't forest pages anymore */
+  uint64_t bad_pages;
+  /* Pages whose checksum doesn't match, see page_checksums */
+  uint64_t bad_checksums;
+  /* Pointers to nowhere, children that don't know their parent, and trees
+   * taller than they should be */
+  uint64_t bad_links;
+  /* Internal nodes whose hash isn't the hash of their children */
+  uint64_t bad_hashes;
+  /* Roots for trees we shouldn't have */
+  uint64_t bad_roots;
+};
+typedef struct utreexo_forest_verify_stats utreexo_forest_verify_stats;
+
+/**
+ * Checks the whole forest for corruption: every page's checksum, if we keep
+ * them, every link between parents and children, every internal hash, and
+ * the roots. This reads the whole forest once, on every core, and waits for
+ * blocks in flight first. The forest must not be changed while this runs.
+ *
+ * This method returns 0 if nothing is wrong, -9 if something is, -1 if this
+ * forest is attached to another process, and -4 if we are out of memory.
+ *
+ * Out:  stats: What we found, may be NULL
+ * In:  forest: The forest we are checking
+ */
+extern int utreexo_forest_verify(utreexo_forest forest,
+                                 utreexo_forest_verify_stats *stats);
+
+/**
+ * Throws away the leaf map, and builds it again from the leaves in the
+ * forest. The map is only an index of the forest, so this is how to recover
+ * from losing or damaging it without applying every block again: the trees
+ * are walked on every core, and the map is written front to back in one go.
+ * It waits for blocks in flight first, and the forest must not be changed
+ * while this runs.
+ *
+ * This method returns 0 on success, -1 if this forest is attached to another
+ * process, and -4 if we are out of memory, leaving the map as it was.
+ *
+ * Out: n_leaves: How many leaves the map holds now, may be NULL
+ * In:    forest: The forest whose leaf map we are rebuilding
+ */
+extern int utreexo_forest_rebuild_leaf_map(utreexo_forest forest,
+                                           uint64_t *n_leaves);
+
+/**
+ * A trace recorded with record_trace, being read back. Applying each block
+ * in it to a forest that starts where the trace does (see
+ * utreexo_forest_trace_start), and checking the roots, replays whatever the
+ * forest that recorded it went through, see bench/bench_replay.c.
+ */
+typedef struct utreexo_trace_ *utreexo_trace;
+
+/**
+ * One block from a trace. Hashes are only good until the next call to
+ * utreexo_forest_trace_next.
+ */
+struct utreexo_trace_block {
+  const utreexo_node_hash *utxos;
+  size_t utxo_count;
+  const utreexo_node_hash *stxos;
+  size_t stxo_count;
+  /* The roots after this block, from the tallest tree down */
+  const utreexo_node_hash *roots;
+  size_t n_roots;
+  /* How many leaves were ever added, after this block */
+  uint64_t num_leaves;
+  /* How long the forest that recorded it took to apply it */
+  uint64_t nanos;
+  /* What applying it returned */
+  int ret;
+};
+typedef struct utreexo_trace_block utreexo_trace_block;
+
+/**
+ * Opens a trace to read it.
+ *
+ * This method returns 0 if everything goes Ok, -1 if the file can't be opened
+ * or isn't a trace, and -4 if we are out of memory.
+ *
+ * Out:    trace: The trace we opened
+ * In:  filename: The trace file
+ */
+extern int utreexo_forest_trace_open(utreexo_trace *trace,
+                                     const char *filename);
+
+/**
+ * Reads the next block from a trace.
+ *
+ * This method returns 0 if we read a block, 1 at the end of the trace, -9 if
+ * the trace is damaged or cut short, and -4 if we are out of memory.
+ *
+ * Out: block: The block we read
+ * In:  trace: The trace we are reading
+ */
+extern int utreexo_forest_trace_next(utreexo_trace trace,
+                                     utreexo_trace_block *block);
+
+/**
+ * Gets where the forest that recorded a trace was before its first block. A
+ * trace started on a new forest has no roots and no leaves.
+ *
+ * This method returns 0 if everything goes Ok, 1 otherwise.
+ *
+ * Out: num_leaves: How many leaves were ever added to it
+ *           roots: Its roots, from the tallest tree down. Must have room for
+ *                  64 of them
+ *         n_roots: How many roots it had
+ * In:       trace: The trace we are reading
+ */
+extern int utreexo_forest_trace_start(utreexo_trace trace,
+                                      uint64_t *num_leaves,
+                                      utreexo_node_hash *roots,
+                                      size_t *n_roots);
+
+/**
+ * Closes a trace.
+ *
+ * In: trace: The trace we are done with
+ */
+extern int utreexo_forest_trace_close(utreexo_trace trace);
+
+/* The library keeps its own copy of the structs above, these make sure both
+ * agree on where every field is. The numbers are for 64-bit targets */
+#if UINTPTR_MAX == UINT64_MAX
+#ifdef __cplusplus
+#define UTREEXO_ABI_CHECK(cond, what) static_assert(cond, what)
+#else
+#define UTREEXO_ABI_CHECK(cond, what) _Static_assert(cond, what)
+#endif
+#define UTREEXO_ABI_FIELD(type, field, offset)                                 \
+  UTREEXO_ABI_CHECK(offsetof(type, field) == (offset),                        \
+                    #type "." #field " doesn't match the library")
+#define UTREEXO_ABI_SIZE(type, size)                                           \
+  UTREEXO_ABI_CHECK(sizeof(type) == (size), #type " doesn't match the library")
+UTREEXO_ABI_FIELD(struct utreexo_forest_options, leaf_map_slots, 0);
+UTREEXO_ABI_FIELD(struct utreexo_forest_options, deferred_hashing, 8);
+UTREEXO_ABI_FIELD(struct utreexo_forest_options, leaf_cache_size, 16);
+UTREEXO_ABI_FIELD(struct utreexo_forest_options, proof_cache_size, 24);
+UTREEXO_ABI_FIELD(struct utreexo_forest_options, leaf_filter_size, 32);
+UTREEXO_ABI_FIELD(struct utreexo_forest_options, writeback_rate, 40);
+UTREEXO_ABI_FIELD(struct utreexo_forest_options, backend, 48);
+UTREEXO_ABI_FIELD(struct utreexo_forest_options, pool_size, 56);
+UTREEXO_ABI_FIELD(struct utreexo_forest_options, warm_start, 64);
+UTREEXO_ABI_FIELD(struct utreexo_forest_options, rss_budget, 72);
+UTREEXO_ABI_FIELD(struct utreexo_forest_options, page_checksums, 80);
+UTREEXO_ABI_FIELD(struct utreexo_forest_options, record_trace, 84);
+UTREEXO_ABI_FIELD(struct utreexo_forest_options, latency_histograms, 88);
+UTREEXO_ABI_SIZE(struct utreexo_forest_options, 96);
+UTREEXO_ABI_FIELD(struct utreexo_block_delta, utxos, 0);
+UTREEXO_ABI_FIELD(struct utreexo_block_delta, utxo_count, 8);
+UTREEXO_ABI_FIELD(struct utreexo_block_delta, stxos, 16);
+UTREEXO_ABI_FIELD(struct utreexo_block_delta, stxo_count, 24);
+UTREEXO_ABI_SIZE(struct utreexo_block_delta, 32);
+UTREEXO_ABI_FIELD(struct utreexo_leaf_cache_stats, hits, 0);
+UTREEXO_ABI_FIELD(struct utreexo_leaf_cache_stats, misses, 8);
+UTREEXO_ABI_FIELD(struct utreexo_leaf_cache_stats, elided, 16);
+UTREEXO_ABI_FIELD(struct utreexo_leaf_cache_stats, evicted, 24);
+UTREEXO_ABI_SIZE(struct utreexo_leaf_cache_stats, 32);
+UTREEXO_ABI_FIELD(struct utreexo_forest_verify_stats, pages, 0);
+UTREEXO_ABI_FIELD(struct utreexo_forest_verify_stats, nodes, 8);
+UTREEXO_ABI_FIELD(struct utreexo_forest_verify_stats, bad_pages, 16);
+UTREEXO_ABI_FIELD(struct utreexo_forest_verify_stats, bad_checksums, 24);
+UTREEXO_ABI_FIELD(struct utreexo_forest_verify_stats, bad_links, 32);
+UTREEXO_ABI_FIELD(struct utreexo_forest_verify_stats, bad_hashes, 40);
+UTREEXO_ABI_FIELD(struct utreexo_forest_verify_stats, bad_roots, 48);
+UTREEXO_ABI_SIZE(struct utreexo_forest_verify_stats, 56);
+UTREEXO_ABI_FIELD(struct utreexo_trace_block, utxos, 0);
+UTREEXO_ABI_FIELD(struct utreexo_trace_block, utxo_count, 8);
+UTREEXO_ABI_FIELD(struct utreexo_trace_block, stxos, 16);
+UTREEXO_ABI_FIELD(struct utreexo_trace_block, stxo_count, 24);
+UTREEXO_ABI_FIELD(struct utreexo_trace_block, roots, 32);
+UTREEXO_ABI_FIELD(struct utreexo_trace_block, n_roots, 40);
+UTREEXO_ABI_FIELD(struct utreexo_trace_block, num_leaves, 48);
+UTREEXO_ABI_FIELD(struct utreexo_trace_block, nanos, 56);
+UTREEXO_ABI_FIELD(struct utreexo_trace_block, ret, 64);
+UTREEXO_ABI_SIZE(struct utreexo_trace_block, 72);
+UTREEXO_ABI_FIELD(struct utreexo_latency_stats, count, 0);
+UTREEXO_ABI_FIELD(struct utreexo_latency_stats, mean, 8);
+UTREEXO_ABI_FIELD(struct utreexo_latency_stats, max, 16);
+UTREEXO_ABI_FIELD(struct utreexo_latency_stats, p50, 24);
+UTREEXO_ABI_FIELD(struct utreexo_latency_stats, p90, 32);
+UTREEXO_ABI_FIELD(struct utreexo_latency_stats, p99, 40);
+UTREEXO_ABI_FIELD(struct utreexo_latency_stats, p999, 48);
+UTREEXO_ABI_SIZE(struct utreexo_latency_stats, 56);
+UTREEXO_ABI_CHECK(UTREEXO_LATENCY_PHASES == 8,
+                  "utreexo_latency_phase doesn't match the library");
+#undef UTREEXO_ABI_SIZE
+#undef UTREEXO_ABI_FIELD
+#undef UTREEXO_ABI_CHECK
+#endif
 #ifdef __cplusplus
 }
 #endif // __cplusplus
@@ -1,17 +1,235 @@
+// The MIT License (MIT)
+
+// Copyright (c) 2023 Davidson Souza
+
+//  Permission is hereby granted, free of charge, to any person obtaining a
+//  copy of this software and associated documentation files (the "Software"),
+//  to deal in the Software without restriction, including without limitation
+//  the rights to use, copy, modify, merge, publish, distribute, sublicense,
+//  and/or sell copies of the Software, and to permit persons to whom the
+//  Software is furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+//  OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+//  FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+//  DEALINGS IN THE SOFTWARE.
+
+/**
+ * A header-only C++17 wrapper around utreexo.h. It doesn't add anything on
+ * top of the C API, it only makes it harder to misuse:
+ *
+ * 1 - Forests are move-only handles, they are freed when they go out of
+ *     scope.
+ *
+ * 2 - Inputs are taken as spans, so any contiguous container can be passed
+ *     without copying it. With C++20 this is std::span, otherwise a minimal
+ *     span with the same interface.
+ *
+ * 3 - Outputs either go into caller-owned buffers, or are allocated from a
+ *     std::pmr::memory_resource, so callers can use an arena that is reset
+ *     once per block.
+ *
+ * 4 - Errors are reported as utreexo::Error exceptions, carrying the code
+ *     returned by the C API.
+ */
+
+#ifndef UTREEXO_HPP
+#define UTREEXO_HPP
+
 #include <utreexo.h>
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-class UtreexoForest {
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+namespace utreexo {
+
+using Hash = utreexo_node_hash;
+
+#if __cplusplus >= 202002L
+template <class T> using Span = std::span<T>;
+#else
+/* Just enough of std::span for C++17 */
+template <class T> class Span {
+public:
+  constexpr Span() noexcept = default;
+  constexpr Span(T *data, std::size_t size) noexcept
+      : data_(data), size_(size) {}
+  template <std::size_t N>
+  constexpr Span(T (&array)[N]) noexcept : data_(array), size_(N) {}
+  template <class Container,
+            class = std::enable_if_t<std::is_convertible_v<
+                decltype(std::declval<Container &>().data()), T *>>>
+  constexpr Span(Container &container) noexcept
+      : data_(container.data()), size_(container.size()) {}
+
+  constexpr T *data() const noexcept { return data_; }
+  constexpr std::size_t size() const noexcept { return size_; }
+  constexpr bool empty() const noexcept { return size_ == 0; }
+  constexpr T *begin() const noexcept { return data_; }
+  constexpr T *end() const noexcept { return data_ + size_; }
+  constexpr T &operator[](std::size_t i) const noexcept { return data_[i]; }
+  constexpr Span first(std::size_t n) const noexcept { return {data_, n}; }
+
+private:
+  T *data_ = nullptr;
+  std::size_t size_ = 0;
+};
+#endif
+
+/* Thrown when the C API fails, code is whatever it returned */
+class Error : public std::runtime_error {
+public:
+  Error(const char *what, int code) : std::runtime_error(what), code_(code) {}
+  int code() const noexcept { return code_; }
+
 private:
-  utreexo_forest forest;
+  int code_;
+};
+
+/* A proof allocated from a memory resource, see Forest::Prove */
+struct Proof {
+  explicit Proof(std::pmr::memory_resource *resource)
+      : targets(resource), hashes(resource) {}
+
+  std::pmr::vector<std::uint64_t> targets;
+  std::pmr::vector<Hash> hashes;
+};
 
+class Forest {
 public:
-  UtreexoForest(char *path) { utreexo_forest_init(&this->forest, path); };
-  UtreexoForest() { utreexo_forest_init(&this->forest, "forest.bin"); };
-  ~UtreexoForest() { utreexo_forest_free(this->forest); };
-  void Modify(std::vector<utreexo_node_hash> utxos,
-              std::vector<utreexo_node_hash> stxos) {
-    utreexo_forest_modify(this->forest, utxos.data(), utxos.size(),
-                          stxos.data(), stxos.size());
-  };
+  /* Every leaf adds at most one hash per row, and we never have more than 64
+   * rows. Buffers this big never make Prove fail */
+  static constexpr std::size_t MaxProofSize(std::size_t n_leaves) noexcept {
+    return n_leaves * 64;
+  }
+
+  Forest(const char *map_name, const char *forest_name,
+         const utreexo_forest_options *options = nullptr) {
+    const int ret =
+        utreexo_forest_init_ex(&forest_, map_name, forest_name, options);
+    if (ret != 0)
+      throw Error("utreexo_forest_init_ex", ret);
+  }
+
+  Forest(const Forest &) = delete;
+  Forest &operator=(const Forest &) = delete;
+
+  Forest(Forest &&other) noexcept
+      : forest_(std::exchange(other.forest_, nullptr)) {}
+
+  Forest &operator=(Forest &&other) noexcept {
+    if (this != &other) {
+      Reset();
+      forest_ = std::exchange(other.forest_, nullptr);
+    }
+    return *this;
+  }
+
+  ~Forest() { Reset(); }
+
+  /* The underlying C handle, still owned by this object */
+  utreexo_forest get() const noexcept { return forest_; }
+
+  void Modify(Span<const Hash> utxos, Span<const Hash> stxos) {
+    if (utxos.size() > INT_MAX || stxos.size() > INT_MAX)
+      throw std::length_error("utreexo::Forest::Modify");
+
+    const int ret =
+        utreexo_forest_modify(forest_, utxos.data(), (int)utxos.size(),
+                              stxos.data(), (int)stxos.size());
+    if (ret != 0)
+      throw Error("utreexo_forest_modify", ret);
+  }
+
+  std::uint64_t Position(const Hash &leaf) const {
+    std::uint64_t pos = 0;
+    const int ret = utreexo_forest_position(forest_, &pos, &leaf);
+    if (ret != 0)
+      throw Error("utreexo_forest_position", ret);
+    return pos;
+  }
+
+  /* Proves leaves into caller-owned buffers, targets must be as big as
+   * leaves. Returns how many hashes of proof were used, throws if proof is
+   * too small (see MaxProofSize) */
+  std::size_t Prove(Span<Hash> proof, Span<std::uint64_t> targets,
+                    Span<const Hash> leaves) const {
+    if (targets.size() < leaves.size())
+      throw std::length_error("utreexo::Forest::Prove");
+
+    std::size_t proof_len = proof.size();
+    const int ret = utreexo_forest_prove(forest_, proof.data(), &proof_len,
+                                         targets.data(), leaves.data(),
+                                         leaves.size());
+    if (ret != 0)
+      throw Error("utreexo_forest_prove", ret);
+    return proof_len;
+  }
+
+  /* Proves leaves, allocating the proof from resource */
+  Proof Prove(Span<const Hash> leaves,
+              std::pmr::memory_resource *resource =
+                  std::pmr::get_default_resource()) const {
+    Proof proof(resource);
+    proof.targets.resize(leaves.size());
+    // Enough for forests up to 2^32 leaves, we only retry past that
+    proof.hashes.resize(leaves.size() * 32);
+
+    std::size_t proof_len = proof.hashes.size();
+    int ret = utreexo_forest_prove(forest_, proof.hashes.data(), &proof_len,
+                                   proof.targets.data(), leaves.data(),
+                                   leaves.size());
+    if (ret == -2) {
+      proof.hashes.resize(proof_len);
+      ret = utreexo_forest_prove(forest_, proof.hashes.data(), &proof_len,
+                                 proof.targets.data(), leaves.data(),
+                                 leaves.size());
+    }
+    if (ret != 0)
+      throw Error("utreexo_forest_prove", ret);
+
+    proof.hashes.resize(proof_len);
+    return proof;
+  }
+
+  void Serialize(const char *filename, int flags = 0) const {
+    const int ret = utreexo_forest_serialize(forest_, filename, flags);
+    if (ret != 0)
+      throw Error("utreexo_forest_serialize", ret);
+  }
+
+  void Deserialize(const char *filename) {
+    const int ret = utreexo_forest_deserialize(forest_, filename);
+    if (ret != 0)
+      throw Error("utreexo_forest_deserialize", ret);
+  }
+
+private:
+  void Reset() noexcept {
+    if (forest_ != nullptr)
+      utreexo_forest_free(forest_);
+    forest_ = nullptr;
+  }
+
+  utreexo_forest forest_ = nullptr;
 };
+
+} // namespace utreexo
+
+#endif // UTREEXO_HPP
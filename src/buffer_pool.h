@@ -0,0 +1,117 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * A user-space buffer pool for the forest file, as an alternative to mapping
+ * it. With mmap, the kernel decides which pages stay in memory, and the forest
+ * competes for the page cache with everything else on the machine. Here the
+ * file is opened with O_DIRECT, so it never goes through the page cache, and
+ * we hold at most a fixed number of frames in memory.
+ *
+ * Nodes point to each other with plain pointers, so a page can't move while
+ * the file is open. Like the mmap backend, we reserve a single range for the
+ * whole file, wherever the kernel puts it, but without anything behind it,
+ * and register it with userfaultfd. A frame always goes back to the same
+ * spot in that range.
+ * The first time a frame is touched its thread blocks, and our handler thread
+ * reads the frame from the file into place and lets it go. Once a frame is
+ * there, reading it costs nothing.
+ *
+ * Frames come in write-protected, so the first write to one also goes
+ * through the handler, which marks it dirty. When we need room, a clock hand
+ * goes over the frames we hold. Frames touched since the hand last passed
+ * get a second chance, pinned ones are skipped, and the first one left is
+ * evicted. If it's dirty it's write-protected again, written to the file, and
+ * then dropped. Only loads and writes count as touching a frame, since reads
+ * of a frame we hold never reach us.
+ *
+ * Everything that changes which frames we hold happens under one lock, and
+ * nobody holding it ever touches the pool's memory, except for frames it knows
+ * are there.
+ */
+#ifndef UTREEXO_BUFFER_POOL_H
+#define UTREEXO_BUFFER_POOL_H
+
+#include "config.h"
+
+#ifdef USE_BUFFER_POOL
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* How much of the file we move at once. A multiple of the page size, and of
+ * whatever O_DIRECT wants */
+#define UTREEXO_POOL_FRAME (1 << 16)
+/* The smallest pool we accept, in frames */
+#define UTREEXO_POOL_MIN_FRAMES 16
+
+/* Per-frame flags */
+#define UTREEXO_POOL_RESIDENT 0x01
+#define UTREEXO_POOL_REFERENCED 0x02
+#define UTREEXO_POOL_DIRTY 0x04
+
+struct utreexo_buffer_pool_stats {
+  /* Frames read from the file */
+  uint64_t loads;
+  /* Frames dropped to make room */
+  uint64_t evictions;
+  /* Frames written to the file */
+  uint64_t writes;
+};
+
+struct utreexo_buffer_pool {
+  int fd;
+  int uffd;
+  /* Written to when the handler should stop */
+  int wake[2];
+  char *base;
+  size_t size;
+
+  /* Flags and pin counts for every frame in our address space */
+  uint8_t *flags;
+  uint32_t *pins;
+  size_t n_frames;
+
+  /* The frames we hold, the clock hand goes over these */
+  size_t *resident;
+  size_t capacity;
+  size_t n_resident;
+  size_t hand;
+  /* Where the last writeback stopped, an index into resident */
+  size_t wb_cursor;
+
+  /* Frames go through here on their way to and from the file, since
+   * O_DIRECT needs aligned buffers */
+  void *bounce;
+
+  pthread_mutex_t lock;
+  pthread_t handler;
+  struct utreexo_buffer_pool_stats stats;
+};
+
+/* Opens filename with O_DIRECT, and reserves size bytes of address space that
+ * show its contents. At most capacity bytes are held in memory at once.
+ * Returns 0 on success, -1 if userfaultfd or O_DIRECT isn't available, and
+ * -4 if we are out of memory */
+static inline int utreexo_buffer_pool_open(struct utreexo_buffer_pool **pool,
+                                           const char *filename, size_t size,
+                                           uint64_t capacity);
+
+/* Writes every dirty frame to the file, stops the handler and releases
+ * everything */
+static inline void utreexo_buffer_pool_close(struct utreexo_buffer_pool *pool);
+
+/* Writes dirty frames to the file, until at least budget bytes are written.
+ * They stay in the pool. Returns how many bytes we wrote */
+static inline uint64_t
+utreexo_buffer_pool_writeback(struct utreexo_buffer_pool *pool,
+                              uint64_t budget);
+
+/* Pins or unpins the frame holding ptr. Pinned frames are never evicted, even
+ * if that means going over capacity */
+static inline void utreexo_buffer_pool_pin(struct utreexo_buffer_pool *pool,
+                                           const void *ptr, int pin);
+
+#endif // USE_BUFFER_POOL
+
+#endif // UTREEXO_BUFFER_POOL_H
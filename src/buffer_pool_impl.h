@@ -0,0 +1,336 @@
+#ifndef UTREEXO_BUFFER_POOL_IMPL_H
+#define UTREEXO_BUFFER_POOL_IMPL_H
+
+#include "buffer_pool.h"
+
+#ifdef USE_BUFFER_POOL
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Only exposed with _GNU_SOURCE, but glibc always has the real name */
+#ifndef O_DIRECT
+#define O_DIRECT __O_DIRECT
+#endif
+
+static inline char *
+utreexo_buffer_pool_frame(const struct utreexo_buffer_pool *pool,
+                          size_t frame) {
+  return pool->base + frame * UTREEXO_POOL_FRAME;
+}
+
+/* Lets threads waiting on a frame go, they'll fault again if they have to */
+static inline void utreexo_buffer_pool_wake(struct utreexo_buffer_pool *pool,
+                                            size_t frame) {
+  struct uffdio_range range = {
+      .start = (uintptr_t)utreexo_buffer_pool_frame(pool, frame),
+      .len = UTREEXO_POOL_FRAME};
+  ioctl(pool->uffd, UFFDIO_WAKE, &range);
+}
+
+static inline void
+utreexo_buffer_pool_protect(struct utreexo_buffer_pool *pool, size_t frame,
+                            int protect) {
+  struct uffdio_writeprotect wp = {
+      .range = {.start = (uintptr_t)utreexo_buffer_pool_frame(pool, frame),
+                .len = UTREEXO_POOL_FRAME},
+      .mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : 0};
+  if (ioctl(pool->uffd, UFFDIO_WRITEPROTECT, &wp) != 0) {
+    perror("UFFDIO_WRITEPROTECT");
+    abort();
+  }
+}
+
+/* Writes a frame we hold to the file. It's write-protected first, so nobody
+ * changes it while we copy it out. Must be called with the lock held */
+static inline void
+utreexo_buffer_pool_write_frame(struct utreexo_buffer_pool *pool,
+                                size_t frame) {
+  utreexo_buffer_pool_protect(pool, frame, 1);
+  memcpy(pool->bounce, utreexo_buffer_pool_frame(pool, frame),
+         UTREEXO_POOL_FRAME);
+  if (pwrite(pool->fd, pool->bounce, UTREEXO_POOL_FRAME,
+             (off_t)frame * UTREEXO_POOL_FRAME) != UTREEXO_POOL_FRAME) {
+    perror("pwrite");
+    abort();
+  }
+  pool->flags[frame] &= ~UTREEXO_POOL_DIRTY;
+  ++pool->stats.writes;
+}
+
+/* Moves the clock hand until it finds a frame we can drop, and drops it.
+ * Returns its slot in resident */
+static inline size_t
+utreexo_buffer_pool_evict(struct utreexo_buffer_pool *pool) {
+  // Twice around is enough to clear every reference bit
+  for (size_t step = 0; step < 2 * pool->n_resident + 1; ++step) {
+    const size_t slot = pool->hand;
+    const size_t frame = pool->resident[slot];
+    pool->hand = (pool->hand + 1) % pool->n_resident;
+
+    if (pool->pins[frame] != 0)
+      continue;
+    if (pool->flags[frame] & UTREEXO_POOL_REFERENCED) {
+      pool->flags[frame] &= ~UTREEXO_POOL_REFERENCED;
+      continue;
+    }
+
+    if (pool->flags[frame] & UTREEXO_POOL_DIRTY)
+      utreexo_buffer_pool_write_frame(pool, frame);
+    if (madvise(utreexo_buffer_pool_frame(pool, frame), UTREEXO_POOL_FRAME,
+                MADV_DONTNEED) != 0) {
+      perror("madvise");
+      abort();
+    }
+    pool->flags[frame] = 0;
+    ++pool->stats.evictions;
+    return slot;
+  }
+
+  fprintf(stderr, "Every frame in the buffer pool is pinned\n");
+  abort();
+}
+
+/* Reads a frame from the file into place. If the fault was a write, the frame
+ * comes in dirty and writable, otherwise write-protected */
+static inline void utreexo_buffer_pool_load(struct utreexo_buffer_pool *pool,
+                                            size_t frame, int write) {
+  const size_t slot = pool->n_resident < pool->capacity
+                          ? pool->n_resident++
+                          : utreexo_buffer_pool_evict(pool);
+
+  // Past the end of the file is all zeros
+  ssize_t n_read = pread(pool->fd, pool->bounce, UTREEXO_POOL_FRAME,
+                         (off_t)frame * UTREEXO_POOL_FRAME);
+  if (n_read < 0) {
+    perror("pread");
+    abort();
+  }
+  memset((char *)pool->bounce + n_read, 0x00, UTREEXO_POOL_FRAME - n_read);
+
+  struct uffdio_copy copy = {
+      .dst = (uintptr_t)utreexo_buffer_pool_frame(pool, frame),
+      .src = (uintptr_t)pool->bounce,
+      .len = UTREEXO_POOL_FRAME,
+      .mode = write ? 0 : UFFDIO_COPY_MODE_WP};
+  if (ioctl(pool->uffd, UFFDIO_COPY, &copy) != 0 && errno != EEXIST) {
+    perror("UFFDIO_COPY");
+    abort();
+  }
+
+  pool->resident[slot] = frame;
+  pool->flags[frame] = UTREEXO_POOL_RESIDENT | UTREEXO_POOL_REFERENCED |
+                       (write ? UTREEXO_POOL_DIRTY : 0);
+  ++pool->stats.loads;
+}
+
+static inline void
+utreexo_buffer_pool_fault(struct utreexo_buffer_pool *pool,
+                          const struct uffd_msg *msg) {
+  const size_t frame =
+      (msg->arg.pagefault.address - (uintptr_t)pool->base) /
+      UTREEXO_POOL_FRAME;
+  const int resident = pool->flags[frame] & UTREEXO_POOL_RESIDENT;
+
+  if (msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP) {
+    // The first write since the frame came in, or since we last wrote it
+    if (!resident) {
+      utreexo_buffer_pool_wake(pool, frame);
+      return;
+    }
+    pool->flags[frame] |= UTREEXO_POOL_DIRTY | UTREEXO_POOL_REFERENCED;
+    utreexo_buffer_pool_protect(pool, frame, 0);
+    return;
+  }
+
+  // Many threads may fault on the same frame, only the first one loads it
+  const int write = msg->arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE;
+  if (resident)
+    utreexo_buffer_pool_wake(pool, frame);
+  else
+    utreexo_buffer_pool_load(pool, frame, write);
+}
+
+static void *utreexo_buffer_pool_handler(void *arg) {
+  struct utreexo_buffer_pool *pool = arg;
+  struct uffd_msg msgs[16];
+
+  for (;;) {
+    struct pollfd fds[2] = {{.fd = pool->uffd, .events = POLLIN},
+                            {.fd = pool->wake[0], .events = POLLIN}};
+    if (poll(fds, 2, -1) < 0)
+      continue;
+    if (fds[1].revents)
+      return NULL;
+
+    const ssize_t n = read(pool->uffd, msgs, sizeof(msgs));
+    if (n <= 0)
+      continue;
+
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < n / sizeof(struct uffd_msg); ++i)
+      if (msgs[i].event == UFFD_EVENT_PAGEFAULT)
+        utreexo_buffer_pool_fault(pool, &msgs[i]);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+static inline int utreexo_buffer_pool_uffd() {
+#ifdef UFFD_USER_MODE_ONLY
+  // We only need faults from our own code, which doesn't need privileges
+  int uffd = syscall(SYS_userfaultfd,
+                     O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+  if (uffd >= 0)
+    return uffd;
+#endif
+  return syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+}
+
+static inline int utreexo_buffer_pool_open(struct utreexo_buffer_pool **ppool,
+                                           const char *filename, size_t size,
+                                           uint64_t capacity) {
+  struct utreexo_buffer_pool *pool = calloc(1, sizeof(*pool));
+  if (pool == NULL)
+    return -4;
+  pool->size = size;
+  pool->n_frames = (size + UTREEXO_POOL_FRAME - 1) / UTREEXO_POOL_FRAME;
+  pool->capacity = capacity / UTREEXO_POOL_FRAME;
+  if (pool->capacity < UTREEXO_POOL_MIN_FRAMES)
+    pool->capacity = UTREEXO_POOL_MIN_FRAMES;
+  pool->base = MAP_FAILED;
+  pool->wake[0] = pool->wake[1] = -1;
+
+  int ret = -1;
+  pool->fd = open(filename, O_RDWR | O_CREAT | O_DIRECT, 0644);
+  pool->uffd = utreexo_buffer_pool_uffd();
+  if (pool->fd < 0 || pool->uffd < 0 || pipe(pool->wake) != 0)
+    goto fail;
+
+  struct uffdio_api api = {.api = UFFD_API,
+                           .features = UFFD_FEATURE_PAGEFAULT_FLAG_WP};
+  if (ioctl(pool->uffd, UFFDIO_API, &api) != 0)
+    goto fail;
+
+  pool->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (pool->base == MAP_FAILED)
+    goto fail;
+  // Frames are filled in small pages, don't let them be merged under us
+  madvise(pool->base, size, MADV_NOHUGEPAGE);
+
+  struct uffdio_register reg = {
+      .range = {.start = (uintptr_t)pool->base, .len = size},
+      .mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP};
+  if (ioctl(pool->uffd, UFFDIO_REGISTER, &reg) != 0)
+    goto fail;
+
+  ret = -4;
+  pool->flags = calloc(pool->n_frames, sizeof(uint8_t));
+  pool->pins = calloc(pool->n_frames, sizeof(uint32_t));
+  pool->resident = malloc(pool->capacity * sizeof(size_t));
+  if (pool->flags == NULL || pool->pins == NULL || pool->resident == NULL ||
+      posix_memalign(&pool->bounce, UTREEXO_POOL_FRAME, UTREEXO_POOL_FRAME))
+    goto fail;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  if (pthread_create(&pool->handler, NULL, utreexo_buffer_pool_handler,
+                     pool) != 0) {
+    pthread_mutex_destroy(&pool->lock);
+    goto fail;
+  }
+
+  *ppool = pool;
+  return 0;
+
+fail:
+  if (pool->base != MAP_FAILED)
+    munmap(pool->base, size);
+  for (size_t i = 0; i < 2; ++i)
+    if (pool->wake[i] >= 0)
+      close(pool->wake[i]);
+  if (pool->uffd >= 0)
+    close(pool->uffd);
+  if (pool->fd >= 0)
+    close(pool->fd);
+  free(pool->bounce);
+  free(pool->resident);
+  free(pool->pins);
+  free(pool->flags);
+  free(pool);
+  return ret;
+}
+
+static inline void utreexo_buffer_pool_close(struct utreexo_buffer_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  for (size_t slot = 0; slot < pool->n_resident; ++slot)
+    if (pool->flags[pool->resident[slot]] & UTREEXO_POOL_DIRTY)
+      utreexo_buffer_pool_write_frame(pool, pool->resident[slot]);
+  pthread_mutex_unlock(&pool->lock);
+
+  if (write(pool->wake[1], "", 1) != 1) {
+    perror("write");
+    abort();
+  }
+  pthread_join(pool->handler, NULL);
+  pthread_mutex_destroy(&pool->lock);
+
+  munmap(pool->base, pool->size);
+  close(pool->wake[0]);
+  close(pool->wake[1]);
+  close(pool->uffd);
+  close(pool->fd);
+  free(pool->bounce);
+  free(pool->resident);
+  free(pool->pins);
+  free(pool->flags);
+  free(pool);
+}
+
+static inline uint64_t
+utreexo_buffer_pool_writeback(struct utreexo_buffer_pool *pool,
+                              uint64_t budget) {
+  uint64_t written = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (size_t seen = 0; seen < pool->n_resident && written < budget; ++seen) {
+    if (pool->wb_cursor >= pool->n_resident)
+      pool->wb_cursor = 0;
+    const size_t frame = pool->resident[pool->wb_cursor++];
+    if (!(pool->flags[frame] & UTREEXO_POOL_DIRTY))
+      continue;
+    utreexo_buffer_pool_write_frame(pool, frame);
+    written += UTREEXO_POOL_FRAME;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return written;
+}
+
+static inline void utreexo_buffer_pool_pin(struct utreexo_buffer_pool *pool,
+                                           const void *ptr, int pin) {
+  const size_t frame =
+      ((const char *)ptr - pool->base) / UTREEXO_POOL_FRAME;
+  if ((const char *)ptr < pool->base || frame >= pool->n_frames)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  if (pin)
+    ++pool->pins[frame];
+  else if (pool->pins[frame] != 0)
+    --pool->pins[frame];
+  pthread_mutex_unlock(&pool->lock);
+}
+
+#endif // USE_BUFFER_POOL
+
+#endif // UTREEXO_BUFFER_POOL_IMPL_H
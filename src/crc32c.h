@@ -0,0 +1,93 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * CRC32C (Castagnoli), the one with an instruction of its own on x86 (SSE4.2)
+ * and ARMv8. We use it to checksum forest pages, so it must keep up with the
+ * disk: with the instruction that's a few GB/s on a single core. Without it,
+ * we fall back to a table, that is several times slower but gives the same
+ * answer, so files can move between machines.
+ */
+#ifndef UTREEXO_CRC32C_H
+#define UTREEXO_CRC32C_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/* The reflected polynomial */
+#define UTREEXO_CRC32C_POLY 0x82f63b78
+
+static uint32_t utreexo_crc32c_table[256];
+static pthread_once_t utreexo_crc32c_once = PTHREAD_ONCE_INIT;
+
+static void utreexo_crc32c_init_table(void) {
+  for (uint32_t n = 0; n < 256; ++n) {
+    uint32_t crc = n;
+    for (int bit = 0; bit < 8; ++bit)
+      crc = crc & 1 ? (crc >> 1) ^ UTREEXO_CRC32C_POLY : crc >> 1;
+    utreexo_crc32c_table[n] = crc;
+  }
+}
+
+static inline uint32_t utreexo_crc32c_sw(uint32_t crc, const void *data,
+                                         size_t len) {
+  pthread_once(&utreexo_crc32c_once, utreexo_crc32c_init_table);
+  const uint8_t *p = data;
+  crc = ~crc;
+  while (len--)
+    crc = utreexo_crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static inline uint32_t
+utreexo_crc32c_hw(uint32_t crc, const void *data, size_t len) {
+  const uint8_t *p = data;
+  uint64_t crc64 = ~crc;
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  uint32_t crc32 = (uint32_t)crc64;
+  while (len--)
+    crc32 = _mm_crc32_u8(crc32, *p++);
+  return ~crc32;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static inline uint32_t utreexo_crc32c_hw(uint32_t crc, const void *data,
+                                         size_t len) {
+  const uint8_t *p = data;
+  crc = ~crc;
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc = __crc32cd(crc, word);
+  }
+  while (len--)
+    crc = __crc32cb(crc, *p++);
+  return ~crc;
+}
+#endif
+
+/* Extends crc, the CRC32C of whatever came before, with len bytes of data.
+ * Start with zero */
+static inline uint32_t utreexo_crc32c(uint32_t crc, const void *data,
+                                      size_t len) {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2"))
+    return utreexo_crc32c_hw(crc, data, len);
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  return utreexo_crc32c_hw(crc, data, len);
+#endif
+  return utreexo_crc32c_sw(crc, data, len);
+}
+
+#endif // UTREEXO_CRC32C_H
@@ -28,6 +28,7 @@
 
 #include "config.h"
 #include "forest_node.h"
+#include "latency.h"
 
 /* Heap is a space before the actual pages that can be used by consumer to
  * persist some data
@@ -44,9 +45,51 @@ typedef struct utreexo_forest_free_page {
 struct utreexo_forest_page_header {
   /* Used for detecting corruption */
   uint64_t pg_magic;
-  uint64_t n_nodes;
+  uint32_t n_nodes;
+  /* CRC32C of the rest of the page, only kept up to date if the file header
+   * says so, see utreexo_forest_file_track_checksums. Files from before we
+   * had it have zeroes here, and n_nodes is never over 32 bits */
+  uint32_t checksum;
 } __attribute__((__packed__));
 
+/* FILE_MAGIC of files from before utreexo_forest_file_header had flags, seq
+ * and base. Their fields are somewhere else, so we refuse to open them
+ * instead of taking them for new files and overwriting them */
+#define UTREEXO_FILE_MAGIC_V1 0x5845525455ULL
+
+/* In utreexo_forest_file_header.flags, every page has the right checksum as
+ * of the last utreexo_forest_file_write_end */
+#define UTREEXO_FILE_CHECKSUMS 1
+
+/* Where a file's pages live while it's open. Mirrors the backend values in
+ * include/utreexo.h */
+enum utreexo_forest_backend {
+  /* The file is mapped, and its pages are in the kernel's page cache */
+  UTREEXO_BACKEND_MMAP = 0,
+  /* Pages are read with O_DIRECT into a buffer pool of our own, see
+   * buffer_pool.h */
+  UTREEXO_BACKEND_POOL = 1,
+};
+
+struct utreexo_forest_file;
+
+/* How a backend gets the file into memory and back. Whatever the backend,
+ * the whole file shows up in a single range of MAP_SIZE bytes, and nodes are
+ * read and written there like any other memory */
+struct utreexo_forest_backend_ops {
+  /* Opens filename and sets file->fd, and data to where the file starts.
+   * budget is how many bytes of it we may hold in memory, if the backend
+   * cares. Returns 0 on success, or a negative error */
+  int (*open)(struct utreexo_forest_file *file, const char *filename,
+              uint64_t budget, char **data);
+  /* Writes out anything pending, and releases whatever open took */
+  void (*close)(struct utreexo_forest_file *file);
+  /* See utreexo_forest_file_writeback */
+  uint64_t (*writeback)(struct utreexo_forest_file *file, uint64_t budget);
+  /* Keeps the page holding ptr in memory while it's pinned. May be NULL */
+  void (*pin)(struct utreexo_forest_file *file, const void *ptr, int pin);
+};
+
 /* Our internal representation of a file, this struct doesn't get persisted on
  * our file, it just keep pointers to the actual stuff at runtime. */
 struct utreexo_forest_file {
@@ -54,18 +97,50 @@ struct utreexo_forest_file {
   const char *filename;
   char *map; // The actual map
   int fd;
+  /* One bit for each page written since it was last handed to the kernel for
+   * writeback, see utreexo_forest_file_writeback. NULL unless someone asked
+   * for it with utreexo_forest_file_track_dirty */
+  uint64_t *dirty;
+  /* Where the last writeback stopped, so every page gets its turn */
+  size_t wb_cursor;
+  /* For each page, the epoch it was last read or written in, see
+   * utreexo_forest_file_access. NULL unless someone asked for it with
+   * utreexo_forest_file_track_access */
+  uint32_t *epochs;
+  /* Bumped by whoever is tracking accesses, every so often */
+  uint32_t epoch;
+  /* One bit for each page written since its checksum was computed. NULL
+   * unless someone asked for it with utreexo_forest_file_track_checksums */
+  uint64_t *stale;
+  /* Where page allocations are timed, NULL if nobody is keeping count */
+  struct utreexo_latency_histogram *alloc_latency;
+  const struct utreexo_forest_backend_ops *ops;
+  /* Whatever the backend keeps for itself */
+  void *backend;
+  /* The page we pinned because we are writing new nodes to it */
+  void *pinned_page;
 } __attribute__((__packed__));
 
 /* Things we need to keep through different sessions, they are persisted at the
- * beginning of a file
+ * beginning of a file. Every field is 8-byte aligned, and so is every node
+ * after the header, so other processes reading them never see half a pointer
  */
 struct utreexo_forest_file_header {
   uint64_t magic;
   struct utreexo_forest_page_header *wrt_page; // Which page are we on
-  uint32_t n_pages;
   uint64_t filesize;
   char heap[HEAP_AREA];          // used for api consumers to store data
   utreexo_forest_free_page *fpg; // The first free page
+  uint32_t n_pages;
+  /* UTREEXO_FILE_* */
+  uint32_t flags;
+  /* Odd while the forest is being changed, bumped again once it's consistent.
+   * See utreexo_forest_file_read_begin */
+  uint64_t seq;
+  /* Where the process writing to this file has it mapped, NULL if it's not
+   * mapped. Nodes point to each other with plain pointers, so readers must
+   * map it at the same address */
+  char *base;
 } __attribute__((__packed__));
 
 /* The size of a page minus it's header */
@@ -97,6 +172,115 @@ static inline void utreexo_forest_file_close(struct utreexo_forest_file *file);
 static inline void utreexo_forest_file_init(struct utreexo_forest_file **file,
                                             void **heap, const char *filename);
 
+/* Same as utreexo_forest_file_init, with the backend of our choosing. budget
+ * is how many bytes of the file the backend may hold in memory, for backends
+ * that care. Returns 0 on success, -1 if we don't have this backend, it can't
+ * work here or the file has a layout we can't read, and -4 if we are out of
+ * memory */
+static inline int
+utreexo_forest_file_init_ex(struct utreexo_forest_file **file, void **heap,
+                            const char *filename,
+                            enum utreexo_forest_backend backend,
+                            uint64_t budget);
+
+/* Maps a file another process is writing to, read-only and at the same
+ * address the writer has it. Returns 0 on success, -1 if the file isn't a
+ * forest, isn't mapped by its writer (e.g. it uses the buffer pool), or we
+ * can't have that address, and -4 if we are out of memory */
+static inline int utreexo_forest_file_attach(struct utreexo_forest_file **file,
+                                             void **heap, const char *filename);
+
+/* Marks the file as being changed, readers in other processes wait until
+ * utreexo_forest_file_write_end. Calling this again before that is fine */
+static inline void
+utreexo_forest_file_write_begin(struct utreexo_forest_file *file);
+
+/* Marks the file as consistent again, if it was being changed. This is
+ * where checksums of the pages we wrote to are brought up to date, if we keep
+ * them */
+static inline void
+utreexo_forest_file_write_end(struct utreexo_forest_file *file);
+
+/* Waits until the file is consistent, and sets *seq for
+ * utreexo_forest_file_read_retry. Readers may look at anything in the file
+ * after this, with no locks, as long as they throw it all away if
+ * utreexo_forest_file_read_retry says so. Pointers they find always point
+ * somewhere inside the file, but may be stale. Returns 0, or -1 if the writer
+ * died while changing the file, so it will never be consistent again */
+static inline int
+utreexo_forest_file_read_begin(const struct utreexo_forest_file *file,
+                               uint64_t *seq);
+
+/* Whether the file changed since utreexo_forest_file_read_begin returned seq,
+ * and everything read since then must be read again */
+static inline int
+utreexo_forest_file_read_retry(const struct utreexo_forest_file *file,
+                               uint64_t seq);
+
+/* Pins or unpins the page holding ptr, backends that hold a limited number of
+ * pages won't drop pinned ones */
+static inline void utreexo_forest_file_pin(struct utreexo_forest_file *file,
+                                           const void *ptr, int pin);
+
+/* Starts keeping track of which pages are written to. Returns 0 on success,
+ * -4 if we are out of memory */
+static inline int
+utreexo_forest_file_track_dirty(struct utreexo_forest_file *file);
+
+/* Marks the page holding ptr as written to, if we are tracking them. Many
+ * threads may call this at once */
+static inline void utreexo_forest_file_touch(struct utreexo_forest_file *file,
+                                             const void *ptr);
+
+/* Whether len bytes at ptr are inside the part of the file we have so far.
+ * For pointers we can't trust, like those read from an attached forest while
+ * its writer changes it. Many threads may call this at once */
+static inline int
+utreexo_forest_file_contains(const struct utreexo_forest_file *file,
+                             const void *ptr, size_t len);
+
+/* Starts keeping track of when each page was last used. Pages we already have
+ * count as used in epoch zero. Returns 0 on success, -4 if we are out of
+ * memory */
+static inline int
+utreexo_forest_file_track_access(struct utreexo_forest_file *file);
+
+/* Marks the page holding ptr as used in the current epoch, if we are tracking
+ * them. utreexo_forest_file_touch does this as well. Many threads may call
+ * this at once */
+static inline void utreexo_forest_file_access(struct utreexo_forest_file *file,
+                                              const void *ptr);
+
+/* Starts keeping a checksum in every page. If the file didn't have them
+ * already, every page gets one the next time the file is marked consistent.
+ * Returns 0 on success, -4 if we are out of memory */
+static inline int
+utreexo_forest_file_track_checksums(struct utreexo_forest_file *file);
+
+/* Stops keeping checksums, and marks the ones we have as useless */
+static inline void
+utreexo_forest_file_drop_checksums(struct utreexo_forest_file *file);
+
+/* Computes the checksum of every page written to since its last one. This
+ * is what utreexo_forest_file_write_end does, and a no-op if we don't keep
+ * checksums */
+static inline void
+utreexo_forest_file_update_checksums(struct utreexo_forest_file *file);
+
+/* The checksum the page at pg should have */
+static inline uint32_t
+utreexo_forest_page_checksum(const struct utreexo_forest_page_header *pg);
+
+/* Starts writeback for pages written to since their last writeback, and the
+ * file header. Consecutive pages go in a single request, and we stop once
+ * budget bytes are on their way, the next call picks up from there. This
+ * doesn't wait for the I/O, it only keeps the kernel from piling up dirty
+ * pages and flushing them all at once. Returns how many bytes we submitted.
+ * With the buffer pool, dirty frames are written out instead */
+static inline uint64_t
+utreexo_forest_file_writeback(struct utreexo_forest_file *file,
+                              uint64_t budget);
+
 /* Allocs a new node and returns a pointer to it */
 static inline utreexo_forest_node *
 utreexo_forest_file_node_alloc(struct utreexo_forest_file *file);
@@ -3,41 +3,302 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "buffer_pool_impl.h"
+#include "crc32c.h"
 #include "flat_file.h"
 #include "forest_node.h"
+#include "latency_impl.h"
+#include "probes.h"
 #include "util.h"
 
 int posix_fallocate(int fd, off_t offset, off_t len);
+int sync_file_range(int fd, off_t offset, off_t nbytes, unsigned int flags);
 
-static inline void utreexo_forest_file_close(struct utreexo_forest_file *file) {
-  munmap(file->map - sizeof(struct utreexo_forest_file_header),
-         file->header->filesize);
+#ifndef SYNC_FILE_RANGE_WRITE
+#define SYNC_FILE_RANGE_WRITE 2
+#endif
+/* Linux 4.17, older kernels take it as a hint, so we check where we got */
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+static inline int utreexo_forest_mmap_open(struct utreexo_forest_file *file,
+                                           const char *filename,
+                                           uint64_t budget, char **data) {
+  // Pages stay in the page cache, rss_budget.h keeps them in check
+  (void)budget;
+  int fd = open(filename, O_RDWR | O_CREAT, 0644);
+
+  if (fd < 0) {
+    perror("open");
+    exit(1);
+  }
+  // Held for as long as we have the file open, so attached readers can tell
+  // whether we are still around, see utreexo_forest_file_read_begin. This
+  // also keeps two processes from writing to the same file
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    fprintf(stderr, "%s is open in another process\n", filename);
+    close(fd);
+    return -1;
+  }
+
+  char *map =
+      (char *)mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE | PROT_GROWSUP,
+                   MAP_FILE | MAP_SHARED, fd, 0);
+
+  if (map == MAP_FAILED /*|| data != (void *)MAP_ORIGIN*/) {
+    perror("mmap");
+    exit(1);
+  }
+
+  debug_print("File mapped to %p\n", map);
+  file->fd = fd;
+  *data = map;
+  return 0;
+}
+
+static inline void utreexo_forest_mmap_close(struct utreexo_forest_file *file) {
+  // Nobody should attach to a file that isn't mapped anymore
+  file->header->base = NULL;
+  // The whole range we reserved, not only what the file grew into
+  munmap(file->map - sizeof(struct utreexo_forest_file_header), MAP_SIZE);
+  close(file->fd);
+}
+
+static inline uint64_t
+utreexo_forest_mmap_writeback(struct utreexo_forest_file *file,
+                              uint64_t budget);
+
+#ifdef USE_BUFFER_POOL
+static inline int utreexo_forest_pool_open(struct utreexo_forest_file *file,
+                                           const char *filename,
+                                           uint64_t budget, char **data) {
+  struct utreexo_buffer_pool *pool = NULL;
+  const int ret = utreexo_buffer_pool_open(&pool, filename, MAP_SIZE, budget);
+  if (ret != 0)
+    return ret;
+
+  file->backend = pool;
+  file->fd = pool->fd;
+  *data = pool->base;
+  return 0;
+}
+
+static inline void utreexo_forest_pool_close(struct utreexo_forest_file *file) {
+  utreexo_buffer_pool_close(file->backend);
+}
+
+static inline uint64_t
+utreexo_forest_pool_writeback(struct utreexo_forest_file *file,
+                              uint64_t budget) {
+  return utreexo_buffer_pool_writeback(file->backend, budget);
+}
+
+static inline void utreexo_forest_pool_pin(struct utreexo_forest_file *file,
+                                           const void *ptr, int pin) {
+  utreexo_buffer_pool_pin(file->backend, ptr, pin);
+}
+#endif // USE_BUFFER_POOL
+
+/* Indexed by enum utreexo_forest_backend, backends we weren't built with are
+ * left empty */
+static const struct utreexo_forest_backend_ops utreexo_forest_backends[] = {
+    [UTREEXO_BACKEND_MMAP] = {.open = utreexo_forest_mmap_open,
+                              .close = utreexo_forest_mmap_close,
+                              .writeback = utreexo_forest_mmap_writeback,
+                              .pin = NULL},
+#ifdef USE_BUFFER_POOL
+    [UTREEXO_BACKEND_POOL] = {.open = utreexo_forest_pool_open,
+                              .close = utreexo_forest_pool_close,
+                              .writeback = utreexo_forest_pool_writeback,
+                              .pin = utreexo_forest_pool_pin},
+#endif
+};
+
+static inline void
+utreexo_forest_attached_close(struct utreexo_forest_file *file) {
+  munmap(file->map - sizeof(struct utreexo_forest_file_header), MAP_SIZE);
   close(file->fd);
+}
+
+/* Files mapped by utreexo_forest_file_attach. We never write to them, and
+ * they stay mapped by their writer */
+static const struct utreexo_forest_backend_ops utreexo_forest_attached_ops = {
+    .open = NULL,
+    .close = utreexo_forest_attached_close,
+    .writeback = utreexo_forest_mmap_writeback,
+    .pin = NULL};
+
+static inline int utreexo_forest_file_attach(struct utreexo_forest_file **file,
+                                             void **heap,
+                                             const char *filename) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  struct utreexo_forest_file_header header;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != FILE_MAGIC || header.base == NULL) {
+    close(fd);
+    return -1;
+  }
+
+  char *data = (char *)mmap(header.base, MAP_SIZE, PROT_READ,
+                            MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  if (data != header.base) {
+    munmap(data, MAP_SIZE);
+    close(fd);
+    return -1;
+  }
+
+  struct utreexo_forest_file *pfile = malloc(sizeof(*pfile));
+  if (pfile == NULL) {
+    munmap(data, MAP_SIZE);
+    close(fd);
+    return -4;
+  }
+  *pfile = (struct utreexo_forest_file){
+      .header = (struct utreexo_forest_file_header *)data,
+      .filename = filename,
+      .map = data + sizeof(struct utreexo_forest_file_header),
+      .fd = fd,
+      .dirty = NULL,
+      .wb_cursor = 0,
+      .epochs = NULL,
+      .epoch = 0,
+      .stale = NULL,
+      .alloc_latency = NULL,
+      .ops = &utreexo_forest_attached_ops,
+      .backend = NULL,
+      .pinned_page = NULL,
+  };
+
+  *file = pfile;
+  *heap = pfile->header->heap;
+  return 0;
+}
+
+static inline void
+utreexo_forest_file_write_begin(struct utreexo_forest_file *file) {
+  const uint64_t seq = file->header->seq;
+  if (seq & 1)
+    return;
+  __atomic_store_n(&file->header->seq, seq + 1, __ATOMIC_RELAXED);
+  // Nothing we write after this may be seen before the odd seq
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+utreexo_forest_file_write_end(struct utreexo_forest_file *file) {
+  utreexo_forest_file_update_checksums(file);
+  const uint64_t seq = file->header->seq;
+  if (!(seq & 1))
+    return;
+  __atomic_store_n(&file->header->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline int
+utreexo_forest_file_read_begin(const struct utreexo_forest_file *file,
+                               uint64_t *seq) {
+  for (;;) {
+    *seq = __atomic_load_n(&file->header->seq, __ATOMIC_ACQUIRE);
+    if (!(*seq & 1))
+      return 0;
+    // A writer that died halfway through a change left seq odd for good, and
+    // its lock went away with it. It may also have just finished and closed
+    // the file, so look at seq again before giving up
+    if (flock(file->fd, LOCK_SH | LOCK_NB) == 0) {
+      flock(file->fd, LOCK_UN);
+      if (__atomic_load_n(&file->header->seq, __ATOMIC_ACQUIRE) & 1)
+        return -1;
+      continue;
+    }
+    // Blocks take milliseconds, there's no point in spinning hard
+    const struct timespec wait = {.tv_sec = 0, .tv_nsec = 50000};
+    nanosleep(&wait, NULL);
+  }
+}
+
+static inline int
+utreexo_forest_file_read_retry(const struct utreexo_forest_file *file,
+                               uint64_t seq) {
+  // Nothing we read before this may be read after the seq
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&file->header->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void utreexo_forest_file_close(struct utreexo_forest_file *file) {
+  file->ops->close(file);
+  free(file->dirty);
+  free(file->epochs);
+  free(file->stale);
   free(file);
 }
 
+static inline void utreexo_forest_file_pin(struct utreexo_forest_file *file,
+                                           const void *ptr, int pin) {
+  if (file->ops->pin != NULL)
+    file->ops->pin(file, ptr, pin);
+}
+
+/* Keeps the page we are writing new nodes to pinned, and only that one */
+static inline void
+utreexo_forest_file_pin_wrt_page(struct utreexo_forest_file *file) {
+  if (file->pinned_page != NULL)
+    utreexo_forest_file_pin(file, file->pinned_page, 0);
+  file->pinned_page = file->header->wrt_page;
+  utreexo_forest_file_pin(file, file->pinned_page, 1);
+}
+
 static inline void utreexo_forest_file_init(struct utreexo_forest_file **file,
                                             void **heap, const char *filename) {
+  utreexo_forest_file_init_ex(file, heap, filename, UTREEXO_BACKEND_MMAP, 0);
+}
+
+static inline int
+utreexo_forest_file_init_ex(struct utreexo_forest_file **file, void **heap,
+                            const char *filename,
+                            enum utreexo_forest_backend backend,
+                            uint64_t budget) {
   debug_print("Openning file %s\n", filename);
 
   /* Makes sure we won't fight our MMU */
   debug_assert((uint128_t)MAP_ORIGIN < sizeof(void *));
   debug_assert((uint128_t)MAP_ORIGIN + MAP_SIZE < sizeof(void *));
 
-  int fd = open(filename, O_RDWR | O_CREAT, 0644);
-
-  if (fd < 0) {
-    perror("open");
-    exit(1);
+  // Before the backend maps it, since closing it would write to its header
+  const int old_fd = open(filename, O_RDONLY);
+  if (old_fd >= 0) {
+    uint64_t magic = 0;
+    const ssize_t n_read = pread(old_fd, &magic, sizeof(magic), 0);
+    close(old_fd);
+    if (n_read == sizeof(magic) && magic == UTREEXO_FILE_MAGIC_V1 &&
+        magic != FILE_MAGIC) {
+      fprintf(stderr, "%s uses an old layout we can't read\n", filename);
+      return -1;
+    }
   }
 
+  const size_t n_backends =
+      sizeof(utreexo_forest_backends) / sizeof(utreexo_forest_backends[0]);
+  if ((size_t)backend >= n_backends ||
+      utreexo_forest_backends[backend].open == NULL)
+    return -1;
+
   struct utreexo_forest_file *pfile =
       (struct utreexo_forest_file *)malloc(sizeof(struct utreexo_forest_file));
 
@@ -46,24 +307,32 @@ static inline void utreexo_forest_file_init(struct utreexo_forest_file **file,
     exit(1);
   }
 
-  const int fsize = lseek(fd, 0, SEEK_END);
-
-  char *data =
-      (char *)mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE | PROT_GROWSUP,
-                   MAP_FILE | MAP_SHARED, fd, 0);
-
-  if (data == MAP_FAILED /*|| data != (void *)MAP_ORIGIN*/) {
-    perror("mmap");
-    exit(1);
+  pfile->ops = &utreexo_forest_backends[backend];
+  pfile->backend = NULL;
+  pfile->pinned_page = NULL;
+  pfile->filename = filename;
+  pfile->dirty = NULL;
+  pfile->wb_cursor = 0;
+  pfile->epochs = NULL;
+  pfile->epoch = 0;
+  pfile->stale = NULL;
+  pfile->alloc_latency = NULL;
+
+  char *data = NULL;
+  const int ret = pfile->ops->open(pfile, filename, budget, &data);
+  if (ret != 0) {
+    free(pfile);
+    return ret;
   }
+  const int fd = pfile->fd;
+  const int fsize = lseek(fd, 0, SEEK_END);
 
-  debug_print("File mapped to %p\n", data);
   const size_t header_size = sizeof(struct utreexo_forest_file_header);
 
   pfile->map = data + header_size;
   pfile->header = (struct utreexo_forest_file_header *)data;
-  pfile->filename = filename;
-  pfile->fd = fd;
+  // The header holds the roots, we need it all the time
+  utreexo_forest_file_pin(pfile, data, 1);
 
   const struct utreexo_forest_file_header *pheader =
       (struct utreexo_forest_file_header *)data;
@@ -78,6 +347,8 @@ static inline void utreexo_forest_file_init(struct utreexo_forest_file **file,
     pfile->header->n_pages = 0;
     memset(pfile->header->heap, 0x00, HEAP_AREA);
     pfile->header->fpg = NULL;
+    pfile->header->flags = 0;
+    pfile->header->seq = 0;
     pfile->header->magic = FILE_MAGIC;
     pfile->header->wrt_page =
         (struct utreexo_forest_page_header *)(data + header_size);
@@ -86,11 +357,21 @@ static inline void utreexo_forest_file_init(struct utreexo_forest_file **file,
   if (pheader->n_pages == 0) {
     utreexo_forest_page_alloc(pfile);
   }
+  utreexo_forest_file_pin_wrt_page(pfile);
+  // A writer that died halfway through a change left it odd, and we don't
+  // know which pages it wrote to, so their checksums can't be trusted
+  if (pfile->header->seq & 1)
+    pfile->header->flags &= ~UTREEXO_FILE_CHECKSUMS;
+  utreexo_forest_file_write_end(pfile);
+  // The buffer pool's memory isn't the file, readers can't attach to that
+  pfile->header->base =
+      backend == UTREEXO_BACKEND_MMAP ? (char *)pfile->header : NULL;
 
   debug_print("Found %d pages writting in %p\n", pfile->header->n_pages,
               pfile->header->wrt_page);
   *file = pfile;
   *heap = pfile->header->heap;
+  return 0;
 }
 
 static inline int utreexo_forest_page_alloc(struct utreexo_forest_file *file) {
@@ -102,7 +383,15 @@ static inline int utreexo_forest_page_alloc(struct utreexo_forest_file *file) {
     file->header->wrt_page =
         (struct utreexo_forest_page_header *)file->header->fpg;
     file->header->fpg = nhead;
+    // The free list wrote over its magic
+    utreexo_forest_mkpg(file->header->wrt_page);
     file->header->n_pages++;
+    UTREEXO_PROBE2(page__alloc,
+                   ((char *)file->header->wrt_page - file->map) /
+                       utreexo_page_size(),
+                   1);
+    if (file->pinned_page != NULL)
+      utreexo_forest_file_pin_wrt_page(file);
     return EXIT_SUCCESS;
   }
 
@@ -120,6 +409,9 @@ static inline int utreexo_forest_page_alloc(struct utreexo_forest_file *file) {
   file->header->wrt_page = (struct utreexo_forest_page_header *)pg;
 
   utreexo_forest_mkpg(file->header->wrt_page);
+  if (file->pinned_page != NULL)
+    utreexo_forest_file_pin_wrt_page(file);
+  UTREEXO_PROBE2(page__alloc, page_offset, 0);
 
   debug_print("Allocated page %d\n", page_offset);
   debug_assert(file->header->wrt_page->n_nodes == 0);
@@ -132,6 +424,7 @@ static inline int utreexo_forest_page_alloc(struct utreexo_forest_file *file) {
 static inline void utreexo_forest_mkpg(struct utreexo_forest_page_header *pg) {
   pg->pg_magic = MAGIC;
   pg->n_nodes = 0;
+  pg->checksum = 0;
 
   debug_assert(pg->n_nodes == 0) debug_assert(pg->pg_magic == MAGIC)
 }
@@ -141,10 +434,15 @@ utreexo_forest_file_node_alloc(struct utreexo_forest_file *file) {
   uint64_t page_nodes = file->header->wrt_page->n_nodes;
   if (page_nodes == NODES_PER_PAGE) {
     debug_print("Page is full, allocating new page\n");
+    const uint64_t start =
+        file->alloc_latency != NULL ? utreexo_latency_now() : 0;
     if (utreexo_forest_page_alloc(file)) {
       fprintf(stderr, "Failed to allocate page\n");
       exit(1);
     }
+    if (file->alloc_latency != NULL)
+      utreexo_latency_record(file->alloc_latency,
+                             utreexo_latency_now() - start);
     page_nodes = 0; // we've just created a new page
   }
 
@@ -156,6 +454,7 @@ utreexo_forest_file_node_alloc(struct utreexo_forest_file *file) {
       (utreexo_forest_node *)((char *)file->header->wrt_page + 16) + page_nodes;
 
   ++(file->header->wrt_page->n_nodes);
+  utreexo_forest_file_touch(file, ptr);
   return ptr;
 }
 
@@ -171,6 +470,7 @@ utreexo_forest_file_node_del(struct utreexo_forest_file *file,
   debug_assert(pg->n_nodes != 0);
   debug_assert(file->header->n_pages > npage);
 
+  utreexo_forest_file_touch(file, pg);
   if (--pg->n_nodes == 0) {
     debug_print("Deallocating page %d\n", npage);
     --file->header->n_pages;
@@ -182,13 +482,226 @@ utreexo_forest_file_node_del(struct utreexo_forest_file *file,
     // This is the first free page
     if (pg == NULL) {
       file->header->fpg = npg;
+      UTREEXO_PROBE2(page__free, npage, 0);
       return;
     }
     // Walk the list until find the last element
-    while (pg->next != NULL)
+    uint64_t walked = 1;
+    for (; pg->next != NULL; ++walked)
       pg = (utreexo_forest_free_page *)pg->next;
+    UTREEXO_PROBE2(page__free, npage, walked);
 
     pg->next = npg;
+    utreexo_forest_file_touch(file, pg);
   }
 }
+
+/* How many pages may ever fit in our mapping */
+static inline size_t utreexo_forest_file_max_pages() {
+  return MAP_SIZE / utreexo_page_size() + 1;
+}
+
+static inline int
+utreexo_forest_file_track_dirty(struct utreexo_forest_file *file) {
+  if (file->dirty != NULL)
+    return 0;
+
+  // Pages we already have may have been written to before, so they all
+  // start dirty
+  file->dirty = calloc((utreexo_forest_file_max_pages() + 63) / 64,
+                       sizeof(uint64_t));
+  if (file->dirty == NULL)
+    return -4;
+  const uint64_t n_pages =
+      (file->header->filesize - sizeof(struct utreexo_forest_file_header)) /
+      utreexo_page_size();
+  for (uint64_t page = 0; page < n_pages; ++page)
+    file->dirty[page / 64] |= (uint64_t)1 << (page % 64);
+  return 0;
+}
+
+static inline int
+utreexo_forest_file_track_access(struct utreexo_forest_file *file) {
+  if (file->epochs != NULL)
+    return 0;
+
+  uint32_t *epochs =
+      calloc(utreexo_forest_file_max_pages(), sizeof(uint32_t));
+  if (epochs == NULL)
+    return -4;
+  __atomic_store_n(&file->epochs, epochs, __ATOMIC_RELEASE);
+  return 0;
+}
+
+static inline int
+utreexo_forest_file_contains(const struct utreexo_forest_file *file,
+                             const void *ptr, size_t len) {
+  uint64_t size = __atomic_load_n(&file->header->filesize, __ATOMIC_RELAXED);
+  if (size > MAP_SIZE)
+    size = MAP_SIZE;
+  const char *end = (const char *)file->header + size;
+  const char *p = ptr;
+  return p >= file->map && p <= end && len <= (size_t)(end - p);
+}
+
+static inline void utreexo_forest_file_access(struct utreexo_forest_file *file,
+                                              const void *ptr) {
+  uint32_t *epochs = __atomic_load_n(&file->epochs, __ATOMIC_ACQUIRE);
+  if (epochs == NULL || (const char *)ptr < file->map)
+    return;
+
+  const size_t page = ((const char *)ptr - file->map) / utreexo_page_size();
+  const uint32_t epoch = __atomic_load_n(&file->epoch, __ATOMIC_RELAXED);
+  // Same as with dirty bits, most pages were already used in this epoch
+  if (page < utreexo_forest_file_max_pages() &&
+      __atomic_load_n(&epochs[page], __ATOMIC_RELAXED) != epoch)
+    __atomic_store_n(&epochs[page], epoch, __ATOMIC_RELAXED);
+}
+
+/* Sets the bit for page in bits, many threads may call this at once */
+static inline void utreexo_forest_file_set_bit(uint64_t *bits, size_t page) {
+  const uint64_t bit = (uint64_t)1 << (page % 64);
+  // Most writes hit pages that are already marked, don't fight over the line
+  if ((__atomic_load_n(&bits[page / 64], __ATOMIC_RELAXED) & bit) == 0)
+    __atomic_fetch_or(&bits[page / 64], bit, __ATOMIC_RELAXED);
+}
+
+static inline void utreexo_forest_file_touch(struct utreexo_forest_file *file,
+                                             const void *ptr) {
+  utreexo_forest_file_access(file, ptr);
+  if ((file->dirty == NULL && file->stale == NULL) ||
+      (const char *)ptr < file->map)
+    return;
+
+  const size_t page = ((const char *)ptr - file->map) / utreexo_page_size();
+  if (page >= utreexo_forest_file_max_pages())
+    return;
+  if (file->dirty != NULL)
+    utreexo_forest_file_set_bit(file->dirty, page);
+  if (file->stale != NULL)
+    utreexo_forest_file_set_bit(file->stale, page);
+}
+
+static inline uint32_t
+utreexo_forest_page_checksum(const struct utreexo_forest_page_header *pg) {
+  const size_t skip = offsetof(struct utreexo_forest_page_header, checksum);
+  const uint32_t crc = utreexo_crc32c(0, pg, skip);
+  return utreexo_crc32c(crc, (const char *)pg + skip + sizeof(pg->checksum),
+                        utreexo_page_size() - skip - sizeof(pg->checksum));
+}
+
+static inline int
+utreexo_forest_file_track_checksums(struct utreexo_forest_file *file) {
+  if (file->stale != NULL)
+    return 0;
+
+  file->stale = calloc((utreexo_forest_file_max_pages() + 63) / 64,
+                       sizeof(uint64_t));
+  if (file->stale == NULL)
+    return -4;
+  if (file->header->flags & UTREEXO_FILE_CHECKSUMS)
+    return 0;
+
+  // Nobody kept them, so we compute them all once
+  const uint64_t n_pages =
+      (file->header->filesize - sizeof(struct utreexo_forest_file_header)) /
+      utreexo_page_size();
+  for (uint64_t page = 0; page < n_pages; ++page)
+    file->stale[page / 64] |= (uint64_t)1 << (page % 64);
+  return 0;
+}
+
+static inline void
+utreexo_forest_file_drop_checksums(struct utreexo_forest_file *file) {
+  free(file->stale);
+  file->stale = NULL;
+  file->header->flags &= ~UTREEXO_FILE_CHECKSUMS;
+}
+
+static inline void
+utreexo_forest_file_update_checksums(struct utreexo_forest_file *file) {
+  if (file->stale == NULL)
+    return;
+
+  const uint64_t n_pages =
+      (file->header->filesize - sizeof(struct utreexo_forest_file_header)) /
+      utreexo_page_size();
+  for (uint64_t word = 0; word < (n_pages + 63) / 64; ++word) {
+    uint64_t bits = __atomic_exchange_n(&file->stale[word], 0,
+                                        __ATOMIC_RELAXED);
+    for (; bits != 0; bits &= bits - 1) {
+      const uint64_t page = word * 64 + __builtin_ctzll(bits);
+      struct utreexo_forest_page_header *pg = utreexo_page(file->map, page);
+      pg->checksum = utreexo_forest_page_checksum(pg);
+    }
+  }
+  // Only now, so a file we never finished checksumming isn't checked
+  file->header->flags |= UTREEXO_FILE_CHECKSUMS;
+}
+
+static inline uint64_t
+utreexo_forest_file_writeback(struct utreexo_forest_file *file,
+                              uint64_t budget) {
+  return file->ops->writeback(file, budget);
+}
+
+/* The kernel knows which pages are dirty, but not which ones we wrote since
+ * we last asked, that's what file->dirty is for */
+static inline uint64_t
+utreexo_forest_mmap_writeback(struct utreexo_forest_file *file,
+                              uint64_t budget) {
+  if (file->dirty == NULL)
+    return 0;
+
+  const size_t header_size = sizeof(struct utreexo_forest_file_header);
+  const uint64_t page_size = utreexo_page_size();
+  const uint64_t n_pages =
+      (__atomic_load_n(&file->header->filesize, __ATOMIC_RELAXED) -
+       header_size) /
+      page_size;
+
+  // The header holds the roots and how many leaves we have, it changes with
+  // every block
+  sync_file_range(file->fd, 0, header_size, SYNC_FILE_RANGE_WRITE);
+  uint64_t spent = header_size;
+
+  size_t page = file->wb_cursor < n_pages ? file->wb_cursor : 0;
+  for (uint64_t scanned = 0; scanned < n_pages && spent < budget;) {
+    uint64_t *word = &file->dirty[page / 64];
+    if (page % 64 == 0 && page + 64 <= n_pages &&
+        __atomic_load_n(word, __ATOMIC_RELAXED) == 0) {
+      scanned += 64;
+      page = page + 64 == n_pages ? 0 : page + 64;
+      continue;
+    }
+    if ((__atomic_load_n(word, __ATOMIC_RELAXED) &
+         ((uint64_t)1 << (page % 64))) == 0) {
+      ++scanned;
+      page = page + 1 == n_pages ? 0 : page + 1;
+      continue;
+    }
+
+    // A run of dirty pages goes in a single request. Bits are cleared before
+    // the request, so pages written to while it's in flight are seen again
+    const size_t first = page;
+    while (page < n_pages && scanned < n_pages && spent < budget) {
+      const uint64_t bit = (uint64_t)1 << (page % 64);
+      if ((__atomic_fetch_and(&file->dirty[page / 64], ~bit,
+                              __ATOMIC_ACQ_REL) &
+           bit) == 0)
+        break;
+      ++page;
+      ++scanned;
+      spent += page_size;
+    }
+    if (page != first)
+      sync_file_range(file->fd, header_size + first * page_size,
+                      (page - first) * page_size, SYNC_FILE_RANGE_WRITE);
+    if (page == n_pages)
+      page = 0;
+  }
+
+  file->wb_cursor = page;
+  return spent;
+}
 #endif
@@ -1,5 +1,6 @@
 #ifndef UTREEXO_FOREST_NODE_H
 #define UTREEXO_FOREST_NODE_H
+#include "config.h"
 #include "parent_hash.h"
 
 /* A node inside our forest, may be either a branch or a leaf, holds a hash and
@@ -10,6 +11,11 @@ typedef struct utreexo_forest_node {
   struct utreexo_forest_node *parent;
   struct utreexo_forest_node *left_child;
   struct utreexo_forest_node *right_child;
+#ifdef USE_POSITION_CACHE
+  /* Only meaningful for leaves, where this leaf would be if the forest had 63
+   * rows. See utreexo_forest_leaf_position */
+  uint64_t position;
+#endif
 } __attribute__((__packed__)) utreexo_forest_node;
 
 #endif
@@ -0,0 +1,48 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * Batch inclusion proofs. A proof for a set of leaves is their positions (the
+ * targets) plus the hashes of every node a verifier needs to recompute the
+ * roots from them. Nodes that can be computed from the targets themselves,
+ * like the parent of two targets that are siblings, are left out. The hashes
+ * are sorted by position, just like in other utreexo implementations, so a
+ * verifier can tell which hash goes where using only the targets and the
+ * number of leaves.
+ */
+#ifndef UTREEXO_FOREST_PROOF_H
+#define UTREEXO_FOREST_PROOF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mmap_forest.h"
+
+/* Errors returned by utreexo_forest_prove_leaves */
+#define UTREEXO_PROOF_ENOTFOUND -1
+#define UTREEXO_PROOF_ENOSPC -2
+
+/* Finds which positions a proof for targets needs the hashes for, and writes
+ * them into positions, sorted. targets are sorted in place. positions has
+ * room for max_positions entries, n_targets * (forest rows + 1) is always
+ * enough for targets that are in the forest. Returns how many positions we
+ * wrote.
+ */
+static inline size_t utreexo_proof_positions(uint64_t *positions,
+                                             size_t max_positions,
+                                             uint64_t *targets,
+                                             size_t n_targets,
+                                             uint64_t num_leaves);
+
+/* Proves a set of leaves. The position of each leaf goes into targets (in the
+ * same order as leaves), and the hashes into proof. *proof_len is how many
+ * hashes proof can hold, and it's set to how many we actually need.
+ *
+ * Returns 0 on success, UTREEXO_PROOF_ENOTFOUND if a leaf isn't in this
+ * forest, or UTREEXO_PROOF_ENOSPC if proof is too small.
+ */
+static inline int
+utreexo_forest_prove_leaves(struct utreexo_forest *f, utreexo_node_hash *proof,
+                            size_t *proof_len, uint64_t *targets,
+                            const utreexo_node_hash *leaves, size_t n_leaves);
+
+#endif // UTREEXO_FOREST_PROOF_H
@@ -0,0 +1,243 @@
+#ifndef UTREEXO_FOREST_PROOF_IMPL_H
+#define UTREEXO_FOREST_PROOF_IMPL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "forest_node.h"
+#include "forest_proof.h"
+#include "leaf_cache_impl.h"
+#include "leaf_map_impl.h"
+#include "mmap_forest.h"
+#include "proof_cache_impl.h"
+#include "util.h"
+
+static int utreexo_proof_position_cmp(const void *a, const void *b) {
+  const uint64_t pa = *(const uint64_t *)a;
+  const uint64_t pb = *(const uint64_t *)b;
+  return (pa > pb) - (pa < pb);
+}
+
+static inline size_t utreexo_proof_positions(uint64_t *positions,
+                                             size_t max_positions,
+                                             uint64_t *targets,
+                                             size_t n_targets,
+                                             uint64_t num_leaves) {
+  const uint8_t forest_rows = tree_rows(num_leaves);
+  size_t n_positions = 0;
+
+  qsort(targets, n_targets, sizeof(uint64_t), utreexo_proof_position_cmp);
+
+  // Nodes we know the hash of in the current row, and the parents we'll know
+  // in the next one. We never know more nodes than we have targets, and both
+  // stay sorted, since parents keep the order of their children
+  uint64_t *row_nodes = malloc(2 * n_targets * sizeof(uint64_t));
+  uint64_t *parents = row_nodes + n_targets;
+  if (row_nodes == NULL) {
+    perror("malloc");
+    abort();
+  }
+
+  size_t n_parents = 0, target = 0;
+  for (uint8_t row = 0; row <= forest_rows; ++row) {
+    // Rows come one after another, so the targets in this row come next.
+    // Leaves may be in any row, since deleting moves them up
+    size_t row_end = target;
+    while (row_end < n_targets &&
+           detect_row(targets[row_end], forest_rows) == row)
+      ++row_end;
+
+    size_t n_row = 0, parent = 0;
+    while (parent < n_parents || target < row_end) {
+      uint64_t next;
+      if (parent == n_parents ||
+          (target < row_end && targets[target] < parents[parent]))
+        next = targets[target++];
+      else
+        next = parents[parent++];
+
+      if (n_row == 0 || row_nodes[n_row - 1] != next)
+        row_nodes[n_row++] = next;
+    }
+
+    n_parents = 0;
+    for (size_t i = 0; i < n_row; ++i) {
+      const uint64_t node = row_nodes[i];
+      if (is_root_position(node, num_leaves, forest_rows))
+        continue;
+
+      // If we know both siblings we don't need any of them, otherwise the
+      // verifier needs the one we don't know
+      if (i + 1 < n_row && row_nodes[i + 1] == sibling_position(node))
+        ++i;
+      else if (n_positions < max_positions)
+        positions[n_positions++] = sibling_position(node);
+      else
+        break;
+
+      parents[n_parents++] = parent_position(node, forest_rows);
+    }
+  }
+
+  free(row_nodes);
+
+  // Siblings come out sorted inside each row, and rows in order
+  return n_positions;
+}
+
+/* A sibling from some cached path, so we can find it by position */
+struct utreexo_proof_cached_node {
+  uint64_t pos;
+  utreexo_node_hash hash;
+};
+
+static int utreexo_proof_cached_node_cmp(const void *a, const void *b) {
+  return utreexo_proof_position_cmp(
+      &((const struct utreexo_proof_cached_node *)a)->pos,
+      &((const struct utreexo_proof_cached_node *)b)->pos);
+}
+
+/* Builds the proof only from cached paths. Returns 1 if every leaf was cached
+ * and the proof is done (or proof is too small), 0 if we need to walk the
+ * forest */
+static inline int
+utreexo_forest_prove_cached(struct utreexo_forest *f, int *ret,
+                            utreexo_node_hash *proof, size_t *proof_len,
+                            uint64_t *targets, const utreexo_node_hash *leaves,
+                            size_t n_leaves) {
+  const uint64_t num_leaves = __atomic_load_n(f->nLeaf, __ATOMIC_RELAXED);
+  const uint8_t forest_rows = tree_rows(num_leaves);
+  const size_t max_positions = n_leaves * (forest_rows + 1);
+  struct utreexo_proof_cached_node *known =
+      malloc(n_leaves * 64 * sizeof(struct utreexo_proof_cached_node));
+  uint64_t *sorted = malloc(n_leaves * sizeof(uint64_t));
+  uint64_t *positions = malloc(max_positions * sizeof(uint64_t));
+  if (known == NULL || sorted == NULL || positions == NULL) {
+    perror("malloc");
+    abort();
+  }
+
+  int done = 1;
+  size_t n_known = 0;
+  for (size_t i = 0; i < n_leaves && done; ++i) {
+    utreexo_node_hash path[64];
+    uint8_t path_len = 0;
+    uint64_t pos;
+    if (!utreexo_proof_cache_get(f->proof_cache, f, &leaves[i], &pos, path,
+                                 &path_len)) {
+      done = 0;
+      break;
+    }
+
+    targets[i] = sorted[i] = pos = translate_position(pos, 63, forest_rows);
+    for (uint8_t depth = 0; depth < path_len; ++depth) {
+      known[n_known++] = (struct utreexo_proof_cached_node){
+          .pos = sibling_position(pos), .hash = path[depth]};
+      pos = parent_position(pos, forest_rows);
+    }
+  }
+
+  if (done) {
+    // Every sibling the proof needs is on the path of some leaf
+    qsort(known, n_known, sizeof(*known), utreexo_proof_cached_node_cmp);
+    const size_t n_positions = utreexo_proof_positions(
+        positions, max_positions, sorted, n_leaves, num_leaves);
+
+    const int err = n_positions > *proof_len ? UTREEXO_PROOF_ENOSPC : 0;
+    for (size_t i = 0; i < n_positions && err == 0; ++i) {
+      const struct utreexo_proof_cached_node key = {.pos = positions[i]};
+      const struct utreexo_proof_cached_node *node =
+          bsearch(&key, known, n_known, sizeof(*known),
+                  utreexo_proof_cached_node_cmp);
+      if (node == NULL) {
+        done = 0;
+        break;
+      }
+      proof[i] = node->hash;
+    }
+    if (done) {
+      *ret = err;
+      *proof_len = n_positions;
+    }
+  }
+
+  free(positions);
+  free(sorted);
+  free(known);
+  return done;
+}
+
+static inline int
+utreexo_forest_prove_leaves(struct utreexo_forest *f, utreexo_node_hash *proof,
+                            size_t *proof_len, uint64_t *targets,
+                            const utreexo_node_hash *leaves, size_t n_leaves) {
+  if (n_leaves == 0) {
+    *proof_len = 0;
+    return 0;
+  }
+  utreexo_forest_flush_hashes(f);
+
+  int ret = 0;
+  if (f->proof_cache != NULL &&
+      utreexo_forest_prove_cached(f, &ret, proof, proof_len, targets, leaves,
+                                  n_leaves))
+    return ret;
+
+  // An attached forest may grow while we read it, everything we size and
+  // compute must agree on a single number of leaves
+  const uint64_t num_leaves = __atomic_load_n(f->nLeaf, __ATOMIC_RELAXED);
+  const uint8_t forest_rows = tree_rows(num_leaves);
+  const size_t max_positions = n_leaves * (forest_rows + 1);
+  utreexo_forest_node **pnodes =
+      malloc(n_leaves * sizeof(utreexo_forest_node *));
+  uint64_t *sorted = malloc(n_leaves * sizeof(uint64_t));
+  uint64_t *positions = malloc(max_positions * sizeof(uint64_t));
+  if (pnodes == NULL || sorted == NULL || positions == NULL) {
+    perror("malloc");
+    abort();
+  }
+
+  utreexo_leaf_cache_get_many(f->leaf_cache, &f->leaf_map, pnodes, leaves,
+                              n_leaves);
+  for (size_t i = 0; i < n_leaves && ret == 0; ++i) {
+    if (!utreexo_forest_node_valid(f, pnodes[i]) ||
+        utreexo_forest_leaf_position(f, pnodes[i], &targets[i]) != 0)
+      ret = UTREEXO_PROOF_ENOTFOUND;
+    else
+      utreexo_forest_file_access(f->data, pnodes[i]);
+    sorted[i] = targets[i];
+  }
+
+  size_t n_positions = 0;
+  if (ret == 0)
+    n_positions = utreexo_proof_positions(positions, max_positions, sorted,
+                                          n_leaves, num_leaves);
+  if (ret == 0 && n_positions > *proof_len)
+    ret = UTREEXO_PROOF_ENOSPC;
+
+  for (size_t i = 0; i < n_positions && ret == 0; ++i) {
+    utreexo_forest_node *pnode, *psibling, *pparent;
+    grab_node_in(f, num_leaves, &pnode, &psibling, &pparent, positions[i]);
+    if (pnode == NULL) {
+      ret = UTREEXO_PROOF_ENOTFOUND;
+      break;
+    }
+    utreexo_forest_file_access(f->data, pnode);
+    memcpy(proof[i].hash, pnode->hash.hash, 32);
+  }
+
+  if (ret == 0 || ret == UTREEXO_PROOF_ENOSPC)
+    *proof_len = n_positions;
+
+  // Next time these leaves come from the cache
+  for (size_t i = 0; i < n_leaves && f->proof_cache != NULL && ret == 0; ++i)
+    utreexo_proof_cache_put(f->proof_cache, f, &leaves[i], pnodes[i]);
+
+  free(positions);
+  free(sorted);
+  free(pnodes);
+  return ret;
+}
+
+#endif // UTREEXO_FOREST_PROOF_IMPL_H
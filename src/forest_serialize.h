@@ -0,0 +1,83 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * A portable export format for the whole forest. The forest file itself can't
+ * be shipped around, since nodes reference each other using pointers that are
+ * only valid inside the process that mapped the file. A snapshot, on the other
+ * hand, holds no pointers at all: it's just the shape of each tree and the
+ * hashes in it, so it can be moved between hosts and loaded into a fresh
+ * forest.
+ *
+ * A snapshot is laid out as follows (all integers are little-endian):
+ *
+ *  magic   (u32) - UTREEXO_SNAPSHOT_MAGIC
+ *  version (u32) - UTREEXO_SNAPSHOT_VERSION
+ *  flags   (u32) - UTREEXO_SNAPSHOT_* flags used to write this file
+ *  n_leaf  (u64) - how many leaves were ever added to this forest
+ *  roots   (u64) - bitmap of which entries in the roots array are populated,
+ *                  only rows whose bit is set in n_leaf may have a root
+ *  trees         - one entry for each populated root, from the tallest tree
+ *                  to the smallest. The root in row i is never more than i
+ *                  levels above its leaves
+ *  checksum      - sha256 of everything above
+ *
+ * Each tree is written as a pre-order walk. Every node starts with a tag byte,
+ * leaves are followed by their hash, and branches are followed by their hash
+ * (only if UTREEXO_SNAPSHOT_INTERIOR is set) and then by their left and right
+ * subtrees. This means leaves come out in position order, and we don't need
+ * to store positions, since they are implied by the tree's shape.
+ *
+ * When interior hashes are omitted, loading a snapshot needs to recompute
+ * them, so we trade file size for load time.
+ */
+#ifndef UTREEXO_FOREST_SERIALIZE_H
+#define UTREEXO_FOREST_SERIALIZE_H
+
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "mmap_forest.h"
+
+/* Magic value at the beginning of every snapshot, hexadecimal for SNAP */
+#define UTREEXO_SNAPSHOT_MAGIC 0x50414e53
+/* Bump this if the snapshot layout ever changes */
+#define UTREEXO_SNAPSHOT_VERSION 1
+
+/* Also write the hashes of branches, not only leaves */
+#define UTREEXO_SNAPSHOT_INTERIOR 0x01
+/* Every flag we know about, snapshots with any other bit set are rejected */
+#define UTREEXO_SNAPSHOT_FLAGS UTREEXO_SNAPSHOT_INTERIOR
+
+/* Tags written before each node */
+#define UTREEXO_SNAPSHOT_LEAF 0x00
+#define UTREEXO_SNAPSHOT_BRANCH 0x01
+
+/* Errors returned by the (de)serializer */
+#define UTREEXO_SNAPSHOT_EIO -1
+#define UTREEXO_SNAPSHOT_EFORMAT -2
+#define UTREEXO_SNAPSHOT_ECHECKSUM -3
+#define UTREEXO_SNAPSHOT_ENOTEMPTY -4
+#define UTREEXO_SNAPSHOT_EFLAGS -5
+
+/* A stream we are reading/writing a snapshot from/to. We hash everything that
+ * goes through it, so we can write/check the checksum at the end */
+struct utreexo_snapshot_stream {
+  FILE *fp;
+  EVP_MD_CTX *ctx;
+  int err;
+};
+
+/* Writes the whole forest into fp, using the flags defined above. Returns 0 on
+ * success, or one of the UTREEXO_SNAPSHOT_E* errors */
+static inline int utreexo_forest_serialize_file(struct utreexo_forest *f,
+                                                FILE *fp, uint32_t flags);
+
+/* Reads a snapshot from fp and rebuilds the forest and its leaf map. The
+ * forest must be empty, and fp seekable: we read the snapshot through once to
+ * check it, and load it only if it's good. Returns 0 on success, or one of
+ * the UTREEXO_SNAPSHOT_E* errors */
+static inline int utreexo_forest_deserialize_file(struct utreexo_forest *f,
+                                                  FILE *fp);
+
+#endif // UTREEXO_FOREST_SERIALIZE_H
@@ -0,0 +1,290 @@
+#ifndef UTREEXO_FOREST_SERIALIZE_IMPL_H
+#define UTREEXO_FOREST_SERIALIZE_IMPL_H
+
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "flat_file_impl.h"
+#include "forest_node.h"
+#include "forest_serialize.h"
+#include "leaf_map_impl.h"
+#include "mmap_forest.h"
+#include "parent_hash.h"
+#include "util.h"
+
+static inline void
+utreexo_snapshot_write(struct utreexo_snapshot_stream *s, const void *data,
+                       size_t len) {
+  if (s->err)
+    return;
+  if (fwrite(data, 1, len, s->fp) != len) {
+    s->err = UTREEXO_SNAPSHOT_EIO;
+    return;
+  }
+  EVP_DigestUpdate(s->ctx, data, len);
+}
+
+static inline void utreexo_snapshot_read(struct utreexo_snapshot_stream *s,
+                                         void *data, size_t len) {
+  if (s->err)
+    return;
+  if (fread(data, 1, len, s->fp) != len) {
+    s->err = UTREEXO_SNAPSHOT_EIO;
+    memset(data, 0x00, len);
+    return;
+  }
+  EVP_DigestUpdate(s->ctx, data, len);
+}
+
+static inline void
+utreexo_snapshot_write_u64(struct utreexo_snapshot_stream *s, uint64_t value,
+                           size_t len) {
+  uint8_t buf[8];
+  for (size_t i = 0; i < len; ++i)
+    buf[i] = (value >> (8 * i)) & 0xff;
+  utreexo_snapshot_write(s, buf, len);
+}
+
+static inline uint64_t
+utreexo_snapshot_read_u64(struct utreexo_snapshot_stream *s, size_t len) {
+  uint8_t buf[8];
+  uint64_t value = 0;
+  utreexo_snapshot_read(s, buf, len);
+  for (size_t i = 0; i < len; ++i)
+    value |= (uint64_t)buf[i] << (8 * i);
+  return value;
+}
+
+/* Writes a subtree in pre-order, see forest_serialize.h for the layout */
+static inline void
+utreexo_snapshot_write_node(struct utreexo_snapshot_stream *s,
+                            const utreexo_forest_node *node, uint32_t flags) {
+  if (node->left_child == NULL) {
+    utreexo_snapshot_write_u64(s, UTREEXO_SNAPSHOT_LEAF, 1);
+    utreexo_snapshot_write(s, node->hash.hash, 32);
+    return;
+  }
+
+  utreexo_snapshot_write_u64(s, UTREEXO_SNAPSHOT_BRANCH, 1);
+  if (flags & UTREEXO_SNAPSHOT_INTERIOR)
+    utreexo_snapshot_write(s, node->hash.hash, 32);
+
+  utreexo_snapshot_write_node(s, node->left_child, flags);
+  utreexo_snapshot_write_node(s, node->right_child, flags);
+}
+
+/* Walks a subtree the way utreexo_snapshot_read_node does, without loading
+ * anything, so we can tell whether a snapshot is good before we touch the
+ * forest */
+static inline void utreexo_snapshot_skip_node(struct utreexo_snapshot_stream *s,
+                                              uint32_t flags, uint8_t height) {
+  if (height >= 64) {
+    s->err = UTREEXO_SNAPSHOT_EFORMAT;
+    return;
+  }
+
+  const uint8_t tag = utreexo_snapshot_read_u64(s, 1);
+  uint8_t hash[32];
+  if (s->err)
+    return;
+  switch (tag) {
+  case UTREEXO_SNAPSHOT_LEAF:
+    utreexo_snapshot_read(s, hash, 32);
+    return;
+  case UTREEXO_SNAPSHOT_BRANCH:
+    // A branch in the bottom row, this tree is taller than its row allows
+    if (height == 0) {
+      s->err = UTREEXO_SNAPSHOT_EFORMAT;
+      return;
+    }
+    if (flags & UTREEXO_SNAPSHOT_INTERIOR)
+      utreexo_snapshot_read(s, hash, 32);
+    utreexo_snapshot_skip_node(s, flags, height - 1);
+    utreexo_snapshot_skip_node(s, flags, height - 1);
+    return;
+  default:
+    s->err = UTREEXO_SNAPSHOT_EFORMAT;
+  }
+}
+
+/* Reads a subtree back, allocating nodes as we go. Since we only append to the
+ * forest file, nodes are written out sequentially. Its leaves may be at most
+ * height levels below it. Returns NULL if the stream is broken */
+static inline utreexo_forest_node *
+utreexo_snapshot_read_node(struct utreexo_snapshot_stream *s,
+                           struct utreexo_forest *f,
+                           utreexo_forest_node *parent, uint32_t flags,
+                           uint8_t height) {
+  if (height >= 64) {
+    s->err = UTREEXO_SNAPSHOT_EFORMAT;
+    return NULL;
+  }
+
+  const uint8_t tag = utreexo_snapshot_read_u64(s, 1);
+  if (s->err)
+    return NULL;
+
+  utreexo_forest_node *pnode = utreexo_forest_file_node_alloc(f->data);
+  *pnode = (utreexo_forest_node){
+      .hash = {{0}}, .parent = parent, .left_child = NULL, .right_child = NULL};
+
+  switch (tag) {
+  case UTREEXO_SNAPSHOT_LEAF:
+    utreexo_snapshot_read(s, pnode->hash.hash, 32);
+    if (s->err)
+      return NULL;
+    utreexo_leaf_map_set(&f->leaf_map, pnode, pnode->hash);
+    return pnode;
+  case UTREEXO_SNAPSHOT_BRANCH:
+    // A branch in the bottom row, this tree is taller than its row allows
+    if (height == 0) {
+      s->err = UTREEXO_SNAPSHOT_EFORMAT;
+      return NULL;
+    }
+    if (flags & UTREEXO_SNAPSHOT_INTERIOR)
+      utreexo_snapshot_read(s, pnode->hash.hash, 32);
+
+    pnode->left_child =
+        utreexo_snapshot_read_node(s, f, pnode, flags, height - 1);
+    if (pnode->left_child == NULL)
+      return NULL;
+    pnode->right_child =
+        utreexo_snapshot_read_node(s, f, pnode, flags, height - 1);
+    if (pnode->right_child == NULL)
+      return NULL;
+
+    if (!(flags & UTREEXO_SNAPSHOT_INTERIOR))
+      parent_hash(pnode->hash.hash, pnode->left_child->hash.hash,
+                  pnode->right_child->hash.hash);
+    // Our children may have pushed us out of the page we were allocated in
+    utreexo_forest_file_touch(f->data, pnode);
+    return pnode;
+  default:
+    s->err = UTREEXO_SNAPSHOT_EFORMAT;
+    return NULL;
+  }
+}
+
+static inline int utreexo_forest_serialize_file(struct utreexo_forest *f,
+                                                FILE *fp, uint32_t flags) {
+  if (flags & ~UTREEXO_SNAPSHOT_FLAGS)
+    return UTREEXO_SNAPSHOT_EFLAGS;
+  utreexo_forest_flush_hashes(f);
+  struct utreexo_snapshot_stream s = {
+      .fp = fp, .ctx = EVP_MD_CTX_new(), .err = 0};
+  EVP_DigestInit_ex(s.ctx, EVP_sha256(), NULL);
+
+  uint64_t roots = 0;
+  for (size_t i = 0; i < 64; ++i)
+    if (f->roots[i] != NULL)
+      roots |= (uint64_t)1 << i;
+
+  utreexo_snapshot_write_u64(&s, UTREEXO_SNAPSHOT_MAGIC, 4);
+  utreexo_snapshot_write_u64(&s, UTREEXO_SNAPSHOT_VERSION, 4);
+  utreexo_snapshot_write_u64(&s, flags, 4);
+  utreexo_snapshot_write_u64(&s, *f->nLeaf, 8);
+  utreexo_snapshot_write_u64(&s, roots, 8);
+
+  // Tallest trees hold the lowest positions
+  for (int i = 63; i >= 0; --i)
+    if (f->roots[i] != NULL)
+      utreexo_snapshot_write_node(&s, f->roots[i], flags);
+
+  uint8_t checksum[32];
+  EVP_DigestFinal_ex(s.ctx, checksum, NULL);
+  EVP_MD_CTX_free(s.ctx);
+
+  if (!s.err && fwrite(checksum, 1, 32, fp) != 32)
+    s.err = UTREEXO_SNAPSHOT_EIO;
+  if (!s.err && fflush(fp) != 0)
+    s.err = UTREEXO_SNAPSHOT_EIO;
+
+  debug_print("Wrote snapshot with %lu leaves, err=%d\n", *f->nLeaf, s.err);
+  return s.err;
+}
+
+/* Reads a whole snapshot from where fp is, and loads its trees into f's roots
+ * and leaf map. If f is NULL, we only check it. Returns 0 on success, or one
+ * of the UTREEXO_SNAPSHOT_E* errors */
+static inline int utreexo_snapshot_load(struct utreexo_forest *f, FILE *fp,
+                                        uint64_t *n_leaf_out) {
+  struct utreexo_snapshot_stream s = {
+      .fp = fp, .ctx = EVP_MD_CTX_new(), .err = 0};
+  EVP_DigestInit_ex(s.ctx, EVP_sha256(), NULL);
+
+  const uint32_t magic = utreexo_snapshot_read_u64(&s, 4);
+  const uint32_t version = utreexo_snapshot_read_u64(&s, 4);
+  const uint32_t flags = utreexo_snapshot_read_u64(&s, 4);
+  const uint64_t n_leaf = utreexo_snapshot_read_u64(&s, 8);
+  const uint64_t roots = utreexo_snapshot_read_u64(&s, 8);
+
+  if (!s.err &&
+      (magic != UTREEXO_SNAPSHOT_MAGIC || version != UTREEXO_SNAPSHOT_VERSION))
+    s.err = UTREEXO_SNAPSHOT_EFORMAT;
+  if (!s.err && (flags & ~UTREEXO_SNAPSHOT_FLAGS))
+    s.err = UTREEXO_SNAPSHOT_EFLAGS;
+  // Trees that were deleted entirely leave their row empty, but there can't
+  // be a tree in a row n_leaf doesn't have
+  if (!s.err && (roots & ~n_leaf))
+    s.err = UTREEXO_SNAPSHOT_EFORMAT;
+
+  for (int i = 63; i >= 0 && !s.err; --i) {
+    if (!(roots & ((uint64_t)1 << i)))
+      continue;
+    if (f == NULL)
+      utreexo_snapshot_skip_node(&s, flags, i);
+    else
+      f->roots[i] = utreexo_snapshot_read_node(&s, f, NULL, flags, i);
+  }
+
+  uint8_t expected[32], checksum[32];
+  EVP_DigestFinal_ex(s.ctx, expected, NULL);
+  EVP_MD_CTX_free(s.ctx);
+
+  if (!s.err && fread(checksum, 1, 32, fp) != 32)
+    s.err = UTREEXO_SNAPSHOT_EIO;
+  if (!s.err && memcmp(checksum, expected, 32) != 0)
+    s.err = UTREEXO_SNAPSHOT_ECHECKSUM;
+  *n_leaf_out = n_leaf;
+  return s.err;
+}
+
+static inline int utreexo_forest_deserialize_file(struct utreexo_forest *f,
+                                                  FILE *fp) {
+  if (*f->nLeaf != 0)
+    return UTREEXO_SNAPSHOT_ENOTEMPTY;
+
+  // Nodes and leaf map entries can't be taken back, so we read the whole
+  // snapshot once without loading it, and only then for real
+  const long begin = ftell(fp);
+  uint64_t n_leaf = 0;
+  int err = utreexo_snapshot_load(NULL, fp, &n_leaf);
+  if (err)
+    return err;
+  if (begin < 0 || fseek(fp, begin, SEEK_SET) != 0)
+    return UTREEXO_SNAPSHOT_EIO;
+
+  utreexo_forest_file_write_begin(f->data);
+  err = utreexo_snapshot_load(f, fp, &n_leaf);
+  if (err) {
+    // Only if the file changed since we checked it
+    memset(f->roots, 0x00, 64 * sizeof(utreexo_forest_node *));
+    utreexo_forest_publish(f);
+    return err;
+  }
+
+  *f->nLeaf = n_leaf;
+#ifdef USE_POSITION_CACHE
+  for (uint8_t i = 0; i < 64; ++i)
+    if (f->roots[i] != NULL)
+      utreexo_forest_cache_positions(f, f->roots[i],
+                                     root_position(n_leaf, i, 63));
+#endif
+  debug_print("Loaded snapshot with %lu leaves\n", n_leaf);
+  utreexo_forest_publish(f);
+  return 0;
+}
+
+#endif // UTREEXO_FOREST_SERIALIZE_IMPL_H
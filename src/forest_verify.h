@@ -0,0 +1,114 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * Checks a whole forest for corruption. Nothing we do while applying blocks
+ * looks at more than a few paths, so a flipped bit in a page nobody touched
+ * for a year goes unnoticed until someone asks for a proof through it.
+ *
+ * There are two passes, both spread over every core we have. The first goes
+ * over every page in the file that isn't in the free list, and checks its
+ * magic and, if the file keeps them, its checksum. The second goes down every
+ * tree, checking that each node's children point back to it, that its hash
+ * is the hash of its children, and that no tree is taller than its root's
+ * row says. Before following a pointer we make sure it points to a node slot
+ * in a page we use, so a corrupted forest gives us a count of what's wrong
+ * instead of a crash.
+ *
+ * The trees are split by going down from the roots until we have a few
+ * thousand disjoint subtrees, and threads take them one at a time. Hashing is
+ * the expensive part, and there's a hash for every internal node, so this is
+ * as parallel as it gets.
+ */
+#ifndef UTREEXO_FOREST_VERIFY_H
+#define UTREEXO_FOREST_VERIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flat_file.h"
+#include "forest_node.h"
+#include "util.h"
+
+struct utreexo_forest;
+
+/* How many subtrees we split the forest into, and how many threads at most
+ * work on them */
+#define UTREEXO_VERIFY_JOBS 4096
+#define UTREEXO_VERIFY_THREADS 32
+/* How many pages a thread takes at once */
+#define UTREEXO_VERIFY_PAGE_BATCH 64
+
+/* Mirrors utreexo_forest_verify_stats in include/utreexo.h */
+struct utreexo_forest_verify_stats {
+  /* Pages we looked at, the ones in the free list aren't */
+  uint64_t pages;
+  /* Nodes we reached from the roots */
+  uint64_t nodes;
+  /* Pages with a bad magic or node count, and free list entries that don't
+   * point to a page */
+  uint64_t bad_pages;
+  /* Pages whose checksum doesn't match */
+  uint64_t bad_checksums;
+  /* Pointers that don't point to a node we use, children that don't point
+   * back to their parent, and nodes below the bottom row */
+  uint64_t bad_links;
+  /* Internal nodes whose hash isn't the hash of their children */
+  uint64_t bad_hashes;
+  /* Roots for trees we shouldn't have, or with a parent */
+  uint64_t bad_roots;
+};
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_verify_stats, pages, 0);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_verify_stats, nodes, 8);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_verify_stats, bad_pages, 16);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_verify_stats, bad_checksums, 24);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_verify_stats, bad_links, 32);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_verify_stats, bad_hashes, 40);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_verify_stats, bad_roots, 48);
+UTREEXO_ASSERT_SIZE(struct utreexo_forest_verify_stats, 56);
+
+/* A subtree some thread will check. rows is how many rows there may be under
+ * node */
+struct utreexo_forest_verify_job {
+  const utreexo_forest_node *node;
+  uint8_t rows;
+};
+
+struct utreexo_forest_verify {
+  const struct utreexo_forest_file *file;
+  /* Pages in the file, used or not */
+  uint64_t n_pages;
+  /* One bit for each page in the free list */
+  uint64_t *free;
+  /* Whether pages have checksums we can trust */
+  int checksums;
+  /* The next page some thread will take */
+  uint64_t next_page;
+
+  struct utreexo_forest_verify_job *jobs;
+  size_t n_jobs;
+  size_t next_job;
+
+  struct utreexo_forest_verify_stats stats;
+};
+
+/* Checks the forest file and every tree in f, and adds what we found to
+ * stats. Hashes must be up to date, see utreexo_forest_flush_hashes, and
+ * nobody may change the forest while we look. Returns 0 if everything is
+ * fine, -9 if something isn't, and -4 if we are out of memory */
+static inline int
+utreexo_forest_check(const struct utreexo_forest *f,
+                     struct utreexo_forest_verify_stats *stats);
+
+/* Whether ptr points to a node slot in a page we use */
+static inline int
+utreexo_forest_verify_ptr(const struct utreexo_forest_verify *v,
+                          const void *ptr);
+
+/* Checks node's links and hash, given how many rows there may be under it.
+ * Returns whether its children may be followed */
+static inline int
+utreexo_forest_verify_node(const struct utreexo_forest_verify *v,
+                           const utreexo_forest_node *node, uint8_t rows,
+                           struct utreexo_forest_verify_stats *stats);
+
+#endif // UTREEXO_FOREST_VERIFY_H
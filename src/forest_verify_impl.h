@@ -0,0 +1,253 @@
+#ifndef UTREEXO_FOREST_VERIFY_IMPL_H
+#define UTREEXO_FOREST_VERIFY_IMPL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flat_file_impl.h"
+#include "forest_verify.h"
+#include "mmap_forest.h"
+#include "parent_hash.h"
+
+static inline int
+utreexo_forest_verify_ptr(const struct utreexo_forest_verify *v,
+                          const void *ptr) {
+  const char *map = v->file->map;
+  if ((const char *)ptr < map ||
+      (const char *)ptr >= map + v->n_pages * utreexo_page_size())
+    return 0;
+
+  const uint64_t offset = (const char *)ptr - map;
+  const uint64_t page = offset / utreexo_page_size();
+  const uint64_t in_page = offset % utreexo_page_size();
+  return in_page >= sizeof(struct utreexo_forest_page_header) &&
+         (in_page - sizeof(struct utreexo_forest_page_header)) %
+                 sizeof(utreexo_forest_node) ==
+             0 &&
+         !(v->free[page / 64] & ((uint64_t)1 << (page % 64)));
+}
+
+static inline int
+utreexo_forest_verify_node(const struct utreexo_forest_verify *v,
+                           const utreexo_forest_node *node, uint8_t rows,
+                           struct utreexo_forest_verify_stats *stats) {
+  ++stats->nodes;
+  const utreexo_forest_node *left = node->left_child;
+  const utreexo_forest_node *right = node->right_child;
+  // Deletions move subtrees up, so leaves may be anywhere above the bottom
+  if (left == NULL && right == NULL)
+    return 0;
+
+  if (rows == 0 || !utreexo_forest_verify_ptr(v, left) ||
+      !utreexo_forest_verify_ptr(v, right)) {
+    ++stats->bad_links;
+    return 0;
+  }
+  if (left->parent != node || right->parent != node)
+    ++stats->bad_links;
+
+  uint8_t hash[32];
+  parent_hash(hash, left->hash.hash, right->hash.hash);
+  if (memcmp(hash, node->hash.hash, 32) != 0)
+    ++stats->bad_hashes;
+  return 1;
+}
+
+static void utreexo_forest_verify_tree(const struct utreexo_forest_verify *v,
+                                       const utreexo_forest_node *node,
+                                       uint8_t rows,
+                                       struct utreexo_forest_verify_stats *s) {
+  // Recurse on the right, loop on the left
+  while (utreexo_forest_verify_node(v, node, rows, s)) {
+    utreexo_forest_verify_tree(v, node->right_child, rows - 1, s);
+    node = node->left_child;
+    --rows;
+  }
+}
+
+static void utreexo_forest_verify_pages(struct utreexo_forest_verify *v,
+                                        struct utreexo_forest_verify_stats *s) {
+  for (;;) {
+    const uint64_t first = __atomic_fetch_add(
+        &v->next_page, UTREEXO_VERIFY_PAGE_BATCH, __ATOMIC_RELAXED);
+    if (first >= v->n_pages)
+      return;
+
+    const uint64_t end = first + UTREEXO_VERIFY_PAGE_BATCH < v->n_pages
+                             ? first + UTREEXO_VERIFY_PAGE_BATCH
+                             : v->n_pages;
+    for (uint64_t page = first; page < end; ++page) {
+      if (v->free[page / 64] & ((uint64_t)1 << (page % 64)))
+        continue;
+
+      const struct utreexo_forest_page_header *pg =
+          utreexo_page(v->file->map, page);
+      ++s->pages;
+      if (pg->pg_magic != MAGIC || pg->n_nodes > NODES_PER_PAGE)
+        ++s->bad_pages;
+      else if (v->checksums &&
+               utreexo_forest_page_checksum(pg) != pg->checksum)
+        ++s->bad_checksums;
+    }
+  }
+}
+
+static void *utreexo_forest_verify_worker(void *arg) {
+  struct utreexo_forest_verify *v = arg;
+  struct utreexo_forest_verify_stats s = {0};
+
+  // Pages first, everyone is done with them about when the trees start
+  utreexo_forest_verify_pages(v, &s);
+  for (;;) {
+    const size_t job = __atomic_fetch_add(&v->next_job, 1, __ATOMIC_RELAXED);
+    if (job >= v->n_jobs)
+      break;
+    utreexo_forest_verify_tree(v, v->jobs[job].node, v->jobs[job].rows, &s);
+  }
+
+  __atomic_fetch_add(&v->stats.pages, s.pages, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&v->stats.nodes, s.nodes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&v->stats.bad_pages, s.bad_pages, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&v->stats.bad_checksums, s.bad_checksums,
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&v->stats.bad_links, s.bad_links, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&v->stats.bad_hashes, s.bad_hashes, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/* Marks every page in the free list, and counts entries that aren't pages */
+static inline void utreexo_forest_verify_free_list(
+    struct utreexo_forest_verify *v) {
+  const utreexo_forest_free_page *fpg = v->file->header->fpg;
+  while (fpg != NULL) {
+    const char *ptr = (const char *)fpg;
+    if (ptr < v->file->map ||
+        ptr >= v->file->map + v->n_pages * utreexo_page_size() ||
+        (ptr - v->file->map) % utreexo_page_size() != 0) {
+      ++v->stats.bad_pages;
+      return;
+    }
+
+    const uint64_t page = (ptr - v->file->map) / utreexo_page_size();
+    const uint64_t bit = (uint64_t)1 << (page % 64);
+    // We've been here before, the list goes round in circles
+    if (v->free[page / 64] & bit) {
+      ++v->stats.bad_pages;
+      return;
+    }
+    v->free[page / 64] |= bit;
+    fpg = fpg->next;
+  }
+}
+
+/* Checks the roots and the nodes near them, until the trees under what's
+ * left are small enough to hand out to threads */
+static inline void utreexo_forest_verify_split(const struct utreexo_forest *f,
+                                               struct utreexo_forest_verify *v,
+                                               struct utreexo_forest_verify_job
+                                                   *level[2]) {
+  size_t n_level = 0, cur = 0;
+  for (uint8_t row = 0; row < 64; ++row) {
+    const utreexo_forest_node *root = f->roots[row];
+    if (root == NULL)
+      continue;
+    // Trees that were deleted whole leave a NULL root, but a root where
+    // there's no tree at all is wrong
+    if (!(*f->nLeaf >> row & 1) || !utreexo_forest_verify_ptr(v, root)) {
+      ++v->stats.bad_roots;
+      continue;
+    }
+    if (root->parent != NULL)
+      ++v->stats.bad_roots;
+    level[cur][n_level++] =
+        (struct utreexo_forest_verify_job){.node = root, .rows = row};
+  }
+
+  // Every step at most doubles the jobs we have
+  while (n_level < UTREEXO_VERIFY_JOBS / 2) {
+    size_t n_next = 0, n_split = 0;
+    for (size_t i = 0; i < n_level; ++i) {
+      const struct utreexo_forest_verify_job job = level[cur][i];
+      if (job.rows == 0) {
+        level[!cur][n_next++] = job;
+        continue;
+      }
+      ++n_split;
+      if (!utreexo_forest_verify_node(v, job.node, job.rows, &v->stats))
+        continue;
+      level[!cur][n_next++] = (struct utreexo_forest_verify_job){
+          .node = job.node->left_child, .rows = job.rows - 1};
+      level[!cur][n_next++] = (struct utreexo_forest_verify_job){
+          .node = job.node->right_child, .rows = job.rows - 1};
+    }
+    if (n_split == 0)
+      break;
+    cur = !cur;
+    n_level = n_next;
+  }
+
+  v->jobs = level[cur];
+  v->n_jobs = n_level;
+}
+
+static inline int
+utreexo_forest_check(const struct utreexo_forest *f,
+                     struct utreexo_forest_verify_stats *stats) {
+  const struct utreexo_forest_file *file = f->data;
+  struct utreexo_forest_verify v = {
+      .file = file,
+      .n_pages =
+          (file->header->filesize - sizeof(struct utreexo_forest_file_header)) /
+          utreexo_page_size(),
+      .checksums = (file->header->flags & UTREEXO_FILE_CHECKSUMS) != 0,
+  };
+  v.free = calloc((v.n_pages + 63) / 64 + 1, sizeof(uint64_t));
+  struct utreexo_forest_verify_job *level[2] = {
+      malloc(UTREEXO_VERIFY_JOBS * sizeof(*level[0])),
+      malloc(UTREEXO_VERIFY_JOBS * sizeof(*level[1]))};
+  if (v.free == NULL || level[0] == NULL || level[1] == NULL) {
+    free(v.free);
+    free(level[0]);
+    free(level[1]);
+    return -4;
+  }
+
+  utreexo_forest_verify_free_list(&v);
+  utreexo_forest_verify_split(f, &v, level);
+
+  long n_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  if (n_threads > UTREEXO_VERIFY_THREADS)
+    n_threads = UTREEXO_VERIFY_THREADS;
+
+  // We work as well, so it's fine if some thread can't be created
+  pthread_t threads[UTREEXO_VERIFY_THREADS];
+  long n_started = 0;
+  for (; n_started < n_threads; ++n_started)
+    if (pthread_create(&threads[n_started], NULL, utreexo_forest_verify_worker,
+                       &v) != 0)
+      break;
+  utreexo_forest_verify_worker(&v);
+  for (long i = 0; i < n_started; ++i)
+    pthread_join(threads[i], NULL);
+
+  free(v.free);
+  free(level[0]);
+  free(level[1]);
+
+  stats->pages += v.stats.pages;
+  stats->nodes += v.stats.nodes;
+  stats->bad_pages += v.stats.bad_pages;
+  stats->bad_checksums += v.stats.bad_checksums;
+  stats->bad_links += v.stats.bad_links;
+  stats->bad_hashes += v.stats.bad_hashes;
+  stats->bad_roots += v.stats.bad_roots;
+  return v.stats.bad_pages || v.stats.bad_checksums || v.stats.bad_links ||
+                 v.stats.bad_hashes || v.stats.bad_roots
+             ? -9
+             : 0;
+}
+
+#endif // UTREEXO_FOREST_VERIFY_IMPL_H
@@ -0,0 +1,108 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * Latency histograms for what the forest does, split by phase. Most blocks
+ * are applied in a few milliseconds, and the ones that take seconds because
+ * of a page fault storm or a long free list walk disappear in any average,
+ * so we keep the whole distribution instead.
+ *
+ * The buckets are laid out like HdrHistogram's: values are grouped by their
+ * highest set bit, and each group is split into UTREEXO_LATENCY_SUB_BUCKETS
+ * buckets of the same width. Every value lands in a bucket at most 1/16th
+ * wider than itself, from a nanosecond to centuries, with less than a
+ * thousand counters. Recording is a clock read at each end and a few relaxed
+ * atomic adds, so it's fine to leave on, and many threads may record and
+ * read at once.
+ */
+#ifndef UTREEXO_LATENCY_H
+#define UTREEXO_LATENCY_H
+
+#include <stdint.h>
+
+#include "util.h"
+
+#define UTREEXO_LATENCY_SUB_BITS 4
+#define UTREEXO_LATENCY_SUB_BUCKETS (1 << UTREEXO_LATENCY_SUB_BITS)
+/* Values below UTREEXO_LATENCY_SUB_BUCKETS get a bucket each, then there
+ * are UTREEXO_LATENCY_SUB_BUCKETS buckets for each bit above that */
+#define UTREEXO_LATENCY_BUCKETS                                               \
+  ((64 - UTREEXO_LATENCY_SUB_BITS + 1) * UTREEXO_LATENCY_SUB_BUCKETS)
+
+/* Mirrors utreexo_latency_phase in include/utreexo.h */
+enum utreexo_latency_phase {
+  UTREEXO_LATENCY_MODIFY,
+  UTREEXO_LATENCY_RESOLVE,
+  UTREEXO_LATENCY_DELETE,
+  UTREEXO_LATENCY_ADD,
+  UTREEXO_LATENCY_HASH,
+  UTREEXO_LATENCY_PAGE_ALLOC,
+  UTREEXO_LATENCY_POSITION,
+  UTREEXO_LATENCY_PROVE,
+  UTREEXO_LATENCY_PHASES,
+};
+_Static_assert(UTREEXO_LATENCY_PHASES == 8,
+               "utreexo_latency_phase doesn't match include/utreexo.h");
+
+/* Mirrors utreexo_latency_stats in include/utreexo.h */
+struct utreexo_latency_stats {
+  uint64_t count;
+  uint64_t mean;
+  uint64_t max;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+};
+UTREEXO_ASSERT_FIELD(struct utreexo_latency_stats, count, 0);
+UTREEXO_ASSERT_FIELD(struct utreexo_latency_stats, mean, 8);
+UTREEXO_ASSERT_FIELD(struct utreexo_latency_stats, max, 16);
+UTREEXO_ASSERT_FIELD(struct utreexo_latency_stats, p50, 24);
+UTREEXO_ASSERT_FIELD(struct utreexo_latency_stats, p90, 32);
+UTREEXO_ASSERT_FIELD(struct utreexo_latency_stats, p99, 40);
+UTREEXO_ASSERT_FIELD(struct utreexo_latency_stats, p999, 48);
+UTREEXO_ASSERT_SIZE(struct utreexo_latency_stats, 56);
+
+/* Every value is in nanoseconds */
+struct utreexo_latency_histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[UTREEXO_LATENCY_BUCKETS];
+};
+
+struct utreexo_latency {
+  struct utreexo_latency_histogram phases[UTREEXO_LATENCY_PHASES];
+};
+
+/* The monotonic clock, in nanoseconds */
+static inline uint64_t utreexo_latency_now(void);
+
+/* Which bucket counts value */
+static inline uint64_t utreexo_latency_bucket(uint64_t value);
+
+/* The highest value counted in bucket */
+static inline uint64_t utreexo_latency_bucket_max(uint64_t bucket);
+
+/* Counts one value */
+static inline void
+utreexo_latency_record(struct utreexo_latency_histogram *histogram,
+                       uint64_t value);
+
+/* When a phase starts, for utreexo_latency_end. Zero if latency is NULL, so
+ * nobody pays for the clock if we aren't keeping histograms */
+static inline uint64_t utreexo_latency_start(const struct utreexo_latency *l);
+
+/* Counts the time since start against phase, does nothing if latency is
+ * NULL */
+static inline void utreexo_latency_end(struct utreexo_latency *latency,
+                                       enum utreexo_latency_phase phase,
+                                       uint64_t start);
+
+/* Summarizes what histogram counted, and if reset is set, starts it over.
+ * Values recorded while we read are counted either now or after the reset,
+ * never twice or not at all */
+static inline void
+utreexo_latency_read(struct utreexo_latency_histogram *histogram,
+                     struct utreexo_latency_stats *stats, int reset);
+
+#endif // UTREEXO_LATENCY_H
@@ -0,0 +1,109 @@
+#ifndef UTREEXO_LATENCY_IMPL_H
+#define UTREEXO_LATENCY_IMPL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "latency.h"
+
+static inline uint64_t utreexo_latency_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t utreexo_latency_bucket(uint64_t value) {
+  if (value < UTREEXO_LATENCY_SUB_BUCKETS)
+    return value;
+
+  // The highest set bit picks the group, the bits right below it the bucket
+  const uint64_t bit = 63 - __builtin_clzll(value);
+  const uint64_t shift = bit - UTREEXO_LATENCY_SUB_BITS;
+  return (shift + 1) * UTREEXO_LATENCY_SUB_BUCKETS + (value >> shift) -
+         UTREEXO_LATENCY_SUB_BUCKETS;
+}
+
+static inline uint64_t utreexo_latency_bucket_max(uint64_t bucket) {
+  if (bucket < UTREEXO_LATENCY_SUB_BUCKETS)
+    return bucket;
+
+  const uint64_t shift = bucket / UTREEXO_LATENCY_SUB_BUCKETS - 1;
+  const uint64_t first =
+      (bucket % UTREEXO_LATENCY_SUB_BUCKETS + UTREEXO_LATENCY_SUB_BUCKETS)
+      << shift;
+  return first + (((uint64_t)1 << shift) - 1);
+}
+
+static inline void
+utreexo_latency_record(struct utreexo_latency_histogram *histogram,
+                       uint64_t value) {
+  __atomic_fetch_add(&histogram->buckets[utreexo_latency_bucket(value)], 1,
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  while (value > max &&
+         !__atomic_compare_exchange_n(&histogram->max, &max, value, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static inline uint64_t utreexo_latency_start(const struct utreexo_latency *l) {
+  return l != NULL ? utreexo_latency_now() : 0;
+}
+
+static inline void utreexo_latency_end(struct utreexo_latency *latency,
+                                       enum utreexo_latency_phase phase,
+                                       uint64_t start) {
+  if (latency == NULL)
+    return;
+  utreexo_latency_record(&latency->phases[phase],
+                         utreexo_latency_now() - start);
+}
+
+static inline void
+utreexo_latency_read(struct utreexo_latency_histogram *histogram,
+                     struct utreexo_latency_stats *stats, int reset) {
+  // We count from the buckets, count and sum may be off by whatever is being
+  // recorded right now
+  uint64_t buckets[UTREEXO_LATENCY_BUCKETS];
+  uint64_t count = 0, sum, max;
+  for (size_t i = 0; i < UTREEXO_LATENCY_BUCKETS; ++i) {
+    buckets[i] = reset ? __atomic_exchange_n(&histogram->buckets[i], 0,
+                                             __ATOMIC_RELAXED)
+                       : __atomic_load_n(&histogram->buckets[i],
+                                         __ATOMIC_RELAXED);
+    count += buckets[i];
+  }
+  if (reset) {
+    __atomic_exchange_n(&histogram->count, 0, __ATOMIC_RELAXED);
+    sum = __atomic_exchange_n(&histogram->sum, 0, __ATOMIC_RELAXED);
+    max = __atomic_exchange_n(&histogram->max, 0, __ATOMIC_RELAXED);
+  } else {
+    sum = __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  }
+
+  *stats = (struct utreexo_latency_stats){
+      .count = count, .mean = count ? sum / count : 0, .max = max};
+  // The smallest value at least this many of them are below or equal to
+  const uint64_t ranks[4] = {
+      (count * 500 + 999) / 1000, (count * 900 + 999) / 1000,
+      (count * 990 + 999) / 1000, (count * 999 + 999) / 1000};
+  uint64_t *quantiles[4] = {&stats->p50, &stats->p90, &stats->p99,
+                            &stats->p999};
+  uint64_t seen = 0;
+  size_t q = 0;
+  for (size_t i = 0; i < UTREEXO_LATENCY_BUCKETS && q < 4; ++i) {
+    seen += buckets[i];
+    for (; q < 4 && ranks[q] != 0 && seen >= ranks[q]; ++q) {
+      // A bucket's top may be above anything we really saw
+      const uint64_t top = utreexo_latency_bucket_max(i);
+      *quantiles[q] = top < max || max == 0 ? top : max;
+    }
+  }
+}
+
+#endif // UTREEXO_LATENCY_IMPL_H
@@ -0,0 +1,126 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * A cache of recently added leaves, in front of the leaf map. Many UTXOs are
+ * spent only a few blocks after being created, and for those going through the
+ * leaf map is wasted work: a write when they are added, a probe when they are
+ * spent, and a delete right after.
+ *
+ * So new leaves first go to a small in-memory table. Only once a leaf is one
+ * of the oldest we hold, and we need room for a new one, it's written to the
+ * leaf map. Leaves spent before that never touch the disk at all.
+ *
+ * Every function here takes the cache and the leaf map under it. A NULL
+ * cache is fine, then everything goes straight to the leaf map.
+ *
+ * Leaves that are only in the cache aren't in the leaf map file, so if we die
+ * without utreexo_leaf_cache_free they are lost, and the leaf map must be
+ * rebuilt from the forest (see leaf_map_rebuild.h). That's why the cache is
+ * only there if someone asks for it.
+ */
+#ifndef UTREEXO_LEAF_CACHE_H
+#define UTREEXO_LEAF_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "forest_node.h"
+#include "leaf_map.h"
+#include "util.h"
+
+/* Mirrors utreexo_leaf_cache_stats in include/utreexo.h */
+struct utreexo_leaf_cache_stats {
+  /* Lookups we answered */
+  uint64_t hits;
+  /* Lookups that went to the leaf map */
+  uint64_t misses;
+  /* Leaves spent while we had them, that the leaf map never saw */
+  uint64_t elided;
+  /* Leaves we had to write to the leaf map to make room */
+  uint64_t evicted;
+};
+UTREEXO_ASSERT_FIELD(struct utreexo_leaf_cache_stats, hits, 0);
+UTREEXO_ASSERT_FIELD(struct utreexo_leaf_cache_stats, misses, 8);
+UTREEXO_ASSERT_FIELD(struct utreexo_leaf_cache_stats, elided, 16);
+UTREEXO_ASSERT_FIELD(struct utreexo_leaf_cache_stats, evicted, 24);
+UTREEXO_ASSERT_SIZE(struct utreexo_leaf_cache_stats, 32);
+
+/* A leaf we hold. node is NULL for empty slots */
+struct utreexo_leaf_cache_entry {
+  utreexo_node_hash hash;
+  utreexo_forest_node *node;
+  /* When this leaf was added, to tell it apart from older copies in the
+   * queue */
+  uint64_t seq;
+};
+
+/* Leaves in the order they were added, the oldest one is at head */
+struct utreexo_leaf_cache_queued {
+  utreexo_node_hash hash;
+  uint64_t seq;
+};
+
+struct utreexo_leaf_cache {
+  /* Open addressing with linear probing, never more than half full. It
+   * never grows, so readers can look into it while the forest changes, like
+   * the pipeline's prefetcher does */
+  struct utreexo_leaf_cache_entry *table;
+  size_t table_size;
+  /* Odd while the table is being changed, bumped again once it's done.
+   * Entries move around when others are removed, so readers that saw this
+   * change may have missed a leaf, or read half of one, and look again */
+  uint64_t version;
+
+  struct utreexo_leaf_cache_queued *queue;
+  size_t size;
+  size_t head;
+  size_t queued;
+  uint64_t seq;
+
+  struct utreexo_leaf_cache_stats stats;
+};
+
+/* Creates a cache holding up to size leaves. Zero means no cache, and *cache
+ * is set to NULL. Returns 0 on success, -4 if we are out of memory */
+static inline int utreexo_leaf_cache_new(struct utreexo_leaf_cache **cache,
+                                         size_t size);
+
+/* Writes everything we hold to the leaf map, then frees the cache */
+static inline void utreexo_leaf_cache_free(struct utreexo_leaf_cache *cache,
+                                           utreexo_leaf_map *map);
+
+/* Same as utreexo_leaf_map_get_many, looking into the cache first. Many threads
+ * may call this at once, even while a single writer changes the cache, see
+ * utreexo_leaf_cache.version. Leaf map readers must still be fine with
+ * whatever the writer does to the leaf map meanwhile */
+static inline void utreexo_leaf_cache_get_many(struct utreexo_leaf_cache *cache,
+                                               utreexo_leaf_map *map,
+                                               utreexo_forest_node **nodes,
+                                               const utreexo_leaf_hash *leaves,
+                                               size_t n);
+
+/* Same as utreexo_leaf_cache_get_many, for a single leaf */
+static inline void utreexo_leaf_cache_get(struct utreexo_leaf_cache *cache,
+                                          utreexo_leaf_map *map,
+                                          utreexo_forest_node **node,
+                                          utreexo_leaf_hash leaf);
+
+/* Adds leaves to the cache. If it's full, the oldest leaves are written to the
+ * leaf map to make room. Only one thread may change the cache at a time */
+static inline void utreexo_leaf_cache_set_many(struct utreexo_leaf_cache *cache,
+                                               utreexo_leaf_map *map,
+                                               utreexo_forest_node **nodes,
+                                               const utreexo_leaf_hash *leaves,
+                                               size_t n);
+
+/* Forgets every leaf we hold without writing it to the leaf map, for when the
+ * map is about to get all of them some other way */
+static inline void utreexo_leaf_cache_drop(struct utreexo_leaf_cache *cache);
+
+/* Deletes leaves, those still in the cache never reach the leaf map */
+static inline void
+utreexo_leaf_cache_delete_many(struct utreexo_leaf_cache *cache,
+                               utreexo_leaf_map *map,
+                               const utreexo_leaf_hash *leaves, size_t n);
+
+#endif // UTREEXO_LEAF_CACHE_H
@@ -0,0 +1,319 @@
+#ifndef UTREEXO_LEAF_CACHE_IMPL_H
+#define UTREEXO_LEAF_CACHE_IMPL_H
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "forest_node.h"
+#include "leaf_cache.h"
+#include "leaf_map_impl.h"
+
+static inline size_t
+utreexo_leaf_cache_home(const struct utreexo_leaf_cache *cache,
+                        const utreexo_leaf_hash *leaf) {
+  uint64_t key;
+  memcpy(&key, leaf->hash, sizeof(key));
+  return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) &
+         (cache->table_size - 1);
+}
+
+/* Where this leaf is, or the empty slot where it would go. Only for whoever
+ * changes the cache, readers use utreexo_leaf_cache_lookup */
+static inline size_t
+utreexo_leaf_cache_find(const struct utreexo_leaf_cache *cache,
+                        const utreexo_leaf_hash *leaf) {
+  size_t slot = utreexo_leaf_cache_home(cache, leaf);
+  for (;; slot = (slot + 1) & (cache->table_size - 1)) {
+    const struct utreexo_leaf_cache_entry *entry = &cache->table[slot];
+    if (entry->node == NULL ||
+        memcmp(entry->hash.hash, leaf->hash, 32) == 0)
+      return slot;
+  }
+}
+
+/* The node for this leaf, or NULL if we don't have it. Unlike
+ * utreexo_leaf_cache_find, this is safe while someone changes the cache */
+static inline utreexo_forest_node *
+utreexo_leaf_cache_lookup(const struct utreexo_leaf_cache *cache,
+                          const utreexo_leaf_hash *leaf) {
+  const size_t mask = cache->table_size - 1;
+  for (;;) {
+    const uint64_t version =
+        __atomic_load_n(&cache->version, __ATOMIC_ACQUIRE);
+    if (version & 1) {
+      sched_yield();
+      continue;
+    }
+
+    utreexo_forest_node *node = NULL;
+    size_t slot = utreexo_leaf_cache_home(cache, leaf);
+    for (size_t probes = 0; probes < cache->table_size;
+         ++probes, slot = (slot + 1) & mask) {
+      const struct utreexo_leaf_cache_entry *entry = &cache->table[slot];
+      node = __atomic_load_n(&entry->node, __ATOMIC_RELAXED);
+      if (node == NULL || memcmp(entry->hash.hash, leaf->hash, 32) == 0)
+        break;
+      node = NULL;
+    }
+
+    // Nothing we read before this may be read after the version
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&cache->version, __ATOMIC_RELAXED) == version)
+      return node;
+  }
+}
+
+/* Brackets every change to the table, see utreexo_leaf_cache.version */
+static inline void
+utreexo_leaf_cache_write_begin(struct utreexo_leaf_cache *cache) {
+  __atomic_store_n(&cache->version, cache->version + 1, __ATOMIC_RELAXED);
+  // Nothing we write after this may be seen before the odd version
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+utreexo_leaf_cache_write_end(struct utreexo_leaf_cache *cache) {
+  __atomic_store_n(&cache->version, cache->version + 1, __ATOMIC_RELEASE);
+}
+
+/* Empties a slot, moving back the entries after it so lookups never stop at a
+ * hole before reaching them */
+static inline void utreexo_leaf_cache_remove(struct utreexo_leaf_cache *cache,
+                                             size_t hole) {
+  const size_t mask = cache->table_size - 1;
+  for (size_t slot = (hole + 1) & mask; cache->table[slot].node != NULL;
+       slot = (slot + 1) & mask) {
+    const size_t home =
+        utreexo_leaf_cache_home(cache, &cache->table[slot].hash);
+    // Only entries whose home isn't between the hole and them may move
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      cache->table[hole] = cache->table[slot];
+      hole = slot;
+    }
+  }
+  cache->table[hole].node = NULL;
+}
+
+static inline int utreexo_leaf_cache_new(struct utreexo_leaf_cache **pcache,
+                                         size_t size) {
+  *pcache = NULL;
+  if (size == 0)
+    return 0;
+
+  size_t table_size = 1;
+  while (table_size < 2 * size)
+    table_size <<= 1;
+
+  struct utreexo_leaf_cache *cache = calloc(1, sizeof(*cache));
+  if (cache == NULL)
+    return -4;
+  cache->table = calloc(table_size, sizeof(struct utreexo_leaf_cache_entry));
+  cache->queue = malloc(size * sizeof(struct utreexo_leaf_cache_queued));
+  if (cache->table == NULL || cache->queue == NULL) {
+    free(cache->table);
+    free(cache->queue);
+    free(cache);
+    return -4;
+  }
+  cache->table_size = table_size;
+  cache->size = size;
+
+  *pcache = cache;
+  return 0;
+}
+
+static inline void utreexo_leaf_cache_free(struct utreexo_leaf_cache *cache,
+                                           utreexo_leaf_map *map) {
+  if (cache == NULL)
+    return;
+
+  utreexo_forest_node **nodes =
+      malloc((cache->queued + 1) * sizeof(utreexo_forest_node *));
+  utreexo_leaf_hash *leaves =
+      malloc((cache->queued + 1) * sizeof(utreexo_leaf_hash));
+  if (nodes == NULL || leaves == NULL) {
+    perror("malloc");
+    abort();
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i < cache->table_size; ++i) {
+    if (cache->table[i].node == NULL)
+      continue;
+    nodes[n] = cache->table[i].node;
+    leaves[n++] = cache->table[i].hash;
+  }
+  utreexo_leaf_map_set_many(map, nodes, leaves, n);
+
+  free(leaves);
+  free(nodes);
+  free(cache->queue);
+  free(cache->table);
+  free(cache);
+}
+
+static inline void utreexo_leaf_cache_drop(struct utreexo_leaf_cache *cache) {
+  if (cache == NULL)
+    return;
+
+  utreexo_leaf_cache_write_begin(cache);
+  memset(cache->table, 0x00,
+         cache->table_size * sizeof(struct utreexo_leaf_cache_entry));
+  utreexo_leaf_cache_write_end(cache);
+  cache->head = 0;
+  cache->queued = 0;
+}
+
+static inline void utreexo_leaf_cache_get_many(struct utreexo_leaf_cache *cache,
+                                               utreexo_leaf_map *map,
+                                               utreexo_forest_node **nodes,
+                                               const utreexo_leaf_hash *leaves,
+                                               size_t n) {
+  if (cache == NULL) {
+    utreexo_leaf_map_get_many(map, nodes, leaves, n);
+    return;
+  }
+
+  // Misses are gathered, so the leaf map gets them in a single batch
+  size_t *missed = malloc((n + 1) * sizeof(size_t));
+  utreexo_leaf_hash *missed_leaves =
+      malloc((n + 1) * sizeof(utreexo_leaf_hash));
+  utreexo_forest_node **missed_nodes =
+      malloc((n + 1) * sizeof(utreexo_forest_node *));
+  if (missed == NULL || missed_leaves == NULL || missed_nodes == NULL) {
+    perror("malloc");
+    abort();
+  }
+
+  size_t n_missed = 0;
+  for (size_t i = 0; i < n; ++i) {
+    nodes[i] = utreexo_leaf_cache_lookup(cache, &leaves[i]);
+    if (nodes[i] != NULL)
+      continue;
+    missed[n_missed] = i;
+    missed_leaves[n_missed++] = leaves[i];
+  }
+
+  __atomic_fetch_add(&cache->stats.hits, n - n_missed, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&cache->stats.misses, n_missed, __ATOMIC_RELAXED);
+
+  if (n_missed != 0) {
+    utreexo_leaf_map_get_many(map, missed_nodes, missed_leaves, n_missed);
+    for (size_t i = 0; i < n_missed; ++i)
+      nodes[missed[i]] = missed_nodes[i];
+  }
+
+  free(missed_nodes);
+  free(missed_leaves);
+  free(missed);
+}
+
+static inline void utreexo_leaf_cache_get(struct utreexo_leaf_cache *cache,
+                                          utreexo_leaf_map *map,
+                                          utreexo_forest_node **node,
+                                          utreexo_leaf_hash leaf) {
+  if (cache != NULL) {
+    *node = utreexo_leaf_cache_lookup(cache, &leaf);
+    if (*node != NULL) {
+      __atomic_fetch_add(&cache->stats.hits, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    __atomic_fetch_add(&cache->stats.misses, 1, __ATOMIC_RELAXED);
+  }
+  utreexo_leaf_map_get(map, node, leaf);
+}
+
+static inline void utreexo_leaf_cache_set_many(struct utreexo_leaf_cache *cache,
+                                               utreexo_leaf_map *map,
+                                               utreexo_forest_node **nodes,
+                                               const utreexo_leaf_hash *leaves,
+                                               size_t n) {
+  if (cache == NULL) {
+    utreexo_leaf_map_set_many(map, nodes, leaves, n);
+    return;
+  }
+
+  // Each new leaf pushes out at most one old leaf
+  utreexo_forest_node **evicted =
+      malloc((n + 1) * sizeof(utreexo_forest_node *));
+  utreexo_leaf_hash *evicted_leaves =
+      malloc((n + 1) * sizeof(utreexo_leaf_hash));
+  if (evicted == NULL || evicted_leaves == NULL) {
+    perror("malloc");
+    abort();
+  }
+
+  size_t n_evicted = 0;
+  utreexo_leaf_cache_write_begin(cache);
+  for (size_t i = 0; i < n; ++i) {
+    if (cache->queued == cache->size) {
+      const struct utreexo_leaf_cache_queued *oldest =
+          &cache->queue[cache->head];
+      const size_t slot = utreexo_leaf_cache_find(cache, &oldest->hash);
+
+      // It may have been spent or added again since it was queued
+      if (cache->table[slot].node != NULL &&
+          cache->table[slot].seq == oldest->seq) {
+        evicted[n_evicted] = cache->table[slot].node;
+        evicted_leaves[n_evicted++] = oldest->hash;
+        utreexo_leaf_cache_remove(cache, slot);
+      }
+      cache->head = (cache->head + 1) % cache->size;
+      --cache->queued;
+    }
+
+    const uint64_t seq = cache->seq++;
+    const size_t slot = utreexo_leaf_cache_find(cache, &leaves[i]);
+    cache->table[slot].hash = leaves[i];
+    cache->table[slot].seq = seq;
+    cache->table[slot].node = nodes[i];
+
+    const size_t tail = (cache->head + cache->queued++) % cache->size;
+    cache->queue[tail] =
+        (struct utreexo_leaf_cache_queued){.hash = leaves[i], .seq = seq};
+  }
+  utreexo_leaf_cache_write_end(cache);
+
+  cache->stats.evicted += n_evicted;
+  utreexo_leaf_map_set_many(map, evicted, evicted_leaves, n_evicted);
+
+  free(evicted_leaves);
+  free(evicted);
+}
+
+static inline void
+utreexo_leaf_cache_delete_many(struct utreexo_leaf_cache *cache,
+                               utreexo_leaf_map *map,
+                               const utreexo_leaf_hash *leaves, size_t n) {
+  if (cache == NULL) {
+    utreexo_leaf_map_delete_many(map, leaves, n);
+    return;
+  }
+
+  utreexo_leaf_hash *missed = malloc((n + 1) * sizeof(utreexo_leaf_hash));
+  if (missed == NULL) {
+    perror("malloc");
+    abort();
+  }
+
+  // Their queue entries stay until they are the oldest, and are skipped then
+  size_t n_missed = 0;
+  utreexo_leaf_cache_write_begin(cache);
+  for (size_t i = 0; i < n; ++i) {
+    const size_t slot = utreexo_leaf_cache_find(cache, &leaves[i]);
+    if (cache->table[slot].node != NULL)
+      utreexo_leaf_cache_remove(cache, slot);
+    else
+      missed[n_missed++] = leaves[i];
+  }
+  utreexo_leaf_cache_write_end(cache);
+
+  cache->stats.elided += n - n_missed;
+  utreexo_leaf_map_delete_many(map, missed, n_missed);
+  free(missed);
+}
+
+#endif // UTREEXO_LEAF_CACHE_IMPL_H
@@ -0,0 +1,104 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * An approximate-membership filter over every leaf in the leaf map. Most
+ * lookups for a leaf that isn't there walk the map until they find an empty
+ * slot, and that's at least one read from a (probably cold) file. The filter
+ * answers "definitely not there" for almost all of them, touching a single
+ * cache line and no I/O.
+ *
+ * Leaves come and go all the time, so a static filter (xor, ribbon) would need
+ * rebuilding after every block. This is a cuckoo filter instead, that can
+ * delete just as easily as it inserts. It's blocked: both buckets a leaf may
+ * live in are inside the same 64-byte block, so a lookup is one cache line.
+ * Blocks hold 8 buckets of 4 fingerprints each.
+ *
+ * The filter lives in its own file, mapped into memory, next to the leaf map
+ * and with the same salt, so it's only rebuilt when it doesn't match the map.
+ * If a block ever fills up we can't insert anymore without losing a
+ * fingerprint, so the filter marks itself saturated and stops answering
+ * until it's rebuilt with the map, the next time it's opened.
+ */
+#ifndef UTREEXO_LEAF_FILTER_H
+#define UTREEXO_LEAF_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Hexadecimal for LEAFFILT, used to tell whether a file is a leaf filter */
+#define UTREEXO_LEAF_FILTER_MAGIC 0x544c49464641454cULL
+/* Blocks start after this many bytes, so they are page-aligned */
+#define UTREEXO_LEAF_FILTER_HEADER_SIZE 4096
+/* Buckets in a block, and fingerprints in a bucket */
+#define UTREEXO_LEAF_FILTER_BUCKETS 8
+#define UTREEXO_LEAF_FILTER_SLOTS 4
+/* How many fingerprints we move around before giving up on an insert */
+#define UTREEXO_LEAF_FILTER_MAX_KICKS 32
+
+/* Persisted at the beginning of the file */
+struct utreexo_leaf_filter_header {
+  uint64_t magic;
+  /* How many blocks we have, always a power of two */
+  uint64_t n_blocks;
+  /* The salt of the leaf map this filter was built for */
+  uint64_t salt;
+  /* Set if some fingerprint didn't fit, we can't be trusted anymore */
+  uint64_t saturated;
+  /* The map's generation when we were last closed with it, see
+   * utreexo_leaf_map_header.generation. A new filter starts at zero, which
+   * only matches a map that was never changed */
+  uint64_t generation;
+};
+
+/* One cache line worth of fingerprints, zero means an empty slot */
+struct utreexo_leaf_filter_block {
+  uint16_t buckets[UTREEXO_LEAF_FILTER_BUCKETS][UTREEXO_LEAF_FILTER_SLOTS];
+} __attribute__((aligned(64)));
+
+struct utreexo_leaf_filter {
+  int fd;
+  struct utreexo_leaf_filter_header *header;
+  struct utreexo_leaf_filter_block *blocks;
+  size_t size;
+  /* Lookups we answered without going to the leaf map */
+  uint64_t negatives;
+};
+
+/* Opens the filter in filename, creating it if needed. A new filter is sized
+ * for n_leaves leaves, an existing one keeps its size. If the file doesn't
+ * hold a usable filter for a leaf map with this salt and generation, it's
+ * emptied and we return 1, so the caller can fill it again. Otherwise returns
+ * 0 */
+static inline int utreexo_leaf_filter_open(struct utreexo_leaf_filter **filter,
+                                           const char *filename,
+                                           uint64_t n_leaves, uint64_t salt,
+                                           uint64_t generation);
+
+static inline void
+utreexo_leaf_filter_close(struct utreexo_leaf_filter *filter);
+
+/* Records that we hold every leaf of the map at this generation */
+static inline void
+utreexo_leaf_filter_set_generation(struct utreexo_leaf_filter *filter,
+                                   uint64_t generation);
+
+/* Returns 0 if the leaf with this key is definitely not in the map, 1 if it
+ * may be. key should be a salted hash of the leaf. Many threads may call this
+ * at once, even while someone is inserting or removing */
+static inline int
+utreexo_leaf_filter_contains(struct utreexo_leaf_filter *filter, uint64_t key);
+
+/* Remembers a leaf that was added to the map */
+static inline void
+utreexo_leaf_filter_insert(struct utreexo_leaf_filter *filter, uint64_t key);
+
+/* Forgets every leaf, for when the map is being filled again from scratch */
+static inline void
+utreexo_leaf_filter_clear(struct utreexo_leaf_filter *filter);
+
+/* Forgets a leaf that was deleted from the map. Only call this for leaves that
+ * were actually there, otherwise we may forget some other leaf */
+static inline void
+utreexo_leaf_filter_remove(struct utreexo_leaf_filter *filter, uint64_t key);
+
+#endif // UTREEXO_LEAF_FILTER_H
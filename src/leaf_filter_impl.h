@@ -0,0 +1,249 @@
+#ifndef UTREEXO_LEAF_FILTER_IMPL_H
+#define UTREEXO_LEAF_FILTER_IMPL_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "leaf_filter.h"
+
+/* Which block a key goes to, the top half of the key picks it */
+static inline struct utreexo_leaf_filter_block *
+utreexo_leaf_filter_block(const struct utreexo_leaf_filter *filter,
+                          uint64_t key) {
+  return &filter->blocks[(key >> 32) & (filter->header->n_blocks - 1)];
+}
+
+/* The fingerprint we keep for a key, never zero since that's an empty slot */
+static inline uint16_t utreexo_leaf_filter_fingerprint(uint64_t key) {
+  const uint16_t fp = (uint16_t)key;
+  return fp == 0 ? 1 : fp;
+}
+
+/* The other bucket a fingerprint may live in. This only depends on where it
+ * is now and the fingerprint itself, so we can move fingerprints without
+ * knowing their keys. It's never the same bucket */
+static inline unsigned int utreexo_leaf_filter_alt(unsigned int bucket,
+                                                   uint16_t fp) {
+  return bucket ^ (1 + fp % (UTREEXO_LEAF_FILTER_BUCKETS - 1));
+}
+
+/* Puts fp in an empty slot of bucket, returns 0 if there was none */
+static inline int
+utreexo_leaf_filter_put(struct utreexo_leaf_filter_block *block,
+                        unsigned int bucket, uint16_t fp) {
+  for (unsigned int s = 0; s < UTREEXO_LEAF_FILTER_SLOTS; ++s) {
+    if (block->buckets[bucket][s] == 0) {
+      __atomic_store_n(&block->buckets[bucket][s], fp, __ATOMIC_RELEASE);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static inline int utreexo_leaf_filter_open(struct utreexo_leaf_filter **pfilter,
+                                           const char *filename,
+                                           uint64_t n_leaves, uint64_t salt,
+                                           uint64_t generation) {
+  int fd = open(filename, O_CREAT | O_RDWR, 0666);
+  if (fd == -1) {
+    perror("open");
+    abort();
+  }
+
+  int fresh = 0;
+  struct utreexo_leaf_filter_header header = {0};
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != UTREEXO_LEAF_FILTER_MAGIC || header.salt != salt ||
+      header.generation != generation || header.saturated) {
+    // Half full blocks on average, so they very rarely fill up
+    const uint64_t per_block =
+        UTREEXO_LEAF_FILTER_BUCKETS * UTREEXO_LEAF_FILTER_SLOTS / 2;
+    uint64_t n_blocks = 1;
+    // A saturated filter was too small for this map, so we grow it
+    if (header.magic == UTREEXO_LEAF_FILTER_MAGIC && header.n_blocks != 0)
+      n_blocks = header.saturated ? 2 * header.n_blocks : header.n_blocks;
+
+    header = (struct utreexo_leaf_filter_header){
+        .magic = UTREEXO_LEAF_FILTER_MAGIC,
+        .n_blocks = n_blocks,
+        .salt = salt,
+    };
+    while (header.n_blocks * per_block < n_leaves)
+      header.n_blocks <<= 1;
+
+    // Truncating first throws away whatever was there
+    const off_t size =
+        UTREEXO_LEAF_FILTER_HEADER_SIZE +
+        header.n_blocks * sizeof(struct utreexo_leaf_filter_block);
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0 ||
+        pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+      perror("ftruncate");
+      abort();
+    }
+    fresh = 1;
+  }
+
+  struct utreexo_leaf_filter *filter = malloc(sizeof(*filter));
+  if (filter == NULL) {
+    perror("malloc");
+    abort();
+  }
+  filter->size = UTREEXO_LEAF_FILTER_HEADER_SIZE +
+                 header.n_blocks * sizeof(struct utreexo_leaf_filter_block);
+  char *data =
+      mmap(NULL, filter->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    abort();
+  }
+
+  filter->fd = fd;
+  filter->header = (struct utreexo_leaf_filter_header *)data;
+  filter->blocks = (struct utreexo_leaf_filter_block *)(
+      data + UTREEXO_LEAF_FILTER_HEADER_SIZE);
+  filter->negatives = 0;
+
+  *pfilter = filter;
+  return fresh;
+}
+
+static inline void
+utreexo_leaf_filter_close(struct utreexo_leaf_filter *filter) {
+  if (filter == NULL)
+    return;
+
+  munmap(filter->header, filter->size);
+  close(filter->fd);
+  free(filter);
+}
+
+static inline void
+utreexo_leaf_filter_set_generation(struct utreexo_leaf_filter *filter,
+                                   uint64_t generation) {
+  filter->header->generation = generation;
+}
+
+static inline int
+utreexo_leaf_filter_contains(struct utreexo_leaf_filter *filter,
+                             uint64_t key) {
+  if (__atomic_load_n(&filter->header->saturated, __ATOMIC_RELAXED))
+    return 1;
+
+  const struct utreexo_leaf_filter_block *block =
+      utreexo_leaf_filter_block(filter, key);
+  const uint16_t fp = utreexo_leaf_filter_fingerprint(key);
+  const unsigned int b1 = (key >> 16) % UTREEXO_LEAF_FILTER_BUCKETS;
+  const unsigned int b2 = utreexo_leaf_filter_alt(b1, fp);
+
+  for (unsigned int s = 0; s < UTREEXO_LEAF_FILTER_SLOTS; ++s) {
+    if (__atomic_load_n(&block->buckets[b1][s], __ATOMIC_ACQUIRE) == fp ||
+        __atomic_load_n(&block->buckets[b2][s], __ATOMIC_ACQUIRE) == fp)
+      return 1;
+  }
+
+  __atomic_fetch_add(&filter->negatives, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static inline void
+utreexo_leaf_filter_insert(struct utreexo_leaf_filter *filter, uint64_t key) {
+  if (filter->header->saturated)
+    return;
+
+  struct utreexo_leaf_filter_block *block =
+      utreexo_leaf_filter_block(filter, key);
+  const uint16_t fp = utreexo_leaf_filter_fingerprint(key);
+  const unsigned int b1 = (key >> 16) % UTREEXO_LEAF_FILTER_BUCKETS;
+  const unsigned int b2 = utreexo_leaf_filter_alt(b1, fp);
+
+  if (utreexo_leaf_filter_put(block, b1, fp) ||
+      utreexo_leaf_filter_put(block, b2, fp))
+    return;
+
+  // Both buckets are full. Look for a chain of fingerprints, each one moving
+  // to its other bucket, that ends at an empty slot. Nothing is touched until
+  // we find one, and then the chain is applied from its end, copying each
+  // fingerprint before its old slot is overwritten. So concurrent lookups
+  // never miss a fingerprint that is being moved.
+  struct {
+    uint8_t bucket;
+    uint8_t slot;
+  } path[UTREEXO_LEAF_FILTER_MAX_KICKS];
+  size_t len = 0;
+  unsigned int bucket = (key >> 20) & 1 ? b2 : b1;
+  uint32_t rnd = (uint32_t)(key >> 24) | 1;
+
+  for (size_t kicks = 0; kicks < UTREEXO_LEAF_FILTER_MAX_KICKS; ++kicks) {
+    // xorshift32, we only need to avoid walking the same cycle forever
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 17;
+    rnd ^= rnd << 5;
+    const uint8_t slot = rnd % UTREEXO_LEAF_FILTER_SLOTS;
+
+    // Chains can't go through the same slot twice, cut the loop out
+    for (size_t j = 0; j < len; ++j) {
+      if (path[j].bucket == bucket && path[j].slot == slot) {
+        len = j;
+        break;
+      }
+    }
+    path[len].bucket = bucket;
+    path[len++].slot = slot;
+
+    const uint16_t victim = block->buckets[bucket][slot];
+    const unsigned int next = utreexo_leaf_filter_alt(bucket, victim);
+    for (unsigned int s = 0; s < UTREEXO_LEAF_FILTER_SLOTS; ++s) {
+      if (block->buckets[next][s] != 0)
+        continue;
+
+      uint16_t *dest = &block->buckets[next][s];
+      while (len > 0) {
+        --len;
+        uint16_t *src = &block->buckets[path[len].bucket][path[len].slot];
+        __atomic_store_n(dest, *src, __ATOMIC_RELEASE);
+        dest = src;
+      }
+      __atomic_store_n(dest, fp, __ATOMIC_RELEASE);
+      return;
+    }
+    bucket = next;
+  }
+
+  // This block is full, the filter would start lying if we went on
+  __atomic_store_n(&filter->header->saturated, 1, __ATOMIC_RELAXED);
+}
+
+static inline void
+utreexo_leaf_filter_remove(struct utreexo_leaf_filter *filter, uint64_t key) {
+  if (filter->header->saturated)
+    return;
+
+  struct utreexo_leaf_filter_block *block =
+      utreexo_leaf_filter_block(filter, key);
+  const uint16_t fp = utreexo_leaf_filter_fingerprint(key);
+  const unsigned int b1 = (key >> 16) % UTREEXO_LEAF_FILTER_BUCKETS;
+  const unsigned int buckets[2] = {b1, utreexo_leaf_filter_alt(b1, fp)};
+
+  for (size_t b = 0; b < 2; ++b) {
+    for (unsigned int s = 0; s < UTREEXO_LEAF_FILTER_SLOTS; ++s) {
+      if (block->buckets[buckets[b]][s] == fp) {
+        __atomic_store_n(&block->buckets[buckets[b]][s], 0, __ATOMIC_RELEASE);
+        return;
+      }
+    }
+  }
+}
+
+static inline void
+utreexo_leaf_filter_clear(struct utreexo_leaf_filter *filter) {
+  memset(filter->blocks, 0x00,
+         filter->header->n_blocks * sizeof(struct utreexo_leaf_filter_block));
+  filter->header->saturated = 0;
+}
+
+#endif // UTREEXO_LEAF_FILTER_IMPL_H
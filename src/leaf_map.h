@@ -11,15 +11,47 @@
  * gets moved around, therefore, it's fair to keep pointers and dereference
  * them to get an (undeleted) node.
  *
- * This is a simple disk-based universal hashing hash map, we allocate a
- * gigantic file at the beginning (64GB) but use a sparse file, where we
- * "pretend" we have 64GB, but the OS doesn't allocate that until we actually
- * use the space. This file starts with zero bytes and grows as we go.
+ * This is a simple disk-based hash map with linear probing. The file starts
+ * with a small header, followed by a table of n_slots pointers. We use a
+ * sparse file, so the table can be sized for the whole UTXO set upfront, and
+ * the OS won't allocate any space until we actually write to a slot.
+ *
+ * Slots are chosen by the leaf hash itself, mixed with a random salt that is
+ * created with the map and kept in its header.
  */
 #ifndef LEAF_MAP_H
 #define LEAF_MAP_H
 
+#include <stdint.h>
+
+#include "config.h"
 #include "forest_node.h"
+#include "leaf_filter.h"
+#include "uring.h"
+
+/* Hexadecimal for LEAFMAP, used to tell whether a file is a leaf map */
+#define UTREEXO_LEAF_MAP_MAGIC 0x50414d4641454c
+/* Slots start after this many bytes, so they are page-aligned */
+#define UTREEXO_LEAF_MAP_HEADER_SIZE 4096
+/* The most slots a map may have, so every slot's offset fits in an off_t */
+#define UTREEXO_LEAF_MAP_MAX_SLOTS (1ULL << 59)
+
+/* Persisted at the beginning of the file */
+struct utreexo_leaf_map_header {
+  uint64_t magic;
+  /* How many slots we have, always a power of two */
+  uint64_t n_slots;
+  /* Mixed into every hash, see utreexo_leaf_map_mix */
+  uint64_t salt;
+  /* How many files this map is split into, see sharded_leaf_map.h */
+  uint64_t n_shards;
+  /* Bumped the first time the map changes after being opened, a leaf filter
+   * that remembers another generation may be missing leaves */
+  uint64_t generation;
+};
+
+/* How many slots utreexo_leaf_map_load writes at once, 1MB worth of them */
+#define UTREEXO_LEAF_MAP_LOAD_WINDOW (1 << 17)
 
 /* Represents the offset of a leaf inside the file */
 typedef unsigned long leaf_offset;
@@ -31,16 +63,39 @@ typedef leaf_offset (*hashfp)(unsigned char *key);
 typedef struct {
   int fd;
   hashfp hash;
+  uint64_t n_slots;
+  uint64_t salt;
+  /* Our generation, see utreexo_leaf_map_header.generation */
+  uint64_t generation;
+  /* Set once generation was bumped */
+  char touched;
+  /* Answers most lookups for leaves we don't have, NULL if there's none. See
+   * leaf_filter.h */
+  struct utreexo_leaf_filter *filter;
+#ifdef USE_IO_URING
+  /* Used for batched operations, NULL if io_uring isn't available */
+  struct utreexo_uring *ring;
+  /* Set while a batch is using ring, and for good once the kernel refused
+   * it. Lookups may run on many threads at once, batches that find the ring
+   * busy use blocking I/O instead */
+  char ring_busy;
+#endif
 } utreexo_leaf_map;
 
 /* Creates a new leaf_map. This function doesn't allocate any memory, since
  * utreexo_leaf_map isn't particularly big. Filename is the file we'll store
- * stuff in and flags are the flags for that file on our FS
+ * stuff in and flags are the flags for that file on our FS. n_slots is how
+ * many slots a new map should have (rounded up to a power of two), if the map
+ * already exists we use whatever is in its header. Zero means LEAF_MAP_SLOTS.
+ * Returns 0 on success, or -1 if n_slots is over UTREEXO_LEAF_MAP_MAX_SLOTS,
+ * or the file holds something else. Maps from before we had a header are
+ * refused, rather than written over: they must be removed, and rebuilt from
+ * the forest (see leaf_map_rebuild.h).
  */
-static inline void utreexo_leaf_map_new(utreexo_leaf_map *map,
+static inline int utreexo_leaf_map_new(utreexo_leaf_map *map,
                                         const char *filename,
                                         const unsigned int flags,
-                                        const hashfp hash);
+                                        const hashfp hash, uint64_t n_slots);
 
 /* Gets a node's reference from the map. You should pass a pointer to a pointer
  * to a utreexo_forest_node. That's because you'll end-up with a
@@ -51,10 +106,64 @@ static inline void utreexo_leaf_map_get(utreexo_leaf_map *map,
                                         utreexo_forest_node **node,
                                         utreexo_leaf_hash leaf);
 
-/* Sets a key to a given pointer */
+/* Sets a key to a given pointer, replacing it if the key is already there.
+ * New keys take the first deleted slot on their way, so a map that keeps
+ * adding and deleting leaves never fills up with tombstones */
 static inline void utreexo_leaf_map_set(utreexo_leaf_map *map,
                                         utreexo_forest_node *node,
                                         utreexo_leaf_hash hash);
+/* Gets many nodes at once. This is the same as calling utreexo_leaf_map_get
+ * for each leaf, but leaves are hashed upfront and sorted by slot, so the file
+ * is read front to back, with neighbouring slots coming in a single read. If
+ * io_uring is available, all probes are in flight at the same time instead.
+ * nodes[i] is set to NULL if leaves[i] isn't in the map. Many threads may call
+ * this at once, as long as nobody is writing to the map.
+ */
+static inline void utreexo_leaf_map_get_many(utreexo_leaf_map *map,
+                                             utreexo_forest_node **nodes,
+                                             const utreexo_leaf_hash *leaves,
+                                             size_t n);
+
+/* Sets many keys at once, the batched version of utreexo_leaf_map_set */
+static inline void utreexo_leaf_map_set_many(utreexo_leaf_map *map,
+                                             utreexo_forest_node **nodes,
+                                             const utreexo_leaf_hash *leaves,
+                                             size_t n);
+
+/* Deletes many leaves at once, the batched version of utreexo_leaf_map_delete
+ */
+static inline void
+utreexo_leaf_map_delete_many(utreexo_leaf_map *map,
+                             const utreexo_leaf_hash *leaves, size_t n);
+
+/* A leaf for utreexo_leaf_map_load, and the first slot it may go to */
+struct utreexo_leaf_map_load_entry {
+  uint64_t slot;
+  utreexo_forest_node *node;
+};
+
+/* Throws away every slot in the map, and fills it with the leaves in runs.
+ * Each run must be sorted by slot (see utreexo_leaf_map_slot), and no leaf
+ * may be in more than one. Runs are merged as we go, and since the map starts
+ * empty, we know where each leaf goes without reading anything: the table is
+ * written front to back, a window at a time */
+static inline void
+utreexo_leaf_map_load(utreexo_leaf_map *map,
+                      struct utreexo_leaf_map_load_entry *const *runs,
+                      const size_t *run_lengths, size_t n_runs);
+
+/* Puts a leaf filter in front of the map, kept in filename. A new filter is
+ * sized for n_leaves leaves. If the file doesn't hold a filter for this map,
+ * or the map changed since the filter was last closed with it, the filter is
+ * built from every leaf in the map, so the forest must be loaded already
+ */
+static inline void utreexo_leaf_map_attach_filter(utreexo_leaf_map *map,
+                                                  const char *filename,
+                                                  uint64_t n_leaves);
+
+/* Closes the map's file, and releases any resource held by it */
+static inline void utreexo_leaf_map_close(utreexo_leaf_map *map);
+
 /* Delete a leaf from the map */
 static inline void utreexo_leaf_delete(utreexo_leaf_map *map,
                                        utreexo_node_hash hash);
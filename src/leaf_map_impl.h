@@ -1,69 +1,218 @@
+#ifndef LEAF_MAP_IMPL_H
+#define LEAF_MAP_IMPL_H
+
 #include <assert.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "forest_node.h"
+#include "leaf_filter_impl.h"
 #include "leaf_map.h"
+#include "probes.h"
+#include "uring.h"
+#include "util.h"
+
+/* These are only exposed with _GNU_SOURCE, but they're part of Linux's ABI */
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
 
 static utreexo_forest_node *utreexo_thumbstone =
     (utreexo_forest_node *)(1 << sizeof(void *));
 
-static const leaf_offset utreexo_leaf_map_get_pos(unsigned int hash) {
-  return hash * sizeof(void *);
+/* Where a slot lives inside the file, slots come right after the header */
+static inline leaf_offset utreexo_leaf_map_get_pos(uint64_t slot) {
+  return UTREEXO_LEAF_MAP_HEADER_SIZE + slot * sizeof(void *);
 }
 
+/* Leaves are sha256 hashes, so they're already uniformly distributed and we
+ * can just use their first 8 bytes. */
 static inline leaf_offset
 utreexo_leaf_map_default_hash(unsigned char value[36]) {
-  unsigned long hash = 5381;
-  int c;
+  uint64_t hash;
+  memcpy(&hash, value, sizeof(uint64_t));
+  return hash;
+}
 
-  for (size_t i = 0; i < 36; ++i)
-    hash = ((hash << 5) + hash) + value[i];
+/* Mixes the salt into a hash. Without this, someone could grind leaves that
+ * all land on the same slots, and turn our lookups into linear scans. This is
+ * the splitmix64 finalizer, so it's cheap and every bit of the input affects
+ * every bit of the output. */
+static inline uint64_t utreexo_leaf_map_mix(uint64_t hash, uint64_t salt) {
+  hash ^= salt;
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+  return hash ^ (hash >> 31);
+}
 
-  return hash & 0xffffffff;
+/* The first slot we should look at for a given leaf */
+static inline uint64_t utreexo_leaf_map_slot(const utreexo_leaf_map *map,
+                                             const utreexo_leaf_hash *leaf) {
+  unsigned char key[36] = {0};
+  memmove(key, leaf->hash, 32);
+
+  return utreexo_leaf_map_mix(map->hash(key), map->salt) & (map->n_slots - 1);
+}
+
+/* What the filter knows a leaf by. We use the next 8 bytes of the hash, so
+ * it's independent from where the leaf goes in the table */
+static inline uint64_t
+utreexo_leaf_map_filter_key(const utreexo_leaf_map *map,
+                            const utreexo_leaf_hash *leaf) {
+  uint64_t key;
+  memcpy(&key, leaf->hash + 8, sizeof(key));
+  return utreexo_leaf_map_mix(key, map->salt);
 }
 
-static inline void utreexo_leaf_map_new(utreexo_leaf_map *map,
-                                        const char *filename,
-                                        const unsigned int flags, hashfp hash) {
+/* Rounds n_slots up to a power of two, so we can use a mask to wrap around.
+ * Returns 0, or -1 if that's more than UTREEXO_LEAF_MAP_MAX_SLOTS */
+static inline int utreexo_leaf_map_round_slots(uint64_t n_slots,
+                                               uint64_t *rounded) {
+  if (n_slots == 0)
+    n_slots = LEAF_MAP_SLOTS;
+  if (n_slots > UTREEXO_LEAF_MAP_MAX_SLOTS)
+    return -1;
+
+  *rounded = 1;
+  while (*rounded < n_slots)
+    *rounded <<= 1;
+  return 0;
+}
+
+static inline int utreexo_leaf_map_new(utreexo_leaf_map *map,
+                                       const char *filename,
+                                       const unsigned int flags, hashfp hash,
+                                       uint64_t n_slots) {
   int fd = open(filename, flags, 0666);
   if (fd == -1) {
     perror("open");
     abort();
   }
 
-  lseek(fd, 0xff, SEEK_SET);
-
-  char end = 0;
-  write(fd, &end, sizeof(char));
   if (hash == NULL)
     hash = utreexo_leaf_map_default_hash;
 
+  struct utreexo_leaf_map_header header = {0};
+  struct stat st;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != UTREEXO_LEAF_MAP_MAGIC) {
+    // Maps without a header start with slots, writing one would corrupt them
+    if (fstat(fd, &st) != 0 || st.st_size != 0) {
+      fprintf(stderr,
+              "%s isn't a leaf map we can read, it may be from an older "
+              "version. Remove it and rebuild it from the forest\n",
+              filename);
+      close(fd);
+      return -1;
+    }
+    if ((flags & O_ACCMODE) == O_RDONLY) {
+      close(fd);
+      return -1;
+    }
+
+    debug_print("Creating new leaf map at %s\n", filename);
+    header.magic = UTREEXO_LEAF_MAP_MAGIC;
+    header.n_shards = 1;
+    if (utreexo_leaf_map_round_slots(n_slots, &header.n_slots) != 0) {
+      close(fd);
+      return -1;
+    }
+
+    if (getrandom(&header.salt, sizeof(header.salt), 0) !=
+        sizeof(header.salt)) {
+      perror("getrandom");
+      abort();
+    }
+
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+      perror("pwrite");
+      abort();
+    }
+  } else if (header.n_slots == 0 ||
+             (header.n_slots & (header.n_slots - 1)) != 0 ||
+             header.n_slots > UTREEXO_LEAF_MAP_MAX_SLOTS) {
+    fprintf(stderr, "%s has a damaged header\n", filename);
+    close(fd);
+    return -1;
+  }
+
   *map = (utreexo_leaf_map){
       .fd = fd,
       .hash = hash,
+      .n_slots = header.n_slots,
+      .salt = header.salt,
+      .generation = header.generation,
+      .touched = 0,
+      .filter = NULL,
+#ifdef USE_IO_URING
+      .ring = utreexo_uring_init(UTREEXO_URING_DEPTH),
+#endif
   };
+  return 0;
+}
+
+/* Bumps our generation the first time we change the map, so a filter that
+ * isn't closed with us (we crashed, or it wasn't attached) gets rebuilt */
+static inline void utreexo_leaf_map_touch(utreexo_leaf_map *map) {
+  if (map->touched)
+    return;
+
+  const uint64_t generation = map->generation + 1;
+  if (pwrite(map->fd, &generation, sizeof(generation),
+             offsetof(struct utreexo_leaf_map_header, generation)) !=
+      sizeof(generation)) {
+    perror("pwrite");
+    abort();
+  }
+  map->generation = generation;
+  map->touched = 1;
+}
+
+static inline void utreexo_leaf_map_close(utreexo_leaf_map *map) {
+#ifdef USE_IO_URING
+  if (map->ring != NULL)
+    utreexo_uring_close(map->ring);
+  map->ring = NULL;
+#endif
+  // Every change we made is in the filter, so it matches the map again
+  if (map->filter != NULL)
+    utreexo_leaf_filter_set_generation(map->filter, map->generation);
+  utreexo_leaf_filter_close(map->filter);
+  map->filter = NULL;
+  close(map->fd);
 }
 
 static inline void utreexo_leaf_map_get(utreexo_leaf_map *map,
                                         utreexo_forest_node **node,
                                         utreexo_leaf_hash leaf) {
   utreexo_forest_node *pnode = NULL;
-  unsigned char key[36] = {0};
-
-  memmove(key, leaf.hash, 32);
+  uint64_t slot = utreexo_leaf_map_slot(map, &leaf);
+  leaf_offset position = 0;
 
-  unsigned int hash = map->hash(key);
-  leaf_offset position = utreexo_leaf_map_get_pos(hash);
+  if (map->filter != NULL &&
+      !utreexo_leaf_filter_contains(map->filter,
+                                    utreexo_leaf_map_filter_key(map, &leaf))) {
+    *node = NULL;
+    return;
+  }
 
-  do {
-    position = utreexo_leaf_map_get_pos(hash);
-    ++hash;
+  for (uint64_t probes = 0; probes < map->n_slots; ++probes) {
+    UTREEXO_PROBE2(leaf_map__probe, slot, probes);
+    position = utreexo_leaf_map_get_pos(slot);
+    slot = (slot + 1) & (map->n_slots - 1);
 
-    pread(map->fd, &pnode, sizeof(utreexo_forest_node *), position);
+    // reading past the end of our sparse file means an empty slot
+    if (pread(map->fd, &pnode, sizeof(utreexo_forest_node *), position) !=
+        sizeof(utreexo_forest_node *))
+      pnode = NULL;
 
     // this is a deleted node, keep looking
     if (pnode == utreexo_thumbstone)
@@ -73,54 +222,79 @@ static inline void utreexo_leaf_map_get(utreexo_leaf_map *map,
     if (pnode == NULL)
       break;
     // we found the leaf
-    if (memcmp(pnode->hash.hash, leaf.hash, 32) == 0)
-      break;
-  } while (1);
-  *node = pnode;
+    if (memcmp(pnode->hash.hash, leaf.hash, 32) == 0) {
+      *node = pnode;
+      return;
+    }
+  }
+  *node = NULL;
 }
 
 static inline void utreexo_leaf_map_set(utreexo_leaf_map *map,
                                         utreexo_forest_node *node,
                                         utreexo_leaf_hash leaf) {
   utreexo_forest_node *pnode = NULL;
-  unsigned char key[36] = {0};
-
-  memmove(key, leaf.hash, 32);
-
-  unsigned int hash = map->hash(key);
-  leaf_offset position = 0;
-
-  do {
-    position = utreexo_leaf_map_get_pos(hash);
-    ++hash;
-
-    pread(map->fd, &pnode, sizeof(utreexo_forest_node **), position);
-
+  uint64_t slot = utreexo_leaf_map_slot(map, &leaf);
+  leaf_offset position = 0, tomb = 0;
+  int found = 0;
+
+  utreexo_leaf_map_touch(map);
+  for (uint64_t probes = 0;; ++probes) {
+    if (probes == map->n_slots) {
+      if (tomb != 0)
+        break;
+      fprintf(stderr, "Leaf map is full\n");
+      abort();
+    }
+    UTREEXO_PROBE2(leaf_map__probe, slot, probes);
+    position = utreexo_leaf_map_get_pos(slot);
+    slot = (slot + 1) & (map->n_slots - 1);
+
+    // reading past the end of our sparse file means an empty slot
+    if (pread(map->fd, &pnode, sizeof(utreexo_forest_node *), position) !=
+        sizeof(utreexo_forest_node *))
+      pnode = NULL;
+
+    // We may reuse the first deleted slot, but only once we know this leaf
+    // isn't further down the chain
+    if (pnode == utreexo_thumbstone) {
+      if (tomb == 0)
+        tomb = position;
+      continue;
+    }
     if (pnode == NULL)
       break;
-  } while (1);
-  // this node is already here
-  if (pnode != NULL && pnode != utreexo_thumbstone)
-    return;
+    // this leaf is already here, just point it to the new node
+    if (memcmp(pnode->hash.hash, leaf.hash, 32) == 0) {
+      found = 1;
+      break;
+    }
+  }
+  if (!found && tomb != 0)
+    position = tomb;
 
   pwrite(map->fd, &node, sizeof(utreexo_forest_node *), position);
+  if (!found && map->filter != NULL)
+    utreexo_leaf_filter_insert(map->filter,
+                               utreexo_leaf_map_filter_key(map, &leaf));
 }
 
 static inline void utreexo_leaf_map_delete(utreexo_leaf_map *map,
                                            utreexo_node_hash leaf) {
   utreexo_forest_node *pnode = NULL;
-  unsigned char key[36] = {0};
-
-  memmove(key, leaf.hash, 32);
-
-  unsigned int hash = map->hash(key);
-  leaf_offset position = utreexo_leaf_map_get_pos(hash);
+  uint64_t slot = utreexo_leaf_map_slot(map, &leaf);
+  leaf_offset position = 0;
 
-  do {
-    position = utreexo_leaf_map_get_pos(hash);
-    ++hash;
+  utreexo_leaf_map_touch(map);
+  for (uint64_t probes = 0; probes < map->n_slots; ++probes) {
+    UTREEXO_PROBE2(leaf_map__probe, slot, probes);
+    position = utreexo_leaf_map_get_pos(slot);
+    slot = (slot + 1) & (map->n_slots - 1);
 
-    pread(map->fd, &pnode, sizeof(utreexo_forest_node *), position);
+    // reading past the end of our sparse file means an empty slot
+    if (pread(map->fd, &pnode, sizeof(utreexo_forest_node *), position) !=
+        sizeof(utreexo_forest_node *))
+      pnode = NULL;
 
     if (pnode == utreexo_thumbstone)
       continue;
@@ -130,17 +304,711 @@ static inline void utreexo_leaf_map_delete(utreexo_leaf_map *map,
       break;
 
     // we found the node
-    if (memcmp(pnode->hash.hash, leaf.hash, 32) == 0)
+    if (memcmp(pnode->hash.hash, leaf.hash, 32) == 0) {
+      // We need to mark positions that have been deleted, because otherwise
+      // our open hashing alogritm wouldn't see the colliding elements added
+      // afterwards.
+      pnode = utreexo_thumbstone;
+      pwrite(map->fd, &pnode, sizeof(utreexo_forest_node **), position);
+      if (map->filter != NULL)
+        utreexo_leaf_filter_remove(map->filter,
+                                   utreexo_leaf_map_filter_key(map, &leaf));
+      return;
+    }
+  }
+}
+
+/* One leaf of a batch, batches are processed in slot order so we walk the
+ * file front to back instead of jumping all over it */
+struct utreexo_leaf_map_batch_entry {
+  uint64_t slot;
+  size_t idx;
+};
+
+static inline int utreexo_leaf_map_batch_cmp(const void *a, const void *b) {
+  const struct utreexo_leaf_map_batch_entry *ea = a, *eb = b;
+  if (ea->slot != eb->slot)
+    return ea->slot < eb->slot ? -1 : 1;
+  // keep the batch order for leaves in the same slot
+  return ea->idx < eb->idx ? -1 : ea->idx > eb->idx;
+}
+
+/* Hashes all leaves in a batch, and sorts them by their first slot. The
+ * returned array should be freed by the caller */
+static inline struct utreexo_leaf_map_batch_entry *
+utreexo_leaf_map_batch_sort(const utreexo_leaf_map *map,
+                            const utreexo_leaf_hash *leaves, size_t n) {
+  struct utreexo_leaf_map_batch_entry *entries =
+      malloc(n * sizeof(struct utreexo_leaf_map_batch_entry));
+  if (entries == NULL) {
+    perror("malloc");
+    abort();
+  }
+
+  for (size_t i = 0; i < n; ++i)
+    entries[i] = (struct utreexo_leaf_map_batch_entry){
+        .slot = utreexo_leaf_map_slot(map, &leaves[i]), .idx = i};
+
+  qsort(entries, n, sizeof(struct utreexo_leaf_map_batch_entry),
+        utreexo_leaf_map_batch_cmp);
+  return entries;
+}
+
+/* How many slots we read from the file at once, one page worth of them */
+#define UTREEXO_LEAF_MAP_WINDOW 512
+
+/* A run of consecutive slots, read with a single pread. Since batches are
+ * sorted, most leaves find their slots in the window we already have */
+struct utreexo_leaf_map_window {
+  uint64_t first;
+  uint64_t len;
+  int dirty;
+  utreexo_forest_node *slots[UTREEXO_LEAF_MAP_WINDOW];
+};
+
+static inline void
+utreexo_leaf_map_window_flush(utreexo_leaf_map *map,
+                              struct utreexo_leaf_map_window *w) {
+  if (!w->dirty)
+    return;
+
+  const size_t len = w->len * sizeof(utreexo_forest_node *);
+  if (pwrite(map->fd, w->slots, len, utreexo_leaf_map_get_pos(w->first)) !=
+      (ssize_t)len) {
+    perror("pwrite");
+    abort();
+  }
+  w->dirty = 0;
+}
+
+/* Returns a pointer to a slot inside the window, reading the run of slots
+ * that holds it if needed */
+static inline utreexo_forest_node **
+utreexo_leaf_map_window_slot(utreexo_leaf_map *map,
+                             struct utreexo_leaf_map_window *w,
+                             uint64_t slot) {
+  if (w->len != 0 && slot >= w->first && slot < w->first + w->len)
+    return &w->slots[slot - w->first];
+
+  utreexo_leaf_map_window_flush(map, w);
+
+  w->first = slot & ~(uint64_t)(UTREEXO_LEAF_MAP_WINDOW - 1);
+  w->len = map->n_slots < UTREEXO_LEAF_MAP_WINDOW ? map->n_slots
+                                                  : UTREEXO_LEAF_MAP_WINDOW;
+
+  const size_t len = w->len * sizeof(utreexo_forest_node *);
+  ssize_t n_read =
+      pread(map->fd, w->slots, len, utreexo_leaf_map_get_pos(w->first));
+  if (n_read < 0)
+    n_read = 0;
+  // reading past the end of our sparse file means empty slots
+  memset((char *)w->slots + n_read, 0x00, len - n_read);
+
+  return &w->slots[slot - w->first];
+}
+
+enum utreexo_leaf_map_op {
+  UTREEXO_LEAF_MAP_GET,
+  UTREEXO_LEAF_MAP_SET,
+  UTREEXO_LEAF_MAP_DELETE,
+};
+
+/* Applies op to a whole batch, sweeping the table in slot order. While we
+ * look at one leaf, we prefetch the node a few leaves ahead will compare
+ * against, so the forest page is (hopefully) there when we need it */
+static inline void utreexo_leaf_map_sweep(utreexo_leaf_map *map,
+                                          utreexo_forest_node **nodes,
+                                          const utreexo_leaf_hash *leaves,
+                                          size_t n,
+                                          enum utreexo_leaf_map_op op) {
+  struct utreexo_leaf_map_batch_entry *entries =
+      utreexo_leaf_map_batch_sort(map, leaves, n);
+  struct utreexo_leaf_map_window *w =
+      malloc(sizeof(struct utreexo_leaf_map_window));
+  if (w == NULL) {
+    perror("malloc");
+    abort();
+  }
+  w->first = 0;
+  w->len = 0;
+  w->dirty = 0;
+
+  for (size_t e = 0; e < n; ++e) {
+    const size_t ahead = e + 4;
+    if (ahead < n && entries[ahead].slot >= w->first &&
+        entries[ahead].slot < w->first + w->len) {
+      const utreexo_forest_node *pnext =
+          w->slots[entries[ahead].slot - w->first];
+      if (pnext != NULL && pnext != utreexo_thumbstone)
+        __builtin_prefetch(pnext);
+    }
+
+    const size_t i = entries[e].idx;
+    uint64_t slot = entries[e].slot;
+    uint64_t probes = 0;
+    // The first deleted slot we saw, a new leaf goes there if it isn't
+    // already in the map
+    uint64_t tomb = map->n_slots;
+
+    for (; probes < map->n_slots; ++probes) {
+      UTREEXO_PROBE2(leaf_map__probe, slot, probes);
+      utreexo_forest_node **pslot = utreexo_leaf_map_window_slot(map, w, slot);
+      utreexo_forest_node *pnode = *pslot;
+      const uint64_t here = slot;
+      slot = (slot + 1) & (map->n_slots - 1);
+
+      if (pnode == utreexo_thumbstone) {
+        if (tomb == map->n_slots)
+          tomb = here;
+        continue;
+      }
+      if (pnode == NULL) {
+        if (op == UTREEXO_LEAF_MAP_SET && tomb == map->n_slots)
+          tomb = here;
+        probes = map->n_slots;
+        break;
+      }
+      if (memcmp(pnode->hash.hash, leaves[i].hash, 32) != 0)
+        continue;
+
+      if (op == UTREEXO_LEAF_MAP_GET) {
+        nodes[i] = pnode;
+      } else if (op == UTREEXO_LEAF_MAP_SET) {
+        *pslot = nodes[i];
+        w->dirty = 1;
+      } else {
+        *pslot = utreexo_thumbstone;
+        w->dirty = 1;
+        if (map->filter != NULL)
+          utreexo_leaf_filter_remove(
+              map->filter, utreexo_leaf_map_filter_key(map, &leaves[i]));
+      }
+      break;
+    }
+
+    // We didn't find it
+    if (probes == map->n_slots) {
+      if (op == UTREEXO_LEAF_MAP_SET) {
+        if (tomb == map->n_slots) {
+          fprintf(stderr, "Leaf map is full\n");
+          abort();
+        }
+        *utreexo_leaf_map_window_slot(map, w, tomb) = nodes[i];
+        w->dirty = 1;
+        if (map->filter != NULL)
+          utreexo_leaf_filter_insert(
+              map->filter, utreexo_leaf_map_filter_key(map, &leaves[i]));
+      }
+      if (op == UTREEXO_LEAF_MAP_GET)
+        nodes[i] = NULL;
+    }
+  }
+
+  utreexo_leaf_map_window_flush(map, w);
+  free(w);
+  free(entries);
+}
+
+#ifdef USE_IO_URING
+/* Positions claimed by a batch that haven't been written yet, so two leaves
+ * in the same batch don't end up at the same empty slot */
+struct utreexo_leaf_map_claims {
+  leaf_offset *slots;
+  size_t mask;
+};
+
+/* Returns 1 if position was already claimed, otherwise claims it */
+static inline int
+utreexo_leaf_map_claim(struct utreexo_leaf_map_claims *claims,
+                       leaf_offset position) {
+  size_t i = (position * 0x9e3779b97f4a7c15ULL) >> 32;
+  for (;; ++i) {
+    leaf_offset *slot = &claims->slots[i & claims->mask];
+    if (*slot == position + 1)
+      return 1;
+    if (*slot == 0) {
+      *slot = position + 1;
+      return 0;
+    }
+  }
+}
+
+/* The kernel refused io_uring_enter with something other than EINTR. Waits
+ * for what it already took, since it writes into buffers our caller is
+ * about to free, and leaves ring_busy set so nobody uses the ring again.
+ * in_flight is how many requests were queued and not reaped */
+static inline void utreexo_leaf_map_ring_failed(utreexo_leaf_map *map,
+                                                size_t in_flight) {
+  struct utreexo_uring *ring = map->ring;
+  perror("io_uring_enter");
+  size_t pending = in_flight - ring->to_submit;
+  uint64_t data;
+  int res;
+  while (pending > 0) {
+    if (utreexo_uring_reap(ring, &data, &res))
+      --pending;
+    else
+      sched_yield();
+  }
+}
+
+/* Probes the map for all leaves at once. Every leaf has at most one read in
+ * flight, once it completes we either found what we are looking for or
+ * queue the next slot. If claims isn't NULL, we are looking for slots to
+ * insert into, and nodes tells which leaves were already in the map.
+ * Otherwise we are looking for the leaves themselves.
+ *
+ * Leaves are submitted in the order given by entries, see
+ * utreexo_leaf_map_batch_sort.
+ *
+ * Completions come back out of order, so we first advise the kernel about all
+ * forest pages we'll need to look at, and only then compare the hashes.
+ *
+ * Returns 0 on success, -4 if we are out of memory, and -1 if the ring
+ * failed, see utreexo_leaf_map_ring_failed. Either way callers should do
+ * the whole batch with the sweep instead.
+ */
+static inline int utreexo_leaf_map_probe_many(
+    utreexo_leaf_map *map, utreexo_forest_node **nodes,
+    leaf_offset *positions, const utreexo_leaf_hash *leaves,
+    const struct utreexo_leaf_map_batch_entry *entries, size_t n,
+    struct utreexo_leaf_map_claims *claims) {
+  struct utreexo_uring *ring = map->ring;
+  uint64_t *hashes = malloc(n * sizeof(uint64_t));
+  uint64_t *probes = calloc(n, sizeof(uint64_t));
+  utreexo_forest_node **slots = malloc(n * sizeof(utreexo_forest_node *));
+  size_t *queue = malloc(n * sizeof(size_t));
+  // Where each leaf may go instead of an empty slot, zero if nowhere
+  leaf_offset *tombs = calloc(n, sizeof(leaf_offset));
+  uint64_t done[UTREEXO_URING_DEPTH];
+  int ret = 0;
+  if (hashes == NULL || probes == NULL || slots == NULL || queue == NULL ||
+      tombs == NULL) {
+    ret = -4;
+    goto out;
+  }
+
+  // Submit in slot order, so the device sees mostly ascending offsets
+  for (size_t e = 0; e < n; ++e) {
+    hashes[entries[e].idx] = entries[e].slot;
+    queue[e] = entries[e].idx;
+  }
+
+  // queue is a ring buffer of leaves waiting for their next probe, each leaf
+  // is either there or in flight, so it never holds more than n entries
+  size_t head = 0, queued = n, in_flight = 0, resolved = 0;
+  while (resolved < n) {
+    while (queued > 0 && in_flight < UTREEXO_URING_DEPTH) {
+      const size_t i = queue[head];
+      head = (head + 1) % n;
+      --queued;
+
+      slots[i] = NULL;
+      positions[i] = utreexo_leaf_map_get_pos(hashes[i]);
+      utreexo_uring_prep(ring, IORING_OP_READ, map->fd, &slots[i],
+                         sizeof(utreexo_forest_node *), positions[i], i);
+      ++in_flight;
+    }
+
+    if (utreexo_uring_submit(ring, 1) < 0) {
+      utreexo_leaf_map_ring_failed(map, in_flight);
+      ret = -1;
+      goto out;
+    }
+
+    size_t n_done = 0;
+    uint64_t i;
+    int res;
+    while (n_done < UTREEXO_URING_DEPTH && utreexo_uring_reap(ring, &i, &res)) {
+      --in_flight;
+      // Try a failed read again the way the sweep would
+      if (res < 0)
+        res = pread(map->fd, &slots[i], sizeof(utreexo_forest_node *),
+                    positions[i]);
+      // Reading past the end of our sparse file means an empty slot
+      if (res != sizeof(utreexo_forest_node *))
+        slots[i] = NULL;
+      if (slots[i] != NULL && slots[i] != utreexo_thumbstone)
+        madvise((void *)((uintptr_t)slots[i] & ~(uintptr_t)4095), 4096,
+                MADV_WILLNEED);
+      done[n_done++] = i;
+    }
+
+    for (size_t j = 0; j < n_done; ++j) {
+      i = done[j];
+      utreexo_forest_node *pnode = slots[i];
+      UTREEXO_PROBE2(leaf_map__probe, hashes[i], probes[i]);
+
+      if (claims != NULL) {
+        // Like utreexo_leaf_map_set, new leaves go to the first deleted slot
+        // nobody else in this batch took, once we know they aren't here yet
+        if (pnode == utreexo_thumbstone) {
+          if (tombs[i] == 0 && !utreexo_leaf_map_claim(claims, positions[i]))
+            tombs[i] = positions[i];
+        } else if (pnode != NULL) {
+          if (memcmp(pnode->hash.hash, leaves[i].hash, 32) == 0) {
+            tombs[i] = 0;
+            nodes[i] = pnode;
+            ++resolved;
+            continue;
+          }
+        } else if (tombs[i] != 0 ||
+                   !utreexo_leaf_map_claim(claims, positions[i])) {
+          ++resolved;
+          continue;
+        }
+      } else if (pnode == NULL ||
+                 (pnode != utreexo_thumbstone &&
+                  memcmp(pnode->hash.hash, leaves[i].hash, 32) == 0)) {
+        nodes[i] = pnode;
+        ++resolved;
+        continue;
+      }
+      // Keep looking in the next slot
+      if (++probes[i] == map->n_slots) {
+        if (claims != NULL) {
+          if (tombs[i] != 0) {
+            ++resolved;
+            continue;
+          }
+          fprintf(stderr, "Leaf map is full\n");
+          abort();
+        }
+        nodes[i] = NULL;
+        ++resolved;
+        continue;
+      }
+      hashes[i] = (hashes[i] + 1) & (map->n_slots - 1);
+      queue[(head + queued) % n] = i;
+      ++queued;
+    }
+  }
+
+  if (claims != NULL)
+    for (size_t i = 0; i < n; ++i)
+      if (tombs[i] != 0)
+        positions[i] = tombs[i];
+
+out:
+  free(tombs);
+  free(queue);
+  free(slots);
+  free(probes);
+  free(hashes);
+  return ret;
+}
+
+/* Writes nodes[i] to positions[i] for every leaf, in slot order. Writes the
+ * ring didn't do, because it failed or wrote less than it should, are done
+ * with pwrite instead. Returns -1 if the ring failed, 0 otherwise */
+static inline int utreexo_leaf_map_write_many(
+    utreexo_leaf_map *map, utreexo_forest_node **nodes,
+    const leaf_offset *positions,
+    const struct utreexo_leaf_map_batch_entry *entries, size_t n) {
+  struct utreexo_uring *ring = map->ring;
+  char *written = calloc(n, 1);
+  size_t in_flight = 0, e = 0;
+  int ret = 0;
+  uint64_t i;
+  int res;
+  while (written != NULL && (e < n || in_flight > 0)) {
+    for (; e < n && in_flight < UTREEXO_URING_DEPTH; ++e, ++in_flight)
+      utreexo_uring_prep(ring, IORING_OP_WRITE, map->fd, &nodes[entries[e].idx],
+                         sizeof(utreexo_forest_node *),
+                         positions[entries[e].idx], entries[e].idx);
+    if (utreexo_uring_submit(ring, 1) < 0) {
+      utreexo_leaf_map_ring_failed(map, in_flight);
+      ret = -1;
+      break;
+    }
+    while (utreexo_uring_reap(ring, &i, &res)) {
+      --in_flight;
+      written[i] = res == sizeof(utreexo_forest_node *);
+    }
+  }
+
+  for (size_t j = 0; j < n; ++j) {
+    if (written != NULL && written[j])
+      continue;
+    if (pwrite(map->fd, &nodes[j], sizeof(utreexo_forest_node *),
+               positions[j]) != sizeof(utreexo_forest_node *)) {
+      perror("pwrite");
+      abort();
+    }
+  }
+  free(written);
+  return ret;
+}
+#endif // USE_IO_URING
+
+/* Looks every leaf up in the map itself, without asking the filter */
+static inline void utreexo_leaf_map_lookup_many(utreexo_leaf_map *map,
+                                                utreexo_forest_node **nodes,
+                                                const utreexo_leaf_hash *leaves,
+                                                size_t n) {
+  if (n == 0)
+    return;
+#ifdef USE_IO_URING
+  if (map->ring != NULL && n > 1 &&
+      !__atomic_test_and_set(&map->ring_busy, __ATOMIC_ACQUIRE)) {
+    struct utreexo_leaf_map_batch_entry *entries =
+        utreexo_leaf_map_batch_sort(map, leaves, n);
+    leaf_offset *positions = malloc(n * sizeof(leaf_offset));
+    const int ret =
+        positions == NULL
+            ? -4
+            : utreexo_leaf_map_probe_many(map, nodes, positions, leaves,
+                                          entries, n, NULL);
+    if (ret != -1)
+      __atomic_clear(&map->ring_busy, __ATOMIC_RELEASE);
+    free(positions);
+    free(entries);
+    if (ret == 0)
+      return;
+  }
+#endif
+  utreexo_leaf_map_sweep(map, nodes, leaves, n, UTREEXO_LEAF_MAP_GET);
+}
+
+static inline void utreexo_leaf_map_get_many(utreexo_leaf_map *map,
+                                             utreexo_forest_node **nodes,
+                                             const utreexo_leaf_hash *leaves,
+                                             size_t n) {
+  if (map->filter == NULL) {
+    utreexo_leaf_map_lookup_many(map, nodes, leaves, n);
+    return;
+  }
+
+  // Only leaves the filter isn't sure about go to the map, in a single batch
+  size_t *maybe = malloc((n + 1) * sizeof(size_t));
+  utreexo_leaf_hash *maybe_leaves = calloc(n + 1, sizeof(utreexo_leaf_hash));
+  utreexo_forest_node **maybe_nodes =
+      calloc(n + 1, sizeof(utreexo_forest_node *));
+  if (maybe == NULL || maybe_leaves == NULL || maybe_nodes == NULL) {
+    perror("malloc");
+    abort();
+  }
+
+  size_t n_maybe = 0;
+  for (size_t i = 0; i < n; ++i) {
+    nodes[i] = NULL;
+    if (!utreexo_leaf_filter_contains(
+            map->filter, utreexo_leaf_map_filter_key(map, &leaves[i])))
+      continue;
+    maybe[n_maybe] = i;
+    maybe_leaves[n_maybe++] = leaves[i];
+  }
+
+  utreexo_leaf_map_lookup_many(map, maybe_nodes, maybe_leaves, n_maybe);
+  for (size_t i = 0; i < n_maybe; ++i)
+    nodes[maybe[i]] = maybe_nodes[i];
+
+  free(maybe_nodes);
+  free(maybe_leaves);
+  free(maybe);
+}
+
+static inline void utreexo_leaf_map_set_many(utreexo_leaf_map *map,
+                                             utreexo_forest_node **nodes,
+                                             const utreexo_leaf_hash *leaves,
+                                             size_t n) {
+  if (n == 0)
+    return;
+  utreexo_leaf_map_touch(map);
+#ifdef USE_IO_URING
+  if (map->ring != NULL && n > 1 &&
+      !__atomic_test_and_set(&map->ring_busy, __ATOMIC_ACQUIRE)) {
+    struct utreexo_leaf_map_batch_entry *entries =
+        utreexo_leaf_map_batch_sort(map, leaves, n);
+    leaf_offset *positions = malloc(n * sizeof(leaf_offset));
+
+    size_t n_claims = 1;
+    while (n_claims < 2 * n)
+      n_claims <<= 1;
+    struct utreexo_leaf_map_claims claims = {
+        .slots = calloc(n_claims, sizeof(leaf_offset)),
+        .mask = n_claims - 1,
+    };
+
+    utreexo_forest_node **found = calloc(n, sizeof(utreexo_forest_node *));
+    int ret = -4;
+    if (positions != NULL && claims.slots != NULL && found != NULL)
+      ret = utreexo_leaf_map_probe_many(map, found, positions, leaves,
+                                        entries, n, &claims);
+    // We know where everything goes, write it all at once. Nothing was
+    // written if that failed, so the sweep can still do the whole batch
+    int ring_ok = ret != -1;
+    if (ret == 0) {
+      ring_ok = utreexo_leaf_map_write_many(map, nodes, positions, entries,
+                                            n) == 0;
+      if (map->filter != NULL)
+        for (size_t i = 0; i < n; ++i)
+          if (found[i] == NULL)
+            utreexo_leaf_filter_insert(
+                map->filter, utreexo_leaf_map_filter_key(map, &leaves[i]));
+    }
+    if (ring_ok)
+      __atomic_clear(&map->ring_busy, __ATOMIC_RELEASE);
+    free(found);
+    free(claims.slots);
+    free(positions);
+    free(entries);
+    if (ret == 0)
+      return;
+  }
+#endif
+  utreexo_leaf_map_sweep(map, nodes, leaves, n, UTREEXO_LEAF_MAP_SET);
+}
+
+static inline void
+utreexo_leaf_map_delete_many(utreexo_leaf_map *map,
+                             const utreexo_leaf_hash *leaves, size_t n) {
+  if (n == 0)
+    return;
+  utreexo_leaf_map_touch(map);
+  utreexo_leaf_map_sweep(map, NULL, leaves, n, UTREEXO_LEAF_MAP_DELETE);
+}
+
+static inline void
+utreexo_leaf_map_load(utreexo_leaf_map *map,
+                      struct utreexo_leaf_map_load_entry *const *runs,
+                      const size_t *run_lengths, size_t n_runs) {
+  const uint64_t window = map->n_slots < UTREEXO_LEAF_MAP_LOAD_WINDOW
+                              ? map->n_slots
+                              : UTREEXO_LEAF_MAP_LOAD_WINDOW;
+  utreexo_forest_node **slots = calloc(window, sizeof(utreexo_forest_node *));
+  size_t *heads = calloc(n_runs + 1, sizeof(size_t));
+  if (slots == NULL || heads == NULL) {
+    perror("calloc");
+    abort();
+  }
+
+  // Everything after the header is a hole again, so it's all empty slots
+  utreexo_leaf_map_touch(map);
+  if (ftruncate(map->fd, UTREEXO_LEAF_MAP_HEADER_SIZE) != 0) {
+    perror("ftruncate");
+    abort();
+  }
+  if (map->filter != NULL)
+    utreexo_leaf_filter_clear(map->filter);
+
+  // Leaves that probed past the last slot, they wrap around to the front
+  // once we are done
+  utreexo_forest_node **wrapped = NULL;
+  size_t n_wrapped = 0, wrapped_cap = 0;
+
+  uint64_t first = 0, next_free = 0;
+  int dirty = 0;
+  for (;;) {
+    // There are only a few runs, one per thread, so a linear pick is as
+    // cheap as a heap here
+    size_t best = n_runs;
+    for (size_t r = 0; r < n_runs; ++r) {
+      if (heads[r] == run_lengths[r])
+        continue;
+      if (best == n_runs ||
+          runs[r][heads[r]].slot < runs[best][heads[best]].slot)
+        best = r;
+    }
+    if (best == n_runs)
       break;
-  } while (1);
 
-  // node not found, return early
-  if (pnode == NULL)
+    const struct utreexo_leaf_map_load_entry *entry =
+        &runs[best][heads[best]++];
+    const uint64_t slot = entry->slot > next_free ? entry->slot : next_free;
+    if (slot >= map->n_slots) {
+      if (n_wrapped == wrapped_cap) {
+        wrapped_cap = wrapped_cap ? wrapped_cap * 2 : 64;
+        wrapped = realloc(wrapped, wrapped_cap * sizeof(*wrapped));
+        if (wrapped == NULL) {
+          perror("realloc");
+          abort();
+        }
+      }
+      wrapped[n_wrapped++] = entry->node;
+      continue;
+    }
+
+    if (slot >= first + window) {
+      if (dirty && pwrite(map->fd, slots, window * sizeof(*slots),
+                          utreexo_leaf_map_get_pos(first)) !=
+                       (ssize_t)(window * sizeof(*slots))) {
+        perror("pwrite");
+        abort();
+      }
+      memset(slots, 0x00, window * sizeof(*slots));
+      first = slot & ~(window - 1);
+      dirty = 0;
+    }
+    slots[slot - first] = entry->node;
+    dirty = 1;
+    next_free = slot + 1;
+    if (map->filter != NULL)
+      utreexo_leaf_filter_insert(
+          map->filter, utreexo_leaf_map_filter_key(map, &entry->node->hash));
+  }
+
+  if (dirty && pwrite(map->fd, slots, window * sizeof(*slots),
+                      utreexo_leaf_map_get_pos(first)) !=
+                   (ssize_t)(window * sizeof(*slots))) {
+    perror("pwrite");
+    abort();
+  }
+  for (size_t i = 0; i < n_wrapped; ++i)
+    utreexo_leaf_map_set(map, wrapped[i], wrapped[i]->hash);
+
+  free(wrapped);
+  free(heads);
+  free(slots);
+}
+
+static inline void utreexo_leaf_map_attach_filter(utreexo_leaf_map *map,
+                                                  const char *filename,
+                                                  uint64_t n_leaves) {
+  // If we changed the map already, our generation is newer than the filter's
+  if (utreexo_leaf_filter_open(&map->filter, filename, n_leaves, map->salt,
+                               map->generation) == 0)
     return;
 
-  // We need to mark positions that have been deleted, because otherwise
-  // our open hashing alogritm wouldn't see the colliding elements added
-  // afterwards.
-  pnode = utreexo_thumbstone;
-  pwrite(map->fd, &pnode, sizeof(utreexo_forest_node **), position);
+  // The filter is new, fill it with whatever the map holds. Only the parts
+  // of the file that were ever written can have leaves, so we skip the holes
+  utreexo_forest_node **slots =
+      malloc(UTREEXO_LEAF_MAP_WINDOW * sizeof(utreexo_forest_node *));
+  if (slots == NULL) {
+    perror("malloc");
+    abort();
+  }
+
+  const off_t end = utreexo_leaf_map_get_pos(map->n_slots);
+  off_t offset = UTREEXO_LEAF_MAP_HEADER_SIZE;
+  while (offset < end) {
+    off_t data = lseek(map->fd, offset, SEEK_DATA);
+    if (data < 0 || data >= end)
+      break;
+    off_t hole = lseek(map->fd, data, SEEK_HOLE);
+    if (hole < 0 || hole > end)
+      hole = end;
+
+    // Extents are page-aligned, and so are slots
+    for (offset = data; offset < hole;) {
+      size_t len = UTREEXO_LEAF_MAP_WINDOW * sizeof(utreexo_forest_node *);
+      if ((off_t)len > hole - offset)
+        len = hole - offset;
+      const ssize_t n_read = pread(map->fd, slots, len, offset);
+      if (n_read <= 0)
+        break;
+      for (size_t s = 0; s < n_read / sizeof(utreexo_forest_node *); ++s) {
+        if (slots[s] == NULL || slots[s] == utreexo_thumbstone)
+          continue;
+        utreexo_leaf_filter_insert(
+            map->filter, utreexo_leaf_map_filter_key(map, &slots[s]->hash));
+      }
+      offset += n_read;
+    }
+    offset = hole;
+  }
+
+  free(slots);
 }
+
+#endif // LEAF_MAP_IMPL_H
@@ -0,0 +1,69 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * Rebuilds the leaf map from the forest. The map is only an index of the
+ * leaves we have, so if it's lost or damaged, everything it held is still in
+ * the forest, and there's no need to apply every block again.
+ *
+ * We can't just go over the forest pages looking for nodes without children:
+ * nodes are never freed, so every leaf that was ever spent is still in some
+ * page, and looks just like one we have. Instead, we go down every tree from
+ * its root. The trees are split into a few thousand disjoint subtrees, the
+ * same way utreexo_forest_check does, and threads take them one at a time.
+ * Each thread collects the leaves it finds with the slot they hash to, and
+ * sorts them. The sorted runs are then merged while the map is written front
+ * to back, see utreexo_leaf_map_load, so the map file only ever sees big,
+ * sequential writes.
+ */
+#ifndef UTREEXO_LEAF_MAP_REBUILD_H
+#define UTREEXO_LEAF_MAP_REBUILD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "forest_node.h"
+#include "leaf_map.h"
+
+struct utreexo_forest;
+
+/* How many subtrees we split the forest into, and how many threads at most
+ * look for leaves in them */
+#define UTREEXO_REBUILD_JOBS 1024
+#define UTREEXO_REBUILD_THREADS 32
+
+/* The leaves one thread found, sorted by slot once it's done */
+struct utreexo_leaf_map_rebuild_run {
+  struct utreexo_leaf_map_load_entry *entries;
+  size_t len;
+  size_t cap;
+};
+
+struct utreexo_leaf_map_rebuild {
+  const utreexo_leaf_map *map;
+
+  utreexo_forest_node **jobs;
+  size_t n_jobs;
+  size_t next_job;
+
+  /* One for each thread, and one for us */
+  struct utreexo_leaf_map_rebuild_run runs[UTREEXO_REBUILD_THREADS + 1];
+  size_t next_run;
+  /* Set if some thread ran out of memory */
+  int failed;
+};
+
+/* Throws away everything in f's leaf map, and puts every leaf in the forest
+ * back in it, the ones still in f's leaf cache too, so it should be dropped
+ * afterwards. Nobody may change the forest while we do this. Returns how many
+ * leaves we found, or -4 if we are out of memory, in which case the map is
+ * left as it was */
+static inline int64_t utreexo_leaf_map_rebuild(struct utreexo_forest *f);
+
+/* Adds every leaf under node to run. Returns 0, or -4 if we are out of
+ * memory */
+static inline int
+utreexo_leaf_map_rebuild_tree(const utreexo_leaf_map *map,
+                              utreexo_forest_node *node,
+                              struct utreexo_leaf_map_rebuild_run *run);
+
+#endif // UTREEXO_LEAF_MAP_REBUILD_H
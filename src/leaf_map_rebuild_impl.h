@@ -0,0 +1,150 @@
+#ifndef UTREEXO_LEAF_MAP_REBUILD_IMPL_H
+#define UTREEXO_LEAF_MAP_REBUILD_IMPL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "leaf_map_impl.h"
+#include "leaf_map_rebuild.h"
+#include "mmap_forest.h"
+
+static inline int
+utreexo_leaf_map_rebuild_add(const utreexo_leaf_map *map,
+                             utreexo_forest_node *leaf,
+                             struct utreexo_leaf_map_rebuild_run *run) {
+  if (run->len == run->cap) {
+    const size_t cap = run->cap ? run->cap * 2 : 4096;
+    struct utreexo_leaf_map_load_entry *entries =
+        realloc(run->entries, cap * sizeof(*entries));
+    if (entries == NULL)
+      return -4;
+    run->entries = entries;
+    run->cap = cap;
+  }
+  run->entries[run->len++] = (struct utreexo_leaf_map_load_entry){
+      .slot = utreexo_leaf_map_slot(map, &leaf->hash), .node = leaf};
+  return 0;
+}
+
+static inline int
+utreexo_leaf_map_rebuild_tree(const utreexo_leaf_map *map,
+                              utreexo_forest_node *node,
+                              struct utreexo_leaf_map_rebuild_run *run) {
+  // Recurse on the right, loop on the left
+  while (node->left_child != NULL) {
+    if (utreexo_leaf_map_rebuild_tree(map, node->right_child, run) != 0)
+      return -4;
+    node = node->left_child;
+  }
+  return utreexo_leaf_map_rebuild_add(map, node, run);
+}
+
+static inline int utreexo_leaf_map_rebuild_cmp(const void *a, const void *b) {
+  const struct utreexo_leaf_map_load_entry *ea = a, *eb = b;
+  return ea->slot < eb->slot ? -1 : ea->slot > eb->slot;
+}
+
+static void *utreexo_leaf_map_rebuild_worker(void *arg) {
+  struct utreexo_leaf_map_rebuild *r = arg;
+  struct utreexo_leaf_map_rebuild_run *run =
+      &r->runs[__atomic_fetch_add(&r->next_run, 1, __ATOMIC_RELAXED)];
+
+  for (;;) {
+    const size_t job = __atomic_fetch_add(&r->next_job, 1, __ATOMIC_RELAXED);
+    if (job >= r->n_jobs || __atomic_load_n(&r->failed, __ATOMIC_RELAXED))
+      break;
+    if (utreexo_leaf_map_rebuild_tree(r->map, r->jobs[job], run) != 0) {
+      __atomic_store_n(&r->failed, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+  }
+
+  // Sorting is most of the work, so each thread sorts what it found
+  qsort(run->entries, run->len, sizeof(*run->entries),
+        utreexo_leaf_map_rebuild_cmp);
+  return NULL;
+}
+
+/* Goes down from the roots until we have enough subtrees for every thread.
+ * Leaves stay as they are, there's nothing under them to split */
+static inline void
+utreexo_leaf_map_rebuild_split(const struct utreexo_forest *f,
+                               struct utreexo_leaf_map_rebuild *r,
+                               utreexo_forest_node **level[2]) {
+  size_t n_level = 0, cur = 0;
+  for (uint8_t row = 0; row < 64; ++row)
+    if (f->roots[row] != NULL)
+      level[cur][n_level++] = f->roots[row];
+
+  // Every step at most doubles the jobs we have
+  while (n_level < UTREEXO_REBUILD_JOBS / 2) {
+    size_t n_next = 0, n_split = 0;
+    for (size_t i = 0; i < n_level; ++i) {
+      utreexo_forest_node *node = level[cur][i];
+      if (node->left_child == NULL) {
+        level[!cur][n_next++] = node;
+        continue;
+      }
+      ++n_split;
+      level[!cur][n_next++] = node->left_child;
+      level[!cur][n_next++] = node->right_child;
+    }
+    if (n_split == 0)
+      break;
+    cur = !cur;
+    n_level = n_next;
+  }
+
+  r->jobs = level[cur];
+  r->n_jobs = n_level;
+}
+
+static inline int64_t utreexo_leaf_map_rebuild(struct utreexo_forest *f) {
+  struct utreexo_leaf_map_rebuild r = {.map = &f->leaf_map};
+  utreexo_forest_node **level[2] = {
+      malloc(UTREEXO_REBUILD_JOBS * sizeof(*level[0])),
+      malloc(UTREEXO_REBUILD_JOBS * sizeof(*level[1]))};
+  if (level[0] == NULL || level[1] == NULL) {
+    free(level[0]);
+    free(level[1]);
+    return -4;
+  }
+  utreexo_leaf_map_rebuild_split(f, &r, level);
+
+  long n_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  if (n_threads > UTREEXO_REBUILD_THREADS)
+    n_threads = UTREEXO_REBUILD_THREADS;
+
+  // We work as well, so it's fine if some thread can't be created
+  pthread_t threads[UTREEXO_REBUILD_THREADS];
+  long n_started = 0;
+  for (; n_started < n_threads; ++n_started)
+    if (pthread_create(&threads[n_started], NULL,
+                       utreexo_leaf_map_rebuild_worker, &r) != 0)
+      break;
+  utreexo_leaf_map_rebuild_worker(&r);
+  for (long i = 0; i < n_started; ++i)
+    pthread_join(threads[i], NULL);
+
+  free(level[0]);
+  free(level[1]);
+
+  struct utreexo_leaf_map_load_entry *runs[UTREEXO_REBUILD_THREADS + 1];
+  size_t run_lengths[UTREEXO_REBUILD_THREADS + 1];
+  int64_t n_leaves = 0;
+  for (size_t i = 0; i < r.next_run; ++i) {
+    runs[i] = r.runs[i].entries;
+    run_lengths[i] = r.runs[i].len;
+    n_leaves += r.runs[i].len;
+  }
+  if (!r.failed)
+    utreexo_leaf_map_load(&f->leaf_map, runs, run_lengths, r.next_run);
+
+  for (size_t i = 0; i < r.next_run; ++i)
+    free(r.runs[i].entries);
+  return r.failed ? -4 : n_leaves;
+}
+
+#endif // UTREEXO_LEAF_MAP_REBUILD_IMPL_H
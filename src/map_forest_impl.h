@@ -6,6 +6,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifndef UTREEXO_MAP_FOREST
@@ -13,17 +14,31 @@
 
 #include "flat_file_impl.h"
 #include "forest_node.h"
+#include "latency_impl.h"
+#include "leaf_cache_impl.h"
 #include "leaf_map_impl.h"
 #include "mmap_forest.h"
 #include "parent_hash.h"
+#include "pipeline_impl.h"
+#include "probes.h"
+#include "proof_cache_impl.h"
+#include "rss_budget_impl.h"
+#include "trace_impl.h"
 #include "util.h"
+#include "warm_start_impl.h"
+#include "writeback_impl.h"
 
 static const char UTREEXO_ZERO_HASH[32] = {0};
 
-static inline void utreexo_forest_add(struct utreexo_forest *p,
-                                      utreexo_node_hash leaf) {
+/* How many subtrees we split a rehash into, and how many threads work on them
+ */
+#define UTREEXO_REHASH_JOBS 64
+#define UTREEXO_REHASH_THREADS 8
+
+static inline utreexo_forest_node *
+utreexo_forest_add_leaf(struct utreexo_forest *p, utreexo_node_hash leaf) {
   utreexo_forest_node *pnode = utreexo_forest_file_node_alloc(p->data);
-  utreexo_leaf_map_set(&p->leaf_map, pnode, leaf);
+  utreexo_forest_node *pleaf = pnode;
 
   *pnode = (utreexo_forest_node){
       .hash = {{0}}, .parent = NULL, .left_child = NULL, .right_child = NULL};
@@ -31,11 +46,19 @@ static inline void utreexo_forest_add(struct utreexo_forest *p,
   memcpy(pnode->hash.hash, leaf.hash, 32);
 
   const uint64_t nLeaves = *p->nLeaf;
+#ifdef USE_POSITION_CACHE
+  // New leaves always go to the end of the bottom row
+  pnode->position = nLeaves;
+#endif
   uint8_t height = 0;
   while ((nLeaves >> height & 1) == 1) {
     utreexo_forest_node *root = p->roots[height];
-    debug_assert(root != NULL);
-    debug_assert(root->hash.hash != NULL);
+
+    // This whole tree was deleted, we just take its place
+    if (root == NULL) {
+      height++;
+      continue;
+    }
 
     p->roots[height] = NULL;
 
@@ -43,30 +66,70 @@ static inline void utreexo_forest_add(struct utreexo_forest *p,
     *proot = (utreexo_forest_node){
         .parent = NULL, .left_child = root, .right_child = pnode};
 
-    parent_hash(proot->hash.hash, root->hash.hash, pnode->hash.hash);
+    if (p->deferred_hashing)
+      utreexo_forest_mark_dirty(p, proot);
+    else
+      parent_hash(proot->hash.hash, root->hash.hash, pnode->hash.hash);
 
     pnode->parent = proot;
     root->parent = proot;
+    utreexo_forest_file_touch(p->data, pnode);
+    utreexo_forest_file_touch(p->data, root);
 
     pnode = proot;
     height++;
   }
   debug_assert(p->roots[height] == NULL);
   p->roots[height] = pnode;
+  // Every tree we merged is gone, and so is whatever was at height
+  if (p->proof_cache != NULL)
+    for (uint8_t tree = 0; tree <= height; ++tree)
+      ++p->tree_generation[tree];
   ++(*p->nLeaf);
+#ifdef USE_POSITION_CACHE
+  // If we took the place of deleted trees, all leaves under us moved up
+  const uint64_t root = root_position(*p->nLeaf, height, 63);
+  if (utreexo_forest_cached_position(pnode) != root)
+    utreexo_forest_cache_positions(p, pnode, root);
+#endif
+  return pleaf;
+}
+
+static inline void utreexo_forest_add(struct utreexo_forest *p,
+                                      utreexo_node_hash leaf) {
+  utreexo_forest_node *pnode = utreexo_forest_add_leaf(p, leaf);
+  utreexo_leaf_cache_set_many(p->leaf_cache, &p->leaf_map, &pnode, &leaf, 1);
+}
+
+static inline int utreexo_forest_node_valid(const struct utreexo_forest *f,
+                                            const utreexo_forest_node *node) {
+  return node != NULL &&
+         (!f->read_only ||
+          utreexo_forest_file_contains(f->data, node, sizeof(*node)));
 }
 
 static inline void grab_node(struct utreexo_forest *f,
                              utreexo_forest_node **node,
                              utreexo_forest_node **sibling,
                              utreexo_forest_node **parent, uint64_t pos) {
-  node_offset offset = detect_offset(pos, *f->nLeaf);
+  grab_node_in(f, *f->nLeaf, node, sibling, parent, pos);
+}
 
-  debug_assert(offset.tree < 64);
+static inline void grab_node_in(struct utreexo_forest *f, uint64_t num_leaves,
+                                utreexo_forest_node **node,
+                                utreexo_forest_node **sibling,
+                                utreexo_forest_node **parent, uint64_t pos) {
+  node_offset offset = detect_offset(pos, num_leaves);
+
+  *node = *sibling = *parent = NULL;
+  if (offset.tree >= 64)
+    return;
 
   utreexo_forest_node *pnode = f->roots[offset.tree];
   utreexo_forest_node *psibling = NULL;
   utreexo_forest_node *pparent = NULL;
+  if (!utreexo_forest_node_valid(f, pnode))
+    return;
   if (offset.depth == 0) {
     *node = pnode;
     *sibling = psibling;
@@ -75,7 +138,7 @@ static inline void grab_node(struct utreexo_forest *f,
     return;
   }
   for (size_t h = offset.depth; h > 0; --h) {
-    uint32_t mask = 1 << (h - 1);
+    uint64_t mask = (uint64_t)1 << (h - 1);
 
     pparent = pnode;
 
@@ -90,6 +153,11 @@ static inline void grab_node(struct utreexo_forest *f,
       psibling = pparent->right_child;
       pnode = pparent->left_child;
     }
+    if (!utreexo_forest_node_valid(f, pnode) ||
+        !utreexo_forest_node_valid(f, psibling)) {
+      pnode = NULL;
+      break;
+    }
   }
 
   *node = pnode;
@@ -97,23 +165,355 @@ static inline void grab_node(struct utreexo_forest *f,
   *parent = pparent;
 }
 
+static inline int utreexo_forest_node_position(const struct utreexo_forest *f,
+                                               const utreexo_forest_node *node,
+                                               uint64_t *pos) {
+  uint64_t bits = 0;
+  uint8_t depth = 0;
+
+  // Walk up to the root, remembering which side we came from at each step.
+  // Those are the lower bits of our position, as seen from the root
+  while (node->parent != NULL) {
+    const utreexo_forest_node *pparent = node->parent;
+    if (!utreexo_forest_node_valid(f, pparent))
+      return -1;
+    if (pparent->right_child == node)
+      bits |= (uint64_t)1 << depth;
+    else if (pparent->left_child != node)
+      return -1; // this node was deleted, its parent doesn't know about it
+    if (++depth == 64)
+      return -1;
+    node = pparent;
+  }
+
+  // Only trees at least as tall as the path we took may hold this root
+  const uint64_t num_leaves = __atomic_load_n(f->nLeaf, __ATOMIC_RELAXED);
+  uint64_t trees = num_leaves & ~(((uint64_t)1 << depth) - 1);
+  for (; trees != 0; trees &= trees - 1) {
+    const uint8_t row = __builtin_ctzll(trees);
+    if (f->roots[row] != node)
+      continue;
+
+    const uint8_t forest_rows = tree_rows(num_leaves);
+    const uint64_t root = root_position(num_leaves, row, forest_rows);
+    *pos = ((root << depth) | bits) & position_mask(forest_rows);
+    return 0;
+  }
+  return -1;
+}
+
+#ifdef USE_POSITION_CACHE
+static inline void utreexo_forest_cache_positions(struct utreexo_forest *f,
+                                                  utreexo_forest_node *node,
+                                                  uint64_t pos) {
+  // Recurse on the right, loop on the left
+  while (node->left_child != NULL) {
+    utreexo_forest_cache_positions(f, node->right_child, (pos << 1) | 1);
+    node = node->left_child;
+    pos <<= 1;
+  }
+  node->position = pos;
+  utreexo_forest_file_touch(f->data, node);
+}
+
+static inline uint64_t
+utreexo_forest_cached_position(const utreexo_forest_node *node) {
+  uint8_t depth = 0;
+  while (node->left_child != NULL) {
+    node = node->left_child;
+    ++depth;
+  }
+
+  uint64_t pos = node->position;
+  for (; depth > 0; --depth)
+    pos = parent_position(pos, 63);
+  return pos;
+}
+#endif
+
+static inline int utreexo_forest_leaf_position(const struct utreexo_forest *f,
+                                               const utreexo_forest_node *leaf,
+                                               uint64_t *pos) {
+#ifdef USE_POSITION_CACHE
+  *pos = translate_position(leaf->position, 63, tree_rows(*f->nLeaf));
+  return 0;
+#else
+  return utreexo_forest_node_position(f, leaf, pos);
+#endif
+}
+
+static inline int utreexo_forest_apply_block(struct utreexo_forest *f,
+                                             utreexo_forest_node **pnodes,
+                                             const utreexo_node_hash *utxos,
+                                             size_t utxo_count,
+                                             const utreexo_node_hash *stxos,
+                                             size_t stxo_count) {
+  // Nothing may fail once we start changing the forest, or we would leave
+  // a block half applied
+  for (size_t stxo = 0; stxo < stxo_count; ++stxo)
+    if (pnodes[stxo] == NULL)
+      return -3;
+  utreexo_forest_node **pleaves = NULL;
+  if (utxo_count != 0) {
+    pleaves = malloc(utxo_count * sizeof(utreexo_forest_node *));
+    if (pleaves == NULL)
+      return -4;
+  }
+
+  uint64_t start = utreexo_latency_start(f->latency);
+  for (size_t stxo = 0; stxo < stxo_count; ++stxo)
+    delete_single(f, pnodes[stxo]);
+
+  // Spent leaves are still readable, since we never free nodes, so we can
+  // drop them from the map only now
+  utreexo_leaf_cache_delete_many(f->leaf_cache, &f->leaf_map, stxos,
+                                 stxo_count);
+  utreexo_latency_end(f->latency, UTREEXO_LATENCY_DELETE, start);
+
+  if (utxo_count == 0)
+    return 0;
+
+  start = utreexo_latency_start(f->latency);
+  for (size_t i = 0; i < utxo_count; i++)
+    pleaves[i] = utreexo_forest_add_leaf(f, utxos[i]);
+  utreexo_leaf_cache_set_many(f->leaf_cache, &f->leaf_map, pleaves, utxos,
+                              utxo_count);
+  utreexo_latency_end(f->latency, UTREEXO_LATENCY_ADD, start);
+
+  free(pleaves);
+  return 0;
+}
+
+static inline int utreexo_forest_apply(struct utreexo_forest *f,
+                                       utreexo_forest_node **pnodes,
+                                       const utreexo_node_hash *utxos,
+                                       size_t utxo_count,
+                                       const utreexo_node_hash *stxos,
+                                       size_t stxo_count) {
+  struct timespec start;
+  if (f->trace != NULL)
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+  utreexo_forest_file_write_begin(f->data);
+  const int ret = utreexo_forest_apply_block(f, pnodes, utxos, utxo_count,
+                                             stxos, stxo_count);
+  utreexo_forest_publish(f);
+
+  if (f->trace != NULL)
+    utreexo_forest_record(f, utxos, utxo_count, stxos, stxo_count, ret,
+                          &start);
+  return ret;
+}
+
+static inline void utreexo_forest_record(struct utreexo_forest *f,
+                                         const utreexo_node_hash *utxos,
+                                         size_t utxo_count,
+                                         const utreexo_node_hash *stxos,
+                                         size_t stxo_count, int ret,
+                                         const struct timespec *start) {
+  // With deferred hashing, this is where the block's hashes get done, so
+  // it's part of what the block costs
+  utreexo_forest_flush_hashes(f);
+  utreexo_node_hash roots[64];
+  size_t n_roots = 0;
+  for (int i = 63; i >= 0; --i)
+    if (f->roots[i] != NULL)
+      roots[n_roots++] = f->roots[i]->hash;
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  const struct utreexo_trace_block block = {
+      .utxos = utxos,
+      .utxo_count = utxo_count,
+      .stxos = stxos,
+      .stxo_count = stxo_count,
+      .roots = roots,
+      .n_roots = n_roots,
+      .num_leaves = *f->nLeaf,
+      .nanos = (end.tv_sec - start->tv_sec) * 1000000000ULL + end.tv_nsec -
+               start->tv_nsec,
+      .ret = ret,
+  };
+  utreexo_trace_write(f->trace, &block);
+}
+
+static inline void utreexo_forest_publish(struct utreexo_forest *f) {
+  if (!__atomic_load_n(&f->dirty, __ATOMIC_ACQUIRE))
+    utreexo_forest_file_write_end(f->data);
+}
+
+static inline int utreexo_forest_read_begin(const struct utreexo_forest *f,
+                                            uint64_t *seq) {
+  *seq = 0;
+  if (!f->read_only)
+    return 0;
+
+  const char *base = __atomic_load_n(&f->data->header->base, __ATOMIC_RELAXED);
+  if (base != NULL && base != (const char *)f->data->header)
+    return -1;
+  return utreexo_forest_file_read_begin(f->data, seq);
+}
+
+static inline int utreexo_forest_read_retry(const struct utreexo_forest *f,
+                                            uint64_t seq) {
+  return f->read_only && utreexo_forest_file_read_retry(f->data, seq);
+}
+
+/* Leaves are never dirty, so a zeroed hash there is just a hash */
+static inline int utreexo_forest_node_dirty(const utreexo_forest_node *node) {
+  return node->left_child != NULL &&
+         memcmp(node->hash.hash, UTREEXO_ZERO_HASH, 32) == 0;
+}
+
+static inline void utreexo_forest_mark_dirty(struct utreexo_forest *f,
+                                             utreexo_forest_node *node) {
+  for (; node != NULL && !utreexo_forest_node_dirty(node);
+       node = node->parent) {
+    memset(node->hash.hash, 0, 32);
+    utreexo_forest_file_touch(f->data, node);
+  }
+  __atomic_store_n(&f->dirty, 1, __ATOMIC_RELEASE);
+}
+
+static void utreexo_forest_rehash(struct utreexo_forest_file *file,
+                                  utreexo_forest_node *node) {
+  if (!utreexo_forest_node_dirty(node))
+    return;
+
+  utreexo_forest_rehash(file, node->left_child);
+  utreexo_forest_rehash(file, node->right_child);
+  parent_hash(node->hash.hash, node->left_child->hash.hash,
+              node->right_child->hash.hash);
+  utreexo_forest_file_touch(file, node);
+}
+
+/* Dirty subtrees that don't share any node, handed out to threads */
+struct utreexo_forest_rehash_jobs {
+  struct utreexo_forest_file *file;
+  utreexo_forest_node **nodes;
+  size_t n_nodes;
+  size_t next;
+};
+
+static void *utreexo_forest_rehash_worker(void *arg) {
+  struct utreexo_forest_rehash_jobs *jobs = arg;
+  for (;;) {
+    const size_t job = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED);
+    if (job >= jobs->n_nodes)
+      return NULL;
+    utreexo_forest_rehash(jobs->file, jobs->nodes[job]);
+  }
+}
+
+static inline void utreexo_forest_flush_hashes(struct utreexo_forest *f) {
+  if (!__atomic_load_n(&f->dirty, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock(&f->hash_lock);
+  if (!f->dirty) {
+    pthread_mutex_unlock(&f->hash_lock);
+    return;
+  }
+  const uint64_t start = utreexo_latency_start(f->latency);
+
+  // Go down from the roots until we have enough disjoint dirty subtrees to
+  // keep every thread busy, or run out of them. Everything above those is
+  // left for the end
+  utreexo_forest_node *level[2][UTREEXO_REHASH_JOBS];
+  size_t n_level = 0, cur = 0;
+  for (size_t i = 0; i < 64; ++i)
+    if (f->roots[i] != NULL && utreexo_forest_node_dirty(f->roots[i]))
+      level[cur][n_level++] = f->roots[i];
+
+  while (n_level > 0 && n_level < UTREEXO_REHASH_JOBS / 2) {
+    size_t n_next = 0;
+    for (size_t i = 0; i < n_level; ++i) {
+      if (utreexo_forest_node_dirty(level[cur][i]->left_child))
+        level[!cur][n_next++] = level[cur][i]->left_child;
+      if (utreexo_forest_node_dirty(level[cur][i]->right_child))
+        level[!cur][n_next++] = level[cur][i]->right_child;
+    }
+    if (n_next == 0)
+      break;
+    cur = !cur;
+    n_level = n_next;
+  }
+
+  struct utreexo_forest_rehash_jobs jobs = {
+      .file = f->data, .nodes = level[cur], .n_nodes = n_level, .next = 0};
+  long n_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+  if (n_threads > (long)n_level - 1)
+    n_threads = (long)n_level - 1;
+  if (n_threads > UTREEXO_REHASH_THREADS)
+    n_threads = UTREEXO_REHASH_THREADS;
+
+  // We work as well, so it's fine if some thread can't be created
+  pthread_t threads[UTREEXO_REHASH_THREADS];
+  long n_started = 0;
+  for (; n_started < n_threads; ++n_started)
+    if (pthread_create(&threads[n_started], NULL, utreexo_forest_rehash_worker,
+                       &jobs) != 0)
+      break;
+  UTREEXO_PROBE2(hash__start, n_level, n_started + 1);
+  utreexo_forest_rehash_worker(&jobs);
+  for (long i = 0; i < n_started; ++i)
+    pthread_join(threads[i], NULL);
+
+  for (size_t i = 0; i < 64; ++i)
+    if (f->roots[i] != NULL)
+      utreexo_forest_rehash(f->data, f->roots[i]);
+
+  __atomic_store_n(&f->dirty, 0, __ATOMIC_RELEASE);
+  utreexo_forest_file_write_end(f->data);
+  UTREEXO_PROBE1(hash__done, n_level);
+  utreexo_latency_end(f->latency, UTREEXO_LATENCY_HASH, start);
+  pthread_mutex_unlock(&f->hash_lock);
+}
+
+static inline void utreexo_forest_recover_hashes(struct utreexo_forest *f) {
+  for (size_t i = 0; i < 64; ++i)
+    if (f->roots[i] != NULL && utreexo_forest_node_dirty(f->roots[i]))
+      __atomic_store_n(&f->dirty, 1, __ATOMIC_RELEASE);
+  utreexo_forest_flush_hashes(f);
+}
+
 static inline void _utreexo_forest_free(struct utreexo_forest *forest) {
+  utreexo_pipeline_stop(forest);
+  // Zeroed hashes left in the file would look like real ones once reopened
+  utreexo_forest_flush_hashes(forest);
+  utreexo_writeback_stop(forest->writeback);
+  utreexo_rss_budget_stop(forest->rss_budget);
+  utreexo_leaf_cache_free(forest->leaf_cache, &forest->leaf_map);
+  utreexo_proof_cache_free(forest->proof_cache);
+  // After the leaf cache, which still writes to the leaf map
+  utreexo_warm_start_end(forest->warm_start);
+  utreexo_trace_close(forest->trace);
+  free(forest->latency);
+  pthread_mutex_destroy(&forest->hash_lock);
+  utreexo_leaf_map_close(&forest->leaf_map);
   utreexo_forest_file_close(forest->data);
   free(forest);
 }
 
-static inline void recompute_parent_hash(utreexo_forest_node *origin) {
+static inline void recompute_parent_hash(struct utreexo_forest *f,
+                                         utreexo_forest_node *origin) {
   utreexo_forest_node *pnode = origin->parent;
-  while (pnode != NULL) {
+  uint64_t rows = 0;
+  for (; pnode != NULL; ++rows) {
     parent_hash(pnode->hash.hash, pnode->left_child->hash.hash,
                 pnode->right_child->hash.hash);
+    utreexo_forest_file_touch(f->data, pnode);
     pnode = pnode->parent;
   }
+  UTREEXO_PROBE1(hash__path, rows);
 }
 
 static inline int delete_single(struct utreexo_forest *f,
                                 utreexo_forest_node *pnode) {
   utreexo_forest_node *pparent = pnode->parent;
+  if (pparent == NULL)
+    return delete_inner(f, pnode, NULL, NULL);
+
   utreexo_forest_node *psibling =
       pparent->left_child == pnode ? pparent->right_child : pparent->left_child;
   return delete_inner(f, pnode, psibling, pparent);
@@ -124,25 +524,42 @@ static inline int delete_inner(struct utreexo_forest *f,
                                utreexo_forest_node *psibling,
                                utreexo_forest_node *pparent) {
   // utreexo_leaf_delete(&f->leaf_map, pnode->hash);
+  if (f->proof_cache != NULL)
+    utreexo_forest_touch_tree(f, pnode);
 
   if (pparent == NULL) {
     for (size_t i = 0; i < 64; ++i)
-      if (f->roots[i] == pnode->parent)
+      if (f->roots[i] == pnode)
         f->roots[i] = NULL;
     return 0;
   }
 
+#ifdef USE_POSITION_CACHE
+  // psibling takes its parent's place, so every leaf under it moves up one
+  // row. A leaf can only move up so many times, so this is amortized
+  // O(forest rows) per leaf
+  utreexo_forest_cache_positions(
+      f, psibling,
+      parent_position(utreexo_forest_cached_position(psibling), 63));
+#endif
+
+  psibling->parent = pparent->parent;
+  utreexo_forest_file_touch(f->data, psibling);
   if (pparent->parent != NULL) {
     if (pparent->parent->right_child == pparent)
       pparent->parent->right_child = psibling;
     else
       pparent->parent->left_child = psibling;
+    utreexo_forest_file_touch(f->data, pparent->parent);
   } else {
     for (size_t i = 0; i < 64; ++i)
       if (f->roots[i] == pnode->parent)
         f->roots[i] = psibling;
   }
-  recompute_parent_hash(psibling);
+  if (f->deferred_hashing)
+    utreexo_forest_mark_dirty(f, psibling->parent);
+  else
+    recompute_parent_hash(f, psibling);
   return 0;
 }
 
@@ -1,14 +1,28 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <valgrind/memcheck.h>
 
 #include "flat_file.h"
 #include "forest_node.h"
+#include "forest_proof_impl.h"
+#include "forest_serialize_impl.h"
+#include "forest_verify_impl.h"
+#include "latency_impl.h"
+#include "leaf_cache_impl.h"
 #include "leaf_map.h"
+#include "leaf_map_rebuild_impl.h"
 #include "map_forest_impl.h"
 #include "mmap_forest.h"
+#include "overlay_impl.h"
+#include "pipeline_impl.h"
+#include "probes.h"
+#include "rss_budget_impl.h"
+#include "trace_impl.h"
 #include "util.h"
+#include "warm_start_impl.h"
+#include "writeback_impl.h"
 
 #define CHECK_PTR(x)                                                           \
   if (x == NULL) {                                                             \
@@ -19,27 +33,47 @@
   if (n > 0 && x == NULL)                                                      \
     return -1;
 
+/* For everything that may change the forest, see utreexo_forest_attach */
+#define CHECK_WRITABLE(x)                                                      \
+  if (x->read_only)                                                            \
+    return -1;
+
 extern int utreexo_forest_modify(struct utreexo_forest *forest,
-                                 utreexo_node_hash *utxos, int utxo_count,
-                                 utreexo_node_hash *stxos, int stxo_count) {
+                                 const utreexo_node_hash *utxos,
+                                 int utxo_count,
+                                 const utreexo_node_hash *stxos,
+                                 int stxo_count) {
   CHECK_PTR(forest);
   CHECK_PTR_VAR(utxos, utxo_count);
   CHECK_PTR_VAR(stxos, stxo_count);
+  CHECK_WRITABLE(forest);
+  if (utxo_count < 0 || stxo_count < 0)
+    return -1;
 
-  for (size_t utxo = 0; utxo < utxo_count; ++utxo) {
-    utreexo_forest_node *pnode = NULL;
-    utreexo_leaf_map_get(&forest->leaf_map, &pnode, utxos[utxo]);
-    if (pnode == NULL)
-      return -3;
-    if (delete_single(forest, pnode)) {
-      return -2;
-    }
-  }
+  UTREEXO_PROBE2(modify__start, utxo_count, stxo_count);
+  const uint64_t start = utreexo_latency_start(forest->latency);
+  // Blocks already submitted come first
+  utreexo_pipeline_stop(forest);
 
-  for (size_t i = 0; i < utxo_count; i++) {
-    utreexo_forest_add(forest, utxos[i]);
+  // Resolve all leaves we are about to delete at once, so the leaf map can
+  // overlap its I/O
+  utreexo_forest_node **pnodes =
+      malloc((stxo_count + 1) * sizeof(utreexo_forest_node *));
+  if (pnodes == NULL) {
+    UTREEXO_PROBE1(modify__done, -4);
+    return -4;
   }
-  return 0;
+  const uint64_t resolve = utreexo_latency_start(forest->latency);
+  utreexo_leaf_cache_get_many(forest->leaf_cache, &forest->leaf_map, pnodes,
+                              stxos, stxo_count);
+  utreexo_latency_end(forest->latency, UTREEXO_LATENCY_RESOLVE, resolve);
+
+  const int ret = utreexo_forest_apply(forest, pnodes, utxos, utxo_count,
+                                       stxos, stxo_count);
+  free(pnodes);
+  utreexo_latency_end(forest->latency, UTREEXO_LATENCY_MODIFY, start);
+  UTREEXO_PROBE1(modify__done, ret);
+  return ret;
 }
 
 extern int utreexo_forest_free(struct utreexo_forest *p) {
@@ -47,26 +81,541 @@ extern int utreexo_forest_free(struct utreexo_forest *p) {
   return 0;
 }
 
-extern int utreexo_forest_init(struct utreexo_forest **p, const char *map_name,
-                               const char *forest_name) {
+/* Where we keep something next to name, e.g. its trace. Returns NULL if we
+ * are out of memory */
+static char *utreexo_forest_sidecar_name(const char *name,
+                                         const char *suffix) {
+  char *sidecar = malloc(strlen(name) + strlen(suffix) + 1);
+  if (sidecar == NULL)
+    return NULL;
+  strcpy(sidecar, name);
+  strcat(sidecar, suffix);
+  return sidecar;
+}
+
+/* Starts reading ahead what the last run had in the page cache, see
+ * warm_start.h */
+static int utreexo_forest_start_warm(struct utreexo_forest *forest,
+                                     const utreexo_leaf_map *map,
+                                     const struct utreexo_forest_file *file,
+                                     const char *map_name,
+                                     const char *forest_name, int backend) {
+  int fds[2];
+  char *sidecars[2] = {NULL, NULL};
+  size_t n_files = 0;
+
+  const char *names[2] = {map_name, forest_name};
+  fds[0] = map->fd;
+  fds[1] = file->fd;
+  // The buffer pool bypasses the page cache, there's nothing to warm up
+  const size_t wanted = backend == UTREEXO_BACKEND_MMAP ? 2 : 1;
+  for (; n_files < wanted; ++n_files) {
+    sidecars[n_files] = utreexo_forest_sidecar_name(names[n_files], ".warm");
+    if (sidecars[n_files] == NULL) {
+      free(sidecars[0]);
+      return -4;
+    }
+  }
+
+  const int ret =
+      utreexo_warm_start_begin(&forest->warm_start, fds,
+                               (const char *const *)sidecars, n_files);
+  free(sidecars[0]);
+  free(sidecars[1]);
+  return ret;
+}
+
+/* Starts recording blocks into the trace next to the forest file, see
+ * trace.h */
+static int utreexo_forest_open_trace(struct utreexo_forest *forest,
+                                     const char *forest_name) {
+  char *trace_name = utreexo_forest_sidecar_name(forest_name, ".trace");
+  if (trace_name == NULL)
+    return -4;
+
+  utreexo_node_hash roots[64];
+  size_t n_roots = 0;
+  for (int i = 63; i >= 0; --i)
+    if (forest->roots[i] != NULL)
+      roots[n_roots++] = forest->roots[i]->hash;
+  const int ret = utreexo_trace_create(&forest->trace, trace_name,
+                                       *forest->nLeaf, roots, n_roots);
+  free(trace_name);
+  return ret;
+}
+
+extern int
+utreexo_forest_init_ex(struct utreexo_forest **p, const char *map_name,
+                       const char *forest_name,
+                       const struct utreexo_forest_options *options) {
   CHECK_PTR(p);
   CHECK_PTR(map_name);
   CHECK_PTR(forest_name);
 
+  const struct utreexo_forest_options defaults = {0};
+  if (options == NULL)
+    options = &defaults;
+
   utreexo_leaf_map map;
-  utreexo_leaf_map_new(&map, map_name, O_CREAT | O_RDWR, NULL);
+  if (utreexo_leaf_map_new(&map, map_name, O_CREAT | O_RDWR, NULL,
+                           options->leaf_map_slots) != 0)
+    return -1;
 
-  struct utreexo_forest *forest = malloc(sizeof(struct utreexo_forest));
+  // Zeroed, so whatever we didn't get to is NULL if we have to unwind
+  struct utreexo_forest *forest = calloc(1, sizeof(struct utreexo_forest));
+  if (forest == NULL) {
+    utreexo_leaf_map_close(&map);
+    return -4;
+  }
+  struct utreexo_leaf_cache *leaf_cache = NULL;
+  struct utreexo_proof_cache *proof_cache = NULL;
   struct utreexo_forest_file *file = NULL;
+  char *filter_name = NULL;
   char *heap;
 
-  utreexo_forest_file_init(&file, (void **)&heap, forest_name);
+  int ret = -4;
+  if (utreexo_leaf_cache_new(&leaf_cache, options->leaf_cache_size) != 0 ||
+      utreexo_proof_cache_new(&proof_cache, options->proof_cache_size) != 0)
+    goto fail;
+
+  const uint64_t pool_size =
+      options->pool_size != 0 ? options->pool_size : 1024;
+  ret = utreexo_forest_file_init_ex(
+      &file, (void **)&heap, forest_name,
+      (enum utreexo_forest_backend)options->backend, pool_size << 20);
+  if (ret != 0)
+    goto fail;
 
+  ret = -4;
   forest->data = file;
   forest->nLeaf = (uint64_t *)heap;
   forest->roots = (utreexo_forest_node **)(heap + sizeof(uint64_t));
+  // Checksums nobody keeps up to date are worse than none
+  if (!options->page_checksums)
+    utreexo_forest_file_drop_checksums(file);
+  else if (utreexo_forest_file_track_checksums(file) != 0)
+    goto fail;
+  if (options->writeback_rate != 0 &&
+      utreexo_writeback_start(&forest->writeback, file,
+                              options->writeback_rate) != 0)
+    goto fail;
+  if (options->rss_budget != 0 && options->backend == UTREEXO_BACKEND_MMAP &&
+      utreexo_rss_budget_start(&forest->rss_budget, file, forest->roots,
+                               options->rss_budget) != 0)
+    goto fail;
+  if (options->warm_start &&
+      utreexo_forest_start_warm(forest, &map, file, map_name, forest_name,
+                                options->backend) != 0)
+    goto fail;
+  if (options->leaf_filter_size != 0) {
+    filter_name = utreexo_forest_sidecar_name(map_name, ".filter");
+    if (filter_name == NULL)
+      goto fail;
+  }
+  if (options->latency_histograms) {
+    forest->latency = calloc(1, sizeof(struct utreexo_latency));
+    if (forest->latency == NULL)
+      goto fail;
+  }
+  if (filter_name != NULL) {
+    utreexo_leaf_map_attach_filter(&map, filter_name,
+                                   options->leaf_filter_size);
+    free(filter_name);
+  }
+  if (forest->latency != NULL)
+    file->alloc_latency =
+        &forest->latency->phases[UTREEXO_LATENCY_PAGE_ALLOC];
+
   forest->leaf_map = map;
+  forest->leaf_cache = leaf_cache;
+  forest->proof_cache = proof_cache;
+  memset(forest->tree_generation, 0, sizeof(forest->tree_generation));
+  forest->pipeline = NULL;
+  forest->tickets = 0;
+  forest->read_only = 0;
+  forest->deferred_hashing = options->deferred_hashing;
+  __atomic_store_n(&forest->dirty, 0, __ATOMIC_RELEASE);
+  pthread_mutex_init(&forest->hash_lock, NULL);
+  utreexo_forest_recover_hashes(forest);
+
+  // Last, so the trace starts from the roots we actually have
+  if (options->record_trace) {
+    const int trace_ret = utreexo_forest_open_trace(forest, forest_name);
+    if (trace_ret != 0) {
+      _utreexo_forest_free(forest);
+      return trace_ret;
+    }
+  }
   *p = forest;
 
   return 0;
+
+fail:
+  free(filter_name);
+  free(forest->latency);
+  utreexo_rss_budget_stop(forest->rss_budget);
+  utreexo_writeback_stop(forest->writeback);
+  utreexo_leaf_cache_free(leaf_cache, &map);
+  // After the leaf cache, which still writes to the leaf map
+  utreexo_warm_start_end(forest->warm_start);
+  if (file != NULL)
+    utreexo_forest_file_close(file);
+  utreexo_proof_cache_free(proof_cache);
+  utreexo_leaf_map_close(&map);
+  free(forest);
+  return ret;
+}
+
+extern int utreexo_forest_attach(struct utreexo_forest **p,
+                                 const char *map_name,
+                                 const char *forest_name) {
+  CHECK_PTR(p);
+  CHECK_PTR(map_name);
+  CHECK_PTR(forest_name);
+
+  struct utreexo_forest_file *file = NULL;
+  char *heap;
+  const int ret =
+      utreexo_forest_file_attach(&file, (void **)&heap, forest_name);
+  if (ret != 0)
+    return ret;
+
+  // We can't create a leaf map, the writer must have one already
+  struct utreexo_forest *forest = calloc(1, sizeof(struct utreexo_forest));
+  if (forest == NULL || access(map_name, R_OK) != 0 ||
+      utreexo_leaf_map_new(&forest->leaf_map, map_name, O_RDONLY, NULL, 0) !=
+          0) {
+    utreexo_forest_file_close(file);
+    free(forest);
+    return forest == NULL ? -4 : -1;
+  }
+
+  // No caches, they would have to follow every change the writer makes
+  forest->data = file;
+  forest->nLeaf = (uint64_t *)heap;
+  forest->roots = (utreexo_forest_node **)(heap + sizeof(uint64_t));
+  forest->read_only = 1;
+  pthread_mutex_init(&forest->hash_lock, NULL);
+  *p = forest;
+  return 0;
+}
+
+extern int utreexo_forest_init(struct utreexo_forest **p, const char *map_name,
+                               const char *forest_name) {
+  return utreexo_forest_init_ex(p, map_name, forest_name, NULL);
+}
+
+extern int utreexo_forest_serialize(struct utreexo_forest *forest,
+                                    const char *filename, int flags) {
+  CHECK_PTR(forest);
+  CHECK_PTR(filename);
+  CHECK_WRITABLE(forest);
+
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL)
+    return UTREEXO_SNAPSHOT_EIO;
+
+  int ret = utreexo_forest_serialize_file(forest, fp, flags);
+  if (fclose(fp) != 0 && ret == 0)
+    ret = UTREEXO_SNAPSHOT_EIO;
+  return ret;
+}
+
+extern int utreexo_forest_deserialize(struct utreexo_forest *forest,
+                                      const char *filename) {
+  CHECK_PTR(forest);
+  CHECK_PTR(filename);
+  CHECK_WRITABLE(forest);
+
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL)
+    return UTREEXO_SNAPSHOT_EIO;
+
+  int ret = utreexo_forest_deserialize_file(forest, fp);
+  fclose(fp);
+  return ret;
+}
+
+extern int utreexo_forest_position(struct utreexo_forest *forest,
+                                   uint64_t *pos,
+                                   const utreexo_node_hash *leaf) {
+  CHECK_PTR(forest);
+  CHECK_PTR(pos);
+  CHECK_PTR(leaf);
+
+  const uint64_t start = utreexo_latency_start(forest->latency);
+  uint64_t seq;
+  int ret;
+  do {
+    if (utreexo_forest_read_begin(forest, &seq) != 0)
+      return -1;
+    utreexo_forest_node *pnode = NULL;
+    utreexo_leaf_cache_get(forest->leaf_cache, &forest->leaf_map, &pnode,
+                           *leaf);
+    ret = utreexo_forest_node_valid(forest, pnode)
+              ? utreexo_forest_leaf_position(forest, pnode, pos)
+              : -1;
+  } while (utreexo_forest_read_retry(forest, seq));
+  utreexo_latency_end(forest->latency, UTREEXO_LATENCY_POSITION, start);
+  return ret;
+}
+
+extern int utreexo_forest_roots(struct utreexo_forest *forest,
+                                const utreexo_node_hash **roots,
+                                size_t *n_roots) {
+  CHECK_PTR(forest);
+  CHECK_PTR(roots);
+  CHECK_PTR(n_roots);
+  CHECK_WRITABLE(forest);
+
+  utreexo_forest_flush_hashes(forest);
+  *n_roots = 0;
+  for (int i = 63; i >= 0; --i)
+    if (forest->roots[i] != NULL)
+      roots[(*n_roots)++] = &forest->roots[i]->hash;
+  return 0;
+}
+
+extern int utreexo_forest_snapshot(struct utreexo_forest *forest,
+                                   utreexo_node_hash *roots, size_t *n_roots,
+                                   uint64_t *num_leaves) {
+  CHECK_PTR(forest);
+  CHECK_PTR(roots);
+  CHECK_PTR(n_roots);
+
+  utreexo_forest_flush_hashes(forest);
+  uint64_t seq;
+  do {
+    if (utreexo_forest_read_begin(forest, &seq) != 0)
+      return 1;
+    *n_roots = 0;
+    for (int i = 63; i >= 0; --i) {
+      const utreexo_forest_node *root = forest->roots[i];
+      if (root != NULL)
+        roots[(*n_roots)++] = root->hash;
+    }
+    if (num_leaves != NULL)
+      *num_leaves = *forest->nLeaf;
+  } while (utreexo_forest_read_retry(forest, seq));
+  return 0;
+}
+
+extern int utreexo_forest_num_leaves(struct utreexo_forest *forest,
+                                     uint64_t *num_leaves) {
+  CHECK_PTR(forest);
+  CHECK_PTR(num_leaves);
+
+  *num_leaves = *forest->nLeaf;
+  return 0;
+}
+
+extern int utreexo_forest_prove(struct utreexo_forest *forest,
+                                utreexo_node_hash *proof, size_t *proof_len,
+                                uint64_t *targets,
+                                const utreexo_node_hash *leaves,
+                                size_t leaf_count) {
+  CHECK_PTR(forest);
+  CHECK_PTR(proof_len);
+  CHECK_PTR_VAR(proof, *proof_len);
+  CHECK_PTR_VAR(targets, leaf_count);
+  CHECK_PTR_VAR(leaves, leaf_count);
+
+  // A proof we made while the writer was changing things may be torn, so we
+  // make it again
+  const size_t proof_cap = *proof_len;
+  const uint64_t start = utreexo_latency_start(forest->latency);
+  uint64_t seq;
+  int ret;
+  do {
+    if (utreexo_forest_read_begin(forest, &seq) != 0)
+      return -1;
+    *proof_len = proof_cap;
+    ret = utreexo_forest_prove_leaves(forest, proof, proof_len, targets,
+                                      leaves, leaf_count);
+  } while (utreexo_forest_read_retry(forest, seq));
+  utreexo_latency_end(forest->latency, UTREEXO_LATENCY_PROVE, start);
+  return ret;
+}
+
+extern int utreexo_forest_pipeline_start(struct utreexo_forest *forest,
+                                         size_t depth) {
+  CHECK_PTR(forest);
+  CHECK_WRITABLE(forest);
+
+  return utreexo_pipeline_start(forest, depth);
+}
+
+extern int utreexo_forest_submit(struct utreexo_forest *forest,
+                                 uint64_t *ticket,
+                                 const struct utreexo_block_delta *block) {
+  CHECK_PTR(forest);
+  CHECK_PTR(ticket);
+  CHECK_PTR(block);
+  CHECK_PTR_VAR(block->utxos, block->utxo_count);
+  CHECK_PTR_VAR(block->stxos, block->stxo_count);
+  CHECK_WRITABLE(forest);
+
+  return utreexo_pipeline_submit(forest, ticket, block);
+}
+
+extern int utreexo_forest_wait(struct utreexo_forest *forest,
+                               utreexo_node_hash *roots, size_t *n_roots,
+                               uint64_t ticket) {
+  CHECK_PTR(forest);
+
+  return utreexo_pipeline_wait(forest, roots, n_roots, ticket);
+}
+
+extern int utreexo_forest_pipeline_stop(struct utreexo_forest *forest) {
+  CHECK_PTR(forest);
+
+  utreexo_pipeline_stop(forest);
+  return 0;
+}
+
+extern int utreexo_forest_overlay_new(struct utreexo_overlay **overlay,
+                                      struct utreexo_forest *forest) {
+  CHECK_PTR(overlay);
+  CHECK_PTR(forest);
+  CHECK_WRITABLE(forest);
+
+  // Blocks in flight would change the forest under us
+  utreexo_pipeline_stop(forest);
+  return utreexo_overlay_new(overlay, forest);
+}
+
+extern int utreexo_forest_overlay_modify(struct utreexo_overlay *overlay,
+                                         const utreexo_node_hash *utxos,
+                                         size_t utxo_count,
+                                         const utreexo_node_hash *stxos,
+                                         size_t stxo_count) {
+  CHECK_PTR(overlay);
+  CHECK_PTR_VAR(utxos, utxo_count);
+  CHECK_PTR_VAR(stxos, stxo_count);
+
+  return utreexo_overlay_modify(overlay, utxos, utxo_count, stxos,
+                                stxo_count);
+}
+
+extern int utreexo_forest_overlay_roots(struct utreexo_overlay *overlay,
+                                        utreexo_node_hash *roots,
+                                        size_t *n_roots) {
+  CHECK_PTR(overlay);
+  CHECK_PTR(roots);
+  CHECK_PTR(n_roots);
+
+  *n_roots = utreexo_overlay_roots(overlay, roots);
+  return 0;
+}
+
+extern int utreexo_forest_overlay_commit(struct utreexo_overlay *overlay) {
+  CHECK_PTR(overlay);
+
+  utreexo_pipeline_stop(overlay->forest);
+  const int ret = utreexo_overlay_commit(overlay);
+  utreexo_overlay_free(overlay);
+  return ret;
+}
+
+extern int utreexo_forest_overlay_free(struct utreexo_overlay *overlay) {
+  CHECK_PTR(overlay);
+
+  utreexo_overlay_free(overlay);
+  return 0;
+}
+
+extern int
+utreexo_forest_leaf_cache_stats(struct utreexo_forest *forest,
+                                struct utreexo_leaf_cache_stats *stats) {
+  CHECK_PTR(forest);
+  CHECK_PTR(stats);
+
+  *stats = (struct utreexo_leaf_cache_stats){0};
+  if (forest->leaf_cache == NULL)
+    return 0;
+
+  const struct utreexo_leaf_cache_stats *cache = &forest->leaf_cache->stats;
+  stats->hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+  stats->elided = cache->elided;
+  stats->evicted = cache->evicted;
+  return 0;
+}
+
+extern int utreexo_forest_latency(struct utreexo_forest *forest, int phase,
+                                  struct utreexo_latency_stats *stats,
+                                  int reset) {
+  CHECK_PTR(forest);
+  CHECK_PTR(stats);
+  if (phase < 0 || phase >= UTREEXO_LATENCY_PHASES)
+    return -1;
+
+  *stats = (struct utreexo_latency_stats){0};
+  if (forest->latency == NULL)
+    return 0;
+  utreexo_latency_read(&forest->latency->phases[phase], stats, reset);
+  return 0;
+}
+
+extern int utreexo_forest_verify(struct utreexo_forest *forest,
+                                 struct utreexo_forest_verify_stats *stats) {
+  CHECK_PTR(forest);
+  CHECK_WRITABLE(forest);
+
+  utreexo_pipeline_stop(forest);
+  utreexo_forest_flush_hashes(forest);
+  utreexo_forest_file_update_checksums(forest->data);
+
+  struct utreexo_forest_verify_stats found = {0};
+  const int ret = utreexo_forest_check(forest, &found);
+  if (stats != NULL)
+    *stats = found;
+  return ret;
+}
+
+extern int utreexo_forest_rebuild_leaf_map(struct utreexo_forest *forest,
+                                           uint64_t *n_leaves) {
+  CHECK_PTR(forest);
+  CHECK_WRITABLE(forest);
+
+  utreexo_pipeline_stop(forest);
+  const int64_t found = utreexo_leaf_map_rebuild(forest);
+  if (found < 0)
+    return found;
+  // Every leaf it held is in the map now
+  utreexo_leaf_cache_drop(forest->leaf_cache);
+  if (n_leaves != NULL)
+    *n_leaves = found;
+  return 0;
+}
+
+extern int utreexo_forest_trace_open(struct utreexo_trace **trace,
+                                     const char *filename) {
+  CHECK_PTR(trace);
+  CHECK_PTR(filename);
+  return utreexo_trace_open(trace, filename);
+}
+
+extern int utreexo_forest_trace_next(struct utreexo_trace *trace,
+                                     struct utreexo_trace_block *block) {
+  CHECK_PTR(trace);
+  CHECK_PTR(block);
+  return utreexo_trace_next(trace, block);
+}
+
+extern int utreexo_forest_trace_start(struct utreexo_trace *trace,
+                                      uint64_t *num_leaves,
+                                      utreexo_node_hash *roots,
+                                      size_t *n_roots) {
+  CHECK_PTR(trace);
+  CHECK_PTR(num_leaves);
+  CHECK_PTR(roots);
+  CHECK_PTR(n_roots);
+  utreexo_trace_start(trace, num_leaves, roots, n_roots);
+  return 0;
+}
+
+extern int utreexo_forest_trace_close(struct utreexo_trace *trace) {
+  utreexo_trace_close(trace);
+  return 0;
 }
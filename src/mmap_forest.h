@@ -2,6 +2,7 @@
 #define MMAP_FOREST_H
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,17 +19,178 @@
 #include "parent_hash.h"
 #include "util.h"
 
+/* Mirrors utreexo_forest_options in include/utreexo.h */
+struct utreexo_forest_options {
+  uint64_t leaf_map_slots;
+  int deferred_hashing;
+  uint64_t leaf_cache_size;
+  uint64_t proof_cache_size;
+  uint64_t leaf_filter_size;
+  uint64_t writeback_rate;
+  int backend;
+  uint64_t pool_size;
+  int warm_start;
+  uint64_t rss_budget;
+  int page_checksums;
+  int record_trace;
+  int latency_histograms;
+};
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_options, leaf_map_slots, 0);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_options, deferred_hashing, 8);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_options, leaf_cache_size, 16);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_options, proof_cache_size, 24);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_options, leaf_filter_size, 32);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_options, writeback_rate, 40);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_options, backend, 48);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_options, pool_size, 56);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_options, warm_start, 64);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_options, rss_budget, 72);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_options, page_checksums, 80);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_options, record_trace, 84);
+UTREEXO_ASSERT_FIELD(struct utreexo_forest_options, latency_histograms, 88);
+UTREEXO_ASSERT_SIZE(struct utreexo_forest_options, 96);
+
+struct utreexo_leaf_cache;
+struct utreexo_proof_cache;
+struct utreexo_pipeline;
+struct utreexo_writeback;
+struct utreexo_warm_start;
+struct utreexo_rss_budget;
+struct utreexo_trace;
+
 struct utreexo_forest {
   utreexo_leaf_map leaf_map;
+  /* Recently added leaves, in front of leaf_map. May be NULL */
+  struct utreexo_leaf_cache *leaf_cache;
   struct utreexo_forest_file *data;
   utreexo_forest_node **roots;
   uint64_t *nLeaf;
+  /* Only set while blocks are being applied through utreexo_forest_submit */
+  struct utreexo_pipeline *pipeline;
+  /* Tickets handed out by pipelines we already stopped, the next one numbers
+   * its blocks from here */
+  uint64_t tickets;
+  /* If set, changes only mark nodes as dirty, and we rehash them all at once
+   * in utreexo_forest_flush_hashes */
+  int deferred_hashing;
+  /* Whether some node may be dirty, guarded by hash_lock */
+  int dirty;
+  pthread_mutex_t hash_lock;
+  /* Proofs we already made, may be NULL */
+  struct utreexo_proof_cache *proof_cache;
+  /* Bumped every time the tree of that height changes, only kept up to date
+   * if we have a proof cache */
+  uint64_t tree_generation[64];
+  /* Submits dirty pages at a steady rate, NULL if that's left to the kernel */
+  struct utreexo_writeback *writeback;
+  /* Reads ahead what was in the page cache last time, NULL if not asked to */
+  struct utreexo_warm_start *warm_start;
+  /* Hands cold pages back to the kernel, NULL if we have no budget */
+  struct utreexo_rss_budget *rss_budget;
+  /* Set if we attached to a file another process writes to, see
+   * utreexo_forest_attach */
+  int read_only;
+  /* Every block we apply is recorded here, NULL if we weren't asked to */
+  struct utreexo_trace *trace;
+  /* How long each phase of what we do takes, NULL if we weren't asked to */
+  struct utreexo_latency *latency;
 };
 
+/* Adds one leaf to the forest, without touching the leaf map. Returns the
+ * newly created leaf node. */
+static inline utreexo_forest_node *
+utreexo_forest_add_leaf(struct utreexo_forest *p, utreexo_node_hash leaf);
+
 /* Adds one node to the forest. */
 static inline void utreexo_forest_add(struct utreexo_forest *p,
                                       utreexo_node_hash leaf);
-/* Free up a forest. */
+/* Finds a node's position by walking up to its root, in O(forest rows). This
+ * works for any node, but needs all nodes in the path to be in memory.
+ *
+ * Returns 0 on success, or -1 if this node isn't in the forest anymore
+ */
+static inline int utreexo_forest_node_position(const struct utreexo_forest *f,
+                                               const utreexo_forest_node *node,
+                                               uint64_t *pos);
+
+/* Returns a leaf's position. If we are built with the position cache, every
+ * leaf knows its own position and this is O(1), otherwise it's the same as
+ * utreexo_forest_node_position. The caller must make sure this leaf wasn't
+ * deleted, e.g. by getting it from the leaf map.
+ */
+static inline int utreexo_forest_leaf_position(const struct utreexo_forest *f,
+                                               const utreexo_forest_node *leaf,
+                                               uint64_t *pos);
+
+#ifdef USE_POSITION_CACHE
+/* Updates the cached position of every leaf under node, given node's position
+ * in a forest with 63 rows. */
+static inline void utreexo_forest_cache_positions(struct utreexo_forest *f,
+                                                  utreexo_forest_node *node,
+                                                  uint64_t pos);
+
+/* Where a node is (with 63 rows), using the cached position of its leftmost
+ * leaf. */
+static inline uint64_t
+utreexo_forest_cached_position(const utreexo_forest_node *node);
+#endif
+
+/* Deletes stxos and then adds utxos, this is what utreexo_forest_modify does
+ * once it knows where each stxo is. pnodes[i] must be the leaf for stxos[i].
+ *
+ * Returns 0 on success, -2 if a deletion fails, -3 if some stxo wasn't found
+ * and -4 if we ran out of memory.
+ */
+static inline int utreexo_forest_apply(struct utreexo_forest *f,
+                                       utreexo_forest_node **pnodes,
+                                       const utreexo_node_hash *utxos,
+                                       size_t utxo_count,
+                                       const utreexo_node_hash *stxos,
+                                       size_t stxo_count);
+
+/* Records a block utreexo_forest_apply just applied, with the roots it gave
+ * us, and how long it took since start */
+static inline void utreexo_forest_record(struct utreexo_forest *f,
+                                         const utreexo_node_hash *utxos,
+                                         size_t utxo_count,
+                                         const utreexo_node_hash *stxos,
+                                         size_t stxo_count, int ret,
+                                         const struct timespec *start);
+
+/* Lets processes attached to our file see what we changed since
+ * utreexo_forest_file_write_begin. With deferred hashing and dirty nodes,
+ * that waits until utreexo_forest_flush_hashes */
+static inline void utreexo_forest_publish(struct utreexo_forest *f);
+
+/* Starts a read of an attached forest, waiting until its writer is done with
+ * whatever it's doing, and sets *seq for utreexo_forest_read_retry. Forests
+ * we write to ourselves are always consistent for us, and this does nothing.
+ * Returns 0, or -1 if the writer was restarted, or died halfway through a
+ * change, and our mapping is useless */
+static inline int utreexo_forest_read_begin(const struct utreexo_forest *f,
+                                            uint64_t *seq);
+
+/* Whether anything read since utreexo_forest_read_begin may be torn, and the
+ * read must be done again */
+static inline int utreexo_forest_read_retry(const struct utreexo_forest *f,
+                                            uint64_t seq);
+
+/* Marks node and every node above it as dirty. Dirty nodes have a zeroed hash,
+ * and so do their parents, so we can stop at the first one already dirty */
+static inline void utreexo_forest_mark_dirty(struct utreexo_forest *f,
+                                             utreexo_forest_node *node);
+
+/* Rehashes every dirty node, bottom-up, splitting big jobs between threads.
+ * This must be called before reading any hash other than a leaf's, and is a
+ * no-op without deferred hashing. Many threads may call this at once */
+static inline void utreexo_forest_flush_hashes(struct utreexo_forest *f);
+
+/* Rehashes whatever a previous writer left dirty. It may have gone away
+ * without flushing, and we can't tell from the file alone, but marking a node
+ * always reaches its root, so looking at the roots is enough */
+static inline void utreexo_forest_recover_hashes(struct utreexo_forest *f);
+
+/* Free up a forest, flushing its hashes first */
 static inline void _utreexo_forest_free(struct utreexo_forest *p);
 
 /* Deletes a single node from a forest. Requires a pointer to the actual node.
@@ -44,14 +206,30 @@ static inline int delete_single(struct utreexo_forest *f,
 static inline int delete_single_pos(struct utreexo_forest *f, uint64_t pos);
 
 /* Walks up the tree and recompute the node hashes */
-static inline void recompute_parent_hash(utreexo_forest_node *origin);
+static inline void recompute_parent_hash(struct utreexo_forest *f,
+                                         utreexo_forest_node *origin);
 
-/* Gets a node, its sibling and parent, given a node's position */
+/* Whether we may follow a pointer to this node. Our own nodes always are, but
+ * an attached forest may be changed under our feet, and we could read a
+ * pointer that's half written. Those must at least point into the file */
+static inline int utreexo_forest_node_valid(const struct utreexo_forest *f,
+                                            const utreexo_forest_node *node);
+
+/* Gets a node, its sibling and parent, given a node's position. node is set to
+ * NULL if there's no such node */
 static inline void grab_node(struct utreexo_forest *f,
                              utreexo_forest_node **node,
                              utreexo_forest_node **sibling,
                              utreexo_forest_node **parent, uint64_t pos);
 
+/* Same as grab_node, for positions in a forest with num_leaves leaves. Readers
+ * of an attached forest must use the same number everywhere, even if the
+ * writer added leaves since they read it */
+static inline void grab_node_in(struct utreexo_forest *f, uint64_t num_leaves,
+                                utreexo_forest_node **node,
+                                utreexo_forest_node **sibling,
+                                utreexo_forest_node **parent, uint64_t pos);
+
 /* A utility that implements the actual deletion code, and it's used by
  * delete_single_* */
 static inline int delete_inner(struct utreexo_forest *f,
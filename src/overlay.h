@@ -0,0 +1,105 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * A speculative layer on top of a forest. We often apply a block only to see
+ * where it takes us, and then throw it away. Doing that on the forest itself
+ * means writing to the shared mapping, and undoing it by hand.
+ *
+ * An overlay never writes to the forest under it. The first time it changes a
+ * forest node, it copies the node and changes the copy, new nodes live only
+ * in the overlay, and the same goes for the roots and the leaf map. Nodes are
+ * still named by their address in the forest, so a copy's pointers may point
+ * to forest nodes, to other copies or to new nodes, and every read goes
+ * through the overlay first.
+ *
+ * Dropping an overlay is just freeing it. Committing writes every copy back
+ * to the node it came from and moves the new nodes into the forest file, in a
+ * single pass.
+ */
+#ifndef UTREEXO_OVERLAY_H
+#define UTREEXO_OVERLAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "forest_node.h"
+#include "mmap_forest.h"
+
+/* The forest changed after this overlay was created, so we can't commit it */
+#define UTREEXO_OVERLAY_ESTALE -8
+
+/* How many nodes we allocate at once */
+#define UTREEXO_OVERLAY_CHUNK 1024
+
+/* A node this overlay knows about. For copies, id is the node in the forest,
+ * for new nodes it is the node itself */
+struct utreexo_overlay_node {
+  const utreexo_forest_node *id;
+  utreexo_forest_node *node;
+  /* Where this node ends up in the forest, only used while committing */
+  utreexo_forest_node *dest;
+};
+
+/* A leaf this overlay added or deleted. node is NULL for deleted leaves */
+struct utreexo_overlay_leaf {
+  utreexo_node_hash hash;
+  utreexo_forest_node *node;
+  /* If the forest's leaf map has this leaf, and we need to delete it */
+  int in_base;
+  int used;
+};
+
+/* Storage for our nodes, we never move them since we hand out pointers */
+struct utreexo_overlay_chunk {
+  struct utreexo_overlay_chunk *next;
+  size_t used;
+  utreexo_forest_node nodes[UTREEXO_OVERLAY_CHUNK];
+};
+
+struct utreexo_overlay {
+  struct utreexo_forest *forest;
+  /* The forest's roots and leaves when we were created, to tell whether it
+   * changed since */
+  utreexo_node_hash base_roots[64];
+  uint64_t base_leaves;
+
+  utreexo_forest_node *roots[64];
+  uint64_t n_leaves;
+
+  /* Open addressing tables, both sizes are powers of two */
+  struct utreexo_overlay_node *nodes;
+  size_t nodes_cap;
+  size_t nodes_len;
+  struct utreexo_overlay_leaf *leaves;
+  size_t leaves_cap;
+  size_t leaves_len;
+
+  struct utreexo_overlay_chunk *chunks;
+};
+
+/* Creates an empty overlay on top of f. Returns 0 on success, -4 if we are
+ * out of memory */
+static inline int utreexo_overlay_new(struct utreexo_overlay **o,
+                                      struct utreexo_forest *f);
+
+/* Drops everything in this overlay, without touching the forest */
+static inline void utreexo_overlay_free(struct utreexo_overlay *o);
+
+/* Applies a block to the overlay only. Either the whole block is applied, or
+ * nothing is and this returns -3 because some stxo isn't in the forest */
+static inline int utreexo_overlay_modify(struct utreexo_overlay *o,
+                                         const utreexo_node_hash *utxos,
+                                         size_t utxo_count,
+                                         const utreexo_node_hash *stxos,
+                                         size_t stxo_count);
+
+/* Copies the roots as they are in this overlay, tallest first */
+static inline size_t utreexo_overlay_roots(const struct utreexo_overlay *o,
+                                           utreexo_node_hash *roots);
+
+/* Writes everything to the forest. This fails with UTREEXO_OVERLAY_ESTALE,
+ * leaving the forest alone, if the forest changed since the overlay was
+ * created. The overlay still needs to be freed afterwards */
+static inline int utreexo_overlay_commit(struct utreexo_overlay *o);
+
+#endif // UTREEXO_OVERLAY_H
@@ -0,0 +1,464 @@
+#ifndef UTREEXO_OVERLAY_IMPL_H
+#define UTREEXO_OVERLAY_IMPL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flat_file_impl.h"
+#include "forest_node.h"
+#include "leaf_cache_impl.h"
+#include "leaf_map_impl.h"
+#include "mmap_forest.h"
+#include "overlay.h"
+#include "parent_hash.h"
+#include "util.h"
+
+static inline size_t utreexo_overlay_slot(uint64_t key, size_t cap) {
+  return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (cap - 1);
+}
+
+static inline uint64_t utreexo_overlay_leaf_key(const utreexo_node_hash *h) {
+  uint64_t key;
+  memcpy(&key, h->hash, sizeof(key));
+  return key;
+}
+
+static inline struct utreexo_overlay_node *
+utreexo_overlay_find(const struct utreexo_overlay *o,
+                     const utreexo_forest_node *id) {
+  size_t slot = utreexo_overlay_slot((uintptr_t)id, o->nodes_cap);
+  for (;; slot = (slot + 1) & (o->nodes_cap - 1)) {
+    struct utreexo_overlay_node *entry = &o->nodes[slot];
+    if (entry->id == id)
+      return entry;
+    if (entry->id == NULL)
+      return NULL;
+  }
+}
+
+static inline struct utreexo_overlay_leaf *
+utreexo_overlay_find_leaf(const struct utreexo_overlay *o,
+                          const utreexo_node_hash *hash) {
+  size_t slot = utreexo_overlay_slot(utreexo_overlay_leaf_key(hash),
+                                     o->leaves_cap);
+  for (;; slot = (slot + 1) & (o->leaves_cap - 1)) {
+    struct utreexo_overlay_leaf *entry = &o->leaves[slot];
+    if (!entry->used)
+      return NULL;
+    if (memcmp(entry->hash.hash, hash->hash, 32) == 0)
+      return entry;
+  }
+}
+
+static inline void utreexo_overlay_grow(struct utreexo_overlay *o) {
+  struct utreexo_overlay_node *old = o->nodes;
+  const size_t old_cap = o->nodes_cap;
+
+  o->nodes_cap *= 2;
+  o->nodes = calloc(o->nodes_cap, sizeof(struct utreexo_overlay_node));
+  if (o->nodes == NULL) {
+    perror("calloc");
+    abort();
+  }
+  for (size_t i = 0; i < old_cap; ++i) {
+    if (old[i].id == NULL)
+      continue;
+    size_t slot = utreexo_overlay_slot((uintptr_t)old[i].id, o->nodes_cap);
+    while (o->nodes[slot].id != NULL)
+      slot = (slot + 1) & (o->nodes_cap - 1);
+    o->nodes[slot] = old[i];
+  }
+  free(old);
+}
+
+static inline void utreexo_overlay_grow_leaves(struct utreexo_overlay *o) {
+  struct utreexo_overlay_leaf *old = o->leaves;
+  const size_t old_cap = o->leaves_cap;
+
+  o->leaves_cap *= 2;
+  o->leaves = calloc(o->leaves_cap, sizeof(struct utreexo_overlay_leaf));
+  if (o->leaves == NULL) {
+    perror("calloc");
+    abort();
+  }
+  for (size_t i = 0; i < old_cap; ++i) {
+    if (!old[i].used)
+      continue;
+    size_t slot = utreexo_overlay_slot(utreexo_overlay_leaf_key(&old[i].hash),
+                                       o->leaves_cap);
+    while (o->leaves[slot].used)
+      slot = (slot + 1) & (o->leaves_cap - 1);
+    o->leaves[slot] = old[i];
+  }
+  free(old);
+}
+
+static inline utreexo_forest_node *
+utreexo_overlay_alloc(struct utreexo_overlay *o,
+                      const utreexo_forest_node *id) {
+  struct utreexo_overlay_chunk *chunk = o->chunks;
+  if (chunk == NULL || chunk->used == UTREEXO_OVERLAY_CHUNK) {
+    chunk = malloc(sizeof(struct utreexo_overlay_chunk));
+    if (chunk == NULL) {
+      perror("malloc");
+      abort();
+    }
+    chunk->next = o->chunks;
+    chunk->used = 0;
+    o->chunks = chunk;
+  }
+  utreexo_forest_node *node = &chunk->nodes[chunk->used++];
+
+  // Keep the table at most half full
+  if (2 * (o->nodes_len + 1) > o->nodes_cap)
+    utreexo_overlay_grow(o);
+
+  if (id == NULL)
+    id = node;
+  size_t slot = utreexo_overlay_slot((uintptr_t)id, o->nodes_cap);
+  while (o->nodes[slot].id != NULL)
+    slot = (slot + 1) & (o->nodes_cap - 1);
+  o->nodes[slot] = (struct utreexo_overlay_node){.id = id, .node = node};
+  ++o->nodes_len;
+  return node;
+}
+
+/* The current version of a node, either our copy or the forest's node */
+static inline const utreexo_forest_node *
+utreexo_overlay_read(const struct utreexo_overlay *o,
+                     const utreexo_forest_node *id) {
+  const struct utreexo_overlay_node *entry = utreexo_overlay_find(o, id);
+  return entry != NULL ? entry->node : id;
+}
+
+/* A version of this node we may change, copying it the first time */
+static inline utreexo_forest_node *
+utreexo_overlay_write(struct utreexo_overlay *o,
+                      const utreexo_forest_node *id) {
+  const struct utreexo_overlay_node *entry = utreexo_overlay_find(o, id);
+  if (entry != NULL)
+    return entry->node;
+
+  utreexo_forest_node *node = utreexo_overlay_alloc(o, id);
+  *node = *id;
+  return node;
+}
+
+static inline void utreexo_overlay_set_leaf(struct utreexo_overlay *o,
+                                            const utreexo_node_hash *hash,
+                                            utreexo_forest_node *node) {
+  struct utreexo_overlay_leaf *entry = utreexo_overlay_find_leaf(o, hash);
+  if (entry != NULL) {
+    entry->node = node;
+    return;
+  }
+
+  if (2 * (o->leaves_len + 1) > o->leaves_cap)
+    utreexo_overlay_grow_leaves(o);
+
+  size_t slot = utreexo_overlay_slot(utreexo_overlay_leaf_key(hash),
+                                     o->leaves_cap);
+  while (o->leaves[slot].used)
+    slot = (slot + 1) & (o->leaves_cap - 1);
+  // Leaves we delete without having added them come from the forest
+  o->leaves[slot] = (struct utreexo_overlay_leaf){
+      .hash = *hash, .node = node, .in_base = node == NULL, .used = 1};
+  ++o->leaves_len;
+}
+
+#ifdef USE_POSITION_CACHE
+/* Same as utreexo_forest_cache_positions, through the overlay */
+static inline void utreexo_overlay_cache_positions(struct utreexo_overlay *o,
+                                                   utreexo_forest_node *id,
+                                                   uint64_t pos) {
+  const utreexo_forest_node *node = utreexo_overlay_read(o, id);
+  while (node->left_child != NULL) {
+    utreexo_overlay_cache_positions(o, node->right_child, (pos << 1) | 1);
+    id = node->left_child;
+    node = utreexo_overlay_read(o, id);
+    pos <<= 1;
+  }
+  if (node->position != pos)
+    utreexo_overlay_write(o, id)->position = pos;
+}
+
+static inline uint64_t
+utreexo_overlay_cached_position(const struct utreexo_overlay *o,
+                                const utreexo_forest_node *id) {
+  const utreexo_forest_node *node = utreexo_overlay_read(o, id);
+  uint8_t depth = 0;
+  while (node->left_child != NULL) {
+    node = utreexo_overlay_read(o, node->left_child);
+    ++depth;
+  }
+
+  uint64_t pos = node->position;
+  for (; depth > 0; --depth)
+    pos = parent_position(pos, 63);
+  return pos;
+}
+#endif
+
+static inline void utreexo_overlay_rehash(struct utreexo_overlay *o,
+                                          const utreexo_forest_node *id) {
+  utreexo_forest_node *pparent = utreexo_overlay_read(o, id)->parent;
+  while (pparent != NULL) {
+    utreexo_forest_node *node = utreexo_overlay_write(o, pparent);
+    parent_hash(node->hash.hash,
+                utreexo_overlay_read(o, node->left_child)->hash.hash,
+                utreexo_overlay_read(o, node->right_child)->hash.hash);
+    pparent = node->parent;
+  }
+}
+
+/* Same as utreexo_forest_add_leaf, through the overlay */
+static inline utreexo_forest_node *
+utreexo_overlay_add_leaf(struct utreexo_overlay *o, utreexo_node_hash leaf) {
+  utreexo_forest_node *pnode = utreexo_overlay_alloc(o, NULL);
+  utreexo_forest_node *pleaf = pnode;
+
+  *pnode = (utreexo_forest_node){
+      .hash = leaf, .parent = NULL, .left_child = NULL, .right_child = NULL};
+#ifdef USE_POSITION_CACHE
+  pnode->position = o->n_leaves;
+#endif
+
+  uint8_t height = 0;
+  while ((o->n_leaves >> height & 1) == 1) {
+    utreexo_forest_node *root = o->roots[height];
+    if (root == NULL) {
+      height++;
+      continue;
+    }
+    o->roots[height] = NULL;
+
+    utreexo_forest_node *proot = utreexo_overlay_alloc(o, NULL);
+    *proot = (utreexo_forest_node){
+        .parent = NULL, .left_child = root, .right_child = pnode};
+    parent_hash(proot->hash.hash, utreexo_overlay_read(o, root)->hash.hash,
+                pnode->hash.hash);
+
+    pnode->parent = proot;
+    utreexo_overlay_write(o, root)->parent = proot;
+
+    pnode = proot;
+    height++;
+  }
+  o->roots[height] = pnode;
+  ++o->n_leaves;
+#ifdef USE_POSITION_CACHE
+  const uint64_t root = root_position(o->n_leaves, height, 63);
+  if (utreexo_overlay_cached_position(o, pnode) != root)
+    utreexo_overlay_cache_positions(o, pnode, root);
+#endif
+  return pleaf;
+}
+
+/* Same as delete_single, through the overlay */
+static inline void utreexo_overlay_delete(struct utreexo_overlay *o,
+                                          utreexo_forest_node *id) {
+  utreexo_forest_node *pparent = utreexo_overlay_read(o, id)->parent;
+  if (pparent == NULL) {
+    for (size_t i = 0; i < 64; ++i)
+      if (o->roots[i] == id)
+        o->roots[i] = NULL;
+    return;
+  }
+
+  const utreexo_forest_node *parent = utreexo_overlay_read(o, pparent);
+  utreexo_forest_node *psibling =
+      parent->left_child == id ? parent->right_child : parent->left_child;
+  utreexo_forest_node *pgrandparent = parent->parent;
+
+#ifdef USE_POSITION_CACHE
+  utreexo_overlay_cache_positions(
+      o, psibling,
+      parent_position(utreexo_overlay_cached_position(o, psibling), 63));
+#endif
+
+  utreexo_overlay_write(o, psibling)->parent = pgrandparent;
+  if (pgrandparent != NULL) {
+    utreexo_forest_node *grandparent = utreexo_overlay_write(o, pgrandparent);
+    if (grandparent->right_child == pparent)
+      grandparent->right_child = psibling;
+    else
+      grandparent->left_child = psibling;
+  } else {
+    for (size_t i = 0; i < 64; ++i)
+      if (o->roots[i] == pparent)
+        o->roots[i] = psibling;
+  }
+  utreexo_overlay_rehash(o, psibling);
+}
+
+static inline int utreexo_overlay_new(struct utreexo_overlay **po,
+                                      struct utreexo_forest *f) {
+  struct utreexo_overlay *o = calloc(1, sizeof(struct utreexo_overlay));
+  if (o == NULL)
+    return -4;
+
+  o->nodes_cap = 64;
+  o->leaves_cap = 64;
+  o->nodes = calloc(o->nodes_cap, sizeof(struct utreexo_overlay_node));
+  o->leaves = calloc(o->leaves_cap, sizeof(struct utreexo_overlay_leaf));
+  if (o->nodes == NULL || o->leaves == NULL) {
+    free(o->nodes);
+    free(o->leaves);
+    free(o);
+    return -4;
+  }
+
+  // We hash on top of the forest's nodes, so they must be up to date
+  utreexo_forest_flush_hashes(f);
+  o->forest = f;
+  o->n_leaves = o->base_leaves = *f->nLeaf;
+  for (size_t i = 0; i < 64; ++i) {
+    o->roots[i] = f->roots[i];
+    if (f->roots[i] != NULL)
+      o->base_roots[i] = f->roots[i]->hash;
+  }
+
+  *po = o;
+  return 0;
+}
+
+static inline void utreexo_overlay_free(struct utreexo_overlay *o) {
+  while (o->chunks != NULL) {
+    struct utreexo_overlay_chunk *next = o->chunks->next;
+    free(o->chunks);
+    o->chunks = next;
+  }
+  free(o->nodes);
+  free(o->leaves);
+  free(o);
+}
+
+static inline int utreexo_overlay_modify(struct utreexo_overlay *o,
+                                         const utreexo_node_hash *utxos,
+                                         size_t utxo_count,
+                                         const utreexo_node_hash *stxos,
+                                         size_t stxo_count) {
+  utreexo_forest_node **pnodes =
+      malloc((stxo_count + 1) * sizeof(utreexo_forest_node *));
+  if (pnodes == NULL)
+    return -4;
+
+  // Leaves we know about hide the forest's, then we make sure every leaf is
+  // there before changing anything
+  utreexo_leaf_cache_get_many(o->forest->leaf_cache, &o->forest->leaf_map,
+                              pnodes, stxos, stxo_count);
+  for (size_t i = 0; i < stxo_count; ++i) {
+    const struct utreexo_overlay_leaf *leaf =
+        utreexo_overlay_find_leaf(o, &stxos[i]);
+    if (leaf != NULL)
+      pnodes[i] = leaf->node;
+    if (pnodes[i] == NULL) {
+      free(pnodes);
+      return -3;
+    }
+  }
+
+  for (size_t i = 0; i < stxo_count; ++i) {
+    utreexo_overlay_delete(o, pnodes[i]);
+    utreexo_overlay_set_leaf(o, &stxos[i], NULL);
+  }
+  for (size_t i = 0; i < utxo_count; ++i)
+    utreexo_overlay_set_leaf(o, &utxos[i],
+                             utreexo_overlay_add_leaf(o, utxos[i]));
+
+  free(pnodes);
+  return 0;
+}
+
+static inline size_t utreexo_overlay_roots(const struct utreexo_overlay *o,
+                                           utreexo_node_hash *roots) {
+  size_t n_roots = 0;
+  for (int i = 63; i >= 0; --i)
+    if (o->roots[i] != NULL)
+      roots[n_roots++] = utreexo_overlay_read(o, o->roots[i])->hash;
+  return n_roots;
+}
+
+/* Where a node our nodes point to ends up */
+static inline utreexo_forest_node *
+utreexo_overlay_dest(const struct utreexo_overlay *o, utreexo_forest_node *id) {
+  if (id == NULL)
+    return NULL;
+  const struct utreexo_overlay_node *entry = utreexo_overlay_find(o, id);
+  return entry != NULL ? entry->dest : id;
+}
+
+static inline int utreexo_overlay_commit(struct utreexo_overlay *o) {
+  struct utreexo_forest *f = o->forest;
+
+  if (*f->nLeaf != o->base_leaves)
+    return UTREEXO_OVERLAY_ESTALE;
+  for (size_t i = 0; i < 64; ++i) {
+    const utreexo_node_hash zero = {{0}};
+    const utreexo_node_hash *root =
+        f->roots[i] != NULL ? &f->roots[i]->hash : &zero;
+    if (memcmp(root->hash, o->base_roots[i].hash, 32) != 0)
+      return UTREEXO_OVERLAY_ESTALE;
+  }
+
+  // First give every new node a place in the file, so we know where all
+  // pointers should go, then write everything
+  utreexo_forest_file_write_begin(f->data);
+  for (size_t i = 0; i < o->nodes_cap; ++i) {
+    struct utreexo_overlay_node *entry = &o->nodes[i];
+    if (entry->id == NULL)
+      continue;
+    entry->dest = entry->id == entry->node
+                      ? utreexo_forest_file_node_alloc(f->data)
+                      : (utreexo_forest_node *)entry->id;
+  }
+  for (size_t i = 0; i < o->nodes_cap; ++i) {
+    const struct utreexo_overlay_node *entry = &o->nodes[i];
+    if (entry->id == NULL)
+      continue;
+    utreexo_forest_node node = *entry->node;
+    node.parent = utreexo_overlay_dest(o, node.parent);
+    node.left_child = utreexo_overlay_dest(o, node.left_child);
+    node.right_child = utreexo_overlay_dest(o, node.right_child);
+    *entry->dest = node;
+    utreexo_forest_file_touch(f->data, entry->dest);
+  }
+  for (size_t i = 0; i < 64; ++i) {
+    f->roots[i] = utreexo_overlay_dest(o, o->roots[i]);
+    ++f->tree_generation[i];
+  }
+  *f->nLeaf = o->n_leaves;
+
+  // Deletes go first, so leaves we spent and added again end up in the map
+  utreexo_node_hash *hashes = malloc(o->leaves_len * sizeof(utreexo_node_hash));
+  utreexo_forest_node **pleaves =
+      malloc(o->leaves_len * sizeof(utreexo_forest_node *));
+  if (o->leaves_len != 0 && (hashes == NULL || pleaves == NULL)) {
+    perror("malloc");
+    abort();
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < o->leaves_cap; ++i)
+    if (o->leaves[i].used && o->leaves[i].in_base)
+      hashes[n++] = o->leaves[i].hash;
+  utreexo_leaf_cache_delete_many(f->leaf_cache, &f->leaf_map, hashes, n);
+
+  n = 0;
+  for (size_t i = 0; i < o->leaves_cap; ++i) {
+    if (!o->leaves[i].used || o->leaves[i].node == NULL)
+      continue;
+    hashes[n] = o->leaves[i].hash;
+    pleaves[n++] = utreexo_overlay_dest(o, o->leaves[i].node);
+  }
+  utreexo_leaf_cache_set_many(f->leaf_cache, &f->leaf_map, pleaves, hashes,
+                              n);
+  utreexo_forest_publish(f);
+
+  free(pleaves);
+  free(hashes);
+  return 0;
+}
+
+#endif // UTREEXO_OVERLAY_IMPL_H
@@ -23,8 +23,8 @@ static inline void hash_from_u8(uint8_t hash[32], const uint8_t data) {
 }
 
 /* Computes the parent hash for two siblings */
-static inline void parent_hash(uint8_t out[32], uint8_t left[32],
-                               uint8_t right[32]) {
+static inline void parent_hash(uint8_t out[32], const uint8_t left[32],
+                               const uint8_t right[32]) {
   uint8_t concat[64];
   memcpy(concat, left, 32);
   memcpy(concat + 32, right, 32);
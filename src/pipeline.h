@@ -0,0 +1,111 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * A pipeline for applying blocks. Applying a block has two very different
+ * halves: first we find the leaves being spent, which is mostly waiting on the
+ * leaf map and on page faults, then we rewire the trees and rehash them, which
+ * is mostly CPU. Done one block after another, each half waits for the other.
+ *
+ * Here each half gets its own thread. The prefetcher looks up the leaves block
+ * N + 1 spends, and walks from each one to its root so every page the
+ * rehashing needs gets faulted in, while the applier is still hashing block N.
+ * Blocks are always applied in the order they were submitted.
+ *
+ * The prefetcher works on a forest that is changing under it, so everything
+ * it finds is just a hint: the applier checks each leaf before using it and
+ * looks it up again if it was wrong. That happens when a block spends
+ * something created by a block still in the pipeline. Since we never free
+ * nodes, stale pointers are always safe to read.
+ */
+#ifndef UTREEXO_PIPELINE_H
+#define UTREEXO_PIPELINE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "forest_node.h"
+#include "mmap_forest.h"
+#include "util.h"
+
+/* How many blocks may be in flight, if the caller doesn't ask for something
+ * else */
+#define UTREEXO_PIPELINE_DEPTH 4
+
+/* Errors returned by the pipeline, besides the ones modify returns */
+#define UTREEXO_PIPELINE_ESTOPPED -5
+#define UTREEXO_PIPELINE_EEXPIRED -6
+#define UTREEXO_PIPELINE_ETICKET -7
+
+/* Mirrors utreexo_block_delta in include/utreexo.h */
+struct utreexo_block_delta {
+  const utreexo_node_hash *utxos;
+  size_t utxo_count;
+  const utreexo_node_hash *stxos;
+  size_t stxo_count;
+};
+UTREEXO_ASSERT_FIELD(struct utreexo_block_delta, utxos, 0);
+UTREEXO_ASSERT_FIELD(struct utreexo_block_delta, utxo_count, 8);
+UTREEXO_ASSERT_FIELD(struct utreexo_block_delta, stxos, 16);
+UTREEXO_ASSERT_FIELD(struct utreexo_block_delta, stxo_count, 24);
+UTREEXO_ASSERT_SIZE(struct utreexo_block_delta, 32);
+
+/* One block going through the pipeline, and what came out of it */
+struct utreexo_pipeline_slot {
+  uint64_t ticket;
+  struct utreexo_block_delta block;
+  /* Where the prefetcher thinks each stxo is */
+  utreexo_forest_node **pnodes;
+  size_t pnodes_cap;
+  int ret;
+  size_t n_roots;
+  utreexo_node_hash roots[64];
+};
+
+struct utreexo_pipeline {
+  struct utreexo_forest *forest;
+  pthread_t prefetcher;
+  pthread_t applier;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t depth;
+  struct utreexo_pipeline_slot *slots;
+  /* How many blocks went through each stage, ticket t lives in slot
+   * t % depth */
+  uint64_t submitted;
+  uint64_t prefetched;
+  uint64_t applied;
+  /* Once a block fails, the forest is in an unknown state, so we fail every
+   * block after it with the same error */
+  int failed;
+  int stopping;
+};
+
+/* Starts the pipeline threads for this forest, with room for depth blocks in
+ * flight. Returns 0 on success */
+static inline int utreexo_pipeline_start(struct utreexo_forest *f,
+                                         size_t depth);
+
+/* Queues a block, blocking while the pipeline is full. The block's arrays must
+ * stay valid until it's applied. Returns 0 on success */
+static inline int
+utreexo_pipeline_submit(struct utreexo_forest *f, uint64_t *ticket,
+                        const struct utreexo_block_delta *block);
+
+/* Waits until a block is applied, and copies the roots right after it. Results
+ * are kept until the ticket's slot is reused, that is, until ticket + depth is
+ * submitted.
+ *
+ * Returns whatever applying this block returned, UTREEXO_PIPELINE_ETICKET if
+ * this ticket was never submitted, UTREEXO_PIPELINE_EEXPIRED if its result
+ * is gone, or UTREEXO_PIPELINE_ESTOPPED if the pipeline it was submitted to
+ * was stopped since.
+ */
+static inline int utreexo_pipeline_wait(struct utreexo_forest *f,
+                                        utreexo_node_hash *roots,
+                                        size_t *n_roots, uint64_t ticket);
+
+/* Applies everything already submitted, then stops the threads */
+static inline void utreexo_pipeline_stop(struct utreexo_forest *f);
+
+#endif // UTREEXO_PIPELINE_H
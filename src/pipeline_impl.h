@@ -0,0 +1,271 @@
+#ifndef UTREEXO_PIPELINE_IMPL_H
+#define UTREEXO_PIPELINE_IMPL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "forest_node.h"
+#include "latency_impl.h"
+#include "leaf_cache_impl.h"
+#include "leaf_map_impl.h"
+#include "mmap_forest.h"
+#include "pipeline.h"
+#include "util.h"
+
+/* Looks up every leaf this block spends, and faults in the path from each one
+ * to its root */
+static inline void utreexo_pipeline_prefetch(struct utreexo_forest *f,
+                                             struct utreexo_pipeline_slot *s) {
+  const struct utreexo_block_delta *block = &s->block;
+  utreexo_leaf_cache_get_many(f->leaf_cache, &f->leaf_map, s->pnodes,
+                              block->stxos, block->stxo_count);
+
+  // The applier may be rewiring these nodes as we go, so we might end up
+  // somewhere else. That's fine, any node is safe to read and we only want
+  // the pages in memory. We still stop after 64 steps, in case we never reach
+  // a root.
+  volatile uint8_t sink = 0;
+  for (size_t i = 0; i < block->stxo_count; ++i) {
+    const utreexo_forest_node *pnode = s->pnodes[i];
+    for (int depth = 0; pnode != NULL && depth < 64; ++depth) {
+      const utreexo_forest_node *pparent = pnode->parent;
+      if (pparent == NULL)
+        break;
+
+      const utreexo_forest_node *pleft = pparent->left_child;
+      const utreexo_forest_node *pright = pparent->right_child;
+      if (pleft != NULL)
+        sink += pleft->hash.hash[0];
+      if (pright != NULL)
+        sink += pright->hash.hash[0];
+      pnode = pparent;
+    }
+  }
+  (void)sink;
+}
+
+/* Applies one block, fixing whatever the prefetcher got wrong */
+static inline void utreexo_pipeline_apply(struct utreexo_pipeline *p,
+                                          struct utreexo_pipeline_slot *s) {
+  struct utreexo_forest *f = p->forest;
+  const struct utreexo_block_delta *block = &s->block;
+
+  if (p->failed) {
+    s->ret = p->failed;
+    return;
+  }
+
+  // A hint is right if it's still in the forest and has the same hash. Those
+  // that aren't were usually created by a block that was still in flight
+  const uint64_t start = utreexo_latency_start(f->latency);
+  for (size_t i = 0; i < block->stxo_count; ++i) {
+    const utreexo_forest_node *pnode = s->pnodes[i];
+    uint64_t pos;
+    if (pnode != NULL &&
+        memcmp(pnode->hash.hash, block->stxos[i].hash, 32) == 0 &&
+        utreexo_forest_node_position(f, pnode, &pos) == 0)
+      continue;
+    utreexo_leaf_cache_get(f->leaf_cache, &f->leaf_map, &s->pnodes[i],
+                           block->stxos[i]);
+  }
+  utreexo_latency_end(f->latency, UTREEXO_LATENCY_RESOLVE, start);
+
+  s->ret = utreexo_forest_apply(f, s->pnodes, block->utxos, block->utxo_count,
+                                block->stxos, block->stxo_count);
+  if (s->ret != 0)
+    p->failed = s->ret;
+
+  utreexo_forest_flush_hashes(f);
+  s->n_roots = 0;
+  for (int i = 63; i >= 0; --i)
+    if (f->roots[i] != NULL)
+      memcpy(s->roots[s->n_roots++].hash, f->roots[i]->hash.hash, 32);
+}
+
+static void *utreexo_pipeline_prefetcher(void *arg) {
+  struct utreexo_pipeline *p = arg;
+
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    while (p->prefetched == p->submitted && !p->stopping)
+      pthread_cond_wait(&p->cond, &p->lock);
+    if (p->prefetched == p->submitted)
+      break;
+
+    // Nobody else touches this slot until we say it's prefetched
+    struct utreexo_pipeline_slot *s = &p->slots[p->prefetched % p->depth];
+    pthread_mutex_unlock(&p->lock);
+
+    utreexo_pipeline_prefetch(p->forest, s);
+
+    pthread_mutex_lock(&p->lock);
+    ++p->prefetched;
+    pthread_cond_broadcast(&p->cond);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static void *utreexo_pipeline_applier(void *arg) {
+  struct utreexo_pipeline *p = arg;
+
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    while (p->applied == p->prefetched &&
+           !(p->stopping && p->applied == p->submitted))
+      pthread_cond_wait(&p->cond, &p->lock);
+    if (p->applied == p->submitted)
+      break;
+
+    struct utreexo_pipeline_slot *s = &p->slots[p->applied % p->depth];
+    pthread_mutex_unlock(&p->lock);
+
+    utreexo_pipeline_apply(p, s);
+
+    pthread_mutex_lock(&p->lock);
+    ++p->applied;
+    pthread_cond_broadcast(&p->cond);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static inline int utreexo_pipeline_start(struct utreexo_forest *f,
+                                         size_t depth) {
+  if (f->pipeline != NULL)
+    return 0;
+  if (depth == 0)
+    depth = UTREEXO_PIPELINE_DEPTH;
+
+  struct utreexo_pipeline *p = calloc(1, sizeof(struct utreexo_pipeline));
+  if (p == NULL)
+    return -4;
+  p->slots = calloc(depth, sizeof(struct utreexo_pipeline_slot));
+  if (p->slots == NULL) {
+    free(p);
+    return -4;
+  }
+  p->forest = f;
+  p->depth = depth;
+  // Tickets stay unique across pipelines, so waiting on an old one can tell
+  p->submitted = p->prefetched = p->applied = f->tickets;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+
+  if (pthread_create(&p->prefetcher, NULL, utreexo_pipeline_prefetcher, p)) {
+    free(p->slots);
+    free(p);
+    return -4;
+  }
+  if (pthread_create(&p->applier, NULL, utreexo_pipeline_applier, p)) {
+    pthread_mutex_lock(&p->lock);
+    p->stopping = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->prefetcher, NULL);
+    free(p->slots);
+    free(p);
+    return -4;
+  }
+
+  f->pipeline = p;
+  return 0;
+}
+
+static inline int
+utreexo_pipeline_submit(struct utreexo_forest *f, uint64_t *ticket,
+                        const struct utreexo_block_delta *block) {
+  if (f->pipeline == NULL) {
+    const int ret = utreexo_pipeline_start(f, UTREEXO_PIPELINE_DEPTH);
+    if (ret != 0)
+      return ret;
+  }
+  struct utreexo_pipeline *p = f->pipeline;
+
+  pthread_mutex_lock(&p->lock);
+  while (!p->stopping && p->submitted - p->applied >= p->depth)
+    pthread_cond_wait(&p->cond, &p->lock);
+  if (p->stopping) {
+    pthread_mutex_unlock(&p->lock);
+    return UTREEXO_PIPELINE_ESTOPPED;
+  }
+
+  // This slot's last block was already applied, so it's ours now
+  struct utreexo_pipeline_slot *s = &p->slots[p->submitted % p->depth];
+  if (s->pnodes_cap < block->stxo_count) {
+    utreexo_forest_node **pnodes =
+        realloc(s->pnodes, block->stxo_count * sizeof(utreexo_forest_node *));
+    if (pnodes == NULL) {
+      pthread_mutex_unlock(&p->lock);
+      return -4;
+    }
+    s->pnodes = pnodes;
+    s->pnodes_cap = block->stxo_count;
+  }
+  s->ticket = p->submitted;
+  s->block = *block;
+  s->ret = 0;
+  s->n_roots = 0;
+
+  *ticket = p->submitted++;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  return 0;
+}
+
+static inline int utreexo_pipeline_wait(struct utreexo_forest *f,
+                                        utreexo_node_hash *roots,
+                                        size_t *n_roots, uint64_t ticket) {
+  if (ticket < f->tickets)
+    return UTREEXO_PIPELINE_ESTOPPED;
+  struct utreexo_pipeline *p = f->pipeline;
+  if (p == NULL)
+    return UTREEXO_PIPELINE_ETICKET;
+
+  pthread_mutex_lock(&p->lock);
+  if (ticket >= p->submitted) {
+    pthread_mutex_unlock(&p->lock);
+    return UTREEXO_PIPELINE_ETICKET;
+  }
+  while (p->applied <= ticket)
+    pthread_cond_wait(&p->cond, &p->lock);
+
+  int ret = UTREEXO_PIPELINE_EEXPIRED;
+  const struct utreexo_pipeline_slot *s = &p->slots[ticket % p->depth];
+  if (s->ticket == ticket) {
+    ret = s->ret;
+    if (roots != NULL)
+      memcpy(roots, s->roots, s->n_roots * sizeof(utreexo_node_hash));
+    if (n_roots != NULL)
+      *n_roots = s->n_roots;
+  }
+  pthread_mutex_unlock(&p->lock);
+  return ret;
+}
+
+static inline void utreexo_pipeline_stop(struct utreexo_forest *f) {
+  struct utreexo_pipeline *p = f->pipeline;
+  if (p == NULL)
+    return;
+
+  pthread_mutex_lock(&p->lock);
+  p->stopping = 1;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+
+  pthread_join(p->prefetcher, NULL);
+  pthread_join(p->applier, NULL);
+  pthread_cond_destroy(&p->cond);
+  pthread_mutex_destroy(&p->lock);
+
+  for (size_t i = 0; i < p->depth; ++i)
+    free(p->slots[i].pnodes);
+  free(p->slots);
+  f->tickets = p->submitted;
+  free(p);
+  f->pipeline = NULL;
+}
+
+#endif // UTREEXO_PIPELINE_IMPL_H
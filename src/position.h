@@ -0,0 +1,158 @@
+/*
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * Position math for utreexo forests. Every node in a forest has a position,
+ * leaves are numbered from 0 at the bottom row, and each row above is numbered
+ * right after the one below it. For a forest with 3 rows (8 leaves):
+ *
+ *  14
+ *  |---------------\
+ *  12              13
+ *  |-------\       |-------\
+ *  08      09      10      11
+ *  |---\   |---\   |---\   |---\
+ *  00  01  02  03  04  05  06  07
+ *
+ * All functions here are constant time, they use count leading zeros instead
+ * of walking bits one by one, which compiles down to a single instruction on
+ * most targets. Every shift is done on 64-bit integers, so they
+ * work for forests of any height.
+ */
+#ifndef UTREEXO_POSITION_H
+#define UTREEXO_POSITION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Same as __builtin_clzll, but defined for zero */
+static inline uint8_t clz64(uint64_t x) {
+  return x == 0 ? 64 : __builtin_clzll(x);
+}
+
+/* A mask with the lower forest_rows + 1 bits set, that's every bit a valid
+ * position may use */
+static inline uint64_t position_mask(uint8_t forest_rows) {
+  return ((uint64_t)2 << forest_rows) - 1;
+}
+
+// detect_row finds the current row of a node, given the position
+// and the total forest rows. The row is how many set bits a position has in
+// a row, starting from bit forest_rows downwards.
+static inline int detect_row(uint64_t pos, uint64_t forest_rows) {
+  // Move bit forest_rows to the top, then count the leading ones. The bits we
+  // shift in are zeros, so this always stops before running out of bits
+  const uint64_t ones = ~(pos << (63 - forest_rows));
+  return clz64(ones) & 0xff;
+}
+
+// tree_rows returns how many rows a forest with n leaves has
+static inline int tree_rows(uint64_t n) {
+  return n == 0 ? 0 : (64 - clz64(n - 1)) & 0xff;
+}
+
+typedef struct {
+  uint8_t tree;
+  uint8_t depth;
+  uint64_t bits;
+} node_offset;
+
+// detect_offset finds in which tree a node is, and how far from the root it
+// is. Trees are identified by their height, the same index we use for roots.
+static inline node_offset detect_offset(uint64_t pos, uint64_t num_leaves) {
+  const uint8_t tr = tree_rows(num_leaves);
+  const uint8_t nr = detect_row(pos, tr);
+
+  // The leftmost leaf under this node. Trees are laid out from the tallest to
+  // the smallest, and each one takes the leaves from one bit of num_leaves,
+  // so the first bit where this leaf and num_leaves differ is our tree.
+  const uint64_t leaf = (pos << nr) & position_mask(tr);
+  const uint8_t tree = 63 - clz64(leaf ^ num_leaves);
+
+  return (node_offset){
+      .tree = tree,
+      .depth = (uint8_t)(tree - nr),
+      .bits = !pos,
+  };
+}
+
+// parent_position returns the position of a node's parent
+static inline uint64_t parent_position(uint64_t pos, uint8_t forest_rows) {
+  return (pos >> 1) | ((uint64_t)1 << forest_rows);
+}
+
+// sibling_position returns the other child of a node's parent
+static inline uint64_t sibling_position(uint64_t pos) { return pos ^ 1; }
+
+// left_child_position returns the position of a node's left child, the right
+// child is its sibling
+static inline uint64_t left_child_position(uint64_t pos, uint8_t forest_rows) {
+  return (pos << 1) & position_mask(forest_rows);
+}
+
+// root_position returns where the root of the tree at a given row would be.
+// There's no guarantee this tree exists, check num_leaves for that.
+static inline uint64_t root_position(uint64_t num_leaves, uint8_t row,
+                                     uint8_t forest_rows) {
+  const uint64_t mask = position_mask(forest_rows);
+  const uint64_t before = num_leaves & (mask << (row + 1));
+  const uint64_t shifted = (before >> row) | (mask << (forest_rows + 1 - row));
+  return shifted & mask;
+}
+
+// is_root_position returns whether a position holds one of the roots
+static inline int is_root_position(uint64_t pos, uint64_t num_leaves,
+                                   uint8_t forest_rows) {
+  const uint8_t row = detect_row(pos, forest_rows);
+  const int present = (num_leaves >> row) & 1;
+  return present && root_position(num_leaves, row, forest_rows) == pos;
+}
+
+// translate_position returns where a node would be if the forest had
+// to_rows rows instead of from_rows. Nodes keep their row and their index
+// inside that row, only the bits marking the row move. The forest must have
+// enough rows to hold the node.
+static inline uint64_t translate_position(uint64_t pos, uint8_t from_rows,
+                                          uint8_t to_rows) {
+  const uint8_t row = detect_row(pos, from_rows);
+  if (row == 0)
+    return pos;
+
+  const uint64_t index = pos & (((uint64_t)1 << (from_rows + 1 - row)) - 1);
+  const uint64_t row_bits = position_mask(to_rows) << (to_rows + 1 - row);
+  return (index | row_bits) & position_mask(to_rows);
+}
+
+// The batch versions below do the same as calling their single versions for
+// each position, but only compute what depends on num_leaves once, and have
+// no dependency between iterations, so the compiler is free to vectorize them.
+
+static inline void detect_row_many(uint8_t *rows, const uint64_t *pos,
+                                   size_t n, uint8_t forest_rows) {
+  for (size_t i = 0; i < n; ++i)
+    rows[i] = detect_row(pos[i], forest_rows);
+}
+
+static inline void parent_position_many(uint64_t *parents, const uint64_t *pos,
+                                        size_t n, uint8_t forest_rows) {
+  const uint64_t row_bit = (uint64_t)1 << forest_rows;
+  for (size_t i = 0; i < n; ++i)
+    parents[i] = (pos[i] >> 1) | row_bit;
+}
+
+static inline void detect_offset_many(node_offset *offsets,
+                                      const uint64_t *pos, size_t n,
+                                      uint64_t num_leaves) {
+  const uint8_t tr = tree_rows(num_leaves);
+  const uint64_t mask = position_mask(tr);
+  for (size_t i = 0; i < n; ++i) {
+    const uint8_t nr = detect_row(pos[i], tr);
+    const uint8_t tree = 63 - clz64(((pos[i] << nr) & mask) ^ num_leaves);
+    offsets[i] = (node_offset){
+        .tree = tree,
+        .depth = (uint8_t)(tree - nr),
+        .bits = !pos[i],
+    };
+  }
+}
+
+#endif // UTREEXO_POSITION_H
@@ -0,0 +1,56 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * Static tracepoints (USDT) on our hot paths, so a stall in production can
+ * be looked into with bpftrace or perf, without a build full of debug_print
+ * writing to stderr. They are only there if we are built with --enable-usdt
+ * and sys/sdt.h is found. Each probe is then a single nop in the code and a
+ * note in the ELF, that does nothing until someone attaches to it. Otherwise,
+ * probes and their arguments are compiled out.
+ *
+ * Every probe belongs to the utreexo provider:
+ *
+ *  modify__start(utxo_count, stxo_count)
+ *  modify__done(ret)
+ *    Around utreexo_forest_modify.
+ *  leaf_map__probe(slot, probes)
+ *    Each slot of the leaf map we look at, and how many we already looked at
+ *    for the same leaf.
+ *  page__alloc(page, reused)
+ *    A new page for nodes, reused is set if it came from the free list.
+ *  page__free(page, walked)
+ *    A page with no nodes left goes to the free list, walked is how many
+ *    free pages we went over to get to its end.
+ *  hash__path(rows)
+ *    Rehashing the path above a changed node, without deferred hashing.
+ *  hash__start(jobs, threads) and hash__done(jobs)
+ *    Around rehashing every dirty node with deferred hashing, with how many
+ *    subtrees it was split into, and how many threads work on them.
+ *
+ * e.g. bpftrace -e 'usdt:./libutreexo.so:utreexo:page__free { @ = hist(arg1) }'
+ */
+#ifndef UTREEXO_PROBES_H
+#define UTREEXO_PROBES_H
+
+#include "config.h"
+
+#ifdef USE_USDT
+#include <sys/sdt.h>
+
+#define UTREEXO_PROBE1(name, a) DTRACE_PROBE1(utreexo, name, a)
+#define UTREEXO_PROBE2(name, a, b) DTRACE_PROBE2(utreexo, name, a, b)
+#else
+/* Arguments aren't evaluated, sizeof only keeps variables that exist for a
+ * probe from looking unused */
+#define UTREEXO_PROBE1(name, a)                                                \
+  do {                                                                         \
+    (void)sizeof(a);                                                           \
+  } while (0)
+#define UTREEXO_PROBE2(name, a, b)                                             \
+  do {                                                                         \
+    (void)sizeof(a);                                                           \
+    (void)sizeof(b);                                                           \
+  } while (0)
+#endif
+
+#endif // UTREEXO_PROBES_H
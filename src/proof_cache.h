@@ -0,0 +1,80 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * A cache of single-leaf proofs. Popular leaves get proven many times between
+ * two blocks, and each time we go through the leaf map and walk the tree again.
+ *
+ * A leaf's proof is its position and the siblings on the way to its root, so
+ * it only changes when the leaf's own tree does. The forest keeps a generation
+ * counter for each tree, bumped every time that tree changes, and each entry
+ * remembers which tree it came from and its generation back then. An entry is
+ * only used if that generation is still current, so a block only invalidates
+ * the trees it touched.
+ *
+ * Positions are kept as if the forest had 63 rows, since adding leaves may
+ * change the number of rows without touching the tree.
+ */
+#ifndef UTREEXO_PROOF_CACHE_H
+#define UTREEXO_PROOF_CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "forest_node.h"
+#include "mmap_forest.h"
+
+/* How many leaves we remember, if the caller doesn't ask for something else */
+#define UTREEXO_PROOF_CACHE_SIZE 4096
+
+struct utreexo_proof_cache_entry {
+  utreexo_node_hash leaf;
+  /* Which tree this leaf is in, by height, and its generation */
+  uint8_t tree;
+  uint64_t generation;
+  /* Where this leaf is, with 63 rows */
+  uint64_t position;
+  /* Siblings from the leaf up to its root, NULL if this entry is empty */
+  utreexo_node_hash *path;
+  uint8_t path_len;
+};
+
+struct utreexo_proof_cache {
+  /* Many threads may be proving at once */
+  pthread_mutex_t lock;
+  /* Direct-mapped by leaf hash, newer entries replace older ones */
+  struct utreexo_proof_cache_entry *entries;
+  size_t size;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+/* Creates a cache holding up to size leaves (rounded up to a power of two),
+ * zero means UTREEXO_PROOF_CACHE_SIZE. Returns 0 on success, -4 if we are out
+ * of memory */
+static inline int utreexo_proof_cache_new(struct utreexo_proof_cache **cache,
+                                          size_t size);
+
+static inline void utreexo_proof_cache_free(struct utreexo_proof_cache *cache);
+
+/* Copies a leaf's proof out of the cache, if we have it and it's still
+ * current. path must have room for 64 hashes. Returns 1 on a hit, 0 otherwise
+ */
+static inline int utreexo_proof_cache_get(struct utreexo_proof_cache *cache,
+                                          const struct utreexo_forest *f,
+                                          const utreexo_node_hash *leaf,
+                                          uint64_t *position,
+                                          utreexo_node_hash *path,
+                                          uint8_t *path_len);
+
+/* Remembers the proof for a leaf, given its node. Hashes must be up to date */
+static inline void utreexo_proof_cache_put(struct utreexo_proof_cache *cache,
+                                           const struct utreexo_forest *f,
+                                           const utreexo_node_hash *leaf,
+                                           const utreexo_forest_node *node);
+
+/* Bumps the generation of the tree holding node, since it's about to change */
+static inline void utreexo_forest_touch_tree(struct utreexo_forest *f,
+                                             const utreexo_forest_node *node);
+
+#endif // UTREEXO_PROOF_CACHE_H
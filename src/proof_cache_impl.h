@@ -0,0 +1,137 @@
+#ifndef UTREEXO_PROOF_CACHE_IMPL_H
+#define UTREEXO_PROOF_CACHE_IMPL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "forest_node.h"
+#include "mmap_forest.h"
+#include "proof_cache.h"
+#include "util.h"
+
+static inline int utreexo_proof_cache_new(struct utreexo_proof_cache **pcache,
+                                          size_t size) {
+  if (size == 0)
+    size = UTREEXO_PROOF_CACHE_SIZE;
+
+  size_t entries = 1;
+  while (entries < size)
+    entries <<= 1;
+
+  struct utreexo_proof_cache *cache = calloc(1, sizeof(*cache));
+  if (cache == NULL)
+    return -4;
+  cache->entries = calloc(entries, sizeof(struct utreexo_proof_cache_entry));
+  if (cache->entries == NULL) {
+    free(cache);
+    return -4;
+  }
+  cache->size = entries;
+  pthread_mutex_init(&cache->lock, NULL);
+
+  *pcache = cache;
+  return 0;
+}
+
+static inline void utreexo_proof_cache_free(struct utreexo_proof_cache *cache) {
+  if (cache == NULL)
+    return;
+
+  for (size_t i = 0; i < cache->size; ++i)
+    free(cache->entries[i].path);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->entries);
+  free(cache);
+}
+
+static inline struct utreexo_proof_cache_entry *
+utreexo_proof_cache_entry(const struct utreexo_proof_cache *cache,
+                          const utreexo_node_hash *leaf) {
+  uint64_t key;
+  memcpy(&key, leaf->hash, sizeof(key));
+  return &cache->entries[(size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) &
+                         (cache->size - 1)];
+}
+
+static inline int utreexo_proof_cache_get(struct utreexo_proof_cache *cache,
+                                          const struct utreexo_forest *f,
+                                          const utreexo_node_hash *leaf,
+                                          uint64_t *position,
+                                          utreexo_node_hash *path,
+                                          uint8_t *path_len) {
+  int hit = 0;
+
+  pthread_mutex_lock(&cache->lock);
+  const struct utreexo_proof_cache_entry *entry =
+      utreexo_proof_cache_entry(cache, leaf);
+  if (entry->path != NULL &&
+      memcmp(entry->leaf.hash, leaf->hash, 32) == 0 &&
+      f->tree_generation[entry->tree] == entry->generation) {
+    *position = entry->position;
+    *path_len = entry->path_len;
+    memcpy(path, entry->path, entry->path_len * sizeof(utreexo_node_hash));
+    hit = 1;
+    ++cache->hits;
+  } else {
+    ++cache->misses;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return hit;
+}
+
+static inline void utreexo_proof_cache_put(struct utreexo_proof_cache *cache,
+                                           const struct utreexo_forest *f,
+                                           const utreexo_node_hash *leaf,
+                                           const utreexo_forest_node *node) {
+  utreexo_node_hash path[64];
+  uint8_t path_len = 0;
+  uint64_t position;
+  if (utreexo_forest_leaf_position(f, node, &position) != 0)
+    return;
+
+  for (; node->parent != NULL && path_len < 64; node = node->parent) {
+    const utreexo_forest_node *pparent = node->parent;
+    path[path_len++] = pparent->left_child == node ? pparent->right_child->hash
+                                                   : pparent->left_child->hash;
+  }
+
+  uint8_t tree = 0;
+  while (tree < 64 && f->roots[tree] != node)
+    ++tree;
+  if (tree == 64)
+    return;
+
+  utreexo_node_hash *copy = malloc(path_len * sizeof(utreexo_node_hash) + 1);
+  if (copy == NULL)
+    return; // it's just a cache
+  memcpy(copy, path, path_len * sizeof(utreexo_node_hash));
+
+  pthread_mutex_lock(&cache->lock);
+  struct utreexo_proof_cache_entry *entry =
+      utreexo_proof_cache_entry(cache, leaf);
+  free(entry->path);
+  *entry = (struct utreexo_proof_cache_entry){
+      .leaf = *leaf,
+      .tree = tree,
+      .generation = f->tree_generation[tree],
+      .position = translate_position(position, tree_rows(*f->nLeaf), 63),
+      .path = copy,
+      .path_len = path_len,
+  };
+  pthread_mutex_unlock(&cache->lock);
+}
+
+static inline void utreexo_forest_touch_tree(struct utreexo_forest *f,
+                                             const utreexo_forest_node *node) {
+  for (uint8_t depth = 0; node->parent != NULL && depth < 64; ++depth)
+    node = node->parent;
+
+  for (size_t i = 0; i < 64; ++i)
+    if (f->roots[i] == node)
+      ++f->tree_generation[i];
+}
+
+#endif // UTREEXO_PROOF_CACHE_IMPL_H
@@ -0,0 +1,82 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * Keeps the forest's share of the page cache under a budget. With mmap, every
+ * page we ever touched stays in the page cache until the kernel needs room,
+ * and on a shared host the forest ends up pushing out everything else.
+ *
+ * We keep an epoch for each page, the last time it was read or written (see
+ * utreexo_forest_file_access), and a background thread bumps the epoch every
+ * UTREEXO_RSS_INTERVAL_MS. Each time it does, it counts how much of the file
+ * is in the page cache (mincore). If that's over the budget, pages no one used
+ * in the last UTREEXO_RSS_COLD_EPOCHS epochs are handed back to the kernel
+ * with MADV_PAGEOUT, oldest first, until we are under it again.
+ *
+ * Pages holding the roots and the top UTREEXO_RSS_HOT_ROWS rows under them
+ * are never handed back, almost every proof and modification goes through
+ * them. The thread finds them by walking down from the roots while the
+ * forest may be changing. Pointers in the file always point somewhere inside
+ * it, so the worst we can get is a stale answer, and that's fine for a hint.
+ */
+#ifndef UTREEXO_RSS_BUDGET_H
+#define UTREEXO_RSS_BUDGET_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flat_file.h"
+#include "forest_node.h"
+
+/* How often the thread wakes up, and how long an epoch is */
+#define UTREEXO_RSS_INTERVAL_MS 1000
+/* Pages not used in this many epochs are cold */
+#define UTREEXO_RSS_COLD_EPOCHS 2
+/* Rows under each root we never hand back */
+#define UTREEXO_RSS_HOT_ROWS 10
+
+struct utreexo_rss_budget_stats {
+  /* How much of the file was in the page cache the last time we looked */
+  uint64_t resident;
+  /* Bytes we handed back to the kernel so far */
+  uint64_t advised;
+};
+
+struct utreexo_rss_budget {
+  struct utreexo_forest_file *file;
+  /* The forest's roots, 64 of them */
+  utreexo_forest_node **roots;
+  /* How many bytes of the file we want in the page cache */
+  uint64_t budget;
+  struct utreexo_rss_budget_stats stats;
+
+  /* mincore's answer, one byte for each system page */
+  unsigned char *vec;
+  size_t vec_len;
+  /* One bit for each forest page we won't hand back */
+  uint64_t *hot;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+};
+
+/* Starts tracking page accesses in file, and a thread that keeps at most
+ * budget megabytes of it in the page cache. Returns 0 on success, -4 if we
+ * are out of memory or couldn't start the thread */
+static inline int utreexo_rss_budget_start(struct utreexo_rss_budget **rb,
+                                           struct utreexo_forest_file *file,
+                                           utreexo_forest_node **roots,
+                                           uint64_t budget);
+
+/* Starts a new epoch, and if we are over the budget hands cold pages back to
+ * the kernel. This is what the thread does every time it wakes up. Returns
+ * how many bytes we handed back */
+static inline uint64_t
+utreexo_rss_budget_step(struct utreexo_rss_budget *rb);
+
+/* Stops the thread and frees rb. A NULL rb is fine */
+static inline void utreexo_rss_budget_stop(struct utreexo_rss_budget *rb);
+
+#endif // UTREEXO_RSS_BUDGET_H
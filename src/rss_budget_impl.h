@@ -0,0 +1,219 @@
+#ifndef UTREEXO_RSS_BUDGET_IMPL_H
+#define UTREEXO_RSS_BUDGET_IMPL_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flat_file_impl.h"
+#include "rss_budget.h"
+
+/* Linux 5.4, older kernels say EINVAL and we fall back to MADV_COLD, or to
+ * nothing at all */
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
+/* A page we may hand back */
+struct utreexo_rss_candidate {
+  uint32_t age;
+  uint32_t resident;
+  size_t page;
+};
+
+static int utreexo_rss_candidate_cmp(const void *a, const void *b) {
+  const struct utreexo_rss_candidate *ca = a, *cb = b;
+  // Oldest first
+  return ca->age < cb->age ? 1 : ca->age > cb->age ? -1 : 0;
+}
+
+static inline void utreexo_rss_budget_mark_hot(struct utreexo_rss_budget *rb,
+                                               const utreexo_forest_node *node,
+                                               int rows) {
+  const struct utreexo_forest_file *file = rb->file;
+  // Children come from the file, so a damaged one may point past its end
+  if (node == NULL || !utreexo_forest_file_contains(file, node, sizeof(*node)))
+    return;
+
+  const size_t page = ((const char *)node - file->map) / utreexo_page_size();
+  rb->hot[page / 64] |= (uint64_t)1 << (page % 64);
+
+  if (rows == 0)
+    return;
+  utreexo_rss_budget_mark_hot(rb, node->left_child, rows - 1);
+  utreexo_rss_budget_mark_hot(rb, node->right_child, rows - 1);
+}
+
+/* The part of a forest page we can hand back on its own, the system pages
+ * at its edges are shared with its neighbours */
+static inline void utreexo_rss_budget_range(const struct utreexo_rss_budget *rb,
+                                            size_t page, size_t sys_page,
+                                            uintptr_t *start, uintptr_t *end) {
+  const uintptr_t first =
+      (uintptr_t)rb->file->map + page * utreexo_page_size();
+  *start = (first + sys_page - 1) & ~(uintptr_t)(sys_page - 1);
+  *end = (first + utreexo_page_size()) & ~(uintptr_t)(sys_page - 1);
+}
+
+static inline uint64_t
+utreexo_rss_budget_step(struct utreexo_rss_budget *rb) {
+  struct utreexo_forest_file *file = rb->file;
+  const uint32_t epoch = __atomic_add_fetch(&file->epoch, 1, __ATOMIC_RELAXED);
+  const size_t sys_page = sysconf(_SC_PAGESIZE);
+  const uintptr_t base = (uintptr_t)file->header;
+  const uint64_t size =
+      __atomic_load_n(&file->header->filesize, __ATOMIC_RELAXED);
+
+  const size_t n_sys = (size + sys_page - 1) / sys_page;
+  if (n_sys > rb->vec_len) {
+    unsigned char *vec = realloc(rb->vec, n_sys);
+    if (vec == NULL)
+      return 0;
+    rb->vec = vec;
+    rb->vec_len = n_sys;
+  }
+  if (mincore((void *)base, n_sys * sys_page, rb->vec) != 0)
+    return 0;
+
+  uint64_t resident = 0;
+  for (size_t p = 0; p < n_sys; ++p)
+    resident += rb->vec[p] & 1;
+  resident *= sys_page;
+  __atomic_store_n(&rb->stats.resident, resident, __ATOMIC_RELAXED);
+  if (resident <= rb->budget)
+    return 0;
+
+  memset(rb->hot, 0x00, (utreexo_forest_file_max_pages() + 63) / 64 * 8);
+  for (size_t i = 0; i < 64; ++i)
+    utreexo_rss_budget_mark_hot(
+        rb, __atomic_load_n(&rb->roots[i], __ATOMIC_RELAXED),
+        UTREEXO_RSS_HOT_ROWS);
+
+  const size_t n_pages =
+      (size - sizeof(struct utreexo_forest_file_header)) / utreexo_page_size();
+  struct utreexo_rss_candidate *candidates =
+      malloc((n_pages + 1) * sizeof(*candidates));
+  if (candidates == NULL)
+    return 0;
+
+  size_t n_candidates = 0;
+  for (size_t page = 0; page < n_pages; ++page) {
+    const uint32_t age =
+        epoch - __atomic_load_n(&file->epochs[page], __ATOMIC_RELAXED);
+    if (age < UTREEXO_RSS_COLD_EPOCHS ||
+        rb->hot[page / 64] & ((uint64_t)1 << (page % 64)))
+      continue;
+
+    uintptr_t start, end;
+    utreexo_rss_budget_range(rb, page, sys_page, &start, &end);
+    uint32_t in_cache = 0;
+    for (uintptr_t p = start; p < end; p += sys_page)
+      in_cache += rb->vec[(p - base) / sys_page] & 1;
+    if (in_cache == 0)
+      continue;
+    candidates[n_candidates++] = (struct utreexo_rss_candidate){
+        .age = age, .resident = in_cache, .page = page};
+  }
+  qsort(candidates, n_candidates, sizeof(*candidates),
+        utreexo_rss_candidate_cmp);
+
+  uint64_t advised = 0;
+  for (size_t c = 0; c < n_candidates && resident > rb->budget; ++c) {
+    uintptr_t start, end;
+    utreexo_rss_budget_range(rb, candidates[c].page, sys_page, &start, &end);
+    if (madvise((void *)start, end - start, MADV_PAGEOUT) != 0 &&
+        errno == EINVAL)
+      madvise((void *)start, end - start, MADV_COLD);
+    resident -= (uint64_t)candidates[c].resident * sys_page;
+    advised += (uint64_t)candidates[c].resident * sys_page;
+  }
+  free(candidates);
+
+  __atomic_fetch_add(&rb->stats.advised, advised, __ATOMIC_RELAXED);
+  return advised;
+}
+
+static void *utreexo_rss_budget_worker(void *arg) {
+  struct utreexo_rss_budget *rb = arg;
+
+  pthread_mutex_lock(&rb->lock);
+  while (!rb->stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += UTREEXO_RSS_INTERVAL_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    int err = 0;
+    while (!rb->stop && err != ETIMEDOUT)
+      err = pthread_cond_timedwait(&rb->cond, &rb->lock, &deadline);
+    if (rb->stop)
+      break;
+
+    pthread_mutex_unlock(&rb->lock);
+    utreexo_rss_budget_step(rb);
+    pthread_mutex_lock(&rb->lock);
+  }
+  pthread_mutex_unlock(&rb->lock);
+  return NULL;
+}
+
+static inline int utreexo_rss_budget_start(struct utreexo_rss_budget **prb,
+                                           struct utreexo_forest_file *file,
+                                           utreexo_forest_node **roots,
+                                           uint64_t budget) {
+  struct utreexo_rss_budget *rb = calloc(1, sizeof(*rb));
+  if (rb == NULL)
+    return -4;
+  rb->hot = calloc((utreexo_forest_file_max_pages() + 63) / 64,
+                   sizeof(uint64_t));
+  if (rb->hot == NULL || utreexo_forest_file_track_access(file) != 0) {
+    free(rb->hot);
+    free(rb);
+    return -4;
+  }
+
+  rb->file = file;
+  rb->roots = roots;
+  rb->budget = budget << 20;
+  pthread_mutex_init(&rb->lock, NULL);
+  pthread_cond_init(&rb->cond, NULL);
+
+  if (pthread_create(&rb->thread, NULL, utreexo_rss_budget_worker, rb) != 0) {
+    pthread_cond_destroy(&rb->cond);
+    pthread_mutex_destroy(&rb->lock);
+    free(rb->hot);
+    free(rb);
+    return -4;
+  }
+
+  *prb = rb;
+  return 0;
+}
+
+static inline void utreexo_rss_budget_stop(struct utreexo_rss_budget *rb) {
+  if (rb == NULL)
+    return;
+
+  pthread_mutex_lock(&rb->lock);
+  rb->stop = 1;
+  pthread_cond_signal(&rb->cond);
+  pthread_mutex_unlock(&rb->lock);
+  pthread_join(rb->thread, NULL);
+
+  pthread_cond_destroy(&rb->cond);
+  pthread_mutex_destroy(&rb->lock);
+  free(rb->vec);
+  free(rb->hot);
+  free(rb);
+}
+
+#endif // UTREEXO_RSS_BUDGET_IMPL_H
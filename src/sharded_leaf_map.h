@@ -0,0 +1,91 @@
+/*
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * A leaf map that can be read from many threads at once. It's split into
+ * shards, each one is a regular leaf map file (see leaf_map.h), but instead
+ * of going through pread/pwrite, the slots are memory mapped and accessed with
+ * atomic loads and stores. The shard a leaf lives in is picked by the high
+ * bits of its (salted) hash, and the slot inside that shard by the low bits.
+ *
+ * Readers never take locks. This works because a slot that was ever used
+ * never becomes empty again: it starts empty, then holds a node, and once that
+ * node is deleted it holds a thumbstone, until some other node takes it. A
+ * reader skips over both thumbstones and nodes that aren't the one it wants,
+ * so it can't stop probing early because of a concurrent delete or set, and
+ * writers publish a node only after it's fully written.
+ *
+ * Writers are not synchronized with each other, so there must be at most one
+ * writer per shard at any time. utreexo_sharded_leaf_map_shard tells which
+ * shard a leaf belongs to, so callers can split their writes between threads.
+ */
+#ifndef SHARDED_LEAF_MAP_H
+#define SHARDED_LEAF_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "forest_node.h"
+#include "leaf_map.h"
+
+/* One shard, the slots point right into the mapped file */
+struct utreexo_leaf_map_shard {
+  int fd;
+  utreexo_forest_node **slots;
+  size_t map_size;
+};
+
+/* A leaf map split in many shards */
+typedef struct {
+  hashfp hash;
+  uint64_t salt;
+  /* slots per shard, always a power of two */
+  uint64_t n_slots;
+  /* we have 1 << shard_bits shards */
+  unsigned int shard_bits;
+  struct utreexo_leaf_map_shard *shards;
+} utreexo_sharded_leaf_map;
+
+/* The most shards a map may have */
+#define UTREEXO_SHARDED_LEAF_MAP_MAX_SHARDS (1 << 16)
+
+/* Opens (or creates) a sharded leaf map. Each shard is stored at
+ * "<prefix>.<shard number>". n_shards is rounded up to a power of two and
+ * n_slots is the number of slots for each shard, both are ignored if the map
+ * already exists. hash may be NULL, meaning the default hash. Returns 0 on
+ * success, -4 if we are out of memory, or -1 if the sizes are too big, or some
+ * shard can't be opened or holds something else: a file without a header, a
+ * shard of another map, or an empty shard of a map that already exists. Those
+ * are refused rather than written over, the map must be removed and rebuilt.
+ */
+static inline int
+utreexo_sharded_leaf_map_new(utreexo_sharded_leaf_map *map, const char *prefix,
+                             unsigned int n_shards, uint64_t n_slots,
+                             const hashfp hash);
+
+/* Unmaps and closes all shards */
+static inline void
+utreexo_sharded_leaf_map_close(utreexo_sharded_leaf_map *map);
+
+/* Which shard this leaf lives in */
+static inline unsigned int
+utreexo_sharded_leaf_map_shard(const utreexo_sharded_leaf_map *map,
+                               const utreexo_leaf_hash *leaf);
+
+/* Gets a node's reference from the map, may be called from any thread, even
+ * while another thread is writing to the same shard. */
+static inline void
+utreexo_sharded_leaf_map_get(const utreexo_sharded_leaf_map *map,
+                             utreexo_forest_node **node,
+                             const utreexo_leaf_hash *leaf);
+
+/* Sets a key to a given pointer. Only one thread may write to a shard */
+static inline void utreexo_sharded_leaf_map_set(utreexo_sharded_leaf_map *map,
+                                                utreexo_forest_node *node,
+                                                const utreexo_leaf_hash *leaf);
+
+/* Deletes a leaf from the map. Only one thread may write to a shard */
+static inline void
+utreexo_sharded_leaf_map_delete(utreexo_sharded_leaf_map *map,
+                                const utreexo_leaf_hash *leaf);
+
+#endif // SHARDED_LEAF_MAP_H
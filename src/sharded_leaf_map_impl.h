@@ -0,0 +1,284 @@
+#ifndef SHARDED_LEAF_MAP_IMPL_H
+#define SHARDED_LEAF_MAP_IMPL_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "forest_node.h"
+#include "leaf_map.h"
+#include "leaf_map_impl.h"
+#include "sharded_leaf_map.h"
+#include "util.h"
+
+/* Checks that a shard's file belongs to the map with this header, writing the
+ * header if it's a new, empty shard of a map we are creating. Returns 0 if we
+ * can use it, -1 otherwise */
+static inline int
+utreexo_sharded_leaf_map_check_shard(int fd, const char *filename,
+                                     const struct utreexo_leaf_map_header *want,
+                                     int created) {
+  struct utreexo_leaf_map_header header = {0};
+  struct stat st;
+  if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+      header.magic == UTREEXO_LEAF_MAP_MAGIC) {
+    // All shards are made with the same header, one from another map (or
+    // another shape of this one) would send leaves to the wrong place
+    if (header.salt != want->salt || header.n_slots != want->n_slots ||
+        header.n_shards != want->n_shards) {
+      fprintf(stderr, "%s belongs to another leaf map\n", filename);
+      return -1;
+    }
+    return 0;
+  }
+
+  // Maps without a header start with slots, writing one would corrupt them.
+  // An empty shard of a map that already exists lost all its leaves
+  if (fstat(fd, &st) != 0 || st.st_size != 0 || !created) {
+    fprintf(stderr,
+            "%s isn't a leaf map shard we can read. Remove the whole map and "
+            "rebuild it from the forest\n",
+            filename);
+    return -1;
+  }
+  if (pwrite(fd, want, sizeof(*want), 0) != sizeof(*want)) {
+    perror("pwrite");
+    return -1;
+  }
+  return 0;
+}
+
+static inline int
+utreexo_sharded_leaf_map_new(utreexo_sharded_leaf_map *map, const char *prefix,
+                             unsigned int n_shards, uint64_t n_slots,
+                             const hashfp hash) {
+  struct utreexo_leaf_map_header header = {0};
+  struct stat st;
+  char filename[4096];
+  int created = 0;
+
+  // The first shard tells whether this map already exists, and its shape
+  snprintf(filename, sizeof(filename), "%s.0", prefix);
+  int fd = open(filename, O_CREAT | O_RDWR, 0666);
+  if (fd == -1) {
+    perror("open");
+    return -1;
+  }
+
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != UTREEXO_LEAF_MAP_MAGIC) {
+    // This is checked again with the other shards, we just don't want to
+    // pick a shape for a file we'll refuse anyway
+    if (fstat(fd, &st) != 0 || st.st_size != 0) {
+      fprintf(stderr, "%s isn't a leaf map shard we can read\n", filename);
+      close(fd);
+      return -1;
+    }
+    debug_print("Creating new sharded leaf map at %s\n", prefix);
+    created = 1;
+    header.magic = UTREEXO_LEAF_MAP_MAGIC;
+    header.n_shards = 1;
+    while (header.n_shards < n_shards)
+      header.n_shards <<= 1;
+    if (header.n_shards > UTREEXO_SHARDED_LEAF_MAP_MAX_SHARDS ||
+        utreexo_leaf_map_round_slots(n_slots, &header.n_slots) != 0) {
+      close(fd);
+      return -1;
+    }
+
+    if (getrandom(&header.salt, sizeof(header.salt), 0) !=
+        sizeof(header.salt)) {
+      perror("getrandom");
+      abort();
+    }
+  } else if (header.n_slots == 0 ||
+             (header.n_slots & (header.n_slots - 1)) != 0 ||
+             header.n_slots > UTREEXO_LEAF_MAP_MAX_SLOTS ||
+             header.n_shards == 0 ||
+             (header.n_shards & (header.n_shards - 1)) != 0 ||
+             header.n_shards > UTREEXO_SHARDED_LEAF_MAP_MAX_SHARDS) {
+    fprintf(stderr, "%s has a damaged header\n", filename);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  *map = (utreexo_sharded_leaf_map){
+      .hash = hash == NULL ? utreexo_leaf_map_default_hash : hash,
+      .salt = header.salt,
+      .n_slots = header.n_slots,
+      .shard_bits = __builtin_ctzll(header.n_shards),
+      .shards = calloc(header.n_shards, sizeof(struct utreexo_leaf_map_shard)),
+  };
+  if (map->shards == NULL)
+    return -4;
+
+  const size_t map_size =
+      UTREEXO_LEAF_MAP_HEADER_SIZE + header.n_slots * sizeof(void *);
+
+  uint64_t i;
+  for (i = 0; i < header.n_shards; ++i) {
+    snprintf(filename, sizeof(filename), "%s.%lu", prefix, i);
+    fd = open(filename, O_CREAT | O_RDWR, 0666);
+    if (fd == -1) {
+      perror("open");
+      goto fail;
+    }
+
+    // Every shard gets the same header, so each one is a valid leaf map on
+    // its own. We need the whole table to be backed by the file before
+    // mapping it, but it's sparse, so this doesn't take any space
+    if (utreexo_sharded_leaf_map_check_shard(fd, filename, &header,
+                                             created) != 0)
+      goto fail_fd;
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size < map_size &&
+                                ftruncate(fd, map_size) != 0)) {
+      perror("ftruncate");
+      goto fail_fd;
+    }
+
+    char *data =
+        mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+      perror("mmap");
+      goto fail_fd;
+    }
+
+    map->shards[i] = (struct utreexo_leaf_map_shard){
+        .fd = fd,
+        .slots = (utreexo_forest_node **)(data + UTREEXO_LEAF_MAP_HEADER_SIZE),
+        .map_size = map_size,
+    };
+  }
+  return 0;
+
+fail_fd:
+  close(fd);
+fail:
+  while (i-- > 0) {
+    munmap((char *)map->shards[i].slots - UTREEXO_LEAF_MAP_HEADER_SIZE,
+           map->shards[i].map_size);
+    close(map->shards[i].fd);
+  }
+  free(map->shards);
+  map->shards = NULL;
+  return -1;
+}
+
+static inline void
+utreexo_sharded_leaf_map_close(utreexo_sharded_leaf_map *map) {
+  for (uint64_t i = 0; i < ((uint64_t)1 << map->shard_bits); ++i) {
+    munmap((char *)map->shards[i].slots - UTREEXO_LEAF_MAP_HEADER_SIZE,
+           map->shards[i].map_size);
+    close(map->shards[i].fd);
+  }
+  free(map->shards);
+  map->shards = NULL;
+}
+
+/* The salted hash of a leaf, the high bits pick a shard and the low bits a
+ * slot inside it */
+static inline uint64_t
+utreexo_sharded_leaf_map_hash(const utreexo_sharded_leaf_map *map,
+                              const utreexo_leaf_hash *leaf) {
+  unsigned char key[36] = {0};
+  memmove(key, leaf->hash, 32);
+
+  return utreexo_leaf_map_mix(map->hash(key), map->salt);
+}
+
+static inline unsigned int
+utreexo_sharded_leaf_map_shard(const utreexo_sharded_leaf_map *map,
+                               const utreexo_leaf_hash *leaf) {
+  if (map->shard_bits == 0)
+    return 0;
+  return utreexo_sharded_leaf_map_hash(map, leaf) >> (64 - map->shard_bits);
+}
+
+/* Finds the slot holding leaf, or the first empty slot if it's not there.
+ * *node is what we found in that slot. Writers may change the slot right after
+ * we looked at it, so readers must use *node instead of reading it again. If
+ * tomb isn't NULL, it gets the first thumbstone we went past, or NULL */
+static inline utreexo_forest_node **
+utreexo_sharded_leaf_map_find(const utreexo_sharded_leaf_map *map,
+                              const utreexo_leaf_hash *leaf,
+                              utreexo_forest_node **node,
+                              utreexo_forest_node ***tomb) {
+  const uint64_t hash = utreexo_sharded_leaf_map_hash(map, leaf);
+  const unsigned int shard =
+      map->shard_bits == 0 ? 0 : hash >> (64 - map->shard_bits);
+  utreexo_forest_node **slots = map->shards[shard].slots;
+  uint64_t slot = hash & (map->n_slots - 1);
+
+  if (tomb != NULL)
+    *tomb = NULL;
+  for (uint64_t probes = 0; probes < map->n_slots; ++probes) {
+    utreexo_forest_node **pslot = &slots[slot];
+    utreexo_forest_node *pnode = __atomic_load_n(pslot, __ATOMIC_ACQUIRE);
+    slot = (slot + 1) & (map->n_slots - 1);
+
+    // this is a deleted node, keep looking
+    if (pnode == utreexo_thumbstone) {
+      if (tomb != NULL && *tomb == NULL)
+        *tomb = pslot;
+      continue;
+    }
+    if (pnode == NULL || memcmp(pnode->hash.hash, leaf->hash, 32) == 0) {
+      *node = pnode;
+      return pslot;
+    }
+  }
+  *node = NULL;
+  return NULL;
+}
+
+static inline void
+utreexo_sharded_leaf_map_get(const utreexo_sharded_leaf_map *map,
+                             utreexo_forest_node **node,
+                             const utreexo_leaf_hash *leaf) {
+  utreexo_sharded_leaf_map_find(map, leaf, node, NULL);
+}
+
+static inline void utreexo_sharded_leaf_map_set(utreexo_sharded_leaf_map *map,
+                                                utreexo_forest_node *node,
+                                                const utreexo_leaf_hash *leaf) {
+  utreexo_forest_node *pnode;
+  utreexo_forest_node **tomb;
+  utreexo_forest_node **pslot =
+      utreexo_sharded_leaf_map_find(map, leaf, &pnode, &tomb);
+  // this node is already here
+  if (pnode != NULL)
+    return;
+
+  // We only know the leaf isn't here after going all the way to an empty
+  // slot, but it may go in the first thumbstone before that. Otherwise deletes
+  // would use slots up for good, and the map would eventually fill up
+  if (tomb != NULL)
+    pslot = tomb;
+  if (pslot == NULL) {
+    fprintf(stderr, "Leaf map is full\n");
+    abort();
+  }
+
+  // Release makes the node's content visible before the pointer itself
+  __atomic_store_n(pslot, node, __ATOMIC_RELEASE);
+}
+
+static inline void
+utreexo_sharded_leaf_map_delete(utreexo_sharded_leaf_map *map,
+                                const utreexo_leaf_hash *leaf) {
+  utreexo_forest_node *pnode;
+  utreexo_forest_node **pslot =
+      utreexo_sharded_leaf_map_find(map, leaf, &pnode, NULL);
+  if (pnode == NULL)
+    return;
+
+  __atomic_store_n(pslot, utreexo_thumbstone, __ATOMIC_RELEASE);
+}
+
+#endif // SHARDED_LEAF_MAP_IMPL_H
@@ -0,0 +1,130 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * Records every block applied to a forest, so it can be replayed later,
+ * somewhere else. A trace taken on a node that's slow at some height can be
+ * applied again on a dev box, under other build options, backends or thread
+ * counts, with no network and no chain. Each block carries the roots it gave,
+ * so a replay can tell right away if it took a different path.
+ *
+ * A trace is a header with the forest's state when recording started,
+ * followed by one record per block, all in host byte order: a
+ * utreexo_trace_record, then the utxos, the stxos and the roots, each a
+ * 32-byte hash. Records are written with a single write each, so a trace cut
+ * short by a crash loses at most its last block.
+ *
+ * Blocks only make sense applied to the forest they were recorded on, so a
+ * trace can only be appended to by a forest that is where the trace ends,
+ * and replaying one must start where it does.
+ */
+#ifndef UTREEXO_TRACE_H
+#define UTREEXO_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "parent_hash.h"
+#include "util.h"
+
+/* Hexadecimal for UTXTRACE, used to tell whether a file is a trace */
+#define UTREEXO_TRACE_MAGIC 0x4543415254585455
+#define UTREEXO_TRACE_VERSION 2
+
+/* Persisted at the beginning of the file */
+struct utreexo_trace_header {
+  uint64_t magic;
+  uint32_t version;
+  /* How many roots the forest had before the first block */
+  uint32_t n_roots;
+  /* How many leaves were ever added, before the first block */
+  uint64_t num_leaves;
+  /* Those roots, from the tallest tree down */
+  utreexo_node_hash roots[64];
+};
+
+/* Comes before the hashes of each block */
+struct utreexo_trace_record {
+  uint32_t utxo_count;
+  uint32_t stxo_count;
+  uint32_t n_roots;
+  /* What applying this block returned */
+  int32_t ret;
+  /* How many leaves were ever added, after this block */
+  uint64_t num_leaves;
+  /* How long applying it took, in nanoseconds */
+  uint64_t nanos;
+};
+
+/* Mirrors utreexo_trace_block in include/utreexo.h */
+struct utreexo_trace_block {
+  const utreexo_node_hash *utxos;
+  size_t utxo_count;
+  const utreexo_node_hash *stxos;
+  size_t stxo_count;
+  const utreexo_node_hash *roots;
+  size_t n_roots;
+  uint64_t num_leaves;
+  uint64_t nanos;
+  int ret;
+};
+UTREEXO_ASSERT_FIELD(struct utreexo_trace_block, utxos, 0);
+UTREEXO_ASSERT_FIELD(struct utreexo_trace_block, utxo_count, 8);
+UTREEXO_ASSERT_FIELD(struct utreexo_trace_block, stxos, 16);
+UTREEXO_ASSERT_FIELD(struct utreexo_trace_block, stxo_count, 24);
+UTREEXO_ASSERT_FIELD(struct utreexo_trace_block, roots, 32);
+UTREEXO_ASSERT_FIELD(struct utreexo_trace_block, n_roots, 40);
+UTREEXO_ASSERT_FIELD(struct utreexo_trace_block, num_leaves, 48);
+UTREEXO_ASSERT_FIELD(struct utreexo_trace_block, nanos, 56);
+UTREEXO_ASSERT_FIELD(struct utreexo_trace_block, ret, 64);
+UTREEXO_ASSERT_SIZE(struct utreexo_trace_block, 72);
+
+struct utreexo_trace {
+  /* -1 once we stopped recording, see utreexo_trace_write */
+  int fd;
+  /* Where the forest was before the first block */
+  struct utreexo_trace_header header;
+  /* Where a record is put together, or read into */
+  char *buf;
+  size_t cap;
+};
+
+/* Opens filename to record blocks into, creating it if needed, for a forest
+ * with these roots (from the tallest tree down) and num_leaves. Blocks from an
+ * existing trace are kept, and new ones go after them, but only if the trace
+ * ends where the forest is. Returns 0 on success, -1 if the file can't be
+ * opened, isn't a trace, or ends somewhere else, and -4 if we are out of
+ * memory */
+static inline int utreexo_trace_create(struct utreexo_trace **trace,
+                                       const char *filename,
+                                       uint64_t num_leaves,
+                                       const utreexo_node_hash *roots,
+                                       size_t n_roots);
+
+/* Opens filename to read the blocks in it, returns the same as
+ * utreexo_trace_create */
+static inline int utreexo_trace_open(struct utreexo_trace **trace,
+                                     const char *filename);
+
+/* Appends one block. A trace that can't be written to is closed, with a
+ * message, and the forest keeps going without it */
+static inline void utreexo_trace_write(struct utreexo_trace *trace,
+                                       const struct utreexo_trace_block *block);
+
+/* Reads the next block. Everything it points to is only good until the next
+ * call. Returns 0 if we read a block, 1 at the end of the trace, -9 if the
+ * trace is damaged or cut short, and -4 if we are out of memory */
+static inline int utreexo_trace_next(struct utreexo_trace *trace,
+                                     struct utreexo_trace_block *block);
+
+/* Where the forest was before the first block: its roots, from the tallest
+ * tree down, and how many leaves were ever added to it. roots must have room
+ * for 64 */
+static inline void utreexo_trace_start(const struct utreexo_trace *trace,
+                                       uint64_t *num_leaves,
+                                       utreexo_node_hash *roots,
+                                       size_t *n_roots);
+
+/* Closes the trace, trace may be NULL */
+static inline void utreexo_trace_close(struct utreexo_trace *trace);
+
+#endif // UTREEXO_TRACE_H
@@ -0,0 +1,239 @@
+#ifndef UTREEXO_TRACE_IMPL_H
+#define UTREEXO_TRACE_IMPL_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Makes sure trace->buf holds at least len bytes. Returns 0 or -4 */
+static inline int utreexo_trace_reserve(struct utreexo_trace *trace,
+                                        size_t len) {
+  if (len <= trace->cap)
+    return 0;
+
+  size_t cap = trace->cap ? trace->cap : 4096;
+  while (cap < len)
+    cap *= 2;
+  char *buf = realloc(trace->buf, cap);
+  if (buf == NULL)
+    return -4;
+  trace->buf = buf;
+  trace->cap = cap;
+  return 0;
+}
+
+/* Opens filename with flags, and checks or writes its header. A new trace
+ * starts at start, if we may create it */
+static inline int
+utreexo_trace_init(struct utreexo_trace **trace, const char *filename,
+                   int flags, const struct utreexo_trace_header *start) {
+  struct utreexo_trace *t = calloc(1, sizeof(struct utreexo_trace));
+  if (t == NULL)
+    return -4;
+
+  t->fd = open(filename, flags, 0644);
+  struct stat st;
+  if (t->fd < 0 || fstat(t->fd, &st) != 0) {
+    utreexo_trace_close(t);
+    return -1;
+  }
+
+  if (st.st_size == 0 && (flags & O_CREAT)) {
+    t->header = *start;
+    if (write(t->fd, &t->header, sizeof(t->header)) != sizeof(t->header)) {
+      utreexo_trace_close(t);
+      return -1;
+    }
+  } else if (pread(t->fd, &t->header, sizeof(t->header), 0) !=
+                 sizeof(t->header) ||
+             t->header.magic != UTREEXO_TRACE_MAGIC ||
+             t->header.version != UTREEXO_TRACE_VERSION ||
+             t->header.n_roots > 64) {
+    utreexo_trace_close(t);
+    return -1;
+  }
+
+  // Reads start after the header, writes always go at the end
+  if (lseek(t->fd, sizeof(t->header), SEEK_SET) != sizeof(t->header)) {
+    utreexo_trace_close(t);
+    return -1;
+  }
+  *trace = t;
+  return 0;
+}
+
+/* Reads the whole trace, and checks it ends at end. Returns 0 if it does,
+ * -1 if it doesn't or is damaged, and -4 if we are out of memory */
+static inline int utreexo_trace_check_end(struct utreexo_trace *trace,
+                                          const struct utreexo_trace_header
+                                              *end) {
+  uint64_t num_leaves = trace->header.num_leaves;
+  size_t n_roots = trace->header.n_roots;
+  const utreexo_node_hash *roots = trace->header.roots;
+
+  struct utreexo_trace_block block;
+  int ret;
+  while ((ret = utreexo_trace_next(trace, &block)) == 0) {
+    num_leaves = block.num_leaves;
+    n_roots = block.n_roots;
+    roots = block.roots;
+  }
+  if (ret == -4)
+    return -4;
+  if (ret < 0 || num_leaves != end->num_leaves || n_roots != end->n_roots ||
+      memcmp(roots, end->roots, n_roots * sizeof(utreexo_node_hash)) != 0)
+    return -1;
+  return 0;
+}
+
+static inline int utreexo_trace_create(struct utreexo_trace **trace,
+                                       const char *filename,
+                                       uint64_t num_leaves,
+                                       const utreexo_node_hash *roots,
+                                       size_t n_roots) {
+  if (n_roots > 64)
+    return -1;
+  struct utreexo_trace_header start = {
+      .magic = UTREEXO_TRACE_MAGIC,
+      .version = UTREEXO_TRACE_VERSION,
+      .n_roots = n_roots,
+      .num_leaves = num_leaves,
+  };
+  memcpy(start.roots, roots, n_roots * sizeof(utreexo_node_hash));
+
+  struct utreexo_trace *t = NULL;
+  int ret =
+      utreexo_trace_init(&t, filename, O_CREAT | O_RDWR | O_APPEND, &start);
+  if (ret != 0)
+    return ret;
+
+  // Blocks after a gap in the trace couldn't be replayed
+  ret = utreexo_trace_check_end(t, &start);
+  if (ret != 0) {
+    if (ret == -1)
+      fprintf(stderr,
+              "%s doesn't end where the forest is, not appending to it\n",
+              filename);
+    utreexo_trace_close(t);
+    return ret;
+  }
+  *trace = t;
+  return 0;
+}
+
+static inline int utreexo_trace_open(struct utreexo_trace **trace,
+                                     const char *filename) {
+  return utreexo_trace_init(trace, filename, O_RDONLY, NULL);
+}
+
+static inline void utreexo_trace_start(const struct utreexo_trace *trace,
+                                       uint64_t *num_leaves,
+                                       utreexo_node_hash *roots,
+                                       size_t *n_roots) {
+  *num_leaves = trace->header.num_leaves;
+  *n_roots = trace->header.n_roots;
+  memcpy(roots, trace->header.roots,
+         trace->header.n_roots * sizeof(utreexo_node_hash));
+}
+
+static inline void
+utreexo_trace_write(struct utreexo_trace *trace,
+                    const struct utreexo_trace_block *block) {
+  if (trace->fd < 0)
+    return;
+
+  const struct utreexo_trace_record record = {
+      .utxo_count = block->utxo_count,
+      .stxo_count = block->stxo_count,
+      .n_roots = block->n_roots,
+      .ret = block->ret,
+      .num_leaves = block->num_leaves,
+      .nanos = block->nanos,
+  };
+  const size_t n_hashes =
+      block->utxo_count + block->stxo_count + block->n_roots;
+  const size_t len = sizeof(record) + n_hashes * sizeof(utreexo_node_hash);
+  if (utreexo_trace_reserve(trace, len) == 0) {
+    char *p = trace->buf;
+    memcpy(p, &record, sizeof(record));
+    p += sizeof(record);
+    memcpy(p, block->utxos, block->utxo_count * sizeof(utreexo_node_hash));
+    p += block->utxo_count * sizeof(utreexo_node_hash);
+    memcpy(p, block->stxos, block->stxo_count * sizeof(utreexo_node_hash));
+    p += block->stxo_count * sizeof(utreexo_node_hash);
+    memcpy(p, block->roots, block->n_roots * sizeof(utreexo_node_hash));
+
+    if (write(trace->fd, trace->buf, len) == (ssize_t)len)
+      return;
+  } else {
+    errno = ENOMEM;
+  }
+
+  // A trace is only good if it has every block, there's no use going on
+  perror("utreexo trace");
+  close(trace->fd);
+  trace->fd = -1;
+}
+
+/* Reads exactly len bytes, returns how many we got */
+static inline size_t utreexo_trace_read(int fd, void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    const ssize_t n = read(fd, (char *)buf + done, len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  return done;
+}
+
+static inline int utreexo_trace_next(struct utreexo_trace *trace,
+                                     struct utreexo_trace_block *block) {
+  struct utreexo_trace_record record;
+  const size_t got = utreexo_trace_read(trace->fd, &record, sizeof(record));
+  if (got == 0)
+    return 1;
+  if (got != sizeof(record) || record.n_roots > 64)
+    return -9;
+
+  const size_t n_hashes =
+      (size_t)record.utxo_count + record.stxo_count + record.n_roots;
+  const size_t len = n_hashes * sizeof(utreexo_node_hash);
+  if (utreexo_trace_reserve(trace, len) != 0)
+    return -4;
+  if (utreexo_trace_read(trace->fd, trace->buf, len) != len)
+    return -9;
+
+  const utreexo_node_hash *hashes = (const utreexo_node_hash *)trace->buf;
+  *block = (struct utreexo_trace_block){
+      .utxos = hashes,
+      .utxo_count = record.utxo_count,
+      .stxos = hashes + record.utxo_count,
+      .stxo_count = record.stxo_count,
+      .roots = hashes + record.utxo_count + record.stxo_count,
+      .n_roots = record.n_roots,
+      .num_leaves = record.num_leaves,
+      .nanos = record.nanos,
+      .ret = record.ret,
+  };
+  return 0;
+}
+
+static inline void utreexo_trace_close(struct utreexo_trace *trace) {
+  if (trace == NULL)
+    return;
+  if (trace->fd >= 0)
+    close(trace->fd);
+  free(trace->buf);
+  free(trace);
+}
+
+#endif // UTREEXO_TRACE_IMPL_H
@@ -0,0 +1,185 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * A tiny io_uring wrapper, just enough to let the leaf map have many reads and
+ * writes in flight at once. We talk to the kernel directly instead of using
+ * liburing, so the only thing we need at build time is the kernel header.
+ *
+ * If the kernel doesn't support io_uring (or we are not allowed to use it),
+ * utreexo_uring_init fails and callers should fall back to blocking I/O.
+ */
+#ifndef UTREEXO_URING_H
+#define UTREEXO_URING_H
+
+#include "config.h"
+
+#ifdef USE_IO_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* How many requests we may have in flight at once */
+#define UTREEXO_URING_DEPTH 256
+
+/* The submission and completion rings, as shared with the kernel */
+struct utreexo_uring {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_len;
+  size_t cq_len;
+  size_t sqes_len;
+  /* Submitted to the ring, but not handed to the kernel yet */
+  unsigned to_submit;
+};
+
+static inline void utreexo_uring_close(struct utreexo_uring *ring) {
+  munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_ptr != ring->sq_ptr)
+    munmap(ring->cq_ptr, ring->cq_len);
+  munmap(ring->sq_ptr, ring->sq_len);
+  close(ring->fd);
+  free(ring);
+}
+
+/* Creates a new ring, returns NULL if io_uring isn't available */
+static inline struct utreexo_uring *utreexo_uring_init(unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0x00, sizeof(params));
+
+  const int fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0)
+    return NULL;
+
+  struct utreexo_uring *ring = calloc(1, sizeof(struct utreexo_uring));
+  if (ring == NULL) {
+    close(fd);
+    return NULL;
+  }
+  ring->fd = fd;
+  ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_len =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  // Newer kernels let us map both rings at once
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_len > ring->sq_len)
+      ring->sq_len = ring->cq_len;
+    ring->cq_len = ring->sq_len;
+  }
+
+  ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED) {
+    close(fd);
+    free(ring);
+    return NULL;
+  }
+
+  ring->cq_ptr = ring->sq_ptr;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+  if (ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+      munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sqes != MAP_FAILED)
+      munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->sq_ptr, ring->sq_len);
+    close(fd);
+    free(ring);
+    return NULL;
+  }
+
+  char *sq = ring->sq_ptr;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+  char *cq = ring->cq_ptr;
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  return ring;
+}
+
+/* Queues a read or write of len bytes at offset off. user_data is handed back
+ * with the completion, so callers can tell requests apart */
+static inline void utreexo_uring_prep(struct utreexo_uring *ring, uint8_t op,
+                                      int fd, void *buf, unsigned len,
+                                      uint64_t off, uint64_t user_data) {
+  const unsigned tail = *ring->sq_tail;
+  const unsigned idx = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+  memset(sqe, 0x00, sizeof(struct io_uring_sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = user_data;
+
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++ring->to_submit;
+}
+
+/* Hands everything we've queued to the kernel, and waits until at least
+ * wait_nr requests complete. A signal may cut the wait short, so callers
+ * reap what's there and submit again. Returns a negative value on error, and
+ * errno says which */
+static inline int utreexo_uring_submit(struct utreexo_uring *ring,
+                                       unsigned wait_nr) {
+  const unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+  int ret;
+  do
+    ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr,
+                  flags, NULL, 0);
+  while (ret < 0 && errno == EINTR);
+  if (ret < 0)
+    return ret;
+  ring->to_submit -= ret;
+  return ret;
+}
+
+/* Pops one completion from the ring, returns 0 if there's nothing there */
+static inline int utreexo_uring_reap(struct utreexo_uring *ring,
+                                     uint64_t *user_data, int *res) {
+  const unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+
+  const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+  *user_data = cqe->user_data;
+  *res = cqe->res;
+
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+#endif // USE_IO_URING
+#endif // UTREEXO_URING_H
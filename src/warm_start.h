@@ -0,0 +1,82 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * Gets the page cache back to where it was before a restart. While the forest
+ * runs, the pages it uses most stay in the page cache. After a restart they
+ * are gone, and the first few thousand blocks wait on the disk for every
+ * page they touch, one fault at a time.
+ *
+ * When we shut down, we ask the kernel which pages of each file are in the
+ * page cache (mincore on a throwaway mapping), and write them to a sidecar
+ * file next to it, as runs of consecutive pages. The next time the files are
+ * opened, a background thread goes over those runs in file order and asks the
+ * kernel to read them ahead. Those are large sequential reads instead of
+ * random faults, and they happen while we are already applying blocks.
+ */
+#ifndef UTREEXO_WARM_START_H
+#define UTREEXO_WARM_START_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Hexadecimal for WARMSTRT, used to tell whether a file is a sidecar */
+#define UTREEXO_WARM_START_MAGIC 0x545254534d524157ULL
+/* The most files a warm start looks after */
+#define UTREEXO_WARM_START_MAX_FILES 4
+/* How much we ask the kernel to read at once, the thread checks whether it
+ * should stop in between */
+#define UTREEXO_WARM_START_CHUNK (1 << 20)
+
+/* Persisted at the beginning of a sidecar, followed by n_runs runs */
+struct utreexo_warm_start_header {
+  uint64_t magic;
+  /* The page size runs are counted in */
+  uint64_t page_size;
+  uint64_t n_runs;
+};
+
+/* Pages [first, first + count) were in the page cache */
+struct utreexo_warm_start_run {
+  uint64_t first;
+  uint64_t count;
+};
+
+struct utreexo_warm_start {
+  int fds[UTREEXO_WARM_START_MAX_FILES];
+  char *sidecars[UTREEXO_WARM_START_MAX_FILES];
+  size_t n_files;
+
+  /* How many bytes we asked the kernel to read so far */
+  uint64_t replayed;
+  int stop;
+  pthread_t thread;
+};
+
+/* Writes which pages of fd are in the page cache to sidecar. Returns 0 on
+ * success, -1 if we couldn't look at fd or write the sidecar, and -4 if we
+ * are out of memory */
+static inline int utreexo_warm_start_save(int fd, const char *sidecar);
+
+/* Reads the runs in sidecar. *runs must be freed by the caller. Returns 0 on
+ * success, -1 if there's no sidecar or it isn't one for this page size, and
+ * -4 if we are out of memory */
+static inline int utreexo_warm_start_load(const char *sidecar,
+                                          struct utreexo_warm_start_run **runs,
+                                          uint64_t *n_runs);
+
+/* Starts a thread that reads ahead the pages recorded in each sidecar, from
+ * the file next to it. fds must stay open until utreexo_warm_start_end.
+ * Files without a sidecar are skipped. Returns 0 on success, -1 if there are
+ * too many files, and -4 if we are out of memory or couldn't start the thread
+ */
+static inline int utreexo_warm_start_begin(struct utreexo_warm_start **ws,
+                                           const int *fds,
+                                           const char *const *sidecars,
+                                           size_t n_files);
+
+/* Stops the thread if it's still going, records the pages in the page cache
+ * for the next start, and frees ws. A NULL ws is fine */
+static inline void utreexo_warm_start_end(struct utreexo_warm_start *ws);
+
+#endif // UTREEXO_WARM_START_H
@@ -0,0 +1,205 @@
+#ifndef UTREEXO_WARM_START_IMPL_H
+#define UTREEXO_WARM_START_IMPL_H
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "warm_start.h"
+
+/* How much of a file we look at in one mincore call */
+#define UTREEXO_WARM_START_WINDOW ((uint64_t)1 << 30)
+
+static inline int utreexo_warm_start_save(int fd, const char *sidecar) {
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return -1;
+
+  const uint64_t page_size = sysconf(_SC_PAGESIZE);
+  const uint64_t size = st.st_size;
+  unsigned char *vec = malloc(UTREEXO_WARM_START_WINDOW / page_size);
+  struct utreexo_warm_start_run *runs = NULL;
+  uint64_t n_runs = 0, capacity = 0;
+  if (vec == NULL)
+    return -4;
+
+  // Mapping the whole file would do, but it may be tens of GB of sparse
+  // leaf map, and the vector for that alone is as big as what we save
+  for (uint64_t offset = 0; offset < size;
+       offset += UTREEXO_WARM_START_WINDOW) {
+    const uint64_t len = size - offset < UTREEXO_WARM_START_WINDOW
+                             ? size - offset
+                             : UTREEXO_WARM_START_WINDOW;
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+    if (map == MAP_FAILED) {
+      free(runs);
+      free(vec);
+      return -1;
+    }
+    const int ret = mincore(map, len, vec);
+    munmap(map, len);
+    if (ret != 0) {
+      free(runs);
+      free(vec);
+      return -1;
+    }
+
+    const uint64_t first_page = offset / page_size;
+    for (uint64_t p = 0; p < (len + page_size - 1) / page_size; ++p) {
+      if (!(vec[p] & 1))
+        continue;
+      // Extends the last run if this page follows it
+      if (n_runs > 0 && runs[n_runs - 1].first + runs[n_runs - 1].count ==
+                            first_page + p) {
+        ++runs[n_runs - 1].count;
+        continue;
+      }
+      if (n_runs == capacity) {
+        capacity = capacity ? 2 * capacity : 64;
+        struct utreexo_warm_start_run *grown =
+            realloc(runs, capacity * sizeof(*runs));
+        if (grown == NULL) {
+          free(runs);
+          free(vec);
+          return -4;
+        }
+        runs = grown;
+      }
+      runs[n_runs++] =
+          (struct utreexo_warm_start_run){.first = first_page + p, .count = 1};
+    }
+  }
+  free(vec);
+
+  const struct utreexo_warm_start_header header = {
+      .magic = UTREEXO_WARM_START_MAGIC,
+      .page_size = page_size,
+      .n_runs = n_runs,
+  };
+  FILE *fp = fopen(sidecar, "wb");
+  int ret = fp != NULL ? 0 : -1;
+  if (fp != NULL &&
+      (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+       fwrite(runs, sizeof(*runs), n_runs, fp) != n_runs))
+    ret = -1;
+  if (fp != NULL && fclose(fp) != 0)
+    ret = -1;
+  free(runs);
+  return ret;
+}
+
+static inline int utreexo_warm_start_load(const char *sidecar,
+                                          struct utreexo_warm_start_run **runs,
+                                          uint64_t *n_runs) {
+  FILE *fp = fopen(sidecar, "rb");
+  if (fp == NULL)
+    return -1;
+
+  struct utreexo_warm_start_header header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      header.magic != UTREEXO_WARM_START_MAGIC ||
+      header.page_size != (uint64_t)sysconf(_SC_PAGESIZE) ||
+      header.n_runs > SIZE_MAX / sizeof(**runs)) {
+    fclose(fp);
+    return -1;
+  }
+
+  *runs = malloc(header.n_runs * sizeof(**runs) + 1);
+  if (*runs == NULL) {
+    fclose(fp);
+    return -4;
+  }
+  if (fread(*runs, sizeof(**runs), header.n_runs, fp) != header.n_runs) {
+    free(*runs);
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+  *n_runs = header.n_runs;
+  return 0;
+}
+
+static void *utreexo_warm_start_worker(void *arg) {
+  struct utreexo_warm_start *ws = arg;
+  const uint64_t page_size = sysconf(_SC_PAGESIZE);
+
+  for (size_t f = 0; f < ws->n_files; ++f) {
+    struct utreexo_warm_start_run *runs;
+    uint64_t n_runs;
+    if (utreexo_warm_start_load(ws->sidecars[f], &runs, &n_runs) != 0)
+      continue;
+
+    // Runs are already in file order, so the disk sees sequential reads
+    for (uint64_t r = 0; r < n_runs; ++r) {
+      uint64_t offset = runs[r].first * page_size;
+      const uint64_t end = offset + runs[r].count * page_size;
+      while (offset < end) {
+        if (__atomic_load_n(&ws->stop, __ATOMIC_RELAXED)) {
+          free(runs);
+          return NULL;
+        }
+        const uint64_t len = end - offset < UTREEXO_WARM_START_CHUNK
+                                 ? end - offset
+                                 : UTREEXO_WARM_START_CHUNK;
+        posix_fadvise(ws->fds[f], offset, len, POSIX_FADV_WILLNEED);
+        __atomic_fetch_add(&ws->replayed, len, __ATOMIC_RELAXED);
+        offset += len;
+      }
+    }
+    free(runs);
+  }
+  return NULL;
+}
+
+static inline int utreexo_warm_start_begin(struct utreexo_warm_start **pws,
+                                           const int *fds,
+                                           const char *const *sidecars,
+                                           size_t n_files) {
+  if (n_files > UTREEXO_WARM_START_MAX_FILES)
+    return -1;
+
+  struct utreexo_warm_start *ws = calloc(1, sizeof(*ws));
+  if (ws == NULL)
+    return -4;
+  for (; ws->n_files < n_files; ++ws->n_files) {
+    ws->fds[ws->n_files] = fds[ws->n_files];
+    ws->sidecars[ws->n_files] = strdup(sidecars[ws->n_files]);
+    if (ws->sidecars[ws->n_files] == NULL)
+      break;
+  }
+
+  if (ws->n_files != n_files ||
+      pthread_create(&ws->thread, NULL, utreexo_warm_start_worker, ws) != 0) {
+    for (size_t f = 0; f < ws->n_files; ++f)
+      free(ws->sidecars[f]);
+    free(ws);
+    return -4;
+  }
+
+  *pws = ws;
+  return 0;
+}
+
+static inline void utreexo_warm_start_end(struct utreexo_warm_start *ws) {
+  if (ws == NULL)
+    return;
+
+  __atomic_store_n(&ws->stop, 1, __ATOMIC_RELAXED);
+  pthread_join(ws->thread, NULL);
+
+  // There's nothing to do about a sidecar we couldn't write, the next start
+  // will just be a cold one
+  for (size_t f = 0; f < ws->n_files; ++f) {
+    utreexo_warm_start_save(ws->fds[f], ws->sidecars[f]);
+    free(ws->sidecars[f]);
+  }
+  free(ws);
+}
+
+#endif // UTREEXO_WARM_START_IMPL_H
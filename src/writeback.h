@@ -0,0 +1,51 @@
+/**
+ * COPYRIGHT (C) 2023 Davidson Souza. All Rights Reserved.
+ *
+ * Controlled writeback for the forest file. Every change to the forest is a
+ * write to a shared mapping, and by default it's up to the kernel to decide
+ * when those pages hit the disk. It tends to let gigabytes pile up and then
+ * flush them all at once, and while it does, our own page faults wait behind
+ * that I/O. Modify latency jumps by orders of magnitude every few seconds.
+ *
+ * Instead, a background thread wakes up every UTREEXO_WRITEBACK_INTERVAL_MS
+ * and starts writeback for the pages written to since it last looked (see
+ * utreexo_forest_file_writeback), never more than rate bytes per second. So
+ * dirty pages leave in a steady trickle, and the kernel rarely has a backlog
+ * to flush on its own.
+ */
+#ifndef UTREEXO_WRITEBACK_H
+#define UTREEXO_WRITEBACK_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "flat_file.h"
+
+/* How often the writeback thread wakes up */
+#define UTREEXO_WRITEBACK_INTERVAL_MS 100
+
+struct utreexo_writeback {
+  struct utreexo_forest_file *file;
+  /* Bytes per second we may submit */
+  uint64_t rate;
+  /* How many bytes we submitted so far */
+  uint64_t written;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop;
+};
+
+/* Starts tracking dirty pages in file, and a thread that submits up to rate
+ * megabytes of them per second. Returns 0 on success, -4 if we are out of
+ * memory or couldn't start the thread */
+static inline int utreexo_writeback_start(struct utreexo_writeback **wb,
+                                          struct utreexo_forest_file *file,
+                                          uint64_t rate);
+
+/* Stops the thread and frees wb. Pages still dirty are left to the kernel.
+ * A NULL wb is fine */
+static inline void utreexo_writeback_stop(struct utreexo_writeback *wb);
+
+#endif // UTREEXO_WRITEBACK_H
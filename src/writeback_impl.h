@@ -0,0 +1,82 @@
+#ifndef UTREEXO_WRITEBACK_IMPL_H
+#define UTREEXO_WRITEBACK_IMPL_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "flat_file_impl.h"
+#include "writeback.h"
+
+static void *utreexo_writeback_worker(void *arg) {
+  struct utreexo_writeback *wb = arg;
+  const uint64_t budget = wb->rate * UTREEXO_WRITEBACK_INTERVAL_MS / 1000;
+
+  pthread_mutex_lock(&wb->lock);
+  while (!wb->stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += UTREEXO_WRITEBACK_INTERVAL_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    int err = 0;
+    while (!wb->stop && err != ETIMEDOUT)
+      err = pthread_cond_timedwait(&wb->cond, &wb->lock, &deadline);
+    if (wb->stop)
+      break;
+
+    // The forest keeps changing while we submit, the dirty bits are safe
+    // for that
+    pthread_mutex_unlock(&wb->lock);
+    const uint64_t written = utreexo_forest_file_writeback(wb->file, budget);
+    __atomic_fetch_add(&wb->written, written, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&wb->lock);
+  }
+  pthread_mutex_unlock(&wb->lock);
+  return NULL;
+}
+
+static inline int utreexo_writeback_start(struct utreexo_writeback **pwb,
+                                          struct utreexo_forest_file *file,
+                                          uint64_t rate) {
+  struct utreexo_writeback *wb = calloc(1, sizeof(*wb));
+  if (wb == NULL || utreexo_forest_file_track_dirty(file) != 0) {
+    free(wb);
+    return -4;
+  }
+
+  wb->file = file;
+  wb->rate = rate << 20;
+  pthread_mutex_init(&wb->lock, NULL);
+  pthread_cond_init(&wb->cond, NULL);
+
+  if (pthread_create(&wb->thread, NULL, utreexo_writeback_worker, wb) != 0) {
+    pthread_cond_destroy(&wb->cond);
+    pthread_mutex_destroy(&wb->lock);
+    free(wb);
+    return -4;
+  }
+
+  *pwb = wb;
+  return 0;
+}
+
+static inline void utreexo_writeback_stop(struct utreexo_writeback *wb) {
+  if (wb == NULL)
+    return;
+
+  pthread_mutex_lock(&wb->lock);
+  wb->stop = 1;
+  pthread_cond_signal(&wb->cond);
+  pthread_mutex_unlock(&wb->lock);
+  pthread_join(wb->thread, NULL);
+
+  pthread_cond_destroy(&wb->cond);
+  pthread_mutex_destroy(&wb->lock);
+  free(wb);
+}
+
+#endif // UTREEXO_WRITEBACK_IMPL_H
@@ -0,0 +1,78 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory_resource>
+#include <vector>
+
+#include <utreexo.hpp>
+
+#include "test_utils.h"
+
+static utreexo::Hash make_hash(uint8_t n) {
+  utreexo::Hash hash{};
+  hash.data[0] = n;
+  hash.data[31] = 0xaa;
+  return hash;
+}
+
+void test_modify_and_prove() {
+  TEST_BEGIN("modify and prove");
+  utreexo::Forest forest("cpp_map.bin", "cpp_forest.bin");
+
+  // any contiguous container works, nothing gets copied
+  std::vector<utreexo::Hash> first;
+  for (uint8_t n = 0; n < 12; ++n)
+    first.push_back(make_hash(n));
+  utreexo::Hash second[] = {make_hash(12), make_hash(13)};
+  forest.Modify(first, {});
+  forest.Modify(second, utreexo::Span<const utreexo::Hash>(first.data(), 1));
+
+  ASSERT_EQ(forest.Position(make_hash(13)), 13);
+
+  const utreexo::Hash leaves[] = {make_hash(3), make_hash(9)};
+  utreexo::Hash buffer[utreexo::Forest::MaxProofSize(2)];
+  uint64_t targets[2];
+  const size_t proof_len = forest.Prove(buffer, targets, leaves);
+  ASSERT_EQ(targets[0], 3);
+  ASSERT_EQ(targets[1], 9);
+
+  // proofs from an arena should be the same
+  char arena[64 * 1024];
+  std::pmr::monotonic_buffer_resource resource(arena, sizeof(arena));
+  utreexo::Proof proof = forest.Prove(leaves, &resource);
+  ASSERT_EQ(proof.hashes.size(), proof_len);
+  ASSERT_EQ(proof.targets[1], 9);
+  for (size_t n = 0; n < proof_len; ++n)
+    ASSERT_EQ(memcmp(proof.hashes[n].data, buffer[n].data, 32), 0);
+
+  // leaf 0 was spent
+  int code = 0;
+  try {
+    forest.Position(make_hash(0));
+  } catch (const utreexo::Error &e) {
+    code = e.code();
+  }
+  ASSERT_EQ(code, -1);
+  TEST_END;
+}
+
+void test_move() {
+  TEST_BEGIN("move");
+  utreexo::Forest forest("cpp_move_map.bin", "cpp_move_forest.bin");
+  const utreexo_forest handle = forest.get();
+
+  utreexo::Forest other(std::move(forest));
+  ASSERT_EQ((forest.get() == nullptr), 1);
+  ASSERT_EQ(other.get(), handle);
+
+  forest = std::move(other);
+  ASSERT_EQ((other.get() == nullptr), 1);
+  ASSERT_EQ(forest.get(), handle);
+  TEST_END;
+}
+
+int main() {
+  test_modify_and_prove();
+  test_move();
+  return 0;
+}
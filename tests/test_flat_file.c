@@ -3,12 +3,15 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "flat_file.h"
 #include "flat_file_impl.h"
 #include "forest_node.h"
 #include "parent_hash.h"
+#include "rss_budget_impl.h"
 #include "test_utils.h"
+#include "warm_start_impl.h"
 
 static const char expected_hash[][32] = {{0x00, 0x01, 0x02, 0x03},
                                          {0x00, 0x01, 0x02, 0x04},
@@ -28,6 +31,21 @@ void test_add_many(int n_adds);
 // Test if a page gets reused after being dealocated
 void test_free_page_list();
 
+// Do we know which pages were written to, and hand them out in order?
+void test_writeback();
+
+// Does the buffer pool give nodes back, with more of them than it can hold?
+void test_buffer_pool();
+
+// Do we record which pages are in the page cache, and read them back?
+void test_warm_start();
+
+// Do we hand back cold pages, and only those, once we are over budget?
+void test_rss_budget();
+
+// Do we leave files with the old header alone, and know where our file ends?
+void test_layout();
+
 int main() {
   struct utreexo_forest_file *file;
   void *heap = NULL;
@@ -39,6 +57,11 @@ int main() {
   utreexo_forest_file_close(file);
   test_add_many(NODES_PER_PAGE + 3);
   test_free_page_list();
+  test_writeback();
+  test_buffer_pool();
+  test_warm_start();
+  test_rss_budget();
+  test_layout();
   return 0;
 }
 
@@ -162,3 +185,227 @@ void test_free_page_list() {
   ASSERT_EQ(pnode, nodes[0]);
   TEST_END;
 }
+
+void test_writeback() {
+  TEST_BEGIN("writeback");
+  struct utreexo_forest_file *file;
+  void *heap = NULL;
+  utreexo_forest_file_init(&file, &heap, "flat_file_writeback.bin");
+  ASSERT_EQ(utreexo_forest_file_track_dirty(file), 0);
+
+  const uint64_t header = sizeof(struct utreexo_forest_file_header);
+  const uint64_t page = utreexo_page_size();
+
+  // Three pages worth of nodes, all of them get written
+  utreexo_forest_node *nodes[3 * NODES_PER_PAGE];
+  for (size_t n = 0; n < 3 * NODES_PER_PAGE; ++n)
+    nodes[n] = utreexo_forest_file_node_alloc(file);
+  ASSERT_EQ(file->dirty[0], 7);
+  ASSERT_EQ(utreexo_forest_file_writeback(file, UINT64_MAX),
+            (header + 3 * page));
+  ASSERT_EQ(file->dirty[0], 0);
+  ASSERT_EQ(utreexo_forest_file_writeback(file, UINT64_MAX), header);
+
+  // A small budget only gets one page out, the next call picks up from there
+  utreexo_forest_file_touch(file, nodes[0]);
+  utreexo_forest_file_touch(file, nodes[2 * NODES_PER_PAGE]);
+  ASSERT_EQ(utreexo_forest_file_writeback(file, header + 1), (header + page));
+  ASSERT_EQ(file->dirty[0], 4);
+  ASSERT_EQ(utreexo_forest_file_writeback(file, header + 1), (header + page));
+  ASSERT_EQ(file->dirty[0], 0);
+
+  utreexo_forest_file_close(file);
+  TEST_END;
+}
+
+void test_buffer_pool() {
+#ifdef USE_BUFFER_POOL
+  TEST_BEGIN("buffer pool");
+  struct utreexo_forest_file *file;
+  void *heap = NULL;
+  unlink("flat_file_pool.bin");
+  // The smallest pool we can have, 16 frames
+  const int ret =
+      utreexo_forest_file_init_ex(&file, &heap, "flat_file_pool.bin",
+                                  UTREEXO_BACKEND_POOL, UTREEXO_POOL_FRAME);
+  if (ret == -1) {
+    printf("userfaultfd isn't available, skipping\n");
+    return;
+  }
+  ASSERT_EQ(ret, 0);
+
+  // Enough pages that most of them get evicted, and read back
+  const size_t n_nodes = 64 * NODES_PER_PAGE;
+  size_t *offsets = malloc(n_nodes * sizeof(size_t));
+  ASSERT_EQ((offsets != NULL), 1);
+  for (size_t n = 0; n < n_nodes; ++n) {
+    utreexo_forest_node *node = utreexo_forest_file_node_alloc(file);
+    memset(node, 0x00, sizeof(*node));
+    memcpy(node->hash.hash, &n, sizeof(n));
+    offsets[n] = (char *)node - file->map;
+  }
+  for (size_t n = 0; n < n_nodes; ++n) {
+    size_t value;
+    memcpy(&value, file->map + offsets[n], sizeof(value));
+    ASSERT_EQ(value, n);
+  }
+
+  const struct utreexo_buffer_pool *pool = file->backend;
+  ASSERT_EQ((pool->n_resident <= pool->capacity), 1);
+  ASSERT_EQ((pool->stats.evictions > 0), 1);
+  ASSERT_EQ((pool->stats.writes > 0), 1);
+  utreexo_forest_file_close(file);
+
+  // Everything made it to the file, and reads the same through a mapping
+  utreexo_forest_file_init(&file, &heap, "flat_file_pool.bin");
+  ASSERT_EQ(file->header->n_pages, 64);
+  for (size_t n = 0; n < n_nodes; ++n) {
+    size_t value;
+    memcpy(&value, file->map + offsets[n], sizeof(value));
+    ASSERT_EQ(value, n);
+  }
+  utreexo_forest_file_close(file);
+  free(offsets);
+  TEST_END;
+#endif
+}
+
+void test_warm_start() {
+  TEST_BEGIN("warm start");
+  const uint64_t page = sysconf(_SC_PAGESIZE);
+  int fd = open("flat_file_warm.bin", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  ASSERT_EQ((fd >= 0), 1);
+
+  // Two runs of pages we just wrote, with a hole that was never there
+  char buf[4096] = {1};
+  for (uint64_t p = 0; p < 4; ++p)
+    ASSERT_EQ(pwrite(fd, buf, sizeof(buf), p * page), sizeof(buf));
+  for (uint64_t p = 16; p < 18; ++p)
+    ASSERT_EQ(pwrite(fd, buf, sizeof(buf), p * page), sizeof(buf));
+  ASSERT_EQ(utreexo_warm_start_save(fd, "flat_file_warm.bin.warm"), 0);
+
+  struct utreexo_warm_start_run *runs;
+  uint64_t n_runs;
+  ASSERT_EQ(utreexo_warm_start_load("flat_file_warm.bin.warm", &runs, &n_runs),
+            0);
+  ASSERT_EQ(n_runs, 2);
+  ASSERT_EQ(runs[0].first, 0);
+  ASSERT_EQ(runs[0].count, 4);
+  ASSERT_EQ(runs[1].first, 16);
+  ASSERT_EQ(runs[1].count, 2);
+  free(runs);
+
+  // Replaying asks for every recorded page, and nothing else
+  struct utreexo_warm_start *ws = NULL;
+  const char *sidecar = "flat_file_warm.bin.warm";
+  ASSERT_EQ(utreexo_warm_start_begin(&ws, &fd, &sidecar, 1), 0);
+  for (int i = 0; i < 1000 && __atomic_load_n(&ws->replayed, __ATOMIC_RELAXED) <
+                                  6 * page;
+       ++i)
+    usleep(1000);
+  ASSERT_EQ(ws->replayed, (6 * page));
+  // Stopping records the pages again, they are all still there
+  utreexo_warm_start_end(ws);
+  ASSERT_EQ(utreexo_warm_start_load("flat_file_warm.bin.warm", &runs, &n_runs),
+            0);
+  ASSERT_EQ(n_runs, 2);
+  free(runs);
+  ASSERT_EQ(utreexo_warm_start_load("missing.warm", &runs, &n_runs), -1);
+
+  close(fd);
+  TEST_END;
+}
+
+void test_rss_budget() {
+  TEST_BEGIN("rss budget");
+  struct utreexo_forest_file *file;
+  void *heap = NULL;
+  unlink("flat_file_rss.bin");
+  utreexo_forest_file_init(&file, &heap, "flat_file_rss.bin");
+  ASSERT_EQ(utreexo_forest_file_track_access(file), 0);
+
+  // 32 pages that were last used in epoch zero, and 32 used in epoch two.
+  // A tiny tree on the very first page, that must stay
+  utreexo_forest_node *roots[64] = {0};
+  utreexo_forest_node *first = NULL;
+  for (size_t n = 0; n < 64 * NODES_PER_PAGE; ++n) {
+    if (n == 32 * NODES_PER_PAGE)
+      file->epoch = 2;
+    utreexo_forest_node *node = utreexo_forest_file_node_alloc(file);
+    memset(node, 0x00, sizeof(*node));
+    if (n == 0)
+      first = node;
+  }
+  roots[1] = first;
+  ASSERT_EQ(fsync(file->fd), 0);
+
+  struct utreexo_rss_budget rb = {
+      .file = file,
+      .roots = roots,
+      .budget = 0,
+      .hot = calloc((utreexo_forest_file_max_pages() + 63) / 64,
+                    sizeof(uint64_t)),
+  };
+
+  // Now we are in epoch three, pages used in epoch two aren't cold yet
+  const uint64_t advised = utreexo_rss_budget_step(&rb);
+  ASSERT_EQ(file->epoch, 3);
+  ASSERT_EQ((rb.stats.resident > 0), 1);
+  ASSERT_EQ((advised > 0), 1);
+  ASSERT_EQ((advised <= 31 * utreexo_page_size()), 1);
+
+  // A budget we are under does nothing at all
+  rb.budget = UINT64_MAX;
+  ASSERT_EQ(utreexo_rss_budget_step(&rb), 0);
+
+  // A child past the end of the file isn't followed, reading it would fault
+  const uint64_t filesize = file->header->filesize;
+  first->left_child =
+      (utreexo_forest_node *)((char *)file->header + filesize +
+                              utreexo_page_size());
+  utreexo_rss_budget_mark_hot(&rb, first, 4);
+  const size_t past =
+      ((char *)first->left_child - file->map) / utreexo_page_size();
+  ASSERT_EQ(((rb.hot[past / 64] >> (past % 64)) & 1), 0);
+  ASSERT_EQ((rb.hot[0] & 1), 1);
+  first->left_child = NULL;
+
+  free(rb.vec);
+  free(rb.hot);
+  utreexo_forest_file_close(file);
+  TEST_END;
+}
+
+void test_layout() {
+  TEST_BEGIN("layout");
+  unlink("flat_file_layout.bin");
+  FILE *old = fopen("flat_file_layout.bin", "w");
+  uint64_t header[512] = {UTREEXO_FILE_MAGIC_V1, 0, 1, 4096};
+  ASSERT_EQ(fwrite(header, sizeof(header), 1, old), 1);
+  fclose(old);
+
+  struct utreexo_forest_file *file = NULL;
+  void *heap = NULL;
+  ASSERT_EQ(utreexo_forest_file_init_ex(&file, &heap, "flat_file_layout.bin",
+                                        UTREEXO_BACKEND_MMAP, 0),
+            -1);
+  old = fopen("flat_file_layout.bin", "r");
+  uint64_t after[512] = {0};
+  ASSERT_EQ(fread(after, sizeof(after), 1, old), 1);
+  fclose(old);
+  ASSERT_ARRAY_EQ(after, header, 512);
+
+  unlink("flat_file_layout.bin");
+  ASSERT_EQ(utreexo_forest_file_init_ex(&file, &heap, "flat_file_layout.bin",
+                                        UTREEXO_BACKEND_MMAP, 0),
+            0);
+  const utreexo_forest_node *node = utreexo_forest_file_node_alloc(file);
+  ASSERT_EQ(utreexo_forest_file_contains(file, node, sizeof(*node)), 1);
+  ASSERT_EQ(utreexo_forest_file_contains(file, heap, 1), 0);
+  const char *end = (const char *)file->header + file->header->filesize;
+  ASSERT_EQ(utreexo_forest_file_contains(file, end - 8, 8), 1);
+  ASSERT_EQ(utreexo_forest_file_contains(file, end - 8, 9), 0);
+  ASSERT_EQ(utreexo_forest_file_contains(file, end + 4096, 1), 0);
+  utreexo_forest_file_close(file);
+  TEST_END;
+}
@@ -3,13 +3,24 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "flat_file.h"
 #include "forest_node.h"
+#include "forest_proof_impl.h"
+#include "forest_serialize_impl.h"
+#include "forest_verify_impl.h"
+#include "latency_impl.h"
 #include "leaf_map.h"
+#include "leaf_map_rebuild_impl.h"
 #include "map_forest_impl.h"
+#include "overlay_impl.h"
 #include "parent_hash.h"
 #include "test_utils.h"
+#include "trace_impl.h"
 
 static inline struct utreexo_forest get_test_forest(const char *filename) {
   void *heap = NULL;
@@ -25,7 +36,7 @@ static inline struct utreexo_forest get_test_forest(const char *filename) {
   sprintf(map_name, "forest_map_%s", filename);
 
   utreexo_leaf_map map;
-  utreexo_leaf_map_new(&map, map_name, O_CREAT | O_RDWR, NULL);
+  utreexo_leaf_map_new(&map, map_name, O_CREAT | O_RDWR, NULL, 0);
 
   struct utreexo_forest p = {
       .data = file,
@@ -165,7 +176,7 @@ void test_add_single() {
 
   utreexo_leaf_map leaf_map;
   utreexo_leaf_map_new(&leaf_map, "forest_leaves_single.bin", O_CREAT | O_RDWR,
-                       NULL);
+                       NULL, 0);
 
   struct utreexo_forest p = {
       .data = file,
@@ -460,6 +471,1198 @@ void test_deletion_cases() {
   }
 }
 
+void test_serialize_roundtrip() {
+  TEST_BEGIN("serialize roundtrip");
+  for (uint32_t flags = 0; flags <= UTREEXO_SNAPSHOT_INTERIOR; ++flags) {
+    char filename[100] = {0};
+    sprintf(filename, "serialize_src%u.bin", flags);
+    struct utreexo_forest src = get_test_forest(filename);
+
+    for (size_t i = 0; i < 20; ++i) {
+      utreexo_node_hash leaf = {.hash = {0}};
+      hash_from_u8(leaf.hash, i);
+      utreexo_forest_add(&src, leaf);
+    }
+    delete_single_pos(&src, 1);
+    delete_single_pos(&src, 10);
+
+    sprintf(filename, "serialize_snapshot%u.bin", flags);
+    FILE *fp = fopen(filename, "wb+");
+    ASSERT_EQ(utreexo_forest_serialize_file(&src, fp, flags), 0);
+
+    rewind(fp);
+    sprintf(filename, "serialize_dst%u.bin", flags);
+    struct utreexo_forest dst = get_test_forest(filename);
+    ASSERT_EQ(utreexo_forest_deserialize_file(&dst, fp), 0);
+
+    ASSERT_EQ(*dst.nLeaf, *src.nLeaf);
+    for (size_t root = 0; root < 64; ++root) {
+      const int has_root = src.roots[root] != NULL;
+      ASSERT_EQ((dst.roots[root] != NULL), has_root);
+      if (has_root)
+        ASSERT_ARRAY_EQ(dst.roots[root]->hash.hash, src.roots[root]->hash.hash,
+                        32);
+    }
+
+    // leaves should be reachable through the new leaf map
+    utreexo_node_hash leaf = {.hash = {0}};
+    hash_from_u8(leaf.hash, 19);
+    utreexo_forest_node *pnode = NULL;
+    utreexo_leaf_map_get(&dst.leaf_map, &pnode, leaf);
+    assert(pnode != NULL);
+    ASSERT_ARRAY_EQ(pnode->hash.hash, leaf.hash, 32);
+
+    // flip one byte of the last leaf and make sure we notice it
+    fseek(fp, -40, SEEK_END);
+    fputc(0xff, fp);
+    rewind(fp);
+    sprintf(filename, "serialize_bad%u.bin", flags);
+    struct utreexo_forest bad = get_test_forest(filename);
+    const int err = utreexo_forest_deserialize_file(&bad, fp);
+    ASSERT_EQ(err, UTREEXO_SNAPSHOT_ECHECKSUM);
+    fclose(fp);
+  }
+  TEST_END;
+}
+
+/* Writes a snapshot header and n_nodes tags for leaves or branches, with a
+ * zero hash after each leaf, without a checksum */
+static void write_bad_snapshot(FILE *fp, uint32_t flags, uint64_t n_leaf,
+                               uint64_t roots, const uint8_t *tags,
+                               size_t n_tags) {
+  rewind(fp);
+  struct utreexo_snapshot_stream s = {
+      .fp = fp, .ctx = EVP_MD_CTX_new(), .err = 0};
+  EVP_DigestInit_ex(s.ctx, EVP_sha256(), NULL);
+  utreexo_snapshot_write_u64(&s, UTREEXO_SNAPSHOT_MAGIC, 4);
+  utreexo_snapshot_write_u64(&s, UTREEXO_SNAPSHOT_VERSION, 4);
+  utreexo_snapshot_write_u64(&s, flags, 4);
+  utreexo_snapshot_write_u64(&s, n_leaf, 8);
+  utreexo_snapshot_write_u64(&s, roots, 8);
+  const uint8_t hash[32] = {0};
+  for (size_t i = 0; i < n_tags; ++i) {
+    utreexo_snapshot_write_u64(&s, tags[i], 1);
+    if (tags[i] == UTREEXO_SNAPSHOT_LEAF)
+      utreexo_snapshot_write(&s, hash, 32);
+  }
+  EVP_MD_CTX_free(s.ctx);
+  ASSERT_EQ(s.err, 0);
+  rewind(fp);
+}
+
+void test_serialize_invalid() {
+  TEST_BEGIN("serialize rejects invalid snapshots");
+  struct utreexo_forest src = get_test_forest("serialize_invalid_src.bin");
+  FILE *fp = fopen("serialize_invalid.bin", "wb+");
+  ASSERT_EQ(utreexo_forest_serialize_file(&src, fp, 0x02),
+            UTREEXO_SNAPSHOT_EFLAGS);
+
+  const uint8_t leaf[1] = {UTREEXO_SNAPSHOT_LEAF};
+  const uint8_t branch[3] = {UTREEXO_SNAPSHOT_BRANCH, UTREEXO_SNAPSHOT_LEAF,
+                             UTREEXO_SNAPSHOT_LEAF};
+  struct {
+    uint32_t flags;
+    uint64_t n_leaf, roots;
+    const uint8_t *tags;
+    size_t n_tags;
+    int err;
+  } cases[] = {
+      // A flag from the future
+      {0x02, 1, 1, leaf, 1, UTREEXO_SNAPSHOT_EFLAGS},
+      // Two leaves don't have a tree in the bottom row
+      {0, 2, 1, leaf, 1, UTREEXO_SNAPSHOT_EFORMAT},
+      // Nor a tree anywhere if there aren't any leaves
+      {0, 0, 2, branch, 3, UTREEXO_SNAPSHOT_EFORMAT},
+      // A single leaf can't have two under it
+      {0, 1, 1, branch, 3, UTREEXO_SNAPSHOT_EFORMAT},
+      // Three leaves, but the tree in row 0 is the one with two
+      {0, 3, 3, (const uint8_t[]){0, 1, 0, 0}, 4, UTREEXO_SNAPSHOT_EFORMAT},
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+    char filename[100] = {0};
+    sprintf(filename, "serialize_invalid%lu.bin", i);
+    struct utreexo_forest dst = get_test_forest(filename);
+    write_bad_snapshot(fp, cases[i].flags, cases[i].n_leaf, cases[i].roots,
+                       cases[i].tags, cases[i].n_tags);
+    const uint64_t filesize = dst.data->header->filesize;
+    const int err = utreexo_forest_deserialize_file(&dst, fp);
+    ASSERT_EQ(err, cases[i].err);
+    ASSERT_EQ(*dst.nLeaf, 0);
+    for (size_t root = 0; root < 64; ++root)
+      assert(dst.roots[root] == NULL);
+    // Nothing was loaded before we found out
+    ASSERT_EQ(dst.data->header->filesize, filesize);
+    utreexo_forest_node *pleaf = NULL;
+    utreexo_leaf_map_get(&dst.leaf_map, &pleaf, (utreexo_node_hash){{0}});
+    assert(pleaf == NULL);
+  }
+  fclose(fp);
+
+  // A good snapshot that was damaged, or cut short, loads nothing either
+  utreexo_node_hash leaves[20];
+  for (size_t n = 0; n < 20; ++n) {
+    leaves[n] = (utreexo_node_hash){{0}};
+    hash_from_u8(leaves[n].hash, n);
+  }
+  ASSERT_EQ(utreexo_forest_apply(&src, NULL, leaves, 20, NULL, 0), 0);
+  fp = fopen("serialize_invalid.bin", "wb+");
+  ASSERT_EQ(utreexo_forest_serialize_file(&src, fp, 0), 0);
+  const long size = ftell(fp);
+  fseek(fp, size - 100, SEEK_SET);
+  fputc(0xff, fp);
+  fclose(fp);
+  for (int cut = 0; cut < 2; ++cut) {
+    if (cut)
+      ASSERT_EQ(truncate("serialize_invalid.bin", size - 40), 0);
+    fp = fopen("serialize_invalid.bin", "rb");
+    char filename[100] = {0};
+    sprintf(filename, "serialize_damaged%d.bin", cut);
+    struct utreexo_forest dst = get_test_forest(filename);
+    const uint64_t filesize = dst.data->header->filesize;
+    const int err = utreexo_forest_deserialize_file(&dst, fp);
+    ASSERT_EQ(err, (cut ? UTREEXO_SNAPSHOT_EIO : UTREEXO_SNAPSHOT_ECHECKSUM));
+    ASSERT_EQ(*dst.nLeaf, 0);
+    ASSERT_EQ(dst.data->header->filesize, filesize);
+    for (size_t n = 0; n < 20; ++n) {
+      utreexo_forest_node *pleaf = NULL;
+      utreexo_leaf_map_get(&dst.leaf_map, &pleaf, leaves[n]);
+      assert(pleaf == NULL);
+    }
+    fclose(fp);
+  }
+  TEST_END;
+}
+
+static void check_leaf_positions(struct utreexo_forest *p, uint64_t n_leaves,
+                                 const int *deleted) {
+  for (uint64_t leaf_n = 0; leaf_n < n_leaves; ++leaf_n) {
+    utreexo_node_hash leaf = {.hash = {0}};
+    hash_from_u8(leaf.hash, leaf_n);
+
+    utreexo_forest_node *pleaf = NULL;
+    utreexo_leaf_map_get(&p->leaf_map, &pleaf, leaf);
+    ASSERT_EQ((pleaf == NULL), deleted[leaf_n]);
+    if (pleaf == NULL)
+      continue;
+
+    uint64_t pos = 0, cached = 0;
+    ASSERT_EQ(utreexo_forest_node_position(p, pleaf, &pos), 0);
+    ASSERT_EQ(utreexo_forest_leaf_position(p, pleaf, &cached), 0);
+    ASSERT_EQ(cached, pos);
+
+    // going back down from this position should give us the same leaf
+    utreexo_forest_node *node = NULL, *sibling = NULL, *parent = NULL;
+    grab_node(p, &node, &sibling, &parent, pos);
+    ASSERT_EQ(node, pleaf);
+  }
+}
+
+void test_leaf_position() {
+  TEST_BEGIN("leaf position");
+  struct utreexo_forest p = get_test_forest("leaf_position.bin");
+  int deleted[71] = {0};
+
+  // 41 leaves, the last one is a root by itself
+  for (size_t leaf_n = 0; leaf_n < 41; ++leaf_n) {
+    utreexo_node_hash leaf = {.hash = {0}};
+    hash_from_u8(leaf.hash, leaf_n);
+    utreexo_forest_add(&p, leaf);
+  }
+  check_leaf_positions(&p, 41, deleted);
+
+  // deleting moves the siblings up, and may leave leaves on upper rows
+  const uint8_t to_delete[] = {0, 1, 5, 6, 7, 12, 20, 22, 33, 40};
+  for (size_t n = 0; n < sizeof(to_delete); ++n) {
+    utreexo_node_hash leaf = {.hash = {0}};
+    hash_from_u8(leaf.hash, to_delete[n]);
+
+    utreexo_forest_node *pleaf = NULL;
+    utreexo_leaf_map_get(&p.leaf_map, &pleaf, leaf);
+    ASSERT_EQ(delete_single(&p, pleaf), 0);
+    utreexo_leaf_map_delete(&p.leaf_map, leaf);
+    deleted[to_delete[n]] = 1;
+
+    uint64_t pos = 0;
+    ASSERT_EQ(utreexo_forest_node_position(&p, pleaf, &pos), -1);
+    check_leaf_positions(&p, 41, deleted);
+  }
+  ASSERT_EQ(p.roots[0], NULL);
+
+  // adding more leaves grows the forest, and renumbers the upper rows
+  for (size_t leaf_n = 41; leaf_n < 71; ++leaf_n) {
+    utreexo_node_hash leaf = {.hash = {0}};
+    hash_from_u8(leaf.hash, leaf_n);
+    utreexo_forest_add(&p, leaf);
+  }
+  check_leaf_positions(&p, 71, deleted);
+  TEST_END;
+}
+
+/* Recomputes the roots from a proof, and checks them against the forest */
+static void verify_proof(struct utreexo_forest *p, const uint64_t *targets,
+                         const utreexo_node_hash *leaves, size_t n_leaves,
+                         const utreexo_node_hash *proof, size_t proof_len) {
+  const uint8_t forest_rows = tree_rows(*p->nLeaf);
+  uint64_t sorted[64];
+  uint64_t positions[64 * 64];
+  memcpy(sorted, targets, n_leaves * sizeof(uint64_t));
+  ASSERT_EQ(utreexo_proof_positions(positions, 64 * 64, sorted, n_leaves,
+                                    *p->nLeaf),
+            proof_len);
+
+  // Every node we know, kept sorted by position
+  uint64_t known_pos[64 * 64 + 64];
+  utreexo_node_hash known[64 * 64 + 64];
+  size_t n_known = 0;
+  for (size_t n = 0; n < n_leaves + proof_len; ++n) {
+    const uint64_t pos = n < n_leaves ? targets[n] : positions[n - n_leaves];
+    size_t at = n_known++;
+    for (; at > 0 && known_pos[at - 1] > pos; --at) {
+      known_pos[at] = known_pos[at - 1];
+      known[at] = known[at - 1];
+    }
+    known_pos[at] = pos;
+    known[at] = n < n_leaves ? leaves[n] : proof[n - n_leaves];
+  }
+
+  while (n_known > 0) {
+    const uint64_t pos = known_pos[0];
+    if (is_root_position(pos, *p->nLeaf, forest_rows)) {
+      const uint8_t row = detect_row(pos, forest_rows);
+      ASSERT_ARRAY_EQ(known[0].hash, p->roots[row]->hash.hash, 32);
+      memmove(known_pos, known_pos + 1, --n_known * sizeof(uint64_t));
+      memmove(known, known + 1, n_known * sizeof(utreexo_node_hash));
+      continue;
+    }
+
+    // the sibling of our smallest node must come right after it
+    ASSERT_EQ((n_known > 1), 1);
+    ASSERT_EQ(known_pos[1], sibling_position(pos));
+
+    utreexo_node_hash parent = {.hash = {0}};
+    parent_hash(parent.hash, known[0].hash, known[1].hash);
+    const uint64_t parent_pos = parent_position(pos, forest_rows);
+
+    n_known -= 2;
+    memmove(known_pos, known_pos + 2, n_known * sizeof(uint64_t));
+    memmove(known, known + 2, n_known * sizeof(utreexo_node_hash));
+
+    size_t at = n_known++;
+    for (; at > 0 && known_pos[at - 1] > parent_pos; --at) {
+      known_pos[at] = known_pos[at - 1];
+      known[at] = known[at - 1];
+    }
+    known_pos[at] = parent_pos;
+    known[at] = parent;
+  }
+}
+
+void test_prove() {
+  TEST_BEGIN("prove");
+  struct utreexo_forest p = get_test_forest("prove.bin");
+
+  for (size_t leaf_n = 0; leaf_n < 30; ++leaf_n) {
+    utreexo_node_hash leaf = {.hash = {0}};
+    hash_from_u8(leaf.hash, leaf_n);
+    utreexo_forest_add(&p, leaf);
+  }
+  // leave some leaves in the upper rows
+  const uint8_t to_delete[] = {4, 17};
+  for (size_t n = 0; n < sizeof(to_delete); ++n) {
+    utreexo_node_hash leaf = {.hash = {0}};
+    hash_from_u8(leaf.hash, to_delete[n]);
+    delete_single_pos(&p, to_delete[n]);
+    utreexo_leaf_map_delete(&p.leaf_map, leaf);
+  }
+
+  const uint8_t sets[][5] = {
+      {0, 0, 0, 0, 0}, {1, 1, 0, 0, 0}, {2, 0, 1, 0, 0},
+      {2, 2, 3, 0, 0}, {3, 29, 5, 12, 0}, {4, 8, 9, 10, 11},
+  };
+  for (size_t set = 0; set < sizeof(sets) / sizeof(sets[0]); ++set) {
+    const size_t n_leaves = sets[set][0];
+    utreexo_node_hash leaves[4];
+    for (size_t leaf_n = 0; leaf_n < n_leaves; ++leaf_n)
+      hash_from_u8(leaves[leaf_n].hash, sets[set][leaf_n + 1]);
+
+    uint64_t targets[4];
+    utreexo_node_hash proof[64];
+    size_t proof_len = 0;
+
+    const int too_small = utreexo_forest_prove_leaves(&p, proof, &proof_len,
+                                                      targets, leaves,
+                                                      n_leaves);
+    ASSERT_EQ(too_small, (proof_len == 0 ? 0 : UTREEXO_PROOF_ENOSPC));
+
+    const int ret = utreexo_forest_prove_leaves(&p, proof, &proof_len,
+                                                targets, leaves, n_leaves);
+    ASSERT_EQ(ret, 0);
+    verify_proof(&p, targets, leaves, n_leaves, proof, proof_len);
+  }
+
+  // leaf 4 was deleted
+  utreexo_node_hash missing = {.hash = {0}};
+  hash_from_u8(missing.hash, 4);
+  uint64_t target = 0;
+  size_t proof_len = 0;
+  const int ret =
+      utreexo_forest_prove_leaves(&p, NULL, &proof_len, &target, &missing, 1);
+  ASSERT_EQ(ret, UTREEXO_PROOF_ENOTFOUND);
+  TEST_END;
+}
+
+static void pipeline_leaf(utreexo_node_hash *leaf, uint32_t n) {
+  memset(leaf->hash, 0xaa, 32);
+  memcpy(leaf->hash, &n, sizeof(n));
+}
+
+static size_t copy_roots(utreexo_node_hash *roots, struct utreexo_forest *p) {
+  size_t n_roots = 0;
+  for (int row = 63; row >= 0; --row)
+    if (p->roots[row] != NULL)
+      roots[n_roots++] = p->roots[row]->hash;
+  return n_roots;
+}
+
+void test_pipeline() {
+  TEST_BEGIN("pipeline");
+  enum { N_BLOCKS = 20, PER_BLOCK = 12 };
+
+  // Every block spends a leaf from the block right before it, which is still
+  // in flight when this one is prefetched, and one from three blocks ago
+  static utreexo_node_hash utxos[N_BLOCKS][PER_BLOCK];
+  static utreexo_node_hash stxos[N_BLOCKS][2];
+  size_t stxo_counts[N_BLOCKS];
+  for (uint32_t block = 0; block < N_BLOCKS; ++block) {
+    for (uint32_t n = 0; n < PER_BLOCK; ++n)
+      pipeline_leaf(&utxos[block][n], block * PER_BLOCK + n);
+
+    stxo_counts[block] = 0;
+    if (block >= 1)
+      stxos[block][stxo_counts[block]++] = utxos[block - 1][block % 10];
+    if (block >= 3)
+      stxos[block][stxo_counts[block]++] = utxos[block - 3][11];
+  }
+
+  // What we should get, applying one block at a time
+  static utreexo_node_hash expected[N_BLOCKS][64];
+  size_t expected_len[N_BLOCKS];
+  struct utreexo_forest reference = get_test_forest("pipeline_ref.bin");
+  for (size_t block = 0; block < N_BLOCKS; ++block) {
+    utreexo_forest_node *pnodes[2];
+    utreexo_leaf_map_get_many(&reference.leaf_map, pnodes, stxos[block],
+                              stxo_counts[block]);
+    const int ret =
+        utreexo_forest_apply(&reference, pnodes, utxos[block], PER_BLOCK,
+                             stxos[block], stxo_counts[block]);
+    ASSERT_EQ(ret, 0);
+    expected_len[block] = copy_roots(expected[block], &reference);
+  }
+
+  struct utreexo_forest p = get_test_forest("pipeline.bin");
+  ASSERT_EQ(utreexo_pipeline_start(&p, 4), 0);
+
+  utreexo_node_hash roots[64];
+  size_t n_roots = 0;
+  for (uint64_t block = 0; block < N_BLOCKS; ++block) {
+    const struct utreexo_block_delta delta = {
+        .utxos = utxos[block],
+        .utxo_count = PER_BLOCK,
+        .stxos = stxos[block],
+        .stxo_count = stxo_counts[block],
+    };
+    uint64_t ticket = 0;
+    ASSERT_EQ(utreexo_pipeline_submit(&p, &ticket, &delta), 0);
+    ASSERT_EQ(ticket, block);
+
+    // Keep three blocks in flight
+    if (block < 3)
+      continue;
+    const uint64_t done = block - 3;
+    ASSERT_EQ(utreexo_pipeline_wait(&p, roots, &n_roots, done), 0);
+    ASSERT_EQ(n_roots, expected_len[done]);
+    for (size_t root = 0; root < n_roots; ++root)
+      ASSERT_ARRAY_EQ(roots[root].hash, expected[done][root].hash, 32);
+  }
+
+  ASSERT_EQ(utreexo_pipeline_wait(&p, roots, &n_roots, N_BLOCKS - 1), 0);
+  ASSERT_EQ(n_roots, expected_len[N_BLOCKS - 1]);
+  ASSERT_EQ(utreexo_pipeline_wait(&p, NULL, NULL, 0),
+            UTREEXO_PIPELINE_EEXPIRED);
+  ASSERT_EQ(utreexo_pipeline_wait(&p, NULL, NULL, N_BLOCKS),
+            UTREEXO_PIPELINE_ETICKET);
+
+  // Once a block fails, so does everything after it
+  utreexo_node_hash missing;
+  pipeline_leaf(&missing, 0xffffffff);
+  const struct utreexo_block_delta bad = {
+      .utxos = NULL, .utxo_count = 0, .stxos = &missing, .stxo_count = 1};
+  const struct utreexo_block_delta good = {
+      .utxos = utxos[0], .utxo_count = 1, .stxos = NULL, .stxo_count = 0};
+  uint64_t bad_ticket = 0, good_ticket = 0;
+  ASSERT_EQ(utreexo_pipeline_submit(&p, &bad_ticket, &bad), 0);
+  ASSERT_EQ(utreexo_pipeline_submit(&p, &good_ticket, &good), 0);
+  ASSERT_EQ(utreexo_pipeline_wait(&p, NULL, NULL, bad_ticket), -3);
+  ASSERT_EQ(utreexo_pipeline_wait(&p, NULL, NULL, good_ticket), -3);
+
+  utreexo_pipeline_stop(&p);
+  ASSERT_EQ((p.pipeline == NULL), 1);
+  n_roots = copy_roots(roots, &p);
+  ASSERT_EQ(n_roots, expected_len[N_BLOCKS - 1]);
+  for (size_t root = 0; root < n_roots; ++root)
+    ASSERT_ARRAY_EQ(roots[root].hash, expected[N_BLOCKS - 1][root].hash, 32);
+
+  // A block spending a leaf we don't have changes nothing, not even the
+  // leaves it spends before that one
+  const utreexo_node_hash spent[2] = {utxos[N_BLOCKS - 1][0], missing};
+  utreexo_forest_node *pspent[2];
+  utreexo_leaf_map_get_many(&p.leaf_map, pspent, spent, 2);
+  ASSERT_EQ((pspent[0] != NULL), 1);
+  int ret = utreexo_forest_apply(&p, pspent, utxos[0], 1, spent, 2);
+  ASSERT_EQ(ret, -3);
+  n_roots = copy_roots(roots, &p);
+  ASSERT_EQ(n_roots, expected_len[N_BLOCKS - 1]);
+  for (size_t root = 0; root < n_roots; ++root)
+    ASSERT_ARRAY_EQ(roots[root].hash, expected[N_BLOCKS - 1][root].hash, 32);
+  utreexo_forest_node *still = NULL;
+  utreexo_leaf_map_get(&p.leaf_map, &still, spent[0]);
+  ASSERT_EQ(still, pspent[0]);
+
+  // Tickets from a stopped pipeline say so, even after we start a new one
+  ret = utreexo_pipeline_wait(&p, NULL, NULL, good_ticket);
+  ASSERT_EQ(ret, UTREEXO_PIPELINE_ESTOPPED);
+  ret = utreexo_pipeline_wait(&p, NULL, NULL, good_ticket + 1);
+  ASSERT_EQ(ret, UTREEXO_PIPELINE_ETICKET);
+  utreexo_node_hash extra;
+  pipeline_leaf(&extra, 0xfffffff0);
+  const struct utreexo_block_delta more = {
+      .utxos = &extra, .utxo_count = 1, .stxos = NULL, .stxo_count = 0};
+  uint64_t more_ticket = 0;
+  ASSERT_EQ(utreexo_pipeline_submit(&p, &more_ticket, &more), 0);
+  ASSERT_EQ(more_ticket, good_ticket + 1);
+  ASSERT_EQ(utreexo_pipeline_wait(&p, NULL, NULL, more_ticket), 0);
+  ret = utreexo_pipeline_wait(&p, NULL, NULL, bad_ticket);
+  ASSERT_EQ(ret, UTREEXO_PIPELINE_ESTOPPED);
+  utreexo_pipeline_stop(&p);
+  TEST_END;
+}
+
+static void overlay_apply(struct utreexo_forest *p, const uint32_t *utxos,
+                          size_t utxo_count, const uint32_t *stxos,
+                          size_t stxo_count, struct utreexo_overlay *o) {
+  utreexo_node_hash adds[512], dels[512];
+  utreexo_forest_node *pnodes[512];
+  for (size_t n = 0; n < utxo_count; ++n)
+    pipeline_leaf(&adds[n], utxos[n]);
+  for (size_t n = 0; n < stxo_count; ++n)
+    pipeline_leaf(&dels[n], stxos[n]);
+
+  if (o != NULL) {
+    ASSERT_EQ(utreexo_overlay_modify(o, adds, utxo_count, dels, stxo_count),
+              0);
+    return;
+  }
+  utreexo_leaf_map_get_many(&p->leaf_map, pnodes, dels, stxo_count);
+  ASSERT_EQ(utreexo_forest_apply(p, pnodes, adds, utxo_count, dels,
+                                 stxo_count),
+            0);
+}
+
+static void assert_same_roots(const utreexo_node_hash *roots, size_t n_roots,
+                              struct utreexo_forest *p) {
+  utreexo_node_hash expected[64];
+  ASSERT_EQ(n_roots, copy_roots(expected, p));
+  for (size_t root = 0; root < n_roots; ++root)
+    ASSERT_ARRAY_EQ(roots[root].hash, expected[root].hash, 32);
+}
+
+void test_overlay() {
+  TEST_BEGIN("overlay");
+  struct utreexo_forest p = get_test_forest("overlay.bin");
+  struct utreexo_forest reference = get_test_forest("overlay_ref.bin");
+
+  uint32_t first[40];
+  for (uint32_t n = 0; n < 40; ++n)
+    first[n] = n;
+  overlay_apply(&p, first, 40, NULL, 0, NULL);
+  overlay_apply(&reference, first, 40, NULL, 0, NULL);
+
+  utreexo_node_hash base_roots[64], roots[64];
+  const size_t n_base_roots = copy_roots(base_roots, &p);
+
+  // The second block spends a leaf the first one added
+  const uint32_t utxos1[] = {40, 41, 42, 43, 44, 45, 46, 47, 48, 49};
+  const uint32_t stxos1[] = {3, 17};
+  const uint32_t utxos2[] = {50, 51, 52, 53, 54};
+  const uint32_t stxos2[] = {45, 20, 0};
+
+  struct utreexo_overlay *o = NULL;
+  ASSERT_EQ(utreexo_overlay_new(&o, &p), 0);
+  overlay_apply(&p, utxos1, 10, stxos1, 2, o);
+  overlay_apply(&p, utxos2, 5, stxos2, 3, o);
+  overlay_apply(&reference, utxos1, 10, stxos1, 2, NULL);
+  overlay_apply(&reference, utxos2, 5, stxos2, 3, NULL);
+
+  // The overlay sees the new roots, the forest still has the old ones
+  size_t n_roots = utreexo_overlay_roots(o, roots);
+  assert_same_roots(roots, n_roots, &reference);
+  assert_same_roots(base_roots, n_base_roots, &p);
+  ASSERT_EQ(*p.nLeaf, 40);
+
+  // A block spending something we don't have changes nothing
+  utreexo_node_hash missing;
+  pipeline_leaf(&missing, 1000);
+  ASSERT_EQ(utreexo_overlay_modify(o, NULL, 0, &missing, 1), -3);
+  n_roots = utreexo_overlay_roots(o, roots);
+  assert_same_roots(roots, n_roots, &reference);
+
+  // A competing overlay is dropped without touching the forest
+  struct utreexo_overlay *other = NULL;
+  ASSERT_EQ(utreexo_overlay_new(&other, &p), 0);
+  overlay_apply(&p, stxos1, 2, first, 10, other);
+  utreexo_overlay_free(other);
+  assert_same_roots(base_roots, n_base_roots, &p);
+
+  ASSERT_EQ(utreexo_overlay_commit(o), 0);
+  utreexo_overlay_free(o);
+  ASSERT_EQ(*p.nLeaf, *reference.nLeaf);
+  n_roots = copy_roots(roots, &p);
+  assert_same_roots(roots, n_roots, &reference);
+
+  // Every leaf is where it should be, and in the leaf map
+  for (uint32_t n = 0; n < 55; ++n) {
+    utreexo_node_hash leaf;
+    pipeline_leaf(&leaf, n);
+    utreexo_forest_node *pnode = NULL, *pexpected = NULL;
+    utreexo_leaf_map_get(&p.leaf_map, &pnode, leaf);
+    utreexo_leaf_map_get(&reference.leaf_map, &pexpected, leaf);
+    ASSERT_EQ((pnode == NULL), (pexpected == NULL));
+    if (pnode == NULL)
+      continue;
+
+    uint64_t pos = 0, expected = 0;
+    ASSERT_EQ(utreexo_forest_leaf_position(&p, pnode, &pos), 0);
+    ASSERT_EQ(utreexo_forest_leaf_position(&reference, pexpected, &expected),
+              0);
+    ASSERT_EQ(pos, expected);
+  }
+
+  // The committed nodes are wired right, so we can keep going from them
+  const uint32_t utxos3[] = {55, 56, 57};
+  const uint32_t stxos3[] = {44, 50, 1};
+  overlay_apply(&p, utxos3, 3, stxos3, 3, NULL);
+  overlay_apply(&reference, utxos3, 3, stxos3, 3, NULL);
+  n_roots = copy_roots(roots, &p);
+  assert_same_roots(roots, n_roots, &reference);
+
+  // Once the forest moves on, older overlays can't be committed
+  ASSERT_EQ(utreexo_overlay_new(&o, &p), 0);
+  const uint32_t utxos4[] = {60};
+  overlay_apply(&p, utxos4, 1, NULL, 0, o);
+  overlay_apply(&p, utxos4, 1, NULL, 0, NULL);
+  ASSERT_EQ(utreexo_overlay_commit(o), UTREEXO_OVERLAY_ESTALE);
+  utreexo_overlay_free(o);
+  TEST_END;
+}
+
+void test_deferred_hashing() {
+  TEST_BEGIN("deferred hashing");
+  struct utreexo_forest p = get_test_forest("deferred.bin");
+  struct utreexo_forest reference = get_test_forest("deferred_ref.bin");
+  p.deferred_hashing = 1;
+
+  // Big enough to split the rehash between threads
+  static uint32_t utxos[300], stxos[50];
+  for (uint32_t block = 0; block < 20; ++block) {
+    for (uint32_t n = 0; n < 300; ++n)
+      utxos[n] = block * 300 + n;
+    const size_t stxo_count = block == 0 ? 0 : 50;
+    for (uint32_t n = 0; n < stxo_count; ++n)
+      stxos[n] = (block - 1) * 300 + n * 5;
+
+    overlay_apply(&p, utxos, 300, stxos, stxo_count, NULL);
+    overlay_apply(&reference, utxos, 300, stxos, stxo_count, NULL);
+  }
+
+  // Nothing was hashed yet
+  ASSERT_EQ(p.dirty, 1);
+  utreexo_node_hash roots[64];
+  size_t n_roots = copy_roots(roots, &p);
+  ASSERT_ARRAY_EQ(roots[0].hash, UTREEXO_ZERO_HASH, 32);
+
+  utreexo_forest_flush_hashes(&p);
+  ASSERT_EQ(p.dirty, 0);
+  n_roots = copy_roots(roots, &p);
+  assert_same_roots(roots, n_roots, &reference);
+
+  // Proving hashes whatever the last change left dirty
+  const uint32_t spend[] = {5700, 2};
+  overlay_apply(&p, NULL, 0, spend, 2, NULL);
+  overlay_apply(&reference, NULL, 0, spend, 2, NULL);
+  ASSERT_EQ(p.dirty, 1);
+
+  utreexo_node_hash leaves[3];
+  pipeline_leaf(&leaves[0], 5701);
+  pipeline_leaf(&leaves[1], 3);
+  pipeline_leaf(&leaves[2], 1201);
+  uint64_t targets[3];
+  utreexo_node_hash proof[64 * 3];
+  size_t proof_len = 64 * 3;
+  ASSERT_EQ(utreexo_forest_prove_leaves(&p, proof, &proof_len, targets, leaves,
+                                        3),
+            0);
+  ASSERT_EQ(p.dirty, 0);
+  verify_proof(&p, targets, leaves, 3, proof, proof_len);
+  n_roots = copy_roots(roots, &p);
+  assert_same_roots(roots, n_roots, &reference);
+  TEST_END;
+}
+
+void test_deferred_reopen() {
+  TEST_BEGIN("deferred hashing survives closing the forest");
+  unlink("forest_deferred_reopen.bin");
+  unlink("forest_map_deferred_reopen.bin");
+  unlink("forest_deferred_crash.bin");
+  unlink("forest_map_deferred_crash.bin");
+  unlink("forest_deferred_reopen_ref.bin");
+  unlink("forest_map_deferred_reopen_ref.bin");
+  struct utreexo_forest *p = malloc(sizeof(struct utreexo_forest));
+  *p = get_test_forest("deferred_reopen.bin");
+  p->deferred_hashing = 1;
+  struct utreexo_forest crashed = get_test_forest("deferred_crash.bin");
+  crashed.deferred_hashing = 1;
+  struct utreexo_forest reference = get_test_forest("deferred_reopen_ref.bin");
+
+  static uint32_t utxos[200], stxos[30];
+  for (uint32_t block = 0; block < 5; ++block) {
+    for (uint32_t n = 0; n < 200; ++n)
+      utxos[n] = block * 200 + n;
+    const size_t stxo_count = block == 0 ? 0 : 30;
+    for (uint32_t n = 0; n < stxo_count; ++n)
+      stxos[n] = (block - 1) * 200 + n * 3;
+
+    overlay_apply(p, utxos, 200, stxos, stxo_count, NULL);
+    overlay_apply(&crashed, utxos, 200, stxos, stxo_count, NULL);
+    overlay_apply(&reference, utxos, 200, stxos, stxo_count, NULL);
+  }
+  ASSERT_EQ(p->dirty, 1);
+
+  // Closing hashes everything before the file goes away. We map it again
+  // where it was, so the roots still point somewhere useful
+  char *base = (char *)p->data->header;
+  _utreexo_forest_free(p);
+  const int fd = open("forest_deferred_reopen.bin", O_RDONLY);
+  ASSERT_EQ((fd >= 0), 1);
+  char *data = mmap(base, MAP_SIZE, PROT_READ,
+                    MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+  ASSERT_EQ(data, base);
+  char *heap = ((struct utreexo_forest_file_header *)data)->heap;
+  struct utreexo_forest reopened = {
+      .roots = (utreexo_forest_node **)(heap + sizeof(uint64_t)),
+      .nLeaf = (uint64_t *)heap,
+  };
+  utreexo_node_hash roots[64];
+  size_t n_roots = copy_roots(roots, &reopened);
+  assert_same_roots(roots, n_roots, &reference);
+  munmap(data, MAP_SIZE);
+  close(fd);
+
+  // A writer that went away without closing leaves zeroed hashes behind, and
+  // whoever opens the forest next doesn't know they are dirty
+  crashed.dirty = 0;
+  utreexo_forest_recover_hashes(&crashed);
+  ASSERT_EQ(crashed.dirty, 0);
+  n_roots = copy_roots(roots, &crashed);
+  assert_same_roots(roots, n_roots, &reference);
+  TEST_END;
+}
+
+/* Proves leaves with and without the proof cache, and checks both agree */
+static void prove_both_ways(struct utreexo_forest *p, const uint32_t *ns,
+                            size_t n_leaves) {
+  utreexo_node_hash leaves[8], proof[8 * 64], expected[8 * 64];
+  uint64_t targets[8], expected_targets[8];
+  for (size_t n = 0; n < n_leaves; ++n)
+    pipeline_leaf(&leaves[n], ns[n]);
+
+  struct utreexo_proof_cache *cache = p->proof_cache;
+  p->proof_cache = NULL;
+  size_t expected_len = 8 * 64;
+  ASSERT_EQ(utreexo_forest_prove_leaves(p, expected, &expected_len,
+                                        expected_targets, leaves, n_leaves),
+            0);
+  p->proof_cache = cache;
+
+  size_t proof_len = 8 * 64;
+  ASSERT_EQ(utreexo_forest_prove_leaves(p, proof, &proof_len, targets, leaves,
+                                        n_leaves),
+            0);
+  ASSERT_EQ(proof_len, expected_len);
+  for (size_t n = 0; n < n_leaves; ++n)
+    ASSERT_EQ(targets[n], expected_targets[n]);
+  for (size_t n = 0; n < proof_len; ++n)
+    ASSERT_ARRAY_EQ(proof[n].hash, expected[n].hash, 32);
+  verify_proof(p, targets, leaves, n_leaves, proof, proof_len);
+}
+
+void test_proof_cache() {
+  TEST_BEGIN("proof cache");
+  struct utreexo_forest p = get_test_forest("proof_cache.bin");
+  ASSERT_EQ(utreexo_proof_cache_new(&p.proof_cache, 64), 0);
+
+  // Two trees, one with 32 leaves and another with 8
+  uint32_t first[40];
+  for (uint32_t n = 0; n < 40; ++n)
+    first[n] = n;
+  overlay_apply(&p, first, 40, NULL, 0, NULL);
+
+  const uint32_t set[] = {35, 3, 10};
+  prove_both_ways(&p, set, 3);
+  ASSERT_EQ(p.proof_cache->hits, 0);
+
+  // Nothing changed, so this one comes from the cache
+  prove_both_ways(&p, set, 3);
+  ASSERT_EQ(p.proof_cache->hits, 3);
+
+  // Deleting from the small tree leaves the big one alone
+  const uint32_t spend[] = {36};
+  overlay_apply(&p, NULL, 0, spend, 1, NULL);
+  prove_both_ways(&p, set + 1, 2);
+  ASSERT_EQ(p.proof_cache->hits, 5);
+  const uint64_t misses = p.proof_cache->misses;
+  prove_both_ways(&p, set, 1);
+  ASSERT_EQ(p.proof_cache->misses, misses + 1);
+
+  // A new leaf makes a new tree, without touching the others
+  const uint32_t add[] = {40};
+  overlay_apply(&p, add, 1, NULL, 0, NULL);
+  prove_both_ways(&p, set, 3);
+  ASSERT_EQ(p.proof_cache->hits, 8);
+
+  // Until the small tree gets merged into a bigger one. Leaf 35 comes first
+  // and misses, so we don't even look for the others
+  const uint32_t more[] = {41, 42, 43, 44, 45, 46, 47};
+  overlay_apply(&p, more, 7, NULL, 0, NULL);
+  prove_both_ways(&p, set, 3);
+  ASSERT_EQ(p.proof_cache->hits, 8);
+  prove_both_ways(&p, set, 3);
+  ASSERT_EQ(p.proof_cache->hits, 11);
+
+  utreexo_proof_cache_free(p.proof_cache);
+  TEST_END;
+}
+
+/* Reads p the way an attached process would, checking that roots and leaf
+ * count always agree, until it sees final_leaves. Then proves a leaf from the
+ * first block, and checks the roots against the ones written to fd */
+static void attach_reader(int fd, uint64_t final_leaves) {
+  struct utreexo_forest p = {.read_only = 1};
+  void *heap = NULL;
+  ASSERT_EQ(utreexo_forest_file_attach(&p.data, &heap, "forest_attach.bin"),
+            0);
+  utreexo_leaf_map_new(&p.leaf_map, "forest_map_attach.bin", O_RDONLY, NULL,
+                       0);
+  p.nLeaf = heap;
+  p.roots = (utreexo_forest_node **)((char *)heap + sizeof(uint64_t));
+
+  utreexo_node_hash roots[64];
+  size_t n_roots = 0;
+  uint64_t n_leaves = 0, seq;
+  while (n_leaves != final_leaves) {
+    do {
+      ASSERT_EQ(utreexo_forest_read_begin(&p, &seq), 0);
+      n_leaves = *p.nLeaf;
+      n_roots = copy_roots(roots, &p);
+    } while (utreexo_forest_read_retry(&p, seq));
+    // Only adds, so there's a root for every bit
+    ASSERT_EQ(n_roots, (size_t)__builtin_popcountll(n_leaves));
+  }
+
+  utreexo_node_hash leaf, proof[64];
+  uint64_t target;
+  size_t proof_len = 64;
+  pipeline_leaf(&leaf, 3);
+  ASSERT_EQ(utreexo_forest_read_begin(&p, &seq), 0);
+  ASSERT_EQ(utreexo_forest_prove_leaves(&p, proof, &proof_len, &target, &leaf,
+                                        1),
+            0);
+  verify_proof(&p, &target, &leaf, 1, proof, proof_len);
+
+  utreexo_node_hash expected[64];
+  ASSERT_EQ(read(fd, expected, sizeof(expected)), sizeof(expected));
+  for (size_t n = 0; n < n_roots; ++n)
+    ASSERT_ARRAY_EQ(roots[n].hash, expected[n].hash, 32);
+
+  utreexo_leaf_map_close(&p.leaf_map);
+  utreexo_forest_file_close(p.data);
+}
+
+void test_attach() {
+  TEST_BEGIN("attach");
+  enum { N_BLOCKS = 200, PER_BLOCK = 37 };
+  unlink("forest_attach.bin");
+  unlink("forest_map_attach.bin");
+  struct utreexo_forest p = get_test_forest("attach.bin");
+
+  utreexo_node_hash utxos[PER_BLOCK];
+  for (uint32_t n = 0; n < PER_BLOCK; ++n)
+    pipeline_leaf(&utxos[n], n);
+  ASSERT_EQ(utreexo_forest_apply(&p, NULL, utxos, PER_BLOCK, NULL, 0), 0);
+
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  fflush(stdout);
+  const pid_t pid = fork();
+  ASSERT_EQ((pid >= 0), 1);
+  if (pid == 0) {
+    // We got the writer's mapping with fork, it's in the way
+    munmap(p.data->header, MAP_SIZE);
+    attach_reader(fds[0], (uint64_t)N_BLOCKS * PER_BLOCK);
+    exit(0);
+  }
+
+  for (uint32_t block = 1; block < N_BLOCKS; ++block) {
+    for (uint32_t n = 0; n < PER_BLOCK; ++n)
+      pipeline_leaf(&utxos[n], block * PER_BLOCK + n);
+    ASSERT_EQ(utreexo_forest_apply(&p, NULL, utxos, PER_BLOCK, NULL, 0), 0);
+  }
+  utreexo_node_hash roots[64];
+  copy_roots(roots, &p);
+  ASSERT_EQ(write(fds[1], roots, sizeof(roots)), sizeof(roots));
+
+  int status;
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+  ASSERT_EQ((WIFEXITED(status) && WEXITSTATUS(status) == 0), 1);
+  close(fds[0]);
+  close(fds[1]);
+
+  // A torn read may give readers any pointer, they don't follow those out of
+  // the file
+  utreexo_forest_node *torn[64];
+  for (size_t row = 0; row < 64; ++row)
+    torn[row] = (utreexo_forest_node *)(uintptr_t)(row + 1);
+  struct utreexo_forest reader = p;
+  reader.read_only = 1;
+  reader.roots = torn;
+  utreexo_forest_node *node = NULL, *sibling = NULL, *parent = NULL;
+  grab_node(&reader, &node, &sibling, &parent, 0);
+  ASSERT_EQ(node, NULL);
+  grab_node(&reader, &node, &sibling, &parent, UINT64_MAX);
+  ASSERT_EQ(node, NULL);
+  for (size_t row = 0; row < 64; ++row)
+    if (p.roots[row] != NULL)
+      ASSERT_EQ(utreexo_forest_node_valid(&reader, p.roots[row]), 1);
+  TEST_END;
+}
+
+/* A writer that dies halfway through a block leaves the file inconsistent for
+ * good, readers must give up instead of waiting for it */
+void test_attach_dead_writer() {
+  TEST_BEGIN("attach to a writer that died");
+  unlink("forest_dead_writer.bin");
+  fflush(stdout);
+  const pid_t pid = fork();
+  ASSERT_EQ((pid >= 0), 1);
+  if (pid == 0) {
+    struct utreexo_forest_file *file = NULL;
+    void *heap = NULL;
+    utreexo_forest_file_init(&file, &heap, "forest_dead_writer.bin");
+    utreexo_forest_file_write_begin(file);
+    _exit(0);
+  }
+  int status;
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+
+  struct utreexo_forest p = {.read_only = 1};
+  void *heap = NULL;
+  ASSERT_EQ(
+      utreexo_forest_file_attach(&p.data, &heap, "forest_dead_writer.bin"), 0);
+  uint64_t seq;
+  ASSERT_EQ(utreexo_forest_read_begin(&p, &seq), -1);
+  utreexo_forest_file_close(p.data);
+
+  // A new writer makes it consistent again, and holds the file
+  struct utreexo_forest_file *file = NULL;
+  ASSERT_EQ(utreexo_forest_file_init_ex(&file, &heap, "forest_dead_writer.bin",
+                                        UTREEXO_BACKEND_MMAP, 0),
+            0);
+  ASSERT_EQ((file->header->seq & 1), 0);
+  struct utreexo_forest_file *other = NULL;
+  ASSERT_EQ(utreexo_forest_file_init_ex(&other, &heap, "forest_dead_writer.bin",
+                                        UTREEXO_BACKEND_MMAP, 0),
+            -1);
+  utreexo_forest_file_close(file);
+  TEST_END;
+}
+
+void test_verify() {
+  TEST_BEGIN("verify");
+  unlink("forest_verify.bin");
+  unlink("forest_map_verify.bin");
+  struct utreexo_forest p = get_test_forest("verify.bin");
+  ASSERT_EQ(utreexo_forest_file_track_checksums(p.data), 0);
+
+  static uint32_t utxos[300], stxos[50];
+  for (uint32_t block = 0; block < 10; ++block) {
+    for (uint32_t n = 0; n < 300; ++n)
+      utxos[n] = block * 300 + n;
+    const size_t stxo_count = block == 0 ? 0 : 50;
+    for (uint32_t n = 0; n < stxo_count; ++n)
+      stxos[n] = (block - 1) * 300 + n * 5;
+    overlay_apply(&p, utxos, 300, stxos, stxo_count, NULL);
+  }
+  ASSERT_EQ((p.data->header->flags & UTREEXO_FILE_CHECKSUMS),
+            UTREEXO_FILE_CHECKSUMS);
+
+  struct utreexo_forest_verify_stats stats = {0};
+  ASSERT_EQ(utreexo_forest_check(&p, &stats), 0);
+  ASSERT_EQ(stats.pages, p.data->header->n_pages);
+  // Every leaf we didn't spend, and the nodes above them
+  ASSERT_EQ((stats.nodes > 3000 - 450), 1);
+
+  // A bit flips in a leaf, behind our back
+  utreexo_forest_node *leaf = p.roots[63 - __builtin_clzll(*p.nLeaf)];
+  while (leaf->left_child != NULL)
+    leaf = leaf->left_child;
+  leaf->hash.hash[7] ^= 0x10;
+  stats = (struct utreexo_forest_verify_stats){0};
+  ASSERT_EQ(utreexo_forest_check(&p, &stats), -9);
+  ASSERT_EQ(stats.bad_checksums, 1);
+  ASSERT_EQ(stats.bad_hashes, 1);
+  ASSERT_EQ(stats.bad_links, 0);
+  leaf->hash.hash[7] ^= 0x10;
+
+  // It forgets about its parent
+  utreexo_forest_node *parent = leaf->parent;
+  leaf->parent = NULL;
+  stats = (struct utreexo_forest_verify_stats){0};
+  ASSERT_EQ(utreexo_forest_check(&p, &stats), -9);
+  ASSERT_EQ(stats.bad_links, 1);
+  leaf->parent = parent;
+
+  // And its parent points to nowhere, which we must not follow
+  parent->left_child = (utreexo_forest_node *)0x10;
+  stats = (struct utreexo_forest_verify_stats){0};
+  ASSERT_EQ(utreexo_forest_check(&p, &stats), -9);
+  ASSERT_EQ(stats.bad_links, 1);
+  parent->left_child = leaf;
+
+  // Changes we make ourselves keep their checksums
+  for (uint32_t n = 0; n < 300; ++n)
+    utxos[n] = 3000 + n;
+  overlay_apply(&p, utxos, 300, NULL, 0, NULL);
+  stats = (struct utreexo_forest_verify_stats){0};
+  ASSERT_EQ(utreexo_forest_check(&p, &stats), 0);
+
+  // Without checksums, only the hashes give it away
+  utreexo_forest_file_drop_checksums(p.data);
+  leaf->hash.hash[7] ^= 0x10;
+  stats = (struct utreexo_forest_verify_stats){0};
+  ASSERT_EQ(utreexo_forest_check(&p, &stats), -9);
+  ASSERT_EQ(stats.bad_checksums, 0);
+  ASSERT_EQ(stats.bad_hashes, 1);
+  leaf->hash.hash[7] ^= 0x10;
+  TEST_END;
+}
+
+void test_rebuild_leaf_map() {
+  TEST_BEGIN("rebuild leaf map");
+  unlink("forest_rebuild.bin");
+  unlink("forest_map_rebuild.bin");
+  struct utreexo_forest p = get_test_forest("rebuild.bin");
+
+  static uint32_t utxos[300], stxos[50];
+  for (uint32_t block = 0; block < 10; ++block) {
+    for (uint32_t n = 0; n < 300; ++n)
+      utxos[n] = block * 300 + n;
+    const size_t stxo_count = block == 0 ? 0 : 50;
+    for (uint32_t n = 0; n < stxo_count; ++n)
+      stxos[n] = (block - 1) * 300 + n * 5;
+    overlay_apply(&p, utxos, 300, stxos, stxo_count, NULL);
+  }
+
+  static utreexo_node_hash leaves[3000];
+  static utreexo_forest_node *before[3000], *after[3000];
+  for (uint32_t n = 0; n < 3000; ++n)
+    pipeline_leaf(&leaves[n], n);
+  utreexo_leaf_map_get_many(&p.leaf_map, before, leaves, 3000);
+
+  // The map is lost
+  ASSERT_EQ(ftruncate(p.leaf_map.fd, UTREEXO_LEAF_MAP_HEADER_SIZE), 0);
+  utreexo_leaf_map_get_many(&p.leaf_map, after, leaves, 3000);
+  for (uint32_t n = 0; n < 3000; ++n)
+    assert(after[n] == NULL);
+
+  ASSERT_EQ(utreexo_leaf_map_rebuild(&p), 3000 - 450);
+  utreexo_leaf_map_get_many(&p.leaf_map, after, leaves, 3000);
+  for (uint32_t n = 0; n < 3000; ++n) {
+    const int spent = n < 2700 && n % 300 < 250 && n % 5 == 0;
+    ASSERT_EQ(after[n], before[n]);
+    ASSERT_EQ((after[n] == NULL), spent);
+  }
+  TEST_END;
+}
+
+void test_trace() {
+  TEST_BEGIN("trace");
+  unlink("forest_trace.bin");
+  unlink("forest_map_trace.bin");
+  unlink("forest_trace_replay.bin");
+  unlink("forest_map_trace_replay.bin");
+  unlink("forest_trace.bin.trace");
+  unlink("forest_trace_later.bin.trace");
+  struct utreexo_forest p = get_test_forest("trace.bin");
+  ASSERT_EQ(utreexo_trace_create(&p.trace, "forest_trace.bin.trace", 0, NULL,
+                                 0),
+            0);
+
+  static uint32_t utxos[100], stxos[20];
+  for (uint32_t block = 0; block < 5; ++block) {
+    for (uint32_t n = 0; n < 100; ++n)
+      utxos[n] = block * 100 + n;
+    const size_t stxo_count = block == 0 ? 0 : 20;
+    for (uint32_t n = 0; n < stxo_count; ++n)
+      stxos[n] = (block - 1) * 100 + n * 3;
+    overlay_apply(&p, utxos, 100, stxos, stxo_count, NULL);
+  }
+  utreexo_trace_close(p.trace);
+  p.trace = NULL;
+
+  // The forest is where the trace ends, so we may keep appending to it, but
+  // not from anywhere else
+  utreexo_node_hash roots[64];
+  size_t n_roots = copy_roots(roots, &p);
+  struct utreexo_trace *trace = NULL;
+  ASSERT_EQ(utreexo_trace_create(&trace, "forest_trace.bin.trace", 500, roots,
+                                 n_roots),
+            0);
+  utreexo_trace_close(trace);
+  int ret = utreexo_trace_create(&trace, "forest_trace.bin.trace", 400, roots,
+                                 n_roots);
+  ASSERT_EQ(ret, -1);
+  ret = utreexo_trace_create(&trace, "forest_trace.bin.trace", 0, NULL, 0);
+  ASSERT_EQ(ret, -1);
+
+  // A trace started later knows where from
+  ASSERT_EQ(utreexo_trace_create(&trace, "forest_trace_later.bin.trace", 500,
+                                 roots, n_roots),
+            0);
+  utreexo_trace_close(trace);
+  ASSERT_EQ(utreexo_trace_open(&trace, "forest_trace_later.bin.trace"), 0);
+  uint64_t num_leaves = 0;
+  utreexo_node_hash start[64];
+  size_t n_start = 0;
+  utreexo_trace_start(trace, &num_leaves, start, &n_start);
+  ASSERT_EQ(num_leaves, 500);
+  assert_same_roots(start, n_start, &p);
+  utreexo_trace_close(trace);
+
+  // Replaying it on a new forest gets the same roots after every block
+  struct utreexo_forest q = get_test_forest("trace_replay.bin");
+  ASSERT_EQ(utreexo_trace_open(&trace, "forest_trace.bin.trace"), 0);
+  utreexo_trace_start(trace, &num_leaves, start, &n_start);
+  ASSERT_EQ(num_leaves, 0);
+  ASSERT_EQ(n_start, 0);
+  struct utreexo_trace_block block;
+  for (uint32_t n = 0; n < 5; ++n) {
+    ASSERT_EQ(utreexo_trace_next(trace, &block), 0);
+    ASSERT_EQ(block.utxo_count, 100);
+    ASSERT_EQ(block.stxo_count, (n == 0 ? 0 : 20));
+    ASSERT_EQ(block.num_leaves, (n + 1) * 100);
+    ASSERT_EQ(block.ret, 0);
+
+    utreexo_forest_node *pnodes[20];
+    utreexo_leaf_map_get_many(&q.leaf_map, pnodes, block.stxos,
+                              block.stxo_count);
+    ASSERT_EQ(utreexo_forest_apply(&q, pnodes, block.utxos, block.utxo_count,
+                                   block.stxos, block.stxo_count),
+              0);
+    assert_same_roots(block.roots, block.n_roots, &q);
+  }
+  assert_same_roots(block.roots, block.n_roots, &p);
+  ASSERT_EQ(utreexo_trace_next(trace, &block), 1);
+  utreexo_trace_close(trace);
+
+  // A trace cut short loses its last block, says so, and can't be appended
+  // to anymore
+  struct stat st;
+  ASSERT_EQ(stat("forest_trace.bin.trace", &st), 0);
+  ASSERT_EQ(truncate("forest_trace.bin.trace", st.st_size - 100), 0);
+  ASSERT_EQ(utreexo_trace_open(&trace, "forest_trace.bin.trace"), 0);
+  size_t n_blocks = 0;
+  while ((ret = utreexo_trace_next(trace, &block)) == 0)
+    ++n_blocks;
+  ASSERT_EQ(ret, -9);
+  ASSERT_EQ(n_blocks, 4);
+  utreexo_trace_close(trace);
+  ret = utreexo_trace_create(&trace, "forest_trace.bin.trace", 500, roots,
+                             n_roots);
+  ASSERT_EQ(ret, -1);
+  TEST_END;
+}
+
+void test_latency() {
+  TEST_BEGIN("latency");
+  // Every value fits its bucket, and buckets are never much wider than it
+  for (uint64_t v = 1; v < ((uint64_t)1 << 62); v += v / 7 + 1) {
+    const uint64_t bucket = utreexo_latency_bucket(v);
+    ASSERT_EQ((bucket < UTREEXO_LATENCY_BUCKETS), 1);
+    ASSERT_EQ((utreexo_latency_bucket_max(bucket) >= v), 1);
+    ASSERT_EQ((utreexo_latency_bucket_max(bucket) - v <= v / 16), 1);
+    if (bucket > 0)
+      ASSERT_EQ((utreexo_latency_bucket_max(bucket - 1) < v), 1);
+  }
+  ASSERT_EQ(utreexo_latency_bucket(UINT64_MAX), UTREEXO_LATENCY_BUCKETS - 1);
+
+  // 1000 fast ones and 10 slow ones
+  static struct utreexo_latency_histogram h;
+  for (uint64_t n = 0; n < 1000; ++n)
+    utreexo_latency_record(&h, 1000 + n);
+  for (uint64_t n = 0; n < 10; ++n)
+    utreexo_latency_record(&h, 5000000);
+  struct utreexo_latency_stats stats;
+  utreexo_latency_read(&h, &stats, 0);
+  ASSERT_EQ(stats.count, 1010);
+  ASSERT_EQ(stats.max, 5000000);
+  ASSERT_EQ((stats.p50 >= 1500 && stats.p50 <= 1500 + 1500 / 16), 1);
+  ASSERT_EQ((stats.p99 < 2000 + 2000 / 16), 1);
+  ASSERT_EQ(stats.p999, 5000000);
+
+  // Reading with reset gives the same, and then nothing
+  utreexo_latency_read(&h, &stats, 1);
+  ASSERT_EQ(stats.count, 1010);
+  utreexo_latency_read(&h, &stats, 0);
+  ASSERT_EQ(stats.count, 0);
+  ASSERT_EQ(stats.max, 0);
+  ASSERT_EQ(stats.p50, 0);
+
+  unlink("forest_latency.bin");
+  unlink("forest_map_latency.bin");
+  struct utreexo_forest p = get_test_forest("latency.bin");
+  p.latency = calloc(1, sizeof(struct utreexo_latency));
+  p.data->alloc_latency = &p.latency->phases[UTREEXO_LATENCY_PAGE_ALLOC];
+  static uint32_t utxos[500], stxos[50];
+  for (uint32_t block = 0; block < 10; ++block) {
+    for (uint32_t n = 0; n < 500; ++n)
+      utxos[n] = block * 500 + n;
+    const size_t stxo_count = block == 0 ? 0 : 50;
+    for (uint32_t n = 0; n < stxo_count; ++n)
+      stxos[n] = (block - 1) * 500 + n * 7;
+    overlay_apply(&p, utxos, 500, stxos, stxo_count, NULL);
+  }
+  utreexo_latency_read(&p.latency->phases[UTREEXO_LATENCY_DELETE], &stats, 0);
+  ASSERT_EQ(stats.count, 10);
+  utreexo_latency_read(&p.latency->phases[UTREEXO_LATENCY_ADD], &stats, 0);
+  ASSERT_EQ(stats.count, 10);
+  ASSERT_EQ((stats.max > 0 && stats.p50 <= stats.max), 1);
+  utreexo_latency_read(&p.latency->phases[UTREEXO_LATENCY_PAGE_ALLOC],
+                       &stats, 0);
+  ASSERT_EQ((stats.count > 0), 1);
+  p.data->alloc_latency = NULL;
+  free(p.latency);
+  TEST_END;
+}
+
 int main() {
   test_parent_hash();
   test_add_single();
@@ -470,6 +1673,22 @@ int main() {
   test_delete_some();
   test_deletion_cases();
   test_delete_with_map();
+  test_serialize_roundtrip();
+  test_serialize_invalid();
+  test_leaf_position();
+  test_prove();
+  test_pipeline();
+  test_overlay();
+  test_deferred_hashing();
+  test_deferred_reopen();
+  test_proof_cache();
+  test_attach();
+  test_attach_dead_writer();
+  test_verify();
+  test_rebuild_leaf_map();
+  test_trace();
+  test_latency();
 
   return 0;
 }
+
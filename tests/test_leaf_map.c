@@ -1,12 +1,71 @@
 #include "flat_file_impl.h"
+#include "leaf_cache_impl.h"
 #include "leaf_map.h"
 #include "leaf_map_impl.h"
+#include "leaf_map_rebuild_impl.h"
 #include "mmap_forest.h"
+#include "sharded_leaf_map_impl.h"
 #include "test_utils.h"
+#include <pthread.h>
 #include <stdio.h>
 
 leaf_offset chash(unsigned char value[36]) { return value[32]; }
 
+#define SHARDED_LEAVES 4000
+
+struct sharded_reader_ctx {
+  utreexo_sharded_leaf_map *map;
+  utreexo_forest_node **nodes;
+  size_t n_ready;
+  size_t n_found;
+};
+
+/* Keeps reading leaves that were added before we started, while another
+ * thread is adding more */
+static void *sharded_reader(void *arg) {
+  struct sharded_reader_ctx *ctx = arg;
+  for (size_t round = 0; round < 20; ++round) {
+    for (size_t i = 0; i < ctx->n_ready; ++i) {
+      utreexo_forest_node *n = NULL;
+      utreexo_sharded_leaf_map_get(ctx->map, &n, &ctx->nodes[i]->hash);
+      if (n == ctx->nodes[i])
+        ++ctx->n_found;
+    }
+  }
+  return NULL;
+}
+
+struct cache_reader_ctx {
+  const struct utreexo_leaf_cache *cache;
+  utreexo_forest_node **nodes;
+  /* Odd while the writer is removing and adding back that leaf */
+  uint64_t *gen;
+  size_t n_nodes;
+  int stop;
+  size_t n_missing;
+};
+
+/* Keeps looking up leaves that another thread keeps removing and adding back,
+ * making the others move around. A leaf that was there the whole time must
+ * always be found */
+static void *cache_reader(void *arg) {
+  struct cache_reader_ctx *ctx = arg;
+  do {
+    for (size_t i = 0; i < ctx->n_nodes; ++i) {
+      const uint64_t gen = __atomic_load_n(&ctx->gen[i], __ATOMIC_ACQUIRE);
+      if (gen & 1)
+        continue;
+      utreexo_forest_node *n =
+          utreexo_leaf_cache_lookup(ctx->cache, &ctx->nodes[i]->hash);
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (n != ctx->nodes[i] &&
+          __atomic_load_n(&ctx->gen[i], __ATOMIC_RELAXED) == gen)
+        ++ctx->n_missing;
+    }
+  } while (!__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED));
+  return NULL;
+}
+
 int main() {
   {
     TEST_BEGIN("add one");
@@ -14,7 +73,8 @@ int main() {
     void *_ptr;
     utreexo_leaf_map map;
 
-    utreexo_leaf_map_new(&map, "leaf_map_leaves1.bin", O_CREAT | O_RDWR, chash);
+    utreexo_leaf_map_new(&map, "leaf_map_leaves1.bin", O_CREAT | O_RDWR, chash,
+                         0);
     utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map1.bin");
 
     utreexo_forest_node *n = utreexo_forest_file_node_alloc(file);
@@ -33,7 +93,8 @@ int main() {
     void *_ptr;
     utreexo_leaf_map map;
 
-    utreexo_leaf_map_new(&map, "leaf_map_leaves2.bin", O_CREAT | O_RDWR, chash);
+    utreexo_leaf_map_new(&map, "leaf_map_leaves2.bin", O_CREAT | O_RDWR, chash,
+                         0);
     utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map2.bin");
 
     // alloc a new node
@@ -67,7 +128,8 @@ int main() {
     void *_ptr;
     utreexo_leaf_map map;
 
-    utreexo_leaf_map_new(&map, "leaf_map_leaves3.bin", O_CREAT | O_RDWR, NULL);
+    utreexo_leaf_map_new(&map, "leaf_map_leaves3.bin", O_CREAT | O_RDWR, NULL,
+                         0);
     utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map3.bin");
 
     for (size_t i = 0; i < 20000; ++i) {
@@ -93,7 +155,8 @@ int main() {
     struct utreexo_forest_file *file = NULL;
     void *_ptr;
     utreexo_leaf_map map;
-    utreexo_leaf_map_new(&map, "leaf_map_leaves4.bin", O_CREAT | O_RDWR, NULL);
+    utreexo_leaf_map_new(&map, "leaf_map_leaves4.bin", O_CREAT | O_RDWR, NULL,
+                         0);
     utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map4.bin");
 
     for (size_t i = 0; i < 1000; ++i) {
@@ -115,4 +178,672 @@ int main() {
     assert(n == NULL);
     TEST_END;
   }
+  {
+    TEST_BEGIN("batched set and get");
+    struct utreexo_forest_file *file = NULL;
+    void *_ptr;
+    utreexo_leaf_map map;
+    utreexo_leaf_map_new(&map, "leaf_map_leaves5.bin", O_CREAT | O_RDWR, chash,
+                         0);
+    utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map5.bin");
+
+    // chash sends everything to the same few slots, so this also checks
+    // that leaves in the same batch don't take each other's slot
+    utreexo_forest_node *nodes[1000];
+    utreexo_leaf_hash leaves[1000];
+    for (size_t i = 0; i < 1000; ++i) {
+      nodes[i] = utreexo_forest_file_node_alloc(file);
+      memset(&nodes[i]->hash, 0x00, sizeof(utreexo_leaf_hash));
+      memmove(&nodes[i]->hash.hash, &i, sizeof(size_t));
+      leaves[i] = nodes[i]->hash;
+    }
+    utreexo_leaf_map_set_many(&map, nodes, leaves, 1000);
+
+    utreexo_forest_node *found[1001];
+    utreexo_leaf_hash missing = {.hash = {0xff, 0xff, 0xff}};
+    utreexo_leaf_hash wanted[1001];
+    memcpy(wanted, leaves, sizeof(leaves));
+    wanted[1000] = missing;
+
+    utreexo_leaf_map_get_many(&map, found, wanted, 1001);
+    for (size_t i = 0; i < 1000; ++i) {
+      utreexo_forest_node *n = NULL;
+      utreexo_leaf_map_get(&map, &n, leaves[i]);
+      ASSERT_EQ(n, nodes[i]);
+      ASSERT_EQ(found[i], nodes[i]);
+    }
+    assert(found[1000] == NULL);
+    utreexo_leaf_map_close(&map);
+    TEST_END;
+  }
+  {
+    TEST_BEGIN("sorted sweep set, get and delete");
+    struct utreexo_forest_file *file = NULL;
+    void *_ptr;
+    utreexo_leaf_map map;
+    utreexo_leaf_map_new(&map, "leaf_map_leaves7.bin", O_CREAT | O_RDWR, NULL,
+                         4096);
+    utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map7.bin");
+#ifdef USE_IO_URING
+    // make sure we go through the sweep, not io_uring
+    if (map.ring != NULL)
+      utreexo_uring_close(map.ring);
+    map.ring = NULL;
+#endif
+
+    utreexo_forest_node *nodes[2000];
+    utreexo_leaf_hash leaves[2000];
+    for (size_t i = 0; i < 2000; ++i) {
+      nodes[i] = utreexo_forest_file_node_alloc(file);
+      memset(&nodes[i]->hash, 0x00, sizeof(utreexo_leaf_hash));
+      hash_from_u8(nodes[i]->hash.hash, i & 0xff);
+      memmove(&nodes[i]->hash.hash[8], &i, sizeof(size_t));
+      leaves[i] = nodes[i]->hash;
+    }
+    utreexo_leaf_map_set_many(&map, nodes, leaves, 2000);
+
+    utreexo_forest_node *found[2000];
+    utreexo_leaf_map_get_many(&map, found, leaves, 2000);
+    for (size_t i = 0; i < 2000; ++i) {
+      utreexo_forest_node *n = NULL;
+      utreexo_leaf_map_get(&map, &n, leaves[i]);
+      ASSERT_EQ(n, nodes[i]);
+      ASSERT_EQ(found[i], nodes[i]);
+    }
+
+    // delete every other leaf, the rest must still be there
+    utreexo_leaf_hash deleted[1000];
+    for (size_t i = 0; i < 1000; ++i)
+      deleted[i] = leaves[2 * i];
+    utreexo_leaf_map_delete_many(&map, deleted, 1000);
+
+    utreexo_leaf_map_get_many(&map, found, leaves, 2000);
+    for (size_t i = 0; i < 2000; ++i) {
+      utreexo_forest_node *expected = (i % 2) ? nodes[i] : NULL;
+      ASSERT_EQ(found[i], expected);
+    }
+    utreexo_leaf_map_close(&map);
+    TEST_END;
+  }
+  {
+    TEST_BEGIN("sharded map with concurrent readers");
+    struct utreexo_forest_file *file = NULL;
+    void *_ptr;
+    utreexo_sharded_leaf_map map;
+    ASSERT_EQ(utreexo_sharded_leaf_map_new(&map, "leaf_map_sharded8.bin", 8,
+                                           4096, NULL),
+              0);
+    utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map8.bin");
+    ASSERT_EQ(map.shard_bits, 3);
+
+    static utreexo_forest_node *nodes[SHARDED_LEAVES];
+    for (size_t i = 0; i < SHARDED_LEAVES; ++i) {
+      nodes[i] = utreexo_forest_file_node_alloc(file);
+      memset(&nodes[i]->hash, 0x00, sizeof(utreexo_leaf_hash));
+      hash_from_u8(nodes[i]->hash.hash, i & 0xff);
+      memmove(&nodes[i]->hash.hash[8], &i, sizeof(size_t));
+    }
+
+    // half of the leaves are there before readers start
+    for (size_t i = 0; i < SHARDED_LEAVES / 2; ++i)
+      utreexo_sharded_leaf_map_set(&map, nodes[i], &nodes[i]->hash);
+
+    pthread_t readers[4];
+    struct sharded_reader_ctx ctx[4];
+    for (size_t t = 0; t < 4; ++t) {
+      ctx[t] = (struct sharded_reader_ctx){
+          .map = &map, .nodes = nodes, .n_ready = SHARDED_LEAVES / 2};
+      pthread_create(&readers[t], NULL, sharded_reader, &ctx[t]);
+    }
+
+    // while they read, add the rest and delete a few of the new ones
+    for (size_t i = SHARDED_LEAVES / 2; i < SHARDED_LEAVES; ++i)
+      utreexo_sharded_leaf_map_set(&map, nodes[i], &nodes[i]->hash);
+    for (size_t i = SHARDED_LEAVES / 2; i < SHARDED_LEAVES; i += 2)
+      utreexo_sharded_leaf_map_delete(&map, &nodes[i]->hash);
+
+    for (size_t t = 0; t < 4; ++t) {
+      pthread_join(readers[t], NULL);
+      ASSERT_EQ(ctx[t].n_found, 20 * (SHARDED_LEAVES / 2));
+    }
+
+    for (size_t i = 0; i < SHARDED_LEAVES; ++i) {
+      utreexo_forest_node *n = NULL;
+      utreexo_forest_node *expected = nodes[i];
+      if (i >= SHARDED_LEAVES / 2 && i % 2 == 0)
+        expected = NULL;
+      utreexo_sharded_leaf_map_get(&map, &n, &nodes[i]->hash);
+      ASSERT_EQ(n, expected);
+    }
+    utreexo_sharded_leaf_map_close(&map);
+    TEST_END;
+  }
+  {
+    TEST_BEGIN("sharded map reuses deleted slots");
+    struct utreexo_forest_file *file = NULL;
+    void *_ptr;
+    utreexo_sharded_leaf_map map;
+    unlink("leaf_map_sharded17.bin.0");
+    ASSERT_EQ(utreexo_sharded_leaf_map_new(&map, "leaf_map_sharded17.bin", 1,
+                                           16, NULL),
+              0);
+    utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map17.bin");
+    ASSERT_EQ(map.n_slots, 16);
+
+    // many more leaves than slots go through the map, but only a few are
+    // there at any time
+    static utreexo_forest_node *nodes[1000];
+    for (size_t i = 0; i < 1000; ++i) {
+      nodes[i] = utreexo_forest_file_node_alloc(file);
+      memset(&nodes[i]->hash, 0x00, sizeof(utreexo_leaf_hash));
+      hash_from_u8(nodes[i]->hash.hash, i & 0xff);
+      memmove(&nodes[i]->hash.hash[8], &i, sizeof(size_t));
+
+      utreexo_sharded_leaf_map_set(&map, nodes[i], &nodes[i]->hash);
+      if (i >= 8)
+        utreexo_sharded_leaf_map_delete(&map, &nodes[i - 8]->hash);
+    }
+
+    for (size_t i = 0; i < 1000; ++i) {
+      utreexo_forest_node *n = NULL;
+      utreexo_sharded_leaf_map_get(&map, &n, &nodes[i]->hash);
+      ASSERT_EQ(n, (i >= 992 ? nodes[i] : NULL));
+    }
+
+    // setting a leaf that's already there doesn't take another slot
+    utreexo_sharded_leaf_map_set(&map, nodes[999], &nodes[999]->hash);
+    utreexo_sharded_leaf_map_delete(&map, &nodes[999]->hash);
+    utreexo_forest_node *n = NULL;
+    utreexo_sharded_leaf_map_get(&map, &n, &nodes[999]->hash);
+    ASSERT_EQ(n, NULL);
+    utreexo_sharded_leaf_map_close(&map);
+    TEST_END;
+  }
+  {
+    TEST_BEGIN("small map wraps around and keeps its salt");
+    struct utreexo_forest_file *file = NULL;
+    void *_ptr;
+    utreexo_leaf_map map;
+    utreexo_leaf_map_new(&map, "leaf_map_leaves6.bin", O_CREAT | O_RDWR, NULL,
+                         100);
+    utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map6.bin");
+    ASSERT_EQ(map.n_slots, 128);
+
+    // fill the whole table, so some probes need to wrap around
+    utreexo_forest_node *nodes[128];
+    for (size_t i = 0; i < 128; ++i) {
+      nodes[i] = utreexo_forest_file_node_alloc(file);
+      hash_from_u8(nodes[i]->hash.hash, i);
+      utreexo_leaf_map_set(&map, nodes[i], nodes[i]->hash);
+    }
+
+    const uint64_t salt = map.salt;
+    utreexo_leaf_map_close(&map);
+
+    // reopening should ignore the size we ask for, and use the same salt
+    utreexo_leaf_map_new(&map, "leaf_map_leaves6.bin", O_CREAT | O_RDWR, NULL,
+                         1024);
+    ASSERT_EQ(map.n_slots, 128);
+    ASSERT_EQ(map.salt, salt);
+
+    for (size_t i = 0; i < 128; ++i) {
+      utreexo_forest_node *n = NULL;
+      utreexo_leaf_map_get(&map, &n, nodes[i]->hash);
+      ASSERT_EQ(n, nodes[i]);
+    }
+
+    // a miss on a full table should still terminate
+    utreexo_leaf_hash missing = {.hash = {0xff, 0xff, 0xff}};
+    utreexo_forest_node *n = NULL;
+    utreexo_leaf_map_get(&map, &n, missing);
+    assert(n == NULL);
+    utreexo_leaf_map_close(&map);
+    TEST_END;
+  }
+  {
+    TEST_BEGIN("recently added leaves skip the map");
+    struct utreexo_forest_file *file = NULL;
+    void *_ptr;
+    utreexo_leaf_map map;
+
+    utreexo_leaf_map_new(&map, "leaf_map_leaves9.bin", O_CREAT | O_RDWR, NULL,
+                         1024);
+    utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map9.bin");
+
+    utreexo_forest_node *nodes[6];
+    utreexo_leaf_hash leaves[6];
+    for (size_t i = 0; i < 6; ++i) {
+      nodes[i] = utreexo_forest_file_node_alloc(file);
+      nodes[i]->hash = (utreexo_leaf_hash){.hash = {9, (uint8_t)i}};
+      leaves[i] = nodes[i]->hash;
+    }
+
+    // Only room for four, so the two oldest go to the map
+    struct utreexo_leaf_cache *cache = NULL;
+    ASSERT_EQ(utreexo_leaf_cache_new(&cache, 4), 0);
+    utreexo_leaf_cache_set_many(cache, &map, nodes, leaves, 6);
+    ASSERT_EQ(cache->stats.evicted, 2);
+
+    utreexo_forest_node *n = NULL;
+    utreexo_leaf_map_get(&map, &n, leaves[1]);
+    ASSERT_EQ(n, nodes[1]);
+    utreexo_leaf_map_get(&map, &n, leaves[2]);
+    assert(n == NULL);
+
+    utreexo_forest_node *found[6];
+    utreexo_leaf_cache_get_many(cache, &map, found, leaves, 6);
+    for (size_t i = 0; i < 6; ++i)
+      ASSERT_EQ(found[i], nodes[i]);
+    ASSERT_EQ(cache->stats.hits, 4);
+    ASSERT_EQ(cache->stats.misses, 2);
+
+    // Leaf 3 dies young and never reaches the map, leaf 0 is deleted from it
+    const utreexo_leaf_hash spent[2] = {leaves[3], leaves[0]};
+    utreexo_leaf_cache_delete_many(cache, &map, spent, 2);
+    ASSERT_EQ(cache->stats.elided, 1);
+    utreexo_leaf_cache_get(cache, &map, &n, leaves[3]);
+    assert(n == NULL);
+    utreexo_leaf_cache_get(cache, &map, &n, leaves[0]);
+    assert(n == NULL);
+
+    // Adding one more skips leaf 3's old place in the queue
+    nodes[3]->hash = (utreexo_leaf_hash){.hash = {9, 6}};
+    leaves[3] = nodes[3]->hash;
+    utreexo_leaf_cache_set_many(cache, &map, &nodes[3], &leaves[3], 1);
+    ASSERT_EQ(cache->stats.evicted, 3);
+    utreexo_leaf_map_get(&map, &n, leaves[2]);
+    ASSERT_EQ(n, nodes[2]);
+
+    // Whatever is left goes to the map
+    utreexo_leaf_cache_free(cache, &map);
+    for (size_t i = 1; i < 6; ++i) {
+      utreexo_leaf_map_get(&map, &n, leaves[i]);
+      ASSERT_EQ(n, nodes[i]);
+    }
+    utreexo_leaf_map_close(&map);
+    TEST_END;
+  }
+  {
+    TEST_BEGIN("leaf cache readers and a writer");
+    struct utreexo_forest_file *file = NULL;
+    void *_ptr;
+    utreexo_leaf_map map;
+
+    utreexo_leaf_map_new(&map, "leaf_map_leaves13.bin", O_CREAT | O_RDWR,
+                         NULL, 1024);
+    utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map13.bin");
+
+    // No size, no cache
+    struct utreexo_leaf_cache unused;
+    struct utreexo_leaf_cache *cache = &unused;
+    ASSERT_EQ(utreexo_leaf_cache_new(&cache, 0), 0);
+    assert(cache == NULL);
+
+    // They all start looking in the same slot, so they make a single run
+    utreexo_forest_node *nodes[64];
+    utreexo_leaf_hash leaves[64];
+    uint64_t gen[64] = {0};
+    for (size_t i = 0; i < 64; ++i) {
+      nodes[i] = utreexo_forest_file_node_alloc(file);
+      nodes[i]->hash = (utreexo_leaf_hash){.hash = {13, [8] = (uint8_t)i}};
+      leaves[i] = nodes[i]->hash;
+    }
+
+    // Big enough that nothing is ever evicted
+    ASSERT_EQ(utreexo_leaf_cache_new(&cache, 1 << 15), 0);
+    utreexo_leaf_cache_set_many(cache, &map, nodes, leaves, 64);
+
+    struct cache_reader_ctx ctx = {
+        .cache = cache, .nodes = nodes, .gen = gen, .n_nodes = 64};
+    pthread_t thread;
+    pthread_create(&thread, NULL, cache_reader, &ctx);
+
+    // The eight leaves at the front of the run go to its back, and everything
+    // after them moves back eight slots, right under the reader
+    for (size_t round = 0; round < 4000; ++round) {
+      const size_t first = (round % 8) * 8;
+      for (size_t i = first; i < first + 8; ++i)
+        __atomic_store_n(&gen[i], gen[i] + 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_RELEASE);
+      utreexo_leaf_cache_delete_many(cache, &map, &leaves[first], 8);
+      utreexo_leaf_cache_set_many(cache, &map, &nodes[first], &leaves[first],
+                                  8);
+      for (size_t i = first; i < first + 8; ++i)
+        __atomic_store_n(&gen[i], gen[i] + 1, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&ctx.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(thread, NULL);
+
+    ASSERT_EQ(ctx.n_missing, 0);
+    ASSERT_EQ(cache->stats.evicted, 0);
+    utreexo_leaf_cache_free(cache, &map);
+    utreexo_leaf_map_close(&map);
+    TEST_END;
+  }
+  {
+    TEST_BEGIN("leaf filter answers for missing leaves");
+    struct utreexo_forest_file *file = NULL;
+    void *_ptr;
+    utreexo_leaf_map map;
+    utreexo_leaf_map_new(&map, "leaf_map_leaves10.bin", O_CREAT | O_RDWR, NULL,
+                         4096);
+    utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map10.bin");
+
+    utreexo_forest_node *nodes[2000];
+    utreexo_leaf_hash leaves[2000];
+    for (size_t i = 0; i < 2000; ++i) {
+      nodes[i] = utreexo_forest_file_node_alloc(file);
+      memset(&nodes[i]->hash, 0x00, sizeof(utreexo_leaf_hash));
+      hash_from_u8(nodes[i]->hash.hash, i & 0xff);
+      memmove(&nodes[i]->hash.hash[8], &i, sizeof(size_t));
+      leaves[i] = nodes[i]->hash;
+    }
+
+    // Half of them are in the map before the filter, it must pick them up
+    utreexo_leaf_map_set_many(&map, nodes, leaves, 500);
+    utreexo_leaf_map_attach_filter(&map, "leaf_map_leaves10.bin.filter", 1000);
+    utreexo_leaf_map_set_many(&map, &nodes[500], &leaves[500], 500);
+
+    utreexo_forest_node *found[2000];
+    utreexo_leaf_map_get_many(&map, found, leaves, 2000);
+    for (size_t k = 0; k < 2000; ++k)
+      ASSERT_EQ(found[k], (k < 1000 ? nodes[k] : NULL));
+    // A few false positives are fine, but not many
+    assert(map.filter->negatives >= 990);
+
+    utreexo_leaf_hash deleted[500];
+    for (size_t k = 0; k < 500; ++k)
+      deleted[k] = leaves[2 * k];
+    utreexo_leaf_map_delete_many(&map, deleted, 500);
+    utreexo_leaf_map_close(&map);
+
+    // The filter is still good for this map, so it's used as is
+    utreexo_leaf_map_new(&map, "leaf_map_leaves10.bin", O_CREAT | O_RDWR, NULL,
+                         0);
+    ASSERT_EQ(utreexo_leaf_filter_open(&map.filter,
+                                       "leaf_map_leaves10.bin.filter", 1000,
+                                       map.salt, map.generation),
+              0);
+    for (size_t k = 0; k < 2000; ++k) {
+      utreexo_forest_node *n = NULL;
+      utreexo_leaf_map_get(&map, &n, leaves[k]);
+      ASSERT_EQ(n, ((k < 1000 && k % 2) ? nodes[k] : NULL));
+    }
+    assert(map.filter->negatives >= 1490);
+    ASSERT_EQ(map.filter->header->saturated, 0);
+    utreexo_leaf_map_close(&map);
+
+    // Leaves added without the filter must be found once it's back
+    utreexo_leaf_map_new(&map, "leaf_map_leaves10.bin", O_CREAT | O_RDWR, NULL,
+                         0);
+    utreexo_leaf_map_set_many(&map, &nodes[1000], &leaves[1000], 100);
+    utreexo_leaf_map_close(&map);
+    utreexo_leaf_map_new(&map, "leaf_map_leaves10.bin", O_CREAT | O_RDWR, NULL,
+                         0);
+    utreexo_leaf_map_attach_filter(&map, "leaf_map_leaves10.bin.filter", 1000);
+    utreexo_leaf_map_get_many(&map, found, &leaves[1000], 100);
+    for (size_t k = 0; k < 100; ++k)
+      ASSERT_EQ(found[k], nodes[1000 + k]);
+
+    // Same if we never got to close the filter with the map
+    utreexo_leaf_map_set(&map, nodes[1100], leaves[1100]);
+    const uint64_t generation = map.generation;
+    utreexo_leaf_filter_close(map.filter);
+    map.filter = NULL;
+    utreexo_leaf_map_close(&map);
+    utreexo_leaf_map_new(&map, "leaf_map_leaves10.bin", O_CREAT | O_RDWR, NULL,
+                         0);
+    ASSERT_EQ(map.generation, generation);
+    ASSERT_EQ(utreexo_leaf_filter_open(&map.filter,
+                                       "leaf_map_leaves10.bin.filter", 1000,
+                                       map.salt, map.generation),
+              1);
+    utreexo_leaf_map_close(&map);
+    TEST_END;
+  }
+  {
+    TEST_BEGIN("bulk load replaces everything and wraps around");
+    struct utreexo_forest_file *file = NULL;
+    void *_ptr;
+    utreexo_leaf_map map;
+    utreexo_leaf_map_new(&map, "leaf_map_leaves11.bin", O_CREAT | O_RDWR, NULL,
+                         128);
+    utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map11.bin");
+    utreexo_leaf_map_attach_filter(&map, "leaf_map_leaves11.bin.filter", 128);
+
+    utreexo_forest_node *stale = utreexo_forest_file_node_alloc(file);
+    hash_from_u8(stale->hash.hash, 0xff);
+    memset(stale->hash.hash + 8, 0xff, 8);
+    utreexo_leaf_map_set(&map, stale, stale->hash);
+
+    // The whole table in three runs, so some leaves go past the last slot
+    struct utreexo_leaf_map_load_entry entries[128];
+    utreexo_forest_node *nodes[128];
+    for (size_t i = 0; i < 128; ++i) {
+      nodes[i] = utreexo_forest_file_node_alloc(file);
+      hash_from_u8(nodes[i]->hash.hash, i);
+      memmove(&nodes[i]->hash.hash[8], &i, sizeof(size_t));
+    }
+    struct utreexo_leaf_map_load_entry *runs[3];
+    size_t run_lengths[3] = {0};
+    for (size_t r = 0; r < 3; ++r) {
+      runs[r] = &entries[r * 43];
+      for (size_t i = r; i < 128; i += 3)
+        runs[r][run_lengths[r]++] = (struct utreexo_leaf_map_load_entry){
+            .slot = utreexo_leaf_map_slot(&map, &nodes[i]->hash),
+            .node = nodes[i]};
+      qsort(runs[r], run_lengths[r], sizeof(entries[0]),
+            utreexo_leaf_map_rebuild_cmp);
+    }
+    utreexo_leaf_map_load(&map, runs, run_lengths, 3);
+
+    for (size_t i = 0; i < 128; ++i) {
+      utreexo_forest_node *n = NULL;
+      utreexo_leaf_map_get(&map, &n, nodes[i]->hash);
+      ASSERT_EQ(n, nodes[i]);
+    }
+    utreexo_forest_node *n = NULL;
+    utreexo_leaf_map_get(&map, &n, stale->hash);
+    assert(n == NULL);
+    utreexo_leaf_map_close(&map);
+    TEST_END;
+  }
+  {
+    TEST_BEGIN("deleted slots are reused");
+    struct utreexo_forest_file *file = NULL;
+    void *_ptr;
+    utreexo_leaf_map map;
+    utreexo_leaf_map_new(&map, "leaf_map_leaves12.bin", O_CREAT | O_RDWR, NULL,
+                         64);
+    utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map12.bin");
+    ASSERT_EQ(map.n_slots, 64);
+
+    utreexo_forest_node *live = utreexo_forest_file_node_alloc(file);
+    hash_from_u8(live->hash.hash, 0xff);
+    utreexo_leaf_map_set(&map, live, live->hash);
+
+    // Many more leaves come and go than we have slots, without reusing
+    // tombstones the table would be full after 63 of them
+    utreexo_forest_node *nodes[8];
+    utreexo_leaf_hash leaves[8];
+    for (size_t i = 0; i < 8; ++i)
+      nodes[i] = utreexo_forest_file_node_alloc(file);
+    for (size_t cycle = 0; cycle < 1000; ++cycle) {
+      for (size_t i = 0; i < 8; ++i) {
+        const size_t id = cycle * 8 + i;
+        hash_from_u8(nodes[i]->hash.hash, id & 0xff);
+        memmove(&nodes[i]->hash.hash[8], &id, sizeof(size_t));
+        leaves[i] = nodes[i]->hash;
+      }
+      if (cycle % 2 == 0) {
+        for (size_t i = 0; i < 8; ++i)
+          utreexo_leaf_map_set(&map, nodes[i], leaves[i]);
+      } else {
+        utreexo_leaf_map_set_many(&map, nodes, leaves, 8);
+      }
+
+      utreexo_forest_node *found[8];
+      utreexo_leaf_map_get_many(&map, found, leaves, 8);
+      for (size_t i = 0; i < 8; ++i)
+        ASSERT_EQ(found[i], nodes[i]);
+
+      if (cycle % 3 == 0) {
+        for (size_t i = 0; i < 8; ++i)
+          utreexo_leaf_map_delete(&map, leaves[i]);
+      } else {
+        utreexo_leaf_map_delete_many(&map, leaves, 8);
+      }
+    }
+
+    utreexo_forest_node *n = NULL;
+    utreexo_leaf_map_get(&map, &n, live->hash);
+    ASSERT_EQ(n, live);
+
+    // Setting a leaf that is already there replaces it
+    utreexo_forest_node *moved = utreexo_forest_file_node_alloc(file);
+    moved->hash = live->hash;
+    utreexo_leaf_map_set(&map, moved, live->hash);
+    utreexo_leaf_map_get(&map, &n, live->hash);
+    ASSERT_EQ(n, moved);
+    utreexo_leaf_map_delete(&map, live->hash);
+    utreexo_leaf_map_get(&map, &n, live->hash);
+    assert(n == NULL);
+    utreexo_leaf_map_close(&map);
+    TEST_END;
+  }
+#ifdef USE_IO_URING
+  {
+    TEST_BEGIN("batches use the sweep once the kernel refuses the ring");
+    struct utreexo_forest_file *file = NULL;
+    void *_ptr;
+    utreexo_leaf_map map;
+    unlink("leaf_map_leaves16.bin");
+    utreexo_leaf_map_new(&map, "leaf_map_leaves16.bin", O_CREAT | O_RDWR, NULL,
+                         4096);
+    utreexo_forest_file_init(&file, &_ptr, "leaf_map_test_map16.bin");
+    // Whatever the kernel supports, io_uring_enter on something that isn't a
+    // ring fails, and not with EINTR
+    if (map.ring != NULL) {
+      close(map.ring->fd);
+      map.ring->fd = dup(map.fd);
+    }
+
+    utreexo_forest_node *nodes[500];
+    utreexo_leaf_hash leaves[500];
+    for (size_t i = 0; i < 500; ++i) {
+      nodes[i] = utreexo_forest_file_node_alloc(file);
+      memset(&nodes[i]->hash, 0x00, sizeof(utreexo_leaf_hash));
+      memmove(&nodes[i]->hash.hash[8], &i, sizeof(size_t));
+      leaves[i] = nodes[i]->hash;
+    }
+    utreexo_leaf_map_set_many(&map, nodes, leaves, 500);
+    ASSERT_EQ(map.ring_busy, (map.ring != NULL));
+
+    utreexo_forest_node *found[500];
+    utreexo_leaf_map_get_many(&map, found, leaves, 500);
+    for (size_t i = 0; i < 500; ++i) {
+      utreexo_forest_node *n = NULL;
+      utreexo_leaf_map_get(&map, &n, leaves[i]);
+      ASSERT_EQ(n, nodes[i]);
+      ASSERT_EQ(found[i], nodes[i]);
+    }
+    utreexo_leaf_map_close(&map);
+    utreexo_forest_file_close(file);
+    TEST_END;
+  }
+#endif
+  {
+    TEST_BEGIN("maps we can't use are refused");
+    utreexo_leaf_map map;
+
+    // Old maps start with their first slot, and we must leave it alone
+    const utreexo_forest_node *slot = (utreexo_forest_node *)0x1000;
+    int fd = open("leaf_map_leaves14.bin", O_CREAT | O_RDWR | O_TRUNC, 0666);
+    ASSERT_EQ(pwrite(fd, &slot, sizeof(slot), 0), sizeof(slot));
+    close(fd);
+    ASSERT_EQ(utreexo_leaf_map_new(&map, "leaf_map_leaves14.bin",
+                                   O_CREAT | O_RDWR, NULL, 1024),
+              -1);
+    fd = open("leaf_map_leaves14.bin", O_RDONLY);
+    const utreexo_forest_node *read_back = NULL;
+    ASSERT_EQ(pread(fd, &read_back, sizeof(read_back), 0), sizeof(read_back));
+    ASSERT_EQ(read_back, slot);
+    close(fd);
+
+    // Too many slots to address, or nothing to open
+    unlink("leaf_map_leaves15.bin");
+    ASSERT_EQ(utreexo_leaf_map_new(&map, "leaf_map_leaves15.bin",
+                                   O_CREAT | O_RDWR, NULL,
+                                   UTREEXO_LEAF_MAP_MAX_SLOTS + 1),
+              -1);
+    ASSERT_EQ(utreexo_leaf_map_new(&map, "leaf_map_leaves15.bin", O_RDONLY,
+                                   NULL, 0),
+              -1);
+    ASSERT_EQ(utreexo_leaf_map_new(&map, "leaf_map_leaves15.bin",
+                                   O_CREAT | O_RDWR, NULL,
+                                   UTREEXO_LEAF_MAP_MAX_SLOTS),
+              0);
+    ASSERT_EQ(map.n_slots, UTREEXO_LEAF_MAP_MAX_SLOTS);
+    utreexo_leaf_map_close(&map);
+    TEST_END;
+  }
+  {
+    TEST_BEGIN("sharded maps we can't use are refused");
+    utreexo_sharded_leaf_map map;
+    const char *names[] = {
+        "leaf_map_sharded18.bin.0", "leaf_map_sharded18.bin.1",
+        "leaf_map_sharded19.bin.0", "leaf_map_sharded19.bin.1",
+        "leaf_map_sharded20.bin.0", "leaf_map_sharded21.bin.0",
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+      unlink(names[i]);
+
+    ASSERT_EQ(utreexo_sharded_leaf_map_new(&map, "leaf_map_sharded18.bin", 2,
+                                           16, NULL),
+              0);
+    const uint64_t salt = map.salt;
+    utreexo_sharded_leaf_map_close(&map);
+    ASSERT_EQ(utreexo_sharded_leaf_map_new(&map, "leaf_map_sharded19.bin", 2,
+                                           16, NULL),
+              0);
+    utreexo_sharded_leaf_map_close(&map);
+
+    // Opening it again keeps its shape and salt
+    ASSERT_EQ(utreexo_sharded_leaf_map_new(&map, "leaf_map_sharded18.bin", 8,
+                                           1024, NULL),
+              0);
+    ASSERT_EQ(map.salt, salt);
+    ASSERT_EQ(map.n_slots, 16);
+    ASSERT_EQ(map.shard_bits, 1);
+    utreexo_sharded_leaf_map_close(&map);
+
+    // A shard that went missing, or one from another map
+    unlink("leaf_map_sharded18.bin.1");
+    ASSERT_EQ(utreexo_sharded_leaf_map_new(&map, "leaf_map_sharded18.bin", 2,
+                                           16, NULL),
+              -1);
+    ASSERT_EQ(rename("leaf_map_sharded19.bin.1", "leaf_map_sharded18.bin.1"),
+              0);
+    ASSERT_EQ(utreexo_sharded_leaf_map_new(&map, "leaf_map_sharded18.bin", 2,
+                                           16, NULL),
+              -1);
+
+    // A map from before we had a header is left alone
+    const utreexo_forest_node *slot = (utreexo_forest_node *)0x1000;
+    int fd = open("leaf_map_sharded20.bin.0", O_CREAT | O_RDWR, 0666);
+    ASSERT_EQ(pwrite(fd, &slot, sizeof(slot), 0), sizeof(slot));
+    ASSERT_EQ(utreexo_sharded_leaf_map_new(&map, "leaf_map_sharded20.bin", 1,
+                                           16, NULL),
+              -1);
+    const utreexo_forest_node *read_back = NULL;
+    ASSERT_EQ(pread(fd, &read_back, sizeof(read_back), 0), sizeof(read_back));
+    ASSERT_EQ(read_back, slot);
+    close(fd);
+
+    ASSERT_EQ(utreexo_sharded_leaf_map_new(
+                  &map, "leaf_map_sharded21.bin",
+                  UTREEXO_SHARDED_LEAF_MAP_MAX_SHARDS + 1, 16, NULL),
+              -1);
+    TEST_END;
+  }
 }
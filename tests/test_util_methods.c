@@ -4,11 +4,55 @@
 #include "test_utils.h"
 #include <util.h>
 
+/* The bit-by-bit versions of our position math, we check the real ones
+ * against these */
+static int ref_detect_row(uint64_t pos, uint64_t forest_rows) {
+  uint64_t marker = (uint64_t)1 << forest_rows;
+  uint8_t h = 0;
+
+  while ((pos & marker) != 0) {
+    marker >>= 1;
+    h += 1;
+  }
+  return h;
+}
+
+static int ref_tree_rows(uint64_t n) {
+  int rows = 0;
+  while (n > ((uint64_t)1 << rows))
+    ++rows;
+  return rows;
+}
+
+static node_offset ref_detect_offset(uint64_t pos, uint64_t num_leaves) {
+  uint8_t tr = ref_tree_rows(num_leaves);
+  uint8_t nr = ref_detect_row(pos, tr);
+  uint64_t marker = pos;
+
+  while (((marker << nr) & (((uint64_t)2 << tr) - 1)) >=
+         (((uint64_t)1 << tr) & num_leaves)) {
+    marker -= ((uint64_t)1 << tr) & num_leaves;
+    tr -= 1;
+  }
+  return (node_offset){.tree = tr, .depth = (uint8_t)(tr - nr), .bits = !pos};
+}
+
+static uint64_t xorshift(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
 void test_tree_rows() {
+  ASSERT_EQ(tree_rows(0), 0);
+  ASSERT_EQ(tree_rows(1), 0);
   ASSERT_EQ(tree_rows(8), 3);
   ASSERT_EQ(tree_rows(9), 4);
   ASSERT_EQ(tree_rows(12), 4);
   ASSERT_EQ(tree_rows(255), 8);
+  ASSERT_EQ(tree_rows((uint64_t)1 << 40), 40);
+  ASSERT_EQ(tree_rows(((uint64_t)1 << 40) + 1), 41);
 };
 
 void test_detect_row() {
@@ -16,6 +60,8 @@ void test_detect_row() {
   ASSERT_EQ(detect_row(10, 3), 1);
   ASSERT_EQ(detect_row(2, 1), 1);
   ASSERT_EQ(detect_row(13, 3), 2);
+  ASSERT_EQ(detect_row(14, 3), 3);
+  ASSERT_EQ(detect_row((uint64_t)3 << 39, 40), 2);
 }
 
 void test_detect_offset() {
@@ -25,8 +71,98 @@ void test_detect_offset() {
   ASSERT_EQ(offset.bits, 1);
 }
 
+void test_position_helpers() {
+  // See the drawing in position.h
+  ASSERT_EQ(parent_position(0, 3), 8);
+  ASSERT_EQ(parent_position(5, 3), 10);
+  ASSERT_EQ(parent_position(13, 3), 14);
+  ASSERT_EQ(sibling_position(10), 11);
+  ASSERT_EQ(left_child_position(12, 3), 8);
+  ASSERT_EQ(left_child_position(9, 3), 2);
+  ASSERT_EQ(root_position(8, 3, 3), 14);
+  ASSERT_EQ(is_root_position(14, 8, 3), 1);
+  ASSERT_EQ(is_root_position(12, 8, 3), 0);
+  // 7 leaves, roots at 12, 10 and 6
+  ASSERT_EQ(is_root_position(12, 7, 3), 1);
+  ASSERT_EQ(is_root_position(10, 7, 3), 1);
+  ASSERT_EQ(is_root_position(6, 7, 3), 1);
+  ASSERT_EQ(is_root_position(5, 7, 3), 0);
+  // nodes keep their row and index when the forest grows or shrinks
+  ASSERT_EQ(translate_position(5, 3, 4), 5);
+  ASSERT_EQ(translate_position(8, 3, 4), 16);
+  ASSERT_EQ(translate_position(14, 3, 4), 28);
+  ASSERT_EQ(translate_position(28, 4, 3), 14);
+  ASSERT_EQ(translate_position(13, 3, 63), 0xc000000000000001);
+  ASSERT_EQ(translate_position(0xc000000000000001, 63, 3), 13);
+}
+
+/* Random nodes in random forests, up to 50 rows tall */
+void test_position_properties() {
+  uint64_t state = 0x2545f4914f6cdd1dULL;
+  static uint64_t positions[1000];
+  static node_offset offsets[1000];
+  static uint64_t parents[1000];
+  static uint8_t rows[1000];
+
+  for (size_t round = 0; round < 2000; ++round) {
+    const uint64_t num_leaves =
+        (xorshift(&state) >> (xorshift(&state) % 50 + 14)) + 1;
+    const uint8_t tr = tree_rows(num_leaves);
+    const uint64_t mask = ((uint64_t)2 << tr) - 1;
+    ASSERT_EQ(tr, ref_tree_rows(num_leaves));
+
+    for (size_t i = 0; i < 1000; ++i) {
+      // pick one of the trees, then a node inside it
+      uint8_t tree = xorshift(&state) % 64;
+      while (!((num_leaves >> tree) & 1))
+        tree = (tree + 1) % 64;
+      const uint8_t row = xorshift(&state) % (tree + 1);
+      const uint64_t first_leaf = num_leaves & ~(((uint64_t)2 << tree) - 1);
+      const uint64_t leaf =
+          first_leaf + ((xorshift(&state) % ((uint64_t)1 << tree)) &
+                        ~(((uint64_t)1 << row) - 1));
+      const uint64_t pos = (mask & ~(mask >> row)) | (leaf >> row);
+      positions[i] = pos;
+
+      ASSERT_EQ(detect_row(pos, tr), row);
+      ASSERT_EQ(detect_row(pos, tr), ref_detect_row(pos, tr));
+
+      const node_offset offset = detect_offset(pos, num_leaves);
+      const node_offset expected = ref_detect_offset(pos, num_leaves);
+      ASSERT_EQ(offset.tree, tree);
+      ASSERT_EQ(offset.tree, expected.tree);
+      ASSERT_EQ(offset.depth, expected.depth);
+
+      const int is_root = row == tree;
+      ASSERT_EQ(is_root_position(pos, num_leaves, tr), is_root);
+      if (row < tree) {
+        ASSERT_EQ(detect_row(parent_position(pos, tr), tr), row + 1);
+        ASSERT_EQ(parent_position(sibling_position(pos), tr),
+                  parent_position(pos, tr));
+      }
+      if (row == tree)
+        ASSERT_EQ(root_position(num_leaves, row, tr), pos);
+      if (row > 0)
+        ASSERT_EQ(parent_position(left_child_position(pos, tr), tr), pos);
+    }
+
+    detect_offset_many(offsets, positions, 1000, num_leaves);
+    parent_position_many(parents, positions, 1000, tr);
+    detect_row_many(rows, positions, 1000, tr);
+    for (size_t i = 0; i < 1000; ++i) {
+      const node_offset offset = detect_offset(positions[i], num_leaves);
+      ASSERT_EQ(offsets[i].tree, offset.tree);
+      ASSERT_EQ(offsets[i].depth, offset.depth);
+      ASSERT_EQ(parents[i], parent_position(positions[i], tr));
+      ASSERT_EQ(rows[i], detect_row(positions[i], tr));
+    }
+  }
+}
+
 int main() {
   test_tree_rows();
   test_detect_row();
   test_detect_offset();
+  test_position_helpers();
+  test_position_properties();
 }